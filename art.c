@@ -0,0 +1,1022 @@
+#include <limits.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "./art.h"
+#include "./engine.h"
+#include "./epoch.h"
+
+// failed optimistic attempts before a thread starts yielding the CPU
+#define ART_SPINS 8
+
+// Every field that is read without holding the node's lock is accessed
+// atomically. Pointers are published with release semantics, so that a
+// reader that picks one up also sees what it points to.
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define LOAD_PTR(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE_PTR(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+
+// returned by the attempt functions when they have to start over; never
+// returned by the callbacks of art_scan()
+#define RESTART INT_MIN
+
+enum { NODE4, NODE16, NODE48, NODE256 };
+
+/* A key/value pair, both strings in one allocation. Pairs never change. */
+typedef struct art_pair {
+    char *value;  // points into key, right after its terminator
+    char key[];
+} art_pair_t;
+
+/*
+ * Header shared by all node types. A node's prefix is stored right after the
+ * struct of its type; it is never longer than when the node was created, so
+ * shortening it in place is safe.
+ */
+typedef struct art_node {
+    unsigned long version;     // odd while locked, and forever once replaced
+    unsigned char type;        // never changes
+    unsigned char obsolete;    // set once the node has been replaced
+    unsigned short count;      // number of children
+    unsigned int prefix_len;   // bytes every key below has in common here
+} art_node_t;
+
+// Children are pointers to nodes, or to pairs with the lowest bit set
+// (leaves).
+
+typedef struct art_node4 {
+    art_node_t hdr;
+    unsigned char keys[4];  // sorted
+    void *child[4];
+} art_node4_t;
+
+typedef struct art_node16 {
+    art_node_t hdr;
+    unsigned char keys[16];  // sorted
+    void *child[16];
+} art_node16_t;
+
+typedef struct art_node48 {
+    art_node_t hdr;
+    unsigned char index[256];  // 0 if there is no child, otherwise slot + 1
+    void *child[48];
+} art_node48_t;
+
+typedef struct art_node256 {
+    art_node_t hdr;
+    void *child[256];
+} art_node256_t;
+
+static const size_t node_size[] = {sizeof(art_node4_t), sizeof(art_node16_t),
+                                   sizeof(art_node48_t), sizeof(art_node256_t)};
+static const int node_slots[] = {4, 16, 48, 256};
+// children at which a node is replaced by the next smaller type
+static const int shrink_at[] = {-1, 3, 12, 40};
+
+struct art {
+    // Always a node256 with an empty prefix, so it never has to be replaced.
+    art_node_t *root;
+};
+
+//------------------------------------------------------------------------------------------------
+// Version locks
+
+/* Returns the node's version, or an odd number if it is locked. */
+static inline unsigned long node_read(art_node_t *node)
+{
+    return __atomic_load_n(&node->version, __ATOMIC_ACQUIRE);
+}
+
+/* Returns nonzero if the node has not been changed since node_read(). */
+static inline int node_check(art_node_t *node, unsigned long version)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return LOAD(node->version) == version;
+}
+
+/* Locks the node if it has not been changed since node_read() returned
+ * version. Returns nonzero on success. */
+static inline int node_upgrade(art_node_t *node, unsigned long version)
+{
+    if (!__atomic_compare_exchange_n(&node->version, &version, version + 1, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 0;
+    // readers that see any of the following changes must also see the lock
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return 1;
+}
+
+static inline void node_unlock(art_node_t *node)
+{
+    __atomic_fetch_add(&node->version, 1, __ATOMIC_RELEASE);
+}
+
+/* Locks parent (unless it is NULL) and node, both only if they have not
+ * changed since they were read. Returns nonzero on success. */
+static int lock_pair(art_node_t *parent, unsigned long parent_version,
+                     art_node_t *node, unsigned long version)
+{
+    if (parent != NULL && !node_upgrade(parent, parent_version))
+        return 0;
+    if (!node_upgrade(node, version))
+    {
+        if (parent != NULL)
+            node_unlock(parent);
+        return 0;
+    }
+    return 1;
+}
+
+/* Backs off before an operation restarts; yields after repeated conflicts so
+ * that the writer it is waiting for gets a chance to run. */
+static void backoff(int attempt)
+{
+    if (attempt > ART_SPINS)
+        sched_yield();
+}
+
+//------------------------------------------------------------------------------------------------
+// Nodes
+
+static inline int is_leaf(void *child)
+{
+    return ((uintptr_t)child & 1) != 0;
+}
+
+static inline art_pair_t *leaf_pair(void *child)
+{
+    return (art_pair_t *)((uintptr_t)child - 1);
+}
+
+static inline void *pair_leaf(art_pair_t *pair)
+{
+    return (void *)((uintptr_t)pair | 1);
+}
+
+static inline unsigned char *node_prefix(art_node_t *node)
+{
+    return (unsigned char *)node + node_size[node->type];
+}
+
+/* Returns the address of the slot holding the child of node under byte b, or
+ * NULL if there is none. */
+static void **child_slot(art_node_t *node, unsigned char b)
+{
+    int count = LOAD(node->count);
+    switch (node->type)
+    {
+    case NODE4:
+    {
+        art_node4_t *n = (art_node4_t *)node;
+        for (int i = 0; i < count; i++)
+        {
+            if (LOAD(n->keys[i]) == b)
+                return &n->child[i];
+        }
+        return NULL;
+    }
+    case NODE16:
+    {
+        art_node16_t *n = (art_node16_t *)node;
+        for (int i = 0; i < count; i++)
+        {
+            if (LOAD(n->keys[i]) == b)
+                return &n->child[i];
+        }
+        return NULL;
+    }
+    case NODE48:
+    {
+        art_node48_t *n = (art_node48_t *)node;
+        int index = LOAD(n->index[b]);
+        return index == 0 ? NULL : &n->child[index - 1];
+    }
+    default:
+        return &((art_node256_t *)node)->child[b];
+    }
+}
+
+/* Returns the child of node under byte b, or NULL if there is none. */
+static inline void *find_child(art_node_t *node, unsigned char b)
+{
+    void **slot = child_slot(node, b);
+    return slot == NULL ? NULL : LOAD_PTR(*slot);
+}
+
+/* Replaces the child of the locked node under byte b. */
+static inline void replace_child(art_node_t *node, unsigned char b, void *child)
+{
+    STORE_PTR(*child_slot(node, b), child);
+}
+
+/* Inserts child under byte b into a sorted keys/children array of n. */
+static void sorted_insert(unsigned char *keys, void **children, int n,
+                          unsigned char b, void *child)
+{
+    int pos = n;
+    while (pos > 0 && keys[pos - 1] > b)
+    {
+        STORE(keys[pos], keys[pos - 1]);
+        STORE_PTR(children[pos], children[pos - 1]);
+        pos--;
+    }
+    STORE(keys[pos], b);
+    STORE_PTR(children[pos], child);
+}
+
+/* Removes the entry under byte b from a sorted keys/children array of n. */
+static void sorted_remove(unsigned char *keys, void **children, int n,
+                          unsigned char b)
+{
+    int pos = 0;
+    while (keys[pos] != b)
+        pos++;
+    for (; pos < n - 1; pos++)
+    {
+        STORE(keys[pos], keys[pos + 1]);
+        STORE_PTR(children[pos], children[pos + 1]);
+    }
+}
+
+/* Adds child under byte b to node, which is locked (or not yet published)
+ * and has room for it. */
+static void add_child(art_node_t *node, unsigned char b, void *child)
+{
+    int count = node->count;
+    switch (node->type)
+    {
+    case NODE4:
+    {
+        art_node4_t *n = (art_node4_t *)node;
+        sorted_insert(n->keys, n->child, count, b, child);
+        break;
+    }
+    case NODE16:
+    {
+        art_node16_t *n = (art_node16_t *)node;
+        sorted_insert(n->keys, n->child, count, b, child);
+        break;
+    }
+    case NODE48:
+    {
+        art_node48_t *n = (art_node48_t *)node;
+        int slot = 0;
+        while (n->child[slot] != NULL)
+            slot++;
+        STORE_PTR(n->child[slot], child);
+        STORE(n->index[b], slot + 1);
+        break;
+    }
+    default:
+        STORE_PTR(((art_node256_t *)node)->child[b], child);
+        break;
+    }
+    STORE(node->count, count + 1);
+}
+
+/* Removes the child under byte b from the locked node. */
+static void remove_child(art_node_t *node, unsigned char b)
+{
+    int count = node->count;
+    switch (node->type)
+    {
+    case NODE4:
+    {
+        art_node4_t *n = (art_node4_t *)node;
+        sorted_remove(n->keys, n->child, count, b);
+        break;
+    }
+    case NODE16:
+    {
+        art_node16_t *n = (art_node16_t *)node;
+        sorted_remove(n->keys, n->child, count, b);
+        break;
+    }
+    case NODE48:
+    {
+        art_node48_t *n = (art_node48_t *)node;
+        STORE_PTR(n->child[n->index[b] - 1], NULL);
+        STORE(n->index[b], 0);
+        break;
+    }
+    default:
+        STORE_PTR(((art_node256_t *)node)->child[b], NULL);
+        break;
+    }
+    STORE(node->count, count - 1);
+}
+
+/* Stores the children of node and their bytes, in byte order, in children
+ * and bytes (which have room for 256 entries). Returns their number. */
+static int list_children(art_node_t *node, unsigned char *bytes,
+                         void **children)
+{
+    int n = 0;
+    switch (node->type)
+    {
+    case NODE4:
+    case NODE16:
+    {
+        unsigned char *keys = node->type == NODE4 ? ((art_node4_t *)node)->keys
+                                                  : ((art_node16_t *)node)->keys;
+        void **child = node->type == NODE4 ? ((art_node4_t *)node)->child
+                                           : ((art_node16_t *)node)->child;
+        int count = LOAD(node->count);
+        for (; n < count; n++)
+        {
+            bytes[n] = LOAD(keys[n]);
+            children[n] = LOAD_PTR(child[n]);
+        }
+        break;
+    }
+    case NODE48:
+    {
+        art_node48_t *node48 = (art_node48_t *)node;
+        for (int b = 0; b < 256; b++)
+        {
+            int index = LOAD(node48->index[b]);
+            if (index != 0)
+            {
+                bytes[n] = b;
+                children[n++] = LOAD_PTR(node48->child[index - 1]);
+            }
+        }
+        break;
+    }
+    default:
+    {
+        art_node256_t *node256 = (art_node256_t *)node;
+        for (int b = 0; b < 256; b++)
+        {
+            void *child = LOAD_PTR(node256->child[b]);
+            if (child != NULL)
+            {
+                bytes[n] = b;
+                children[n++] = child;
+            }
+        }
+        break;
+    }
+    }
+    return n;
+}
+
+static art_node_t *node_constructor(int type, unsigned int prefix_len)
+{
+    art_node_t *node = calloc(1, node_size[type] + prefix_len);
+    if (node == NULL)
+        return NULL;
+    node->type = type;
+    node->prefix_len = prefix_len;
+    return node;
+}
+
+/* free() in the shape epoch_retire() expects */
+static void node_reclaim(void *node)
+{
+    free(node);
+}
+
+/*
+ * Returns a new node of the given type with the children and prefix of the
+ * locked node src, or NULL if out of memory. The new prefix starts with extra
+ * bytes that the caller fills in.
+ */
+static art_node_t *node_clone(art_node_t *src, int type, unsigned int extra)
+{
+    unsigned char bytes[256];
+    void *children[256];
+
+    art_node_t *dst = node_constructor(type, extra + src->prefix_len);
+    if (dst == NULL)
+        return NULL;
+    memcpy(node_prefix(dst) + extra, node_prefix(src), src->prefix_len);
+
+    int n = list_children(src, bytes, children);
+    for (int i = 0; i < n; i++)
+        add_child(dst, bytes[i], children[i]);
+    return dst;
+}
+
+/* Gives up a locked node that has just been unlinked. It stays locked, so
+ * that every optimistic reader and writer still looking at it restarts. */
+static void node_retire(art_node_t *node)
+{
+    STORE(node->obsolete, 1);
+    epoch_retire(node, node_reclaim);
+}
+
+/* Recursively frees node, its subtrees, and their pairs. */
+static void node_destructor(art_node_t *node)
+{
+    unsigned char bytes[256];
+    void *children[256];
+
+    int n = list_children(node, bytes, children);
+    for (int i = 0; i < n; i++)
+    {
+        if (is_leaf(children[i]))
+            free(leaf_pair(children[i]));
+        else
+            node_destructor(children[i]);
+    }
+    free(node);
+}
+
+static art_pair_t *pair_constructor(const char *key, size_t key_len,
+                                    const char *value, size_t val_len)
+{
+    art_pair_t *pair = malloc(sizeof(art_pair_t) + key_len + val_len + 2);
+    if (pair == NULL)
+        return NULL;
+
+    memcpy(pair->key, key, key_len);
+    pair->key[key_len] = '\0';
+    pair->value = pair->key + key_len + 1;
+    memcpy(pair->value, value, val_len);
+    pair->value[val_len] = '\0';
+    return pair;
+}
+
+/* free() in the shape epoch_retire() expects */
+static void pair_reclaim(void *pair)
+{
+    free(pair);
+}
+
+/* Returns byte i of key, whose length is len, with the terminator at len:
+ * keys from the network are not terminated in place. */
+static inline unsigned char key_byte(const unsigned char *key, unsigned int len,
+                                     unsigned int i)
+{
+    return i < len ? key[i] : 0;
+}
+
+/*
+ * Returns how many of the first prefix_len bytes of node's prefix match key
+ * from depth on. Prefixes never contain '\0', so a match never runs past the
+ * end of key, whose length is len.
+ */
+static unsigned int prefix_match(art_node_t *node, const unsigned char *key,
+                                 unsigned int len, unsigned int depth,
+                                 unsigned int prefix_len)
+{
+    unsigned char *prefix = node_prefix(node);
+    unsigned int i = 0;
+    while (i < prefix_len && depth + i <= len &&
+           LOAD(prefix[i]) == key_byte(key, len, depth + i))
+        i++;
+    return i;
+}
+
+//------------------------------------------------------------------------------------------------
+// Public interface
+
+art_t *art_constructor(void)
+{
+    art_t *tree = malloc(sizeof(art_t));
+    if (tree == NULL)
+        return NULL;
+    if ((tree->root = node_constructor(NODE256, 0)) == NULL)
+    {
+        free(tree);
+        return NULL;
+    }
+    return tree;
+}
+
+void art_destructor(art_t *tree)
+{
+    node_destructor(tree->root);
+    free(tree);
+}
+
+/*
+ * One attempt at finding key, whose length is len. Stores the pair holding it
+ * (or NULL) in *pairp and returns 0, or returns RESTART.
+ */
+static int lookup_attempt(art_t *tree, const unsigned char *key,
+                          unsigned int len, art_pair_t **pairp)
+{
+    art_node_t *node = tree->root;
+    unsigned long version = node_read(node);
+    unsigned int depth = 0;
+    if (version & 1)
+        return RESTART;
+
+    *pairp = NULL;
+    while (1)
+    {
+        unsigned int prefix_len = LOAD(node->prefix_len);
+        if (prefix_match(node, key, len, depth, prefix_len) < prefix_len ||
+            depth + prefix_len > len)
+            return node_check(node, version) ? 0 : RESTART;
+        depth += prefix_len;
+
+        void *child = find_child(node, key_byte(key, len, depth));
+        if (!node_check(node, version))
+            return RESTART;
+        if (child == NULL)
+            return 0;
+        if (is_leaf(child))
+        {
+            art_pair_t *pair = leaf_pair(child);
+            if (engine_key_cmp((const char *)key, len, pair->key) == 0)
+                *pairp = pair;
+            return 0;
+        }
+
+        art_node_t *next = child;
+        unsigned long next_version = node_read(next);
+        if ((next_version & 1) || !node_check(node, version))
+            return RESTART;
+        node = next;
+        version = next_version;
+        depth++;
+    }
+}
+
+const char *art_lookup(art_t *tree, const char *key, size_t len)
+{
+    art_pair_t *pair;
+    for (int attempt = 0;
+         lookup_attempt(tree, (const unsigned char *)key, len, &pair) == RESTART;
+         attempt++)
+        backoff(attempt);
+    return pair == NULL ? NULL : pair->value;
+}
+
+/*
+ * One attempt at adding pair, whose key has length len, to the tree. Returns 1
+ * on success, 0 if the key is already there or memory ran out, or RESTART.
+ */
+static int insert_attempt(art_t *tree, art_pair_t *pair, unsigned int len)
+{
+    const unsigned char *key = (const unsigned char *)pair->key;
+    art_node_t *parent = NULL;
+    unsigned long parent_version = 0;
+    unsigned char parent_byte = 0;  // byte node hangs under in parent
+    art_node_t *node = tree->root;
+    unsigned long version = node_read(node);
+    unsigned int depth = 0;
+    if (version & 1)
+        return RESTART;
+
+    while (1)
+    {
+        unsigned int prefix_len = LOAD(node->prefix_len);
+        unsigned int m = prefix_match(node, key, len, depth, prefix_len);
+        if (m < prefix_len)
+        {
+            // The key leaves node's prefix after m bytes: a new node4 with
+            // those m bytes as its prefix takes node's place, and node keeps
+            // what is left of its prefix after the byte it now hangs under.
+            if (!lock_pair(parent, parent_version, node, version))
+                return RESTART;
+            art_node_t *split = node_constructor(NODE4, m);
+            if (split == NULL)
+            {
+                node_unlock(node);
+                node_unlock(parent);
+                return 0;
+            }
+            unsigned char *prefix = node_prefix(node);
+            memcpy(node_prefix(split), prefix, m);
+            add_child(split, prefix[m], node);
+            add_child(split, key[depth + m], pair_leaf(pair));
+
+            for (unsigned int i = 0; i < prefix_len - m - 1; i++)
+                STORE(prefix[i], prefix[m + 1 + i]);
+            STORE(node->prefix_len, prefix_len - m - 1);
+            replace_child(parent, parent_byte, split);
+            node_unlock(node);
+            node_unlock(parent);
+            return 1;
+        }
+        depth += prefix_len;
+        if (depth > len)
+            return RESTART;
+
+        unsigned char b = key[depth];
+        void *child = find_child(node, b);
+        if (!node_check(node, version))
+            return RESTART;
+
+        if (child == NULL)
+        {
+            if (LOAD(node->count) < node_slots[node->type])
+            {
+                if (!node_upgrade(node, version))
+                    return RESTART;
+                add_child(node, b, pair_leaf(pair));
+                node_unlock(node);
+                return 1;
+            }
+
+            // node is full: a copy of the next larger type takes its place
+            if (!lock_pair(parent, parent_version, node, version))
+                return RESTART;
+            art_node_t *grown = node_clone(node, node->type + 1, 0);
+            if (grown == NULL)
+            {
+                node_unlock(node);
+                node_unlock(parent);
+                return 0;
+            }
+            add_child(grown, b, pair_leaf(pair));
+            replace_child(parent, parent_byte, grown);
+            node_retire(node);
+            node_unlock(parent);
+            return 1;
+        }
+
+        if (is_leaf(child))
+        {
+            art_pair_t *other = leaf_pair(child);
+            if (strcmp(other->key, pair->key) == 0)
+                return 0;
+
+            // Two keys meet here: a node4 holding the bytes they still have
+            // in common takes the leaf's place, with both leaves below it.
+            if (!node_upgrade(node, version))
+                return RESTART;
+            const unsigned char *other_key = (const unsigned char *)other->key;
+            unsigned int n = 0;
+            while (key[depth + 1 + n] == other_key[depth + 1 + n])
+                n++;
+            art_node_t *split = node_constructor(NODE4, n);
+            if (split == NULL)
+            {
+                node_unlock(node);
+                return 0;
+            }
+            memcpy(node_prefix(split), key + depth + 1, n);
+            add_child(split, other_key[depth + 1 + n], child);
+            add_child(split, key[depth + 1 + n], pair_leaf(pair));
+            replace_child(node, b, split);
+            node_unlock(node);
+            return 1;
+        }
+
+        art_node_t *next = child;
+        unsigned long next_version = node_read(next);
+        if ((next_version & 1) || !node_check(node, version))
+            return RESTART;
+        parent = node;
+        parent_version = version;
+        parent_byte = b;
+        node = next;
+        version = next_version;
+        depth++;
+    }
+}
+
+int art_insert(art_t *tree, const char *key, size_t key_len,
+               const char *value, size_t value_len)
+{
+    art_pair_t *pair = pair_constructor(key, key_len, value, value_len);
+    if (pair == NULL)
+        return 0;
+
+    // nodes and pairs that are looked at may be replaced or removed meanwhile
+    int ret;
+    epoch_enter();
+    for (int attempt = 0;
+         (ret = insert_attempt(tree, pair, key_len)) == RESTART;
+         attempt++)
+        backoff(attempt);
+    epoch_exit();
+
+    if (ret == 0)
+        free(pair);
+    return ret;
+}
+
+/*
+ * Removes the child under byte b from node, a node4 with two children. node
+ * is unlinked, and its other child takes its place in parent: a leaf as it
+ * is, an inner node as a copy whose prefix starts with node's prefix and the
+ * byte it hung under. Returns 1, or RESTART.
+ */
+static int collapse(art_node_t *parent, unsigned long parent_version,
+                    unsigned char parent_byte, art_node_t *node,
+                    unsigned long version, unsigned char b)
+{
+    if (!lock_pair(parent, parent_version, node, version))
+        return RESTART;
+
+    art_node4_t *node4 = (art_node4_t *)node;
+    int other = node4->keys[0] == b ? 1 : 0;
+    void *sibling = node4->child[other];
+    if (is_leaf(sibling))
+    {
+        replace_child(parent, parent_byte, sibling);
+    }
+    else
+    {
+        art_node_t *snode = sibling;
+        unsigned long sversion = node_read(snode);
+        if ((sversion & 1) || !node_upgrade(snode, sversion))
+        {
+            node_unlock(node);
+            node_unlock(parent);
+            return RESTART;
+        }
+
+        art_node_t *merged = node_clone(snode, snode->type, node->prefix_len + 1);
+        if (merged == NULL)
+        {
+            // a node4 with a single child is still a valid tree
+            node_unlock(snode);
+            remove_child(node, b);
+            node_unlock(node);
+            node_unlock(parent);
+            return 1;
+        }
+        memcpy(node_prefix(merged), node_prefix(node), node->prefix_len);
+        node_prefix(merged)[node->prefix_len] = node4->keys[other];
+        replace_child(parent, parent_byte, merged);
+        node_retire(snode);
+    }
+
+    node_retire(node);
+    node_unlock(parent);
+    return 1;
+}
+
+/*
+ * Removes the child under byte b from node, which is then replaced in parent
+ * by a copy of the next smaller type. Returns 1, or RESTART.
+ */
+static int shrink(art_node_t *parent, unsigned long parent_version,
+                  unsigned char parent_byte, art_node_t *node,
+                  unsigned long version, unsigned char b)
+{
+    if (!lock_pair(parent, parent_version, node, version))
+        return RESTART;
+
+    art_node_t *smaller = node_clone(node, node->type - 1, 0);
+    if (smaller == NULL)
+    {
+        // keep the larger node
+        remove_child(node, b);
+        node_unlock(node);
+        node_unlock(parent);
+        return 1;
+    }
+    remove_child(smaller, b);
+    replace_child(parent, parent_byte, smaller);
+    node_retire(node);
+    node_unlock(parent);
+    return 1;
+}
+
+/*
+ * One attempt at removing key, whose length is len, from the tree. Returns 1
+ * on success, 0 if it is not there, or RESTART.
+ */
+static int remove_attempt(art_t *tree, const unsigned char *key,
+                          unsigned int len)
+{
+    art_node_t *parent = NULL;
+    unsigned long parent_version = 0;
+    unsigned char parent_byte = 0;
+    art_node_t *node = tree->root;
+    unsigned long version = node_read(node);
+    unsigned int depth = 0;
+    if (version & 1)
+        return RESTART;
+
+    while (1)
+    {
+        unsigned int prefix_len = LOAD(node->prefix_len);
+        if (prefix_match(node, key, len, depth, prefix_len) < prefix_len ||
+            depth + prefix_len > len)
+            return node_check(node, version) ? 0 : RESTART;
+        depth += prefix_len;
+
+        unsigned char b = key_byte(key, len, depth);
+        void *child = find_child(node, b);
+        if (!node_check(node, version))
+            return RESTART;
+        if (child == NULL)
+            return 0;
+
+        if (is_leaf(child))
+        {
+            art_pair_t *pair = leaf_pair(child);
+            if (engine_key_cmp((const char *)key, len, pair->key) != 0)
+                return 0;
+
+            int ret;
+            int count = LOAD(node->count);
+            if (node != tree->root && node->type == NODE4 && count == 2)
+            {
+                ret = collapse(parent, parent_version, parent_byte, node,
+                               version, b);
+            }
+            else if (node != tree->root && count - 1 == shrink_at[node->type])
+            {
+                ret = shrink(parent, parent_version, parent_byte, node,
+                             version, b);
+            }
+            else
+            {
+                if (!node_upgrade(node, version))
+                    return RESTART;
+                remove_child(node, b);
+                node_unlock(node);
+                ret = 1;
+            }
+
+            if (ret == 1)
+                epoch_retire(pair, pair_reclaim);
+            return ret;
+        }
+
+        art_node_t *next = child;
+        unsigned long next_version = node_read(next);
+        if ((next_version & 1) || !node_check(node, version))
+            return RESTART;
+        parent = node;
+        parent_version = version;
+        parent_byte = b;
+        node = next;
+        version = next_version;
+        depth++;
+    }
+}
+
+int art_remove(art_t *tree, const char *key, size_t len)
+{
+    int ret;
+    epoch_enter();
+    for (int attempt = 0;
+         (ret = remove_attempt(tree, (const unsigned char *)key, len)) ==
+         RESTART;
+         attempt++)
+        backoff(attempt);
+    epoch_exit();
+    return ret;
+}
+
+/* The key an art_scan() starts at. */
+typedef struct scan_start {
+    const unsigned char *key;
+    unsigned int len;
+} scan_start_t;
+
+/*
+ * Visits the pairs under node, at depth, whose keys sort after *lastp, in
+ * order, and updates *lastp as it goes. If start is not NULL, the keys below
+ * node share their first depth bytes with it and only those not smaller are
+ * visited. Returns what the last call to fn returned, 0, or RESTART if node
+ * turned out to have been replaced.
+ */
+static int scan_node(art_node_t *node, unsigned int depth,
+                     const scan_start_t *start, const char **lastp,
+                     int (*fn)(const char *key, const char *value, void *arg),
+                     void *arg)
+{
+    unsigned char bytes[256];
+    void *children[256];
+    int n;
+    unsigned int prefix_len = 0;
+
+    // take a consistent snapshot of the node's children
+    for (int attempt = 0;; attempt++)
+    {
+        unsigned long version = node_read(node);
+        if (!(version & 1))
+        {
+            int cmp = 0;
+            prefix_len = LOAD(node->prefix_len);
+            if (start != NULL)
+            {
+                // the node's prefix decides whether its keys come before
+                // start, after it, or have to be told apart further down
+                unsigned char *prefix = node_prefix(node);
+                for (unsigned int i = 0; i < prefix_len && cmp == 0; i++)
+                    cmp = (int)LOAD(prefix[i]) -
+                          key_byte(start->key, start->len, depth + i);
+            }
+            n = cmp < 0 ? 0 : list_children(node, bytes, children);
+            if (node_check(node, version))
+            {
+                if (cmp > 0)
+                    start = NULL;
+                break;
+            }
+        }
+        else if (LOAD(node->obsolete))
+        {
+            return RESTART;
+        }
+        backoff(attempt);
+    }
+
+    depth += prefix_len;
+    for (int i = 0; i < n; i++)
+    {
+        int ret;
+        const scan_start_t *child_start = NULL;
+        if (start != NULL)
+        {
+            unsigned char b = key_byte(start->key, start->len, depth);
+            if (bytes[i] < b)
+                continue;
+            if (bytes[i] == b)
+                child_start = start;
+        }
+        if (is_leaf(children[i]))
+        {
+            art_pair_t *pair = leaf_pair(children[i]);
+            if (*lastp != NULL && strcmp(pair->key, *lastp) <= 0)
+                continue;
+            if (child_start != NULL &&
+                engine_key_cmp((const char *)start->key, start->len,
+                               pair->key) > 0)
+                continue;
+            if ((ret = fn(pair->key, pair->value, arg)) != 0)
+                return ret;
+            *lastp = pair->key;
+        }
+        else if ((ret = scan_node(children[i], depth + 1, child_start, lastp,
+                                  fn, arg)) != 0)
+        {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+int art_scan(art_t *tree, const char *start, size_t len,
+             int (*fn)(const char *key, const char *value, void *arg),
+             void *arg)
+{
+    scan_start_t from = {(const unsigned char *)start, len};
+    // after a restart, the pairs that have been visited already are skipped
+    const char *last = NULL;
+    int ret;
+    while ((ret = scan_node(tree->root, 0, len > 0 ? &from : NULL, &last, fn,
+                            arg)) == RESTART)
+        ;
+    return ret;
+}
+
+//------------------------------------------------------------------------------------------------
+// Engine interface
+
+static void *art_engine_constructor(unsigned int flags)
+{
+    (void)flags;  // there is no hash index to keep
+    return art_constructor();
+}
+
+static void art_engine_destructor(void *state)
+{
+    art_destructor(state);
+}
+
+static const char *art_engine_lookup(void *state, const char *key,
+                                     size_t key_len)
+{
+    return art_lookup(state, key, key_len);
+}
+
+static int art_engine_insert(void *state, const char *key, size_t key_len,
+                             const char *value, size_t value_len)
+{
+    return art_insert(state, key, key_len, value, value_len);
+}
+
+static int art_engine_remove(void *state, const char *key, size_t key_len)
+{
+    return art_remove(state, key, key_len);
+}
+
+static int art_engine_scan(void *state, const char *start, size_t start_len,
+                           engine_visit_t fn, void *arg)
+{
+    return art_scan(state, start, start_len, fn, arg);
+}
+
+// there is no binary tree to print
+const engine_ops_t art_engine = {
+    "art",
+    art_engine_constructor,
+    art_engine_destructor,
+    art_engine_lookup,
+    NULL,
+    art_engine_insert,
+    NULL,
+    art_engine_remove,
+    NULL,
+    art_engine_scan,
+    NULL,
+    NULL,
+    NULL,
+};
@@ -0,0 +1,67 @@
+#ifndef ART_H_
+#define ART_H_
+
+#include <stddef.h>
+
+/*
+ * An adaptive radix tree (ART) mapping string keys to string values, used as
+ * an alternative storage engine to the binary tree in bst.c.
+ *
+ * The tree branches on one byte of the key per level, so a lookup costs one
+ * step per key byte instead of one full key comparison per level, and keys
+ * with a long common prefix share the nodes for it. Inner nodes come in four
+ * sizes, holding up to 4, 16, 48 or 256 children, and are replaced by the
+ * next larger or smaller size as children come and go. Chains of nodes with a
+ * single child are collapsed into a prefix stored in the node below them
+ * (path compression). The terminating '\0' counts as part of the key, so no
+ * key is a prefix of another, and every key/value pair ends up in a leaf of
+ * its own.
+ *
+ * Concurrency uses optimistic lock coupling, as in bptree.h: every node has a
+ * version that is odd while the node is locked, lookups take no locks and
+ * restart when a version they read has changed, and updates lock only the
+ * node they change, plus its parent when that node has to be replaced. Nodes
+ * that are replaced stay locked forever and are reclaimed through
+ * epoch_retire(), as are removed pairs; lookups must run inside an epoch.
+ */
+typedef struct art art_t;
+
+/* Creates an empty tree. Returns NULL on failure. */
+art_t *art_constructor(void);
+
+/*
+ * Frees the tree and every pair in it. Only call this when no other thread is
+ * using the tree.
+ */
+void art_destructor(art_t *tree);
+
+/*
+ * Returns the value stored under key, or NULL if there is none. Must be
+ * called inside an epoch; the value stays valid until the matching
+ * epoch_exit().
+ */
+const char *art_lookup(art_t *tree, const char *key, size_t len);
+
+/*
+ * Adds the pair (key, value) to the tree. Returns 1 on success and 0 if key
+ * is already in the tree or memory ran out.
+ */
+int art_insert(art_t *tree, const char *key, size_t key_len,
+               const char *value, size_t value_len);
+
+/* Removes key from the tree. Returns 1 on success and 0 if it is not there. */
+int art_remove(art_t *tree, const char *key, size_t len);
+
+/*
+ * Calls fn on every pair in the tree whose key is not smaller than the len
+ * bytes at start, in ascending key order, stopping early if fn returns
+ * nonzero, and returns what fn last returned (or 0). Subtrees holding only
+ * smaller keys are skipped without being visited. Pairs that are added or
+ * removed concurrently may or may not be visited. Must be called inside an
+ * epoch.
+ */
+int art_scan(art_t *tree, const char *start, size_t len,
+             int (*fn)(const char *key, const char *value, void *arg),
+             void *arg);
+
+#endif  // ART_H_
@@ -0,0 +1,245 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "./db.h"
+#include "./rwlock.h"
+
+// room for the longest line the server takes, a batch command
+#define LINELEN 4096
+#define RESPLEN 256
+
+/*
+ * A script loaded into memory, so that reading it from disk is not part of
+ * the measurement.
+ */
+typedef struct script {
+    char **lines;
+    size_t nlines;
+} script_t;
+
+typedef struct worker {
+    pthread_t thread;
+    script_t *script;
+} worker_t;
+
+/*
+ * Reads every line of the file at path into script. Returns 0 on success and
+ * -1 on failure.
+ */
+int script_load(const char *path, script_t *script)
+{
+    FILE *in;
+    if ((in = fopen(path, "r")) == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    size_t cap = 1024;
+    script->nlines = 0;
+    if ((script->lines = malloc(cap * sizeof(char *))) == NULL)
+    {
+        perror("malloc");
+        fclose(in);
+        return -1;
+    }
+
+    char buf[LINELEN];
+    while (fgets(buf, sizeof(buf), in) != NULL)
+    {
+        if (script->nlines == cap)
+        {
+            cap *= 2;
+            char **grown = realloc(script->lines, cap * sizeof(char *));
+            if (grown == NULL)
+            {
+                perror("realloc");
+                fclose(in);
+                return -1;
+            }
+            script->lines = grown;
+        }
+        if ((script->lines[script->nlines++] = strdup(buf)) == NULL)
+        {
+            perror("strdup");
+            fclose(in);
+            return -1;
+        }
+    }
+
+    fclose(in);
+    return 0;
+}
+
+void script_free(script_t *script)
+{
+    for (size_t i = 0; i < script->nlines; i++)
+    {
+        free(script->lines[i]);
+    }
+    free(script->lines);
+}
+
+/* Runs every command of a script through interpret_command(). */
+void run_script(script_t *script)
+{
+    char response[RESPLEN];
+    for (size_t i = 0; i < script->nlines; i++)
+    {
+        interpret_command(script->lines[i], response, RESPLEN);
+    }
+}
+
+void *run_worker(void *arg)
+{
+    worker_t *worker = (worker_t *)arg;
+    run_script(worker->script);
+    return NULL;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void usage_error(const char *cmd)
+{
+    fprintf(stderr,
+            "Usage: %s [-i] [-H] [-e <engine>] [-s <shards>] "
+            "[-p <preload script>] [-t <threads>] <script>...\n",
+            cmd);
+}
+
+/*
+ * In-process benchmark for the database. The preload script (if any) is run
+ * once, single-threaded and untimed. Then the given number of threads is
+ * started, thread i running script i modulo the number of scripts, and the
+ * aggregate throughput is reported. -i enables the hash index, -H backs the
+ * tree nodes with huge pages, -e selects the storage engine and -s splits the
+ * database into the given number of shards.
+ */
+int main(int argc, char *argv[])
+{
+    const char *preload = NULL;
+    int nthreads = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "iHe:s:p:t:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            if (db_index_enable() < 0)
+            {
+                fprintf(stderr, "could not create the hash index\n");
+                return 1;
+            }
+            break;
+        case 'H':
+            if (db_huge_pages_enable() < 0)
+            {
+                fprintf(stderr, "could not set up huge pages\n");
+                return 1;
+            }
+            break;
+        case 'e':
+            if (db_set_engine(optarg) < 0)
+            {
+                fprintf(stderr, "invalid engine: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 's':
+            if (db_set_shards(atoi(optarg)) < 0)
+            {
+                fprintf(stderr, "invalid shard count: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'p':
+            preload = optarg;
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        default:
+            usage_error(argv[0]);
+            return 1;
+        }
+    }
+
+    int nscripts = argc - optind;
+    if (nscripts < 1 || nthreads < 1)
+    {
+        usage_error(argv[0]);
+        return 1;
+    }
+
+    if (preload != NULL)
+    {
+        script_t pre;
+        if (script_load(preload, &pre) < 0)
+            return 1;
+        run_script(&pre);
+        script_free(&pre);
+    }
+
+    script_t *scripts = calloc(nscripts, sizeof(script_t));
+    worker_t *workers = calloc(nthreads, sizeof(worker_t));
+    if (scripts == NULL || workers == NULL)
+    {
+        perror("calloc");
+        return 1;
+    }
+    for (int i = 0; i < nscripts; i++)
+    {
+        if (script_load(argv[optind + i], &scripts[i]) < 0)
+            return 1;
+    }
+
+    size_t total = 0;
+    double start = now();
+    for (int i = 0; i < nthreads; i++)
+    {
+        workers[i].script = &scripts[i % nscripts];
+        total += workers[i].script->nlines;
+
+        int err;
+        if ((err = pthread_create(&workers[i].thread, 0, run_worker,
+                                  &workers[i])) != 0)
+        {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            return 1;
+        }
+    }
+    for (int i = 0; i < nthreads; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+    double elapsed = now() - start;
+
+    printf("%zu commands, %d threads: %.3f s, %.0f commands/s\n", total,
+           nthreads, elapsed, total / elapsed);
+
+    // only counted in builds with -DRWLOCK_STATS
+    unsigned long spins, sleeps;
+    rwlock_stats(&spins, &sleeps);
+    if (spins != 0 || sleeps != 0)
+        printf("node lock contention: %lu spins, %lu sleeps\n", spins,
+               sleeps);
+
+    for (int i = 0; i < nscripts; i++)
+    {
+        script_free(&scripts[i]);
+    }
+    free(scripts);
+    free(workers);
+    db_cleanup();
+    return 0;
+}
@@ -0,0 +1,704 @@
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "./bptree.h"
+#include "./engine.h"
+#include "./epoch.h"
+
+// size of every node; a multiple of the cache line size
+#define BPTREE_NODE_SIZE 512
+// pairs per leaf and separators per inner node that fit in BPTREE_NODE_SIZE
+#define LEAF_SLOTS 30
+#define INNER_SLOTS 20
+// failed optimistic attempts before a thread starts yielding the CPU
+#define BPTREE_SPINS 8
+
+// Every field that is read without holding the node's lock is accessed
+// atomically. Pointers are published with release semantics, so that a
+// reader that picks one up also sees what it points to.
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define LOAD_PTR(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE_PTR(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+
+// returned by the attempt functions when they have to start over
+#define RESTART (-1)
+
+/* A key/value pair, both strings in one allocation. Pairs never change. */
+typedef struct bp_pair {
+    char *value;  // points into key, right after its terminator
+    char key[];
+} bp_pair_t;
+
+/* Header shared by leaves and inner nodes. */
+typedef struct bp_node {
+    unsigned long version;  // odd while the node is locked
+    unsigned short count;   // pairs in a leaf, separators in an inner node
+    unsigned short leaf;    // never changes
+} bp_node_t;
+
+typedef struct bp_leaf {
+    bp_node_t hdr;
+    struct bp_leaf *next;  // right sibling, or NULL
+    unsigned long prefix[LEAF_SLOTS];
+    bp_pair_t *pair[LEAF_SLOTS];
+} __attribute__((aligned(64))) bp_leaf_t;
+
+/*
+ * child[i] holds the keys k with sep[i - 1] <= k < sep[i]. The separators are
+ * owned by the node; they move along with their slot when the node is split.
+ */
+typedef struct bp_inner {
+    bp_node_t hdr;
+    unsigned long prefix[INNER_SLOTS];
+    char *sep[INNER_SLOTS];
+    bp_node_t *child[INNER_SLOTS + 1];
+} __attribute__((aligned(64))) bp_inner_t;
+
+_Static_assert(sizeof(bp_leaf_t) <= BPTREE_NODE_SIZE, "leaf too large");
+_Static_assert(sizeof(bp_inner_t) <= BPTREE_NODE_SIZE, "inner node too large");
+
+struct bptree {
+    bp_node_t *root;
+    // The leftmost leaf. Splits always move the upper half of a node into a
+    // new right sibling and nodes are never merged, so this is the first leaf
+    // the tree ever had, and it stays the leftmost one for good.
+    bp_leaf_t *first;
+};
+
+//------------------------------------------------------------------------------------------------
+// Version locks
+
+/* Returns the node's version, or an odd number if it is locked. */
+static inline unsigned long node_read(bp_node_t *node)
+{
+    return __atomic_load_n(&node->version, __ATOMIC_ACQUIRE);
+}
+
+/* Returns nonzero if the node has not been changed since node_read(). */
+static inline int node_check(bp_node_t *node, unsigned long version)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return LOAD(node->version) == version;
+}
+
+/* Locks the node if it has not been changed since node_read() returned
+ * version. Returns nonzero on success. */
+static inline int node_upgrade(bp_node_t *node, unsigned long version)
+{
+    if (!__atomic_compare_exchange_n(&node->version, &version, version + 1, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 0;
+    // readers that see any of the following changes must also see the lock
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return 1;
+}
+
+static inline void node_unlock(bp_node_t *node)
+{
+    __atomic_fetch_add(&node->version, 1, __ATOMIC_RELEASE);
+}
+
+/* Backs off before an operation restarts; yields after repeated conflicts so
+ * that the writer it is waiting for gets a chance to run. */
+static void backoff(int attempt)
+{
+    if (attempt > BPTREE_SPINS)
+        sched_yield();
+}
+
+//------------------------------------------------------------------------------------------------
+// Keys
+
+/* Returns the first eight bytes of key as a big-endian integer, padded with
+ * zeros, so that comparing prefixes compares the keys' first eight bytes. */
+static inline unsigned long key_prefix(const char *key, size_t len)
+{
+    unsigned long prefix = 0;
+    for (size_t i = 0; i < 8; i++)
+    {
+        prefix <<= 8;
+        if (i < len)
+            prefix |= (unsigned char)key[i];
+    }
+    return prefix;
+}
+
+/* Compares key, len bytes, with skey, given that both have the prefix kp. */
+static inline int tail_cmp(unsigned long kp, const char *key, size_t len,
+                           const char *skey)
+{
+    // both keys end within the prefix
+    if ((kp & 0xff) == 0)
+        return 0;
+    // only seen by a reader racing with a writer; its validation will fail
+    if (skey == NULL)
+        return 0;
+    return engine_key_cmp(key, len, skey);
+}
+
+/* Compares key, whose prefix is kp, with separator i of inner. */
+static inline int sep_cmp(bp_inner_t *inner, int i, unsigned long kp,
+                          const char *key, size_t len)
+{
+    unsigned long sp = LOAD(inner->prefix[i]);
+    if (kp != sp)
+        return kp < sp ? -1 : 1;
+    return tail_cmp(kp, key, len, LOAD_PTR(inner->sep[i]));
+}
+
+/* Compares key, whose prefix is kp, with the key of pair i of leaf. */
+static inline int pair_cmp(bp_leaf_t *leaf, int i, unsigned long kp,
+                           const char *key, size_t len)
+{
+    unsigned long sp = LOAD(leaf->prefix[i]);
+    if (kp != sp)
+        return kp < sp ? -1 : 1;
+    bp_pair_t *pair = LOAD_PTR(leaf->pair[i]);
+    return tail_cmp(kp, key, len, pair == NULL ? NULL : pair->key);
+}
+
+/* Returns the child of inner whose subtree holds key. */
+static bp_node_t *inner_child(bp_inner_t *inner, unsigned long kp,
+                              const char *key, size_t len)
+{
+    int lo = 0;
+    int hi = LOAD(inner->hdr.count);
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (sep_cmp(inner, mid, kp, key, len) < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return LOAD_PTR(inner->child[lo]);
+}
+
+/* Returns the position of the first pair of leaf whose key is not smaller
+ * than key, and sets *found to whether that key is key. */
+static int leaf_find(bp_leaf_t *leaf, unsigned long kp, const char *key,
+                     size_t len, int *found)
+{
+    int n = LOAD(leaf->hdr.count);
+    int lo = 0;
+    int hi = n;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (pair_cmp(leaf, mid, kp, key, len) > 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *found = lo < n && pair_cmp(leaf, lo, kp, key, len) == 0;
+    return lo;
+}
+
+/* Returns a new string holding the shortest prefix of right that sorts after
+ * left, where left < right, or NULL if out of memory. */
+static char *separator(const char *left, const char *right)
+{
+    size_t n = 0;
+    while (left[n] == right[n])
+        n++;
+
+    char *sep = malloc(n + 2);
+    if (sep == NULL)
+        return NULL;
+    memcpy(sep, right, n + 1);
+    sep[n + 1] = '\0';
+    return sep;
+}
+
+//------------------------------------------------------------------------------------------------
+// Constructors and destructors
+
+static bp_pair_t *pair_constructor(const char *key, size_t key_len,
+                                   const char *value, size_t val_len)
+{
+    bp_pair_t *pair = malloc(sizeof(bp_pair_t) + key_len + val_len + 2);
+    if (pair == NULL)
+        return NULL;
+
+    memcpy(pair->key, key, key_len);
+    pair->key[key_len] = '\0';
+    pair->value = pair->key + key_len + 1;
+    memcpy(pair->value, value, val_len);
+    pair->value[val_len] = '\0';
+    return pair;
+}
+
+/* free() in the shape epoch_retire() expects */
+static void pair_reclaim(void *pair)
+{
+    free(pair);
+}
+
+static void *node_constructor(int leaf)
+{
+    size_t size = leaf ? sizeof(bp_leaf_t) : sizeof(bp_inner_t);
+    bp_node_t *node;
+    if (posix_memalign((void **)&node, 64, size) != 0)
+        return NULL;
+    memset(node, 0, size);
+    node->leaf = leaf;
+    return node;
+}
+
+/* Recursively frees node, its subtrees, and everything they own. */
+static void node_destructor(bp_node_t *node)
+{
+    if (node->leaf)
+    {
+        bp_leaf_t *leaf = (bp_leaf_t *)node;
+        for (int i = 0; i < leaf->hdr.count; i++)
+            free(leaf->pair[i]);
+    }
+    else
+    {
+        bp_inner_t *inner = (bp_inner_t *)node;
+        for (int i = 0; i < inner->hdr.count; i++)
+            free(inner->sep[i]);
+        for (int i = 0; i <= inner->hdr.count; i++)
+            node_destructor(inner->child[i]);
+    }
+    free(node);
+}
+
+bptree_t *bptree_constructor(void)
+{
+    bptree_t *tree = malloc(sizeof(bptree_t));
+    if (tree == NULL)
+        return NULL;
+    if ((tree->first = node_constructor(1)) == NULL)
+    {
+        free(tree);
+        return NULL;
+    }
+    tree->root = &tree->first->hdr;
+    return tree;
+}
+
+void bptree_destructor(bptree_t *tree)
+{
+    node_destructor(tree->root);
+    free(tree);
+}
+
+//------------------------------------------------------------------------------------------------
+// Splitting
+//
+// A node is split while it and its parent are locked. The upper half of the
+// node is copied into a new right sibling, and a separator for the two is
+// added to the parent, which always has room for it because full inner nodes
+// are split on the way down. If the node is the root, a new root is created
+// above it instead.
+
+/*
+ * Adds sep, with right as the child after it, to parent, next to its child
+ * left. If parent is NULL, left is the root and root (a new, empty inner
+ * node) becomes the root above left and right.
+ */
+static void add_separator(bptree_t *tree, bp_inner_t *parent, bp_inner_t *root,
+                          bp_node_t *left, char *sep, bp_node_t *right)
+{
+    size_t sep_len = strlen(sep);
+    unsigned long sp = key_prefix(sep, sep_len);
+    if (parent == NULL)
+    {
+        root->hdr.count = 1;
+        root->prefix[0] = sp;
+        root->sep[0] = sep;
+        root->child[0] = left;
+        root->child[1] = right;
+        STORE_PTR(tree->root, &root->hdr);
+        return;
+    }
+
+    // sep lies strictly between the separators around left, so it goes right
+    // after the last separator that is smaller than it
+    int n = parent->hdr.count;
+    int pos = 0;
+    while (pos < n && sep_cmp(parent, pos, sp, sep, sep_len) > 0)
+        pos++;
+
+    for (int i = n; i > pos; i--)
+    {
+        STORE(parent->prefix[i], parent->prefix[i - 1]);
+        STORE_PTR(parent->sep[i], parent->sep[i - 1]);
+        STORE_PTR(parent->child[i + 1], parent->child[i]);
+    }
+    STORE(parent->prefix[pos], sp);
+    STORE_PTR(parent->sep[pos], sep);
+    STORE_PTR(parent->child[pos + 1], right);
+    STORE(parent->hdr.count, n + 1);
+}
+
+/* Splits the full leaf. Returns 1 on success and 0 if out of memory. */
+static int split_leaf(bptree_t *tree, bp_inner_t *parent, bp_leaf_t *leaf)
+{
+    int n = leaf->hdr.count;
+    int m = n / 2;
+    bp_leaf_t *right = node_constructor(1);
+    bp_inner_t *root = NULL;
+    char *sep = NULL;
+
+    if (right == NULL ||
+        (parent == NULL && (root = node_constructor(0)) == NULL) ||
+        (sep = separator(leaf->pair[m - 1]->key, leaf->pair[m]->key)) == NULL)
+    {
+        free(right);
+        free(root);
+        return 0;
+    }
+
+    right->hdr.count = n - m;
+    memcpy(right->prefix, &leaf->prefix[m], (n - m) * sizeof(unsigned long));
+    memcpy(right->pair, &leaf->pair[m], (n - m) * sizeof(bp_pair_t *));
+    right->next = leaf->next;
+
+    add_separator(tree, parent, root, &leaf->hdr, sep, &right->hdr);
+    STORE_PTR(leaf->next, right);
+    STORE(leaf->hdr.count, m);
+    return 1;
+}
+
+/* Splits the full inner node. Returns 1 on success and 0 if out of memory. */
+static int split_inner(bptree_t *tree, bp_inner_t *parent, bp_inner_t *inner)
+{
+    int n = inner->hdr.count;
+    int m = n / 2;
+    bp_inner_t *right = node_constructor(0);
+    bp_inner_t *root = NULL;
+
+    if (right == NULL ||
+        (parent == NULL && (root = node_constructor(0)) == NULL))
+    {
+        free(right);
+        free(root);
+        return 0;
+    }
+
+    // separator m moves up into the parent
+    right->hdr.count = n - m - 1;
+    memcpy(right->prefix, &inner->prefix[m + 1],
+           (n - m - 1) * sizeof(unsigned long));
+    memcpy(right->sep, &inner->sep[m + 1], (n - m - 1) * sizeof(char *));
+    memcpy(right->child, &inner->child[m + 1], (n - m) * sizeof(bp_node_t *));
+
+    add_separator(tree, parent, root, &inner->hdr, inner->sep[m], &right->hdr);
+    STORE(inner->hdr.count, m);
+    return 1;
+}
+
+//------------------------------------------------------------------------------------------------
+// Public interface
+
+/*
+ * Walks down to the leaf that would hold key without taking any locks.
+ * Returns the leaf, with its version in *versionp, or NULL if a concurrent
+ * change was detected and the caller has to restart.
+ */
+static bp_leaf_t *find_leaf(bptree_t *tree, unsigned long kp, const char *key,
+                            size_t len, unsigned long *versionp)
+{
+    bp_node_t *node = LOAD_PTR(tree->root);
+    unsigned long version = node_read(node);
+    // the root pointer only changes while the old root is locked, so if it
+    // still points here, version belongs to the root
+    if ((version & 1) || node != LOAD_PTR(tree->root))
+        return NULL;
+
+    while (!node->leaf)
+    {
+        bp_node_t *child = inner_child((bp_inner_t *)node, kp, key, len);
+        if (child == NULL)
+            return NULL;
+        unsigned long child_version = node_read(child);
+        if ((child_version & 1) || !node_check(node, version))
+            return NULL;
+        node = child;
+        version = child_version;
+    }
+
+    *versionp = version;
+    return (bp_leaf_t *)node;
+}
+
+const char *bptree_lookup(bptree_t *tree, const char *key, size_t len)
+{
+    unsigned long kp = key_prefix(key, len);
+
+    for (int attempt = 0;; attempt++)
+    {
+        unsigned long version;
+        bp_leaf_t *leaf = find_leaf(tree, kp, key, len, &version);
+        if (leaf != NULL)
+        {
+            int found;
+            int pos = leaf_find(leaf, kp, key, len, &found);
+            bp_pair_t *pair = found ? LOAD_PTR(leaf->pair[pos]) : NULL;
+            if (node_check(&leaf->hdr, version))
+                return pair == NULL ? NULL : pair->value;
+        }
+        backoff(attempt);
+    }
+}
+
+/*
+ * One attempt at adding pair to the tree. Splits the first full node on the
+ * way down and restarts; otherwise locks the leaf and adds pair to it.
+ * Returns 1 on success, 0 if the key is already there or memory ran out, or
+ * RESTART.
+ */
+static int insert_attempt(bptree_t *tree, bp_pair_t *pair, size_t len,
+                          unsigned long kp)
+{
+    const char *key = pair->key;
+    bp_node_t *node = LOAD_PTR(tree->root);
+    unsigned long version = node_read(node);
+    if ((version & 1) || node != LOAD_PTR(tree->root))
+        return RESTART;
+
+    bp_inner_t *parent = NULL;
+    unsigned long parent_version = 0;
+    while (1)
+    {
+        int slots = node->leaf ? LEAF_SLOTS : INNER_SLOTS;
+        if (LOAD(node->count) == slots)
+        {
+            // Both locks are only taken if neither node has changed since it
+            // was read, so the node is still parent's child (or the root).
+            if (parent != NULL && !node_upgrade(&parent->hdr, parent_version))
+                return RESTART;
+            if (!node_upgrade(node, version))
+            {
+                if (parent != NULL)
+                    node_unlock(&parent->hdr);
+                return RESTART;
+            }
+
+            int ok = node->leaf ? split_leaf(tree, parent, (bp_leaf_t *)node)
+                                : split_inner(tree, parent, (bp_inner_t *)node);
+            node_unlock(node);
+            if (parent != NULL)
+                node_unlock(&parent->hdr);
+            return ok ? RESTART : 0;
+        }
+        if (node->leaf)
+            break;
+
+        bp_node_t *child = inner_child((bp_inner_t *)node, kp, key, len);
+        if (child == NULL)
+            return RESTART;
+        unsigned long child_version = node_read(child);
+        if ((child_version & 1) || !node_check(node, version))
+            return RESTART;
+        parent = (bp_inner_t *)node;
+        parent_version = version;
+        node = child;
+        version = child_version;
+    }
+
+    // A leaf's key range only changes when the leaf itself is split, so if it
+    // has not changed since it was reached, key still belongs in it.
+    bp_leaf_t *leaf = (bp_leaf_t *)node;
+    if (!node_upgrade(node, version))
+        return RESTART;
+
+    int found;
+    int pos = leaf_find(leaf, kp, key, len, &found);
+    if (found)
+    {
+        node_unlock(node);
+        return 0;
+    }
+
+    int n = leaf->hdr.count;
+    for (int i = n; i > pos; i--)
+    {
+        STORE(leaf->prefix[i], leaf->prefix[i - 1]);
+        STORE_PTR(leaf->pair[i], leaf->pair[i - 1]);
+    }
+    STORE(leaf->prefix[pos], kp);
+    STORE_PTR(leaf->pair[pos], pair);
+    STORE(leaf->hdr.count, n + 1);
+    node_unlock(node);
+    return 1;
+}
+
+int bptree_insert(bptree_t *tree, const char *key, size_t key_len,
+                  const char *value, size_t value_len)
+{
+    bp_pair_t *pair = pair_constructor(key, key_len, value, value_len);
+    if (pair == NULL)
+        return 0;
+
+    // comparisons look at the keys of pairs that may be removed meanwhile
+    int ret;
+    unsigned long kp = key_prefix(key, key_len);
+    epoch_enter();
+    for (int attempt = 0;
+         (ret = insert_attempt(tree, pair, key_len, kp)) == RESTART;
+         attempt++)
+        backoff(attempt);
+    epoch_exit();
+
+    if (ret == 0)
+        free(pair);
+    return ret;
+}
+
+int bptree_remove(bptree_t *tree, const char *key, size_t len)
+{
+    unsigned long kp = key_prefix(key, len);
+
+    epoch_enter();
+    for (int attempt = 0;; attempt++)
+    {
+        unsigned long version;
+        bp_leaf_t *leaf = find_leaf(tree, kp, key, len, &version);
+        if (leaf == NULL || !node_upgrade(&leaf->hdr, version))
+        {
+            backoff(attempt);
+            continue;
+        }
+
+        int found;
+        int pos = leaf_find(leaf, kp, key, len, &found);
+        if (!found)
+        {
+            node_unlock(&leaf->hdr);
+            epoch_exit();
+            return 0;
+        }
+
+        // underfull leaves are left as they are; nodes are never merged
+        bp_pair_t *pair = leaf->pair[pos];
+        int n = leaf->hdr.count;
+        for (int i = pos; i < n - 1; i++)
+        {
+            STORE(leaf->prefix[i], leaf->prefix[i + 1]);
+            STORE_PTR(leaf->pair[i], leaf->pair[i + 1]);
+        }
+        STORE(leaf->hdr.count, n - 1);
+        node_unlock(&leaf->hdr);
+
+        epoch_retire(pair, pair_reclaim);
+        epoch_exit();
+        return 1;
+    }
+}
+
+int bptree_scan(bptree_t *tree, const char *start, size_t len,
+                int (*fn)(const char *key, const char *value, void *arg),
+                void *arg)
+{
+    bp_pair_t *batch[LEAF_SLOTS];
+    const char *last = NULL;  // largest key visited so far
+
+    // leaves are never freed while the tree is in use, and splits only move
+    // pairs to the right, so the scan may start from a leaf that has changed
+    // since it was found
+    bp_leaf_t *leaf = tree->first;
+    if (len > 0)
+    {
+        unsigned long kp = key_prefix(start, len);
+        unsigned long version;
+        for (int attempt = 0;
+             (leaf = find_leaf(tree, kp, start, len, &version)) == NULL;
+             attempt++)
+            backoff(attempt);
+    }
+    while (leaf != NULL)
+    {
+        // take a consistent snapshot of the leaf
+        int n;
+        bp_leaf_t *next;
+        for (int attempt = 0;; attempt++)
+        {
+            unsigned long version = node_read(&leaf->hdr);
+            if (!(version & 1))
+            {
+                n = LOAD(leaf->hdr.count);
+                for (int i = 0; i < n; i++)
+                    batch[i] = LOAD_PTR(leaf->pair[i]);
+                next = LOAD_PTR(leaf->next);
+                if (node_check(&leaf->hdr, version))
+                    break;
+            }
+            backoff(attempt);
+        }
+
+        // if the leaf was split after an earlier one was read, its pairs may
+        // show up again in the new right sibling
+        for (int i = 0; i < n; i++)
+        {
+            if (last != NULL ? strcmp(batch[i]->key, last) <= 0
+                             : engine_key_cmp(start, len, batch[i]->key) > 0)
+                continue;
+            int ret = fn(batch[i]->key, batch[i]->value, arg);
+            if (ret != 0)
+                return ret;
+            last = batch[i]->key;
+        }
+        leaf = next;
+    }
+    return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Engine interface
+
+static void *bptree_engine_constructor(unsigned int flags)
+{
+    (void)flags;  // there is no hash index to keep
+    return bptree_constructor();
+}
+
+static void bptree_engine_destructor(void *state)
+{
+    bptree_destructor(state);
+}
+
+static const char *bptree_engine_lookup(void *state, const char *key,
+                                        size_t key_len)
+{
+    return bptree_lookup(state, key, key_len);
+}
+
+static int bptree_engine_insert(void *state, const char *key, size_t key_len,
+                                const char *value, size_t value_len)
+{
+    return bptree_insert(state, key, key_len, value, value_len);
+}
+
+static int bptree_engine_remove(void *state, const char *key, size_t key_len)
+{
+    return bptree_remove(state, key, key_len);
+}
+
+static int bptree_engine_scan(void *state, const char *start,
+                              size_t start_len, engine_visit_t fn, void *arg)
+{
+    return bptree_scan(state, start, start_len, fn, arg);
+}
+
+// there is no binary tree to print
+const engine_ops_t bptree_engine = {
+    "bptree",
+    bptree_engine_constructor,
+    bptree_engine_destructor,
+    bptree_engine_lookup,
+    NULL,
+    bptree_engine_insert,
+    NULL,
+    bptree_engine_remove,
+    NULL,
+    bptree_engine_scan,
+    NULL,
+    NULL,
+    NULL,
+};
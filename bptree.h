@@ -0,0 +1,66 @@
+#ifndef BPTREE_H_
+#define BPTREE_H_
+
+#include <stddef.h>
+
+/*
+ * A concurrent B+-tree mapping string keys to string values, used as an
+ * alternative storage engine to the binary tree in bst.c.
+ *
+ * Nodes are 512 bytes, eight cache lines. Next to every key they hold the
+ * first eight bytes of that key, big-endian, so most comparisons during a
+ * search are integer comparisons on the node itself, and the full key (kept
+ * out of line) is only looked at when two prefixes are equal. Leaves are
+ * linked left to right for ordered traversal, and the separators in inner
+ * nodes are cut down to the shortest prefix that still tells their two
+ * subtrees apart.
+ *
+ * Concurrency uses optimistic lock coupling. Every node has a version that is
+ * odd while the node is locked. Lookups take no locks: they validate the
+ * versions of the nodes they pass and restart if one of them changed, and they
+ * must run inside an epoch (see epoch.h). Updates descend the same way and
+ * only lock the leaf they modify, plus its parent when a node has to be
+ * split. Full nodes are split on the way down, so a split never propagates
+ * upwards. Nodes are never merged or freed before bptree_destructor(); only
+ * the removed key/value pairs are reclaimed, through epoch_retire().
+ */
+typedef struct bptree bptree_t;
+
+/* Creates an empty tree. Returns NULL on failure. */
+bptree_t *bptree_constructor(void);
+
+/*
+ * Frees the tree and every pair in it. Only call this when no other thread is
+ * using the tree.
+ */
+void bptree_destructor(bptree_t *tree);
+
+/*
+ * Returns the value stored under key, or NULL if there is none. Must be
+ * called inside an epoch; the value stays valid until the matching
+ * epoch_exit().
+ */
+const char *bptree_lookup(bptree_t *tree, const char *key, size_t len);
+
+/*
+ * Adds the pair (key, value) to the tree. Returns 1 on success and 0 if key
+ * is already in the tree or memory ran out.
+ */
+int bptree_insert(bptree_t *tree, const char *key, size_t key_len,
+                  const char *value, size_t value_len);
+
+/* Removes key from the tree. Returns 1 on success and 0 if it is not there. */
+int bptree_remove(bptree_t *tree, const char *key, size_t len);
+
+/*
+ * Calls fn on every pair in the tree whose key is not smaller than the len
+ * bytes at start, in ascending key order, stopping early if fn returns
+ * nonzero, and returns what fn last returned (or 0). The scan starts at the
+ * leaf start belongs in. Pairs that are added or removed concurrently may or
+ * may not be visited. Must be called inside an epoch.
+ */
+int bptree_scan(bptree_t *tree, const char *start, size_t len,
+                int (*fn)(const char *key, const char *value, void *arg),
+                void *arg);
+
+#endif  // BPTREE_H_
@@ -0,0 +1,1656 @@
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "./bst.h"
+#include "./engine.h"
+#include "./epoch.h"
+#include "./hindex.h"
+#include "./slab.h"
+
+#define MAXLEN 256
+// failed optimistic attempts before a reader starts yielding the CPU
+#define OPTIMISTIC_SPINS 8
+// lookups search_interleaved() keeps in flight
+#define INTERLEAVE 16
+// nodes of a writer's path that release_path() finds without a comparison
+#define PATH_RECORDED 64
+
+struct bst {
+    // The root node of the tree. Unlike all other nodes in the tree, this one
+    // is never freed (it lives in the bst_t itself).
+    node_t head;
+    // optional hash index answering point queries; NULL when disabled
+    hindex_t *index;
+    // where every node but head is allocated
+    slab_arena_t *arena;
+} __attribute__((aligned(64)));
+
+//------------------------------------------------------------------------------------------------
+// Keys
+//
+// Every node keeps the first eight bytes of its key inline, as a big-endian
+// integer, next to its child pointers. A search computes the same integer for
+// its key once, so at most levels one integer comparison decides the way
+// down, and the key itself is only looked at when the two prefixes tie.
+
+/* Returns the first eight bytes of key as a big-endian integer, padded with
+ * zeros, so that comparing prefixes compares the keys' first eight bytes. */
+static inline unsigned long key_prefix(const char *key, size_t len)
+{
+    unsigned long prefix = 0;
+    for (size_t i = 0; i < 8; i++)
+    {
+        prefix <<= 8;
+        if (i < len)
+            prefix |= (unsigned char)key[i];
+    }
+    return prefix;
+}
+
+/* Compares key, len bytes whose prefix is kp, with node's key, like
+ * strcmp(). */
+static inline int node_cmp(unsigned long kp, const char *key, size_t len,
+                           const node_t *node)
+{
+    if (kp != node->prefix)
+        return kp < node->prefix ? -1 : 1;
+    // both keys end within the prefix
+    if ((kp & 0xff) == 0)
+        return 0;
+    return engine_key_cmp(key + 8, len - 8, node->key + 8);
+}
+
+//------------------------------------------------------------------------------------------------
+// Optimistic read helpers
+//
+// Queries do not take any locks. Every node carries a version counter that
+// writers make odd while they are relinking the node (always under its write
+// lock) and even again once they are done; a node that has been unlinked for
+// deletion is left odd forever. A reader remembers the version of each node
+// before looking at it, and validates the parent's version only after it has
+// read the version of the child it is moving to, so it never observes a
+// half-relinked path without noticing. A failed validation restarts the
+// search from head. Unlinked nodes are handed to epoch_retire(), so a reader
+// can always finish looking at a node even if it was removed meanwhile.
+
+/* Marks the start of a modification of a write-locked node. */
+static inline void node_write_begin(node_t *node)
+{
+    __atomic_store_n(&node->version, node->version + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/* Marks the end of a modification of a write-locked node. */
+static inline void node_write_end(node_t *node)
+{
+    __atomic_store_n(&node->version, node->version + 1, __ATOMIC_RELEASE);
+}
+
+/* Ends the modification of a node and releases its write lock. */
+static inline void node_write_unlock(node_t *node)
+{
+    node_write_end(node);
+    rwlock_unlock(&node->rwlock);
+}
+
+/* Publishes a child pointer; only called between node_write_begin() and
+ * node_write_end() on the node that owns slot. */
+static inline void set_child(node_t **slot, node_t *child)
+{
+    __atomic_store_n(slot, child, __ATOMIC_RELEASE);
+}
+
+/* Returns the node's version, or an odd number if it is being modified. */
+static inline unsigned int read_begin(node_t *node)
+{
+    return __atomic_load_n(&node->version, __ATOMIC_ACQUIRE);
+}
+
+/* Returns nonzero if the node has not been modified since read_begin(). */
+static inline int read_validate(node_t *node, unsigned int version)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&node->version, __ATOMIC_RELAXED) == version;
+}
+
+/* Backs off before a reader restarts; yields after repeated conflicts so
+ * that the writer it is waiting for gets a chance to run. */
+static void read_backoff(int attempt)
+{
+    if (attempt > OPTIMISTIC_SPINS)
+        sched_yield();
+}
+
+/*
+ * Lock-free counterpart of the writers' descent, used by bst_lookup():
+ * returns the node holding key in the tree under root, or NULL if there is
+ * none. Must be called inside an epoch; the returned node stays valid until
+ * the matching epoch_exit().
+ */
+static node_t *search_optimistic(node_t *root, const char *key, size_t len)
+{
+    unsigned long kp = key_prefix(key, len);
+    for (int attempt = 0;; attempt++)
+    {
+        node_t *node = root;
+        unsigned int version = read_begin(node);
+        node_t *found = NULL;
+
+        while (!(version & 1))
+        {
+            node_t *next;
+            int cmp = node_cmp(kp, key, len, node);
+            if (cmp == 0 && node != root)
+            {
+                found = node;
+                break;
+            }
+            if (cmp < 0)
+                next = __atomic_load_n(&node->lchild, __ATOMIC_ACQUIRE);
+            else
+                next = __atomic_load_n(&node->rchild, __ATOMIC_ACQUIRE);
+
+            if (next == NULL)
+                break;
+
+            unsigned int next_version = read_begin(next);
+            if (!read_validate(node, version))
+            {
+                version = 1;
+                break;
+            }
+            node = next;
+            version = next_version;
+        }
+
+        if (!(version & 1) && read_validate(node, version))
+            return found;
+
+        read_backoff(attempt);
+    }
+}
+
+/* One of the lookups search_interleaved() runs side by side. */
+typedef struct cursor {
+    int i;  // the key's position in the batch, -1 if the cursor is idle
+    const char *key;
+    size_t len;
+    unsigned long kp;
+    node_t *node;          // where the lookup is
+    unsigned int version;  // node's version when the lookup got there
+    node_t *next;          // the child it moves to next, prefetched
+    int attempt;
+} cursor_t;
+
+/* Starts (or restarts) the lookup of c's key at root. */
+static void cursor_start(cursor_t *c, node_t *root)
+{
+    c->node = root;
+    c->version = read_begin(root);
+    c->next = NULL;
+}
+
+/*
+ * Takes the lookup of c one node further, like one iteration of the loop in
+ * search_optimistic(), except that the child it moves to is only prefetched
+ * here and looked at on the next call. Returns 1 once the lookup is done,
+ * with the node holding the key, or NULL, in *found.
+ */
+static int cursor_step(cursor_t *c, node_t *root, node_t **found)
+{
+    if (c->next != NULL)
+    {
+        unsigned int next_version = read_begin(c->next);
+        if (!read_validate(c->node, c->version))
+            c->version = 1;
+        else
+        {
+            c->node = c->next;
+            c->version = next_version;
+        }
+        c->next = NULL;
+    }
+
+    if (!(c->version & 1))
+    {
+        node_t *node = c->node;
+        int cmp = node_cmp(c->kp, c->key, c->len, node);
+        int hit = cmp == 0 && node != root;
+        node_t *next = NULL;
+        if (cmp < 0)
+            next = __atomic_load_n(&node->lchild, __ATOMIC_ACQUIRE);
+        else if (!hit)
+            next = __atomic_load_n(&node->rchild, __ATOMIC_ACQUIRE);
+
+        if (next != NULL)
+        {
+            __builtin_prefetch(next);
+            c->next = next;
+            return 0;
+        }
+        if (read_validate(node, c->version))
+        {
+            *found = hit ? node : NULL;
+            return 1;
+        }
+    }
+
+    read_backoff(c->attempt++);
+    cursor_start(c, root);
+    return 0;
+}
+
+/*
+ * Looks up the n keys at keys[i], lens[i] bytes each, in the tree under root
+ * like search_optimistic() would, storing the value of the node holding
+ * keys[i], or NULL, in values[i]. Up to INTERLEAVE lookups are in flight at a
+ * time: each step of one prefetches the child it goes to and moves on to the
+ * next lookup, so by the time it comes back the child is in the cache, and
+ * the misses of all of them overlap instead of following one another. Keys
+ * given in ascending order share the top of their paths as well. Must be
+ * called inside an epoch.
+ */
+static void search_interleaved(node_t *root, const char *const *keys,
+                               const size_t *lens, int n, const char **values)
+{
+    cursor_t cursors[INTERLEAVE];
+    int started = 0;
+    int active = 0;
+    for (int j = 0; j < INTERLEAVE; j++)
+    {
+        cursors[j].i = -1;
+        if (started < n)
+        {
+            cursor_t *c = &cursors[j];
+            c->i = started++;
+            c->key = keys[c->i];
+            c->len = lens[c->i];
+            c->kp = key_prefix(c->key, c->len);
+            c->attempt = 0;
+            cursor_start(c, root);
+            active++;
+        }
+    }
+
+    while (active > 0)
+    {
+        for (int j = 0; j < INTERLEAVE; j++)
+        {
+            cursor_t *c = &cursors[j];
+            node_t *found;
+            if (c->i < 0 || !cursor_step(c, root, &found))
+                continue;
+
+            values[c->i] = found != NULL ? found->value : NULL;
+            if (started < n)
+            {
+                // the cursor goes on with the next key
+                c->i = started++;
+                c->key = keys[c->i];
+                c->len = lens[c->i];
+                c->kp = key_prefix(c->key, c->len);
+                c->attempt = 0;
+                cursor_start(c, root);
+            }
+            else
+            {
+                c->i = -1;
+                active--;
+            }
+        }
+    }
+}
+
+//------------------------------------------------------------------------------------------------
+// Subtree sizes
+//
+// Every node but head counts the nodes in its left subtree, which is all a
+// rank or select query needs on its way down; an add or remove only has to
+// change the count of the nodes where its key's path turns left, about half
+// of them. A writer adds its +1 or -1 to those counts as it read-locks them
+// on the way down, and holds the read locks on its whole path from head until
+// it is done; if it fails, it takes the delta off again while unlocking.
+// split() and merge() change the counts of the nodes they relink while
+// holding their write locks. So a count only changes while the subtree below
+// it cannot be relinked by anyone else, and the counts are exact whenever no
+// writer is active.
+//
+// The count sits right after the lock word, so that rwlock.h can take the
+// lock and change the count with a single atomic instruction.
+
+_Static_assert(offsetof(node_t, lsize) == offsetof(node_t, rwlock) + 4 &&
+                   offsetof(node_t, rwlock) % 8 == 0,
+               "lsize must share an aligned word with rwlock");
+
+static inline unsigned int left_size(node_t *node)
+{
+    return __atomic_load_n(&node->lsize, __ATOMIC_RELAXED);
+}
+
+/* Adds delta to the left count of a node the caller holds a lock on. */
+static inline void left_size_add(node_t *node, unsigned int delta)
+{
+    __atomic_add_fetch(&node->lsize, delta, __ATOMIC_RELAXED);
+}
+
+//------------------------------------------------------------------------------------------------
+// Treap helpers
+//
+// The tree is kept balanced as a treap: every node carries a priority derived
+// from a hash of its key, and the tree is a max-heap on priorities as well as
+// a binary search tree on keys. Because the priorities look random regardless
+// of the order in which keys arrive, the expected depth is O(log n) even for
+// sorted input. Both insertion and deletion restructure the tree top-down, so
+// they fit the writers' top-down locking: only the nodes that are being
+// relinked are write-locked, and each is released as soon as its child
+// pointers are final.
+
+/* Returns the treap priority of key (32-bit FNV-1a, finalized with murmur3's
+ * avalanche step so that similar keys get unrelated priorities). */
+static unsigned int key_priority(const char *key, size_t len)
+{
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)key[i];
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+/*
+ * Returns the number of keys smaller than the len bytes at key (prefix kp)
+ * in the subtree rooted at t, or the number of keys in it if key is NULL. The
+ * caller has write-locked t. No new writer can get below t, but an earlier
+ * split() or merge() may still be relinking nodes further down after
+ * releasing t, so the walk follows it with read locks: every node it gets a
+ * lock on has its final children and count.
+ */
+static unsigned int count_below(node_t *t, unsigned long kp, const char *key,
+                                size_t len)
+{
+    unsigned int count = 0;
+    node_t *locked = NULL;
+    while (t != NULL)
+    {
+        node_t *next;
+        if (key == NULL || node_cmp(kp, key, len, t) > 0)
+        {
+            count += left_size(t) + 1;
+            next = t->rchild;
+        }
+        else
+        {
+            next = t->lchild;
+        }
+
+        if (next != NULL)
+            rwlock_rdlock(&next->rwlock);
+        if (locked != NULL)
+            rwlock_unlock(&locked->rwlock);
+        locked = next;
+        t = next;
+    }
+    return count;
+}
+
+/*
+ * Splits the subtree rooted at t around the len bytes at key (prefix kp),
+ * hanging the smaller keys off *lslot and the others off *rslot, sets the
+ * left counts of the nodes that moved and returns the number of smaller
+ * keys. t (if not NULL) must be write-locked by the caller, and so must the
+ * node owning each slot (if any), already marked as being modified; t is
+ * released here, the owners are not.
+ */
+static unsigned int split(node_t *t, unsigned long kp, const char *key,
+                          size_t len, node_t **lslot, node_t **rslot)
+{
+    // last node placed on each spine; its inner child pointer is still pending
+    node_t *lhold = NULL;
+    node_t *rhold = NULL;
+    // keys smaller than key in the subtree rooted at t
+    unsigned int smaller = count_below(t, kp, key, len);
+    unsigned int total = smaller;
+
+    while (t != NULL)
+    {
+        node_t *next;
+        node_write_begin(t);
+        if (node_cmp(kp, key, len, t) > 0)
+        {
+            // t keeps its left subtree
+            smaller -= left_size(t) + 1;
+            set_child(lslot, t);
+            if (lhold != NULL)
+                node_write_unlock(lhold);
+            lhold = t;
+            lslot = &t->rchild;
+            next = t->rchild;
+        }
+        else
+        {
+            // the smaller keys, all in t's left subtree, go to the left side
+            left_size_add(t, -smaller);
+            set_child(rslot, t);
+            if (rhold != NULL)
+                node_write_unlock(rhold);
+            rhold = t;
+            rslot = &t->lchild;
+            next = t->lchild;
+        }
+
+        if (next != NULL)
+            rwlock_wrlock(&next->rwlock);
+        t = next;
+    }
+
+    set_child(lslot, NULL);
+    set_child(rslot, NULL);
+    if (lhold != NULL)
+        node_write_unlock(lhold);
+    if (rhold != NULL)
+        node_write_unlock(rhold);
+    return total;
+}
+
+/*
+ * Stores the merge of the subtrees l and r (every key in l is smaller than
+ * every key in r) into *slot, which belongs to the write-locked node owner.
+ * owner is released once its pointer is final; l and r must not be locked by
+ * the caller. l_size is the number of nodes in l: each node of r taken onto
+ * the merged spine gets what is left of l in its left subtree.
+ */
+static void merge(node_t *owner, node_t **slot, node_t *l, node_t *r,
+                  unsigned int l_size)
+{
+    if (l != NULL)
+        rwlock_wrlock(&l->rwlock);
+    if (r != NULL)
+        rwlock_wrlock(&r->rwlock);
+
+    node_write_begin(owner);
+    while (l != NULL && r != NULL)
+    {
+        node_t *next;
+        if (l->prio >= r->prio)
+        {
+            l_size -= left_size(l) + 1;
+            set_child(slot, l);
+            node_write_unlock(owner);
+            owner = l;
+            node_write_begin(owner);
+            slot = &l->rchild;
+            next = l->rchild;
+            if (next != NULL)
+                rwlock_wrlock(&next->rwlock);
+            l = next;
+        }
+        else
+        {
+            left_size_add(r, l_size);
+            set_child(slot, r);
+            node_write_unlock(owner);
+            owner = r;
+            node_write_begin(owner);
+            slot = &r->lchild;
+            next = r->lchild;
+            if (next != NULL)
+                rwlock_wrlock(&next->rwlock);
+            r = next;
+        }
+    }
+
+    node_t *rest = (l != NULL) ? l : r;
+    set_child(slot, rest);
+    node_write_unlock(owner);
+    if (rest != NULL)
+        rwlock_unlock(&rest->rwlock);
+}
+
+//------------------------------------------------------------------------------------------------
+// Constructor, destructor, and cleanup methods
+
+/*
+ * Creates a node of tree holding copies of key and value. The node and both
+ * strings are one block from the tree's arena: the strings follow the node
+ * header, key first, so reading a node's key touches the same cache lines as
+ * its child pointers.
+ */
+static node_t *node_constructor(bst_t *tree, const char *arg_key,
+                                size_t key_len, const char *arg_value,
+                                size_t val_len, node_t *arg_left,
+                                node_t *arg_right)
+{
+    if (key_len > MAXLEN || val_len > MAXLEN)
+        return 0;
+
+    node_t *new_node =
+        slab_alloc(tree->arena, sizeof(node_t) + key_len + val_len + 2);
+
+    if (new_node == NULL)
+        return 0;
+
+    rwlock_init(&new_node->rwlock);
+    new_node->key = new_node->data;
+    memcpy(new_node->key, arg_key, key_len);
+    new_node->key[key_len] = '\0';
+    new_node->value = new_node->key + key_len + 1;
+    memcpy(new_node->value, arg_value, val_len);
+    new_node->value[val_len] = '\0';
+    new_node->lchild = arg_left;
+    new_node->rchild = arg_right;
+    new_node->prio = key_priority(arg_key, key_len);
+    new_node->prefix = key_prefix(arg_key, key_len);
+    new_node->version = 0;
+    new_node->hnext = NULL;
+    new_node->hash = 0;
+    new_node->lsize = 0;
+    return new_node;
+}
+
+static void node_destructor(node_t *node)
+{
+    slab_free(node);
+}
+
+/* node_destructor() in the shape epoch_retire() expects */
+static void node_reclaim(void *node)
+{
+    node_destructor((node_t *)node);
+}
+
+/*
+ * Subtrees detached by bst_remove_range() are freed by a background thread,
+ * so that removing a range costs its caller the same however many keys it
+ * holds. Once no reader can be in a subtree anymore, the epoch reclamation
+ * queues its root here, linked through hnext (the nodes are no longer
+ * indexed), and the thread frees the subtree node by node.
+ */
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t queued;  // signalled when a subtree is queued or on stop
+    node_t *queue;
+    int running;   // whether the thread has been started and not joined
+    int stopping;  // whether the thread should exit once the queue is empty
+    pthread_t thread;
+} reclaimer = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0,
+               0};
+
+/*
+ * Waits until nobody holds node's lock. Used on detached nodes: the writer
+ * whose merge() or split() relinked a node last, or a reader walking down
+ * with locks, may still be below it, but they are always ahead of anyone
+ * following them down with locks, and never come back up. So once the lock
+ * has been free, node's child pointers are final and nobody touches the
+ * node again.
+ */
+static void node_quiesce(node_t *node)
+{
+    rwlock_wrlock(&node->rwlock);
+    rwlock_unlock(&node->rwlock);
+}
+
+/* Frees every node of the detached subtree rooted at node, rotating left
+ * children up so that no stack is needed however deep the subtree is. */
+static void subtree_destructor(node_t *node)
+{
+    if (node != NULL)
+        node_quiesce(node);
+    while (node != NULL)
+    {
+        node_t *next;
+        if (node->lchild != NULL)
+        {
+            next = node->lchild;
+            node_quiesce(next);
+            node->lchild = next->rchild;
+            next->rchild = node;
+        }
+        else
+        {
+            next = node->rchild;
+            node_destructor(node);
+            if (next != NULL)
+                node_quiesce(next);
+        }
+        node = next;
+    }
+}
+
+static void *reclaimer_main(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&reclaimer.mutex);
+    while (1)
+    {
+        while (reclaimer.queue == NULL && !reclaimer.stopping)
+            pthread_cond_wait(&reclaimer.queued, &reclaimer.mutex);
+        if (reclaimer.queue == NULL)
+            break;
+        node_t *root = reclaimer.queue;
+        reclaimer.queue = root->hnext;
+        pthread_mutex_unlock(&reclaimer.mutex);
+        subtree_destructor(root);
+        pthread_mutex_lock(&reclaimer.mutex);
+    }
+    pthread_mutex_unlock(&reclaimer.mutex);
+    return NULL;
+}
+
+/* Hands a detached subtree to the background thread, starting it if need be;
+ * called through epoch_retire() once no reader can still be in it. */
+static void subtree_reclaim(void *root)
+{
+    pthread_mutex_lock(&reclaimer.mutex);
+    if (!reclaimer.running)
+    {
+        int err = pthread_create(&reclaimer.thread, NULL, reclaimer_main,
+                                 NULL);
+        if (err != 0)
+        {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            exit(1);
+        }
+        reclaimer.running = 1;
+    }
+    ((node_t *)root)->hnext = reclaimer.queue;
+    reclaimer.queue = root;
+    pthread_cond_signal(&reclaimer.queued);
+    pthread_mutex_unlock(&reclaimer.mutex);
+}
+
+/* Has the background thread free every subtree queued so far, then exit, and
+ * joins it; the next subtree_reclaim() starts it again. */
+static void reclaimer_stop(void)
+{
+    pthread_mutex_lock(&reclaimer.mutex);
+    if (!reclaimer.running)
+    {
+        pthread_mutex_unlock(&reclaimer.mutex);
+        return;
+    }
+    reclaimer.stopping = 1;
+    pthread_cond_signal(&reclaimer.queued);
+    pthread_mutex_unlock(&reclaimer.mutex);
+    pthread_join(reclaimer.thread, NULL);
+    pthread_mutex_lock(&reclaimer.mutex);
+    reclaimer.running = 0;
+    reclaimer.stopping = 0;
+    pthread_mutex_unlock(&reclaimer.mutex);
+}
+
+bst_t *bst_constructor(int index, int huge_pages)
+{
+    bst_t *tree;
+    if (posix_memalign((void **)&tree, 64, sizeof(bst_t)) != 0)
+        return NULL;
+
+    memset(tree, 0, sizeof(bst_t));
+    tree->head.key = "";
+    tree->head.value = "";
+    tree->head.prio = UINT_MAX;
+    rwlock_init(&tree->head.rwlock);
+    if ((tree->arena = slab_arena_constructor(huge_pages)) == NULL ||
+        (index && (tree->index = hindex_constructor()) == NULL))
+    {
+        if (tree->arena != NULL)
+            slab_arena_destructor(tree->arena);
+        free(tree);
+        return NULL;
+    }
+    return tree;
+}
+
+void bst_destructor(bst_t *tree)
+{
+    // Every node lives in the arena, so there is no need to visit them; only
+    // the background thread must be done with any subtree of this tree. It is
+    // stopped rather than left waiting, or the server could not exit.
+    reclaimer_stop();
+    slab_arena_destructor(tree->arena);
+    if (tree->index != NULL)
+        hindex_destructor(tree->index);
+    free(tree);
+}
+
+//------------------------------------------------------------------------------------------------
+// Database modifiers and accessors
+
+/*
+ * The nodes a writer holds locked on its way down, from head on, for
+ * release_path() to go through again without repeating the comparisons (and
+ * their mispredicted branches). Only the first PATH_RECORDED are recorded;
+ * release_path() follows the key past those.
+ */
+typedef struct path {
+    node_t *nodes[PATH_RECORDED];
+    int n;  // nodes on the path, recorded or not
+} path_t;
+
+static inline void path_push(path_t *path, node_t *node)
+{
+    if (path->n < PATH_RECORDED)
+        path->nodes[path->n] = node;
+    path->n++;
+}
+
+/*
+ * Shared-lock descent used by the writers. Walks down from root with read
+ * locks and stops at the first node on key's path that holds key or whose
+ * priority is lower than prio (bst_remove() passes 0, so it only stops on
+ * key). Returns that node, read-locked, or NULL if the path ran out. Every
+ * node above it stays read-locked, down to *parentp, the node right above
+ * it, and is pushed onto path: none of them can be unlinked or relinked until
+ * the writer is done (see release_path()).
+ *
+ * The writer counts itself in on the way: delta is added to the left count
+ * of every node passed where the path turns left, with the same atomic
+ * instruction that locks it. Whether the path turns left at a node, and
+ * whether the descent stops there, only depend on the node's key and
+ * priority, which never change, so they are known before it is locked.
+ */
+static node_t *descend_shared(node_t *root, const char *key, size_t len,
+                              unsigned long kp, unsigned int prio, int delta,
+                              path_t *path, node_t **parentp)
+{
+    node_t *parent = root;
+    node_t *next;
+    rwlock_rdlock(&root->rwlock);
+    path->n = 0;
+    path_push(path, root);
+
+    while (1)
+    {
+        if (node_cmp(kp, key, len, parent) < 0)
+            next = parent->lchild;
+        else
+            next = parent->rchild;
+
+        if (next == NULL)
+            break;
+
+        int cmp = node_cmp(kp, key, len, next);
+        if (cmp == 0 || next->prio < prio)
+        {
+            rwlock_rdlock(&next->rwlock);
+            break;
+        }
+
+        if (cmp < 0)
+            rwlock_rdlock_add(&next->rwlock, delta);
+        else
+            rwlock_rdlock(&next->rwlock);
+        path_push(path, next);
+        parent = next;
+    }
+
+    *parentp = parent;
+    return next;
+}
+
+/*
+ * Trades the read locks on parent and next left by descend_shared() for a
+ * write lock on parent. The read locks above parent are kept, so no writer
+ * can unlink parent in between (that would need its parent's write lock);
+ * parent's own children may have changed, so the caller has to look at them
+ * again.
+ */
+static void upgrade_parent(node_t *parent, node_t *next)
+{
+    if (next != NULL)
+        rwlock_unlock(&next->rwlock);
+    rwlock_unlock(&parent->rwlock);
+    rwlock_wrlock(&parent->rwlock);
+}
+
+/*
+ * Goes on from the write-locked node *parentp like descend_shared(), but
+ * with write locks: returns the first node on key's path that holds key or
+ * whose priority is lower than prio, write-locked, or NULL, and sets
+ * *parentp to the node above it. The nodes passed on the way stay locked,
+ * are pushed onto path and are counted in like descend_shared() does.
+ */
+static node_t *descend_exclusive(node_t **parentp, const char *key,
+                                 size_t len, unsigned long kp,
+                                 unsigned int prio, int delta, path_t *path)
+{
+    node_t *parent = *parentp;
+    node_t *next;
+
+    while (1)
+    {
+        if (node_cmp(kp, key, len, parent) < 0)
+            next = parent->lchild;
+        else
+            next = parent->rchild;
+
+        if (next == NULL)
+            break;
+
+        rwlock_wrlock(&next->rwlock);
+        int cmp = node_cmp(kp, key, len, next);
+        if (cmp == 0 || next->prio < prio)
+            break;
+
+        if (cmp < 0)
+            left_size_add(next, delta);
+        path_push(path, next);
+        parent = next;
+    }
+
+    *parentp = parent;
+    return next;
+}
+
+/*
+ * Releases the locks a writer holds on the first n nodes of path, which go
+ * down key's path from head. If uncount is nonzero, it is first taken off
+ * the count of each of those nodes where the path turns left: a writer that
+ * failed passes the delta it counted itself in with, bst_remove_range() the
+ * number of nodes it detached. That happens while every node on the path is
+ * still locked: once a node is released, a writer above it may split or
+ * merge the subtree and read the counts below it, which therefore have to be
+ * final by then.
+ */
+static void release_path(path_t *path, const char *key, size_t len,
+                         unsigned long kp, int n, int uncount)
+{
+    node_t *node = path->nodes[0];
+    for (int i = 1; i <= n && uncount != 0; i++)
+    {
+        node_t *next = NULL;
+        int left;
+        if (i < n && i < PATH_RECORDED)
+        {
+            next = path->nodes[i];
+            left = next == node->lchild;
+        }
+        else
+        {
+            left = node_cmp(kp, key, len, node) < 0;
+            if (i < n)
+                next = left ? node->lchild : node->rchild;
+        }
+
+        if (left)
+            left_size_add(node, -uncount);
+        node = next;
+    }
+
+    // only the nodes beyond the recorded ones have to be found again
+    node = path->nodes[0];
+    for (int i = 1; i <= n; i++)
+    {
+        node_t *next = NULL;
+        if (i < n && i < PATH_RECORDED)
+            next = path->nodes[i];
+        else if (i < n)
+            next = (node_cmp(kp, key, len, node) < 0) ? node->lchild
+                                                        : node->rchild;
+        rwlock_unlock(&node->rwlock);
+        node = next;
+    }
+}
+
+const char *bst_lookup(bst_t *tree, const char *key, size_t len)
+{
+    // readers take no locks; the caller's epoch keeps the target alive while
+    // its value is copied out even if it is removed concurrently
+    node_t *target;
+    if (tree->index != NULL)
+        target = hindex_lookup(tree->index, key, len);
+    else
+        target = search_optimistic(&tree->head, key, len);
+    return target != NULL ? target->value : NULL;
+}
+
+void bst_lookup_batch(bst_t *tree, const char *const *keys,
+                      const size_t *lens, int n, const char **values)
+{
+    if (tree->index != NULL)
+    {
+        for (int i = 0; i < n; i++)
+            values[i] = bst_lookup(tree, keys[i], lens[i]);
+        return;
+    }
+    search_interleaved(&tree->head, keys, lens, n, values);
+}
+
+int bst_insert(bst_t *tree, const char *key, size_t key_len,
+               const char *value, size_t value_len)
+{
+    size_t len = key_len;
+    unsigned int prio = key_priority(key, len);
+    unsigned long kp = key_prefix(key, len);
+    node_t *parent;
+    node_t *next;
+    path_t path;
+
+    // Walk down with shared locks until we either hit the bottom of the tree
+    // or reach the first node whose priority is lower than the new one's; that
+    // node's subtree is where the new node has to be spliced in. Any existing
+    // node with the same key has the same priority, so it lies above that
+    // point and is found on the way down without taking any write lock.
+    next = descend_shared(&tree->head, key, len, kp, prio, 1, &path, &parent);
+    if (next != NULL && node_cmp(kp, key, len, next) == 0)
+    {
+        rwlock_unlock(&next->rwlock);
+        release_path(&path, key, len, kp, path.n, 1);
+        return 0;
+    }
+
+    // Only the parent has to be locked exclusively. Things may have moved
+    // while its lock was being upgraded, so keep walking with write locks
+    // until the splice point is found again (usually right away).
+    upgrade_parent(parent, next);
+    next = descend_exclusive(&parent, key, len, kp, prio, 1, &path);
+    if (next != NULL && node_cmp(kp, key, len, next) == 0)
+    {
+        rwlock_unlock(&next->rwlock);
+        release_path(&path, key, len, kp, path.n, 1);
+        return 0;
+    }
+
+    node_t *newnode =
+        node_constructor(tree, key, key_len, value, value_len, NULL, NULL);
+    if (newnode == NULL)
+    {
+        if (next != NULL)
+            rwlock_unlock(&next->rwlock);
+        release_path(&path, key, len, kp, path.n, 1);
+        return 0;
+    }
+
+    // the new node stays locked until the subtree below it is consistent
+    rwlock_wrlock(&newnode->rwlock);
+    node_write_begin(newnode);
+    node_write_begin(parent);
+    if (node_cmp(kp, key, len, parent) < 0)
+        set_child(&parent->lchild, newnode);
+    else
+        set_child(&parent->rchild, newnode);
+    node_write_unlock(parent);
+
+    __atomic_store_n(&newnode->lsize,
+                     split(next, kp, key, len, &newnode->lchild,
+                           &newnode->rchild),
+                     __ATOMIC_RELAXED);
+
+    // Index the node while it is still locked: any other writer for the same
+    // key has to get past this lock first, so tree and index change together.
+    if (tree->index != NULL)
+        hindex_insert(tree->index, newnode);
+    node_write_unlock(newnode);
+
+    // parent has been released already; the nodes above it counted the new
+    // node in on the way down
+    release_path(&path, key, len, kp, path.n - 1, 0);
+    return 1;
+}
+
+int bst_remove(bst_t *tree, const char *key, size_t len)
+{
+    node_t *parent; // parent of the node to delete
+    node_t *dnode;  // node to delete
+    path_t path;
+    unsigned long kp = key_prefix(key, len);
+
+    // first, find the node to be removed with shared locks only
+    if ((dnode = descend_shared(&tree->head, key, len, kp, 0, -1, &path,
+                                &parent)) == NULL)
+    {
+        // it's not there
+        release_path(&path, key, len, kp, path.n, -1);
+        return 0;
+    }
+
+    // then lock its parent exclusively and find it again from there
+    upgrade_parent(parent, dnode);
+    if ((dnode = descend_exclusive(&parent, key, len, kp, 0, -1, &path)) ==
+        NULL)
+    {
+        // it's not there
+        release_path(&path, key, len, kp, path.n, -1);
+        return 0;
+    }
+
+    // Found it. Replace it in its parent with the merge of its two subtrees.
+    node_t **slot;
+    if (node_cmp(kp, key, len, parent) < 0)
+        slot = &parent->lchild;
+    else
+        slot = &parent->rchild;
+
+    // dnode's version is left odd, so optimistic readers that still reach it
+    // will retry instead of returning a removed key
+    node_write_begin(dnode);
+    if (tree->index != NULL)
+        hindex_remove(tree->index, dnode);
+    merge(parent, slot, dnode->lchild, dnode->rchild, left_size(dnode));
+
+    // parent has been released by merge(), and nothing points at dnode anymore
+    rwlock_unlock(&dnode->rwlock);
+    epoch_retire(dnode, node_reclaim);
+
+    release_path(&path, key, len, kp, path.n - 1, 0);
+    return 1;
+}
+
+//------------------------------------------------------------------------------------------------
+// Range removal
+//
+// bst_remove_range() detaches every key of a range at once. All of them lie
+// in the subtree of the highest node in the range, top: the nodes above it
+// are below the range or past it, and the way to the range leads through
+// them to top. Splitting the keys below the range off top's left subtree and
+// those past it off its right subtree leaves exactly the range under top;
+// merging the two cut-off parts in top's place unlinks it. That takes a
+// split or a merge down one spine each, so O(log n) locks however many keys
+// go, and the subtree is freed in the background.
+//
+// top is marked as being modified before anything moves and stays so, like
+// a removed node: a lock-free reader that reaches it retries until the merge
+// has replaced it, and then finds none of the range's keys anymore, while a
+// reader already below it when it was detached still sees the keys as they
+// were before. Readers that walk with locks wait for the write lock on top's
+// parent or are ahead of the writer.
+
+/* A range of keys: from start on, up to but not including end, or up to the
+ * last key if end is NULL. */
+typedef struct key_range {
+    const char *start;
+    size_t start_len;
+    unsigned long start_kp;
+    const char *end;
+    size_t end_len;
+    unsigned long end_kp;
+} key_range_t;
+
+/* Returns whether node's key lies in range. */
+static inline int in_range(const key_range_t *range, const node_t *node)
+{
+    return node_cmp(range->start_kp, range->start, range->start_len, node) <=
+               0 &&
+           (range->end == NULL ||
+            node_cmp(range->end_kp, range->end, range->end_len, node) > 0);
+}
+
+/*
+ * Goes down from *parentp, which the caller holds locked, toward range, and
+ * returns the first node in it, locked, or NULL if there is none. The nodes
+ * passed stay locked and are pushed onto path, and *parentp is set to the
+ * node above the one returned. Takes read locks like descend_shared(), or
+ * write locks like descend_exclusive() if exclusive is nonzero. The way to
+ * the range is the way to its start, so release_path() follows start.
+ */
+static node_t *descend_range(node_t **parentp, const key_range_t *range,
+                             int exclusive, path_t *path)
+{
+    node_t *parent = *parentp;
+    node_t *next;
+
+    while (1)
+    {
+        if (node_cmp(range->start_kp, range->start, range->start_len,
+                     parent) < 0)
+            next = parent->lchild;
+        else
+            next = parent->rchild;
+
+        if (next == NULL)
+            break;
+
+        if (exclusive)
+            rwlock_wrlock(&next->rwlock);
+        else
+            rwlock_rdlock(&next->rwlock);
+        if (in_range(range, next))
+            break;
+
+        path_push(path, next);
+        parent = next;
+    }
+
+    *parentp = parent;
+    return next;
+}
+
+/* Removes every node of the detached subtree rooted at node from index. */
+static void subtree_unindex(hindex_t *index, node_t *node)
+{
+    while (node != NULL)
+    {
+        node_quiesce(node);
+        hindex_remove(index, node);
+        subtree_unindex(index, node->lchild);
+        node = node->rchild;
+    }
+}
+
+unsigned long bst_remove_range(bst_t *tree, const char *start,
+                               size_t start_len, const char *end,
+                               size_t end_len)
+{
+    key_range_t range = {start, start_len, key_prefix(start, start_len),
+                         end, end_len,
+                         (end != NULL) ? key_prefix(end, end_len) : 0};
+    node_t *parent = &tree->head;
+    node_t *top;
+    path_t path;
+
+    // find the highest node in the range with shared locks only
+    rwlock_rdlock(&parent->rwlock);
+    path.n = 0;
+    path_push(&path, parent);
+    if ((top = descend_range(&parent, &range, 0, &path)) == NULL)
+    {
+        // the range is empty
+        release_path(&path, start, start_len, range.start_kp, path.n, 0);
+        return 0;
+    }
+
+    // then lock its parent exclusively and find it again from there
+    upgrade_parent(parent, top);
+    if ((top = descend_range(&parent, &range, 1, &path)) == NULL)
+    {
+        release_path(&path, start, start_len, range.start_kp, path.n, 0);
+        return 0;
+    }
+    node_write_begin(top);
+
+    // Cut the keys below the range off top's left subtree and the keys past
+    // it off its right subtree, counting what stays under top.
+    node_t *below = NULL;
+    node_t *past = NULL;
+    unsigned int nbelow = 0;
+    unsigned int nright = 0;
+    node_t *t;
+    if ((t = top->lchild) != NULL)
+    {
+        rwlock_wrlock(&t->rwlock);
+        nbelow = split(t, range.start_kp, start, start_len, &below,
+                       &top->lchild);
+    }
+    if ((t = top->rchild) != NULL)
+    {
+        rwlock_wrlock(&t->rwlock);
+        if (end != NULL)
+        {
+            nright = split(t, range.end_kp, end, end_len, &top->rchild, &past);
+        }
+        else
+        {
+            nright = count_below(t, 0, NULL, 0);
+            rwlock_unlock(&t->rwlock);
+        }
+    }
+    unsigned long removed = left_size(top) - nbelow + 1 + nright;
+
+    if (tree->index != NULL)
+    {
+        hindex_remove(tree->index, top);
+        subtree_unindex(tree->index, top->lchild);
+        subtree_unindex(tree->index, top->rchild);
+    }
+
+    // unlink the range by putting the merge of the two other parts in its
+    // place, and take it out of the counts above
+    node_t **slot;
+    if (node_cmp(range.start_kp, start, start_len, parent) < 0)
+    {
+        slot = &parent->lchild;
+        left_size_add(parent, -removed);
+    }
+    else
+    {
+        slot = &parent->rchild;
+    }
+    merge(parent, slot, below, past, nbelow);
+
+    // parent has been released by merge(); nothing points at top anymore
+    rwlock_unlock(&top->rwlock);
+    epoch_retire(top, subtree_reclaim);
+
+    release_path(&path, start, start_len, range.start_kp, path.n - 1,
+                 removed);
+    return removed;
+}
+
+//------------------------------------------------------------------------------------------------
+// Bulk loading
+//
+// bst_insert_sorted() adds a batch of keys with one pass over the tree
+// instead of one descent per key. Coming in key order, the new nodes make a
+// treap of their own in linear time, which is then merged into the tree top
+// down, the way a treap union goes: where a new node's priority is higher
+// than that of the tree node in its place, it takes the place and the tree
+// node's subtree is split around it, as bst_insert() would do; where the
+// tree node stays, the new nodes are split around its key and merged into its
+// two subtrees. No tree node is visited twice, and the tree ends up as if the
+// keys had been added one by one in ascending order.
+//
+// The merge write-locks the tree nodes it goes through, top-down. A node
+// stays locked while the merge is in its left subtree, whose size its count
+// depends on, and is released once the merge moves on to its right subtree,
+// so that writers follow hand over hand down the right spine as behind
+// split(). Lock-free readers only wait for the node being relinked.
+
+/*
+ * Links the n new nodes at nodes[], in ascending key order and not yet in the
+ * tree, into a treap and returns its root. stack has room for n nodes. A node
+ * whose priority ties with that of a smaller key goes below it, as it would
+ * if the keys were added in order.
+ */
+static node_t *batch_build(node_t **nodes, size_t n, node_t **stack)
+{
+    // the right spine of the nodes so far, from the root down
+    size_t depth = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        node_t *below = NULL;
+        while (depth > 0 && stack[depth - 1]->prio < nodes[i]->prio)
+            below = stack[--depth];
+        nodes[i]->lchild = below;
+        if (depth > 0)
+            stack[depth - 1]->rchild = nodes[i];
+        stack[depth++] = nodes[i];
+    }
+    return depth > 0 ? stack[0] : NULL;
+}
+
+/*
+ * Splits the treap of new nodes rooted at b around the len bytes at key
+ * (prefix kp), hanging the smaller keys off *lslot and the larger ones off
+ * *rslot. Returns the node holding key itself, which goes to neither side,
+ * or NULL.
+ */
+static node_t *batch_split(node_t *b, unsigned long kp, const char *key,
+                           size_t len, node_t **lslot, node_t **rslot)
+{
+    while (b != NULL)
+    {
+        int cmp = node_cmp(kp, key, len, b);
+        if (cmp == 0)
+        {
+            *lslot = b->lchild;
+            *rslot = b->rchild;
+            return b;
+        }
+        if (cmp > 0)
+        {
+            *lslot = b;
+            lslot = &b->rchild;
+            b = b->rchild;
+        }
+        else
+        {
+            *rslot = b;
+            rslot = &b->lchild;
+            b = b->lchild;
+        }
+    }
+    *lslot = NULL;
+    *rslot = NULL;
+    return NULL;
+}
+
+/*
+ * Merges the treap of new nodes rooted at b into the subtree at *slot, which
+ * belongs to the write-locked node owner, and returns the number of new nodes
+ * added; those whose key is in the tree already are freed. If release is
+ * nonzero owner is released as soon as its pointer is final, otherwise it
+ * stays locked.
+ */
+static unsigned long splice(bst_t *tree, node_t *owner, node_t **slot,
+                            node_t *b, int release)
+{
+    unsigned long added = 0;
+    // the node this call locked last, released once the merge moves past it
+    node_t *held = release ? owner : NULL;
+
+    while (b != NULL)
+    {
+        node_t *t = *slot;
+        node_t *node;
+        node_t *lb;
+        node_t *rb;
+        unsigned int smaller = 0;
+        if (t != NULL)
+            rwlock_wrlock(&t->rwlock);
+
+        if (t == NULL || t->prio < b->prio)
+        {
+            // b takes t's place, as a new node does in bst_insert()
+            node = b;
+            lb = b->lchild;
+            rb = b->rchild;
+            rwlock_wrlock(&node->rwlock);
+            node_write_begin(node);
+            node_write_begin(owner);
+            set_child(slot, node);
+            node_write_end(owner);
+            smaller = split(t, node->prefix, node->key, strlen(node->key),
+                            &node->lchild, &node->rchild);
+            if (tree->index != NULL)
+                hindex_insert(tree->index, node);
+            node_write_end(node);
+            added++;
+        }
+        else
+        {
+            // t stays; the new nodes go to either side of it
+            node = t;
+            node_t *dup = batch_split(b, t->prefix, t->key, strlen(t->key),
+                                      &lb, &rb);
+            if (dup != NULL)
+                node_destructor(dup);
+            smaller = left_size(t);
+        }
+        if (held != NULL)
+            rwlock_unlock(&held->rwlock);
+
+        unsigned long left = splice(tree, node, &node->lchild, lb, 0);
+        __atomic_store_n(&node->lsize, smaller + left, __ATOMIC_RELAXED);
+        added += left;
+
+        held = node;
+        owner = node;
+        slot = &node->rchild;
+        b = rb;
+    }
+
+    if (held != NULL)
+        rwlock_unlock(&held->rwlock);
+    return added;
+}
+
+unsigned long bst_insert_sorted(bst_t *tree, const char *const *keys,
+                                const size_t *key_lens,
+                                const char *const *values,
+                                const size_t *value_lens, size_t n)
+{
+    if (n == 0)
+        return 0;
+
+    size_t built = 0;
+    node_t **nodes = malloc(2 * n * sizeof(node_t *));
+    if (nodes != NULL)
+    {
+        for (; built < n; built++)
+        {
+            if ((nodes[built] =
+                     node_constructor(tree, keys[built], key_lens[built],
+                                      values[built], value_lens[built], NULL,
+                                      NULL)) == NULL)
+                break;
+        }
+    }
+    if (built < n)
+    {
+        // out of memory, or a string too long: add the keys one by one,
+        // which fails where it has to
+        while (built > 0)
+            node_destructor(nodes[--built]);
+        free(nodes);
+        unsigned long added = 0;
+        for (size_t i = 0; i < n; i++)
+            added += bst_insert(tree, keys[i], key_lens[i], values[i],
+                                value_lens[i]);
+        return added;
+    }
+
+    node_t *root = batch_build(nodes, n, nodes + n);
+    free(nodes);
+    rwlock_wrlock(&tree->head.rwlock);
+    return splice(tree, &tree->head, &tree->head.rchild, root, 1);
+}
+
+//------------------------------------------------------------------------------------------------
+// Printing methods and their helpers
+
+static inline void print_spaces(int lvl, FILE *out)
+{
+    for (int i = 0; i < lvl; i++)
+    {
+        fprintf(out, " ");
+    }
+}
+
+/* helper function for bst_print */
+static void print_recurs(node_t *node, int lvl, FILE *out)
+{
+    print_spaces(lvl, out); // print spaces to differentiate levels
+
+    // print node's key/value, or (root) if it's the root
+    if (node == NULL)
+    {
+        fprintf(out, "(null)\n");
+        return;
+    }
+
+    rwlock_rdlock(&node->rwlock); // lock after checking NULL
+
+    if (lvl == 0)
+    {
+        fprintf(out, "(root)\n");
+    }
+    else
+    {
+        fprintf(out, "%s %s\n", node->key, node->value);
+    }
+    print_recurs(node->lchild, lvl + 1, out);
+    print_recurs(node->rchild, lvl + 1, out);
+    rwlock_unlock(&node->rwlock);
+}
+
+void bst_print(bst_t *tree, FILE *out)
+{
+    print_recurs(&tree->head, 0, out);
+}
+
+/*
+ * Calls fn on the pairs of the subtree rooted at node in key order,
+ * read-locking each node while its subtrees are visited. If start is not
+ * NULL, only keys not smaller than the len bytes at start (whose prefix is
+ * kp) are visited; once a node's key is, its right subtree is all visited.
+ */
+static int scan_recurs(node_t *node, unsigned long kp, const char *start,
+                       size_t len,
+                       int (*fn)(const char *key, const char *value, void *arg),
+                       void *arg)
+{
+    if (node == NULL)
+        return 0;
+
+    int ret = 0;
+    rwlock_rdlock(&node->rwlock);
+    int cmp = start == NULL ? -1 : node_cmp(kp, start, len, node);
+    if (cmp < 0)
+        ret = scan_recurs(node->lchild, kp, start, len, fn, arg);
+    if (ret == 0 && cmp <= 0)
+        ret = fn(node->key, node->value, arg);
+    if (ret == 0)
+        ret = scan_recurs(node->rchild, kp, cmp > 0 ? start : NULL, len, fn,
+                          arg);
+    rwlock_unlock(&node->rwlock);
+    return ret;
+}
+
+int bst_scan(bst_t *tree, const char *start, size_t len,
+             int (*fn)(const char *key, const char *value, void *arg),
+             void *arg)
+{
+    // every key is larger than the head's empty one
+    rwlock_rdlock(&tree->head.rwlock);
+    int ret = scan_recurs(tree->head.rchild, key_prefix(start, len),
+                          len > 0 ? start : NULL, len, fn, arg);
+    rwlock_unlock(&tree->head.rwlock);
+    return ret;
+}
+
+//------------------------------------------------------------------------------------------------
+// Order statistics
+
+unsigned long bst_rank(bst_t *tree, const char *key, size_t len)
+{
+    // every key is larger than the head's empty one
+    unsigned long kp = key_prefix(key, len);
+    unsigned long rank = 0;
+    node_t *parent = &tree->head;
+    rwlock_rdlock(&parent->rwlock);
+    node_t *node = parent->rchild;
+    while (node != NULL)
+    {
+        rwlock_rdlock(&node->rwlock);
+        rwlock_unlock(&parent->rwlock);
+        parent = node;
+        if (key == NULL || node_cmp(kp, key, len, node) > 0)
+        {
+            // node and its left subtree are all smaller
+            rank += left_size(node) + 1;
+            node = node->rchild;
+        }
+        else
+        {
+            node = node->lchild;
+        }
+    }
+    rwlock_unlock(&parent->rwlock);
+    return rank;
+}
+
+const char *bst_select(bst_t *tree, unsigned long rank, const char **value)
+{
+    node_t *parent = &tree->head;
+    rwlock_rdlock(&parent->rwlock);
+    node_t *node = parent->rchild;
+    while (node != NULL)
+    {
+        rwlock_rdlock(&node->rwlock);
+        rwlock_unlock(&parent->rwlock);
+        parent = node;
+        unsigned long left = left_size(node);
+        if (rank == left)
+            break;
+        if (rank < left)
+        {
+            node = node->lchild;
+        }
+        else
+        {
+            rank -= left + 1;
+            node = node->rchild;
+        }
+    }
+    rwlock_unlock(&parent->rwlock);
+
+    // the caller's epoch keeps the node's strings alive from here on
+    if (node == NULL)
+        return NULL;
+    *value = node->value;
+    return node->key;
+}
+
+//------------------------------------------------------------------------------------------------
+// Engine interface
+
+static void *bst_engine_constructor(unsigned int flags)
+{
+    return bst_constructor((flags & ENGINE_HASH_INDEX) != 0,
+                           (flags & ENGINE_HUGE_PAGES) != 0);
+}
+
+static void bst_engine_destructor(void *state)
+{
+    bst_destructor(state);
+}
+
+static const char *bst_engine_lookup(void *state, const char *key,
+                                     size_t key_len)
+{
+    return bst_lookup(state, key, key_len);
+}
+
+static void bst_engine_lookup_batch(void *state, const char *const *keys,
+                                    const size_t *key_lens, int n,
+                                    const char **values)
+{
+    bst_lookup_batch(state, keys, key_lens, n, values);
+}
+
+static int bst_engine_insert(void *state, const char *key, size_t key_len,
+                             const char *value, size_t value_len)
+{
+    return bst_insert(state, key, key_len, value, value_len);
+}
+
+static unsigned long bst_engine_insert_sorted(void *state,
+                                              const char *const *keys,
+                                              const size_t *key_lens,
+                                              const char *const *values,
+                                              const size_t *value_lens,
+                                              size_t n)
+{
+    return bst_insert_sorted(state, keys, key_lens, values, value_lens, n);
+}
+
+static int bst_engine_remove(void *state, const char *key, size_t key_len)
+{
+    return bst_remove(state, key, key_len);
+}
+
+static int bst_engine_scan(void *state, const char *start, size_t start_len,
+                           engine_visit_t fn, void *arg)
+{
+    return bst_scan(state, start, start_len, fn, arg);
+}
+
+static unsigned long bst_engine_remove_range(void *state, const char *start,
+                                             size_t start_len,
+                                             const char *end, size_t end_len)
+{
+    return bst_remove_range(state, start, start_len, end, end_len);
+}
+
+static unsigned long bst_engine_rank(void *state, const char *key,
+                                     size_t key_len)
+{
+    return bst_rank(state, key, key_len);
+}
+
+static const char *bst_engine_select(void *state, unsigned long rank,
+                                     const char **value)
+{
+    return bst_select(state, rank, value);
+}
+
+static void bst_engine_print(void *state, FILE *out)
+{
+    bst_print(state, out);
+}
+
+const engine_ops_t bst_engine = {
+    "bst",
+    bst_engine_constructor,
+    bst_engine_destructor,
+    bst_engine_lookup,
+    bst_engine_lookup_batch,
+    bst_engine_insert,
+    bst_engine_insert_sorted,
+    bst_engine_remove,
+    bst_engine_remove_range,
+    bst_engine_scan,
+    bst_engine_rank,
+    bst_engine_select,
+    bst_engine_print,
+};
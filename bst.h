@@ -0,0 +1,145 @@
+#ifndef BST_H_
+#define BST_H_
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "./rwlock.h"
+
+/*
+ * The binary search tree engine: a treap mapping string keys to string
+ * values, with optimistic lock-free lookups, read-then-write lock coupling
+ * for updates, and an optional hash index answering point queries (see
+ * hindex.h). Every node counts the nodes in its left subtree, so keys can be
+ * ranked and selected by rank in O(log n). It is the default storage engine
+ * of the database.
+ */
+typedef struct node {
+    char *key;    // points into data, or to "" for the head node
+    char *value;  // points into data, right after key's terminator
+    struct node *lchild;
+    struct node *rchild;
+    unsigned long prefix;  // key's first eight bytes, big-endian
+    unsigned int prio;     // treap priority, a hash of key
+    unsigned int version;  // odd while a writer is relinking the node
+    struct node *hnext;    // next node in the same hash index chain
+    unsigned long hash;    // hash of key, set when the node is indexed
+    rwlock_t rwlock;
+    unsigned int lsize;    // nodes in the left subtree
+    char data[];  // key and value, both '\0'-terminated
+} node_t;
+
+typedef struct bst bst_t;
+
+/*
+ * Creates an empty tree, with a hash index over it if index is nonzero. Its
+ * nodes are allocated from a slab arena of its own (see slab.h), backed by
+ * huge pages if huge_pages is nonzero. Returns NULL on failure.
+ */
+bst_t *bst_constructor(int index, int huge_pages);
+
+/*
+ * Frees the tree, its index and every node in it, by releasing the node
+ * arena as a whole. Only call this when no other thread is using the tree,
+ * and after epoch_cleanup(), so that no removed node is still waiting to be
+ * freed into the arena.
+ */
+void bst_destructor(bst_t *tree);
+
+/*
+ * Looks up the node holding key without taking any locks: validates per-node
+ * version counters on the way down and retries if a writer changed the path
+ * under it, or asks the hash index if there is one. Returns the node's value,
+ * or NULL if key is not in the tree. Must be called inside an epoch; the
+ * value stays valid until the matching epoch_exit().
+ */
+const char *bst_lookup(bst_t *tree, const char *key, size_t len);
+
+/*
+ * Looks up the n keys at keys[i], lens[i] bytes each, like bst_lookup(), and
+ * stores their values, or NULL, in values[i]. The lookups are interleaved:
+ * each prefetches the next node on its path and lets the others run while it
+ * arrives, so the cache misses of the batch overlap.
+ */
+void bst_lookup_batch(bst_t *tree, const char *const *keys,
+                      const size_t *lens, int n, const char **values);
+
+/*
+ * Walks down the tree looking for the given key. If the key is not in the
+ * tree, creates a new node with the given key and value and splices it in
+ * where its priority belongs: the subtree that used to hang there is split
+ * around the new key into the new node's left and right children. Returns 1
+ * on success and 0 on failure.
+ */
+int bst_insert(bst_t *tree, const char *key, size_t key_len,
+               const char *value, size_t value_len);
+
+/*
+ * Adds the n pairs (keys[i], values[i]), given in ascending key order with no
+ * key twice, skipping those whose key is in the tree already, and returns how
+ * many it added. The new nodes are linked into a treap of their own first,
+ * which is then merged into the tree in one top-down pass, with the same
+ * result as adding the pairs one by one in order.
+ */
+unsigned long bst_insert_sorted(bst_t *tree, const char *const *keys,
+                                const size_t *key_lens,
+                                const char *const *values,
+                                const size_t *value_lens, size_t n);
+
+/*
+ * Searches the tree for the node holding key. If such a node is found, it is
+ * replaced in its parent with the merge of its two subtrees: the merged tree
+ * is built top-down by repeatedly taking whichever subtree root has the
+ * higher priority, so both the ordering and the heap constraints of the treap
+ * are preserved. If one of the children is NULL this simply replaces the node
+ * with its other child. Returns 1 on success and 0 on failure.
+ */
+int bst_remove(bst_t *tree, const char *key, size_t len);
+
+/*
+ * Removes every key from start on, up to but not including end (or up to the
+ * last key, if end is NULL), and returns how many there were. The keys are
+ * detached as one subtree, with O(log n) locks however many there are, so
+ * that a concurrent lookup in the tree sees either all of them or none. The
+ * nodes are freed later by a background thread; with a hash index, they are
+ * unindexed here one by one.
+ */
+unsigned long bst_remove_range(bst_t *tree, const char *start,
+                               size_t start_len, const char *end,
+                               size_t end_len);
+
+/*
+ * Calls fn on every pair in the tree whose key is not smaller than the len
+ * bytes at start, in ascending key order, stopping early if fn returns
+ * nonzero, and returns what fn last returned (or 0). Subtrees holding only
+ * smaller keys are skipped without being visited. Each node is read-locked
+ * while its subtrees are visited, and unlocked once they are done.
+ */
+int bst_scan(bst_t *tree, const char *start, size_t len,
+             int (*fn)(const char *key, const char *value, void *arg),
+             void *arg);
+
+/*
+ * Returns the number of keys in the tree smaller than the len bytes at key,
+ * or the number of keys in the tree if key is NULL, summing the left counts
+ * of the nodes it passes on the right, with read locks, hand-over-hand. The
+ * count is exact while no writer is active; a concurrent add or remove may or
+ * may not be counted.
+ */
+unsigned long bst_rank(bst_t *tree, const char *key, size_t len);
+
+/*
+ * Returns the key of rank rank in the tree (the smallest has rank 0), and
+ * stores its value in *value, or returns NULL if the tree holds no more than
+ * rank keys. Descends like bst_rank(). Must be called inside an epoch; the
+ * strings stay valid until the matching epoch_exit().
+ */
+const char *bst_select(bst_t *tree, unsigned long rank, const char **value);
+
+/*
+ * Performs a pre-order traversal of the tree, printing each node's
+ * representation and then recursively printing its left and right subtrees.
+ */
+void bst_print(bst_t *tree, FILE *out);
+
+#endif  // BST_H_
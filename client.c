@@ -12,7 +12,10 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
-#define BUFSIZE 1024
+#include "./db.h"
+
+// room for the longest line the server takes, a batch command
+#define BUFSIZE 4096
 
 /*
  * Helper that opens a TCP socket representing the server.
@@ -63,13 +66,50 @@ int get_socket(const char *server, const char *port)
     return sock;
 }
 
+/*
+ * Returns how many response lines the server sends for the command in line:
+ * one per key for a batch command ('Q', 'A' or 'D', see interpret_batch() in
+ * db.h), counting the words the way the server splits them, and one for
+ * anything else, including an ill-formed batch.
+ */
+int expected_responses(const char *line)
+{
+    if (line[0] != 'Q' && line[0] != 'A' && line[0] != 'D')
+        return 1;
+
+    int words = 0;
+    const char *p = line + 1;
+    while (1)
+    {
+        while (*p == ' ' || (*p >= '\t' && *p <= '\r'))
+            p++;
+        if (*p == '\0')
+            break;
+        // words longer than 255 bytes are split
+        for (int len = 0; len < 255 && *p != '\0' && *p != ' ' &&
+                          !(*p >= '\t' && *p <= '\r');
+             len++)
+            p++;
+        words++;
+    }
+
+    int keys = line[0] == 'A' ? words / 2 : words;
+    if (keys == 0 || keys > DB_BATCH_MAX || (line[0] == 'A' && words % 2))
+        return 1;
+    return keys;
+}
+
 /*
  * Forks off a process that attempts to connect to the server, and then run the
- * script in the file provided.
+ * script in the file provided. Up to depth commands are sent ahead of their
+ * responses; with a depth of 1 every command waits for the response to the
+ * one before it. The response to a scan command ('r' or 'p', see
+ * interpret_scan() in db.h) counts as one, however many lines it has: it
+ * ends with the DB_SCAN_END line.
  * Returns the pid of the child process.
  */
 pid_t create_occurence(const char *server, const char *port,
-                       const char *script)
+                       const char *script, int depth)
 {
     pid_t pid;
 
@@ -98,42 +138,84 @@ pid_t create_occurence(const char *server, const char *port,
             exit(1);
         }
 
-        // 4: loop, sending queries and printing responses
-        FILE *cxn = fdopen(sock, "w+");
+        // 4: loop, sending queries and printing responses. Responses may
+        // already be buffered while commands are being sent, so the two
+        // directions get streams of their own.
+        FILE *rx = fdopen(sock, "r");
+        FILE *tx = fdopen(dup(sock), "w");
+        if (rx == NULL || tx == NULL)
+        {
+            perror("fdopen");
+            exit(1);
+        }
         char rbuf[BUFSIZE], qbuf[BUFSIZE];
         rbuf[0] = '\0';
+        int outstanding = 0;
+        int done = 0;
+        // for every response still to come, oldest first, whether it is the
+        // response to a scan
+        int window = depth + DB_BATCH_MAX;
+        char *scans = malloc(window);
+        int first = 0;
+        if (scans == NULL)
+        {
+            perror("malloc");
+            exit(1);
+        }
 
         while (1)
         {
+            // send commands until depth of them are waiting for responses
+            while (!done && outstanding < depth)
+            {
+                if (fgets(qbuf, sizeof(qbuf), infile) == NULL)
+                {
+                    done = 1;
+                    break;
+                }
+                if (fputs(qbuf, tx) == EOF)
+                {
+                    fprintf(stderr, "No connection!\n");
+                    exit(1);
+                }
+                int n = expected_responses(qbuf);
+                for (int i = 0; i < n; i++)
+                    scans[(first + outstanding + i) % window] =
+                        qbuf[0] == 'r' || qbuf[0] == 'p';
+                outstanding += n;
+            }
+            fflush(tx);
+
             // if there are no more commands, so we can clean up and exit
-            if (fgets(qbuf, sizeof(qbuf), infile) == NULL)
+            if (done && outstanding == 0)
             {
                 qbuf[0] = EOF;
-                fputs(qbuf, cxn);
-                fflush(cxn);
-                fclose(cxn);
+                qbuf[1] = '\0';
+                fputs(qbuf, tx);
+                fflush(tx);
+                fclose(tx);
+                fclose(rx);
                 fclose(infile);
+                free(scans);
                 printf("Client terminated cleanly.\n");
                 exit(0);
             }
-            else
+
+            // wait for responses and print them, sending more once half the
+            // window is free
+            do
             {
-                // otherwise, send the command
-                if (fputs(qbuf, cxn) == EOF)
+                if (fgets(rbuf, BUFSIZE, rx) == NULL)
                 {
-                    fprintf(stderr, "No connection!\n");
+                    fprintf(stderr, "Connection terminated.\n");
                     exit(1);
                 }
-                fflush(cxn);
-            }
-
-            // wait for the response and print it
-            if (fgets(rbuf, BUFSIZE, cxn) == NULL)
-            {
-                fprintf(stderr, "Connection terminated.\n");
-                exit(1);
-            }
-            printf("%s", rbuf);
+                printf("%s", rbuf);
+                if (scans[first] && strcmp(rbuf, DB_SCAN_END "\n") != 0)
+                    continue;
+                first = (first + 1) % window;
+                outstanding--;
+            } while (outstanding > (done ? 0 : depth / 2));
         }
     }
 
@@ -148,13 +230,15 @@ void usage_error(const char *cmd)
 {
     fprintf(stderr,
             "Usage: %s <servername> <port> "
-            "[<script> <occurences>]\n",
+            "[<script> <occurences> [<depth>]]\n",
             cmd);
 }
 
 /*
  * The arguments to the client should be servername, port number,
- * [script-file, number of occurences].
+ * [script-file, number of occurences, [pipeline depth]]. The depth is how
+ * many commands each client may have sent ahead of their responses; it
+ * defaults to 1.
  *
  * Step 1: fork to create as many clients as number of occurences argument
  *
@@ -168,27 +252,37 @@ void usage_error(const char *cmd)
 int main(int argc, const char *argv[])
 {
     // parse args
-    if (argc != 3 && argc != 5)
+    if (argc != 3 && argc != 5 && argc != 6)
     {
         usage_error(argv[0]);
         return 1;
     }
 
     int occurences = 1;
+    int depth = 1;
     const char *script = NULL;
     const char *server = argv[1];
     const char *port = argv[2];
 
-    if (argc == 5)
+    if (argc >= 5)
     {
         script = argv[3];
         occurences = atoi(argv[4]);
     }
+    if (argc == 6)
+    {
+        depth = atoi(argv[5]);
+        if (depth < 1)
+        {
+            usage_error(argv[0]);
+            return 1;
+        }
+    }
 
     // 1: create clients, they'll do the rest
     for (int i = 0; i < occurences; i++)
     {
-        if (create_occurence(server, port, script) == -1)
+        if (create_occurence(server, port, script, depth) == -1)
         {
             perror("Error forking off process");
             return 1;
@@ -1,11 +1,13 @@
 #include "./comm.h"
 #include <arpa/inet.h>
+#include <errno.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <unistd.h>
@@ -18,6 +20,11 @@ static void *listener(void (*server)(FILE *));
 
 static int comm_port;
 
+#ifdef COMM_STATS
+unsigned long comm_stat_syscalls;
+static unsigned long comm_stat_commands;
+#endif
+
 /* Notice that this function takes in an argument `server`, which is a function 
    that takes in a file pointer. What function have you 
    implemented that has a file pointer as an argument? */
@@ -33,8 +40,9 @@ pthread_t start_listener(int port, void (*server)(FILE *)) {
     return tid;
 }
 
-void *listener(void (*server)(FILE *)) {
-    if ((lsock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+int comm_listen(int port, int backlog) {
+    int sock;
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         perror("socket");
         exit(1);
     }
@@ -42,21 +50,35 @@ void *listener(void (*server)(FILE *)) {
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
-    addr.sin_port = htons(comm_port);
+    addr.sin_port = htons(port);
     addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
-    if (bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
         perror("bind");
-        if (close(lsock) < 0) perror("close");
+        if (close(sock) < 0) perror("close");
         exit(1);
     }
 
-    if (listen(lsock, 100) < 0) {
+    if (listen(sock, backlog) < 0) {
         perror("listen");
-        if (close(lsock) < 0) perror("close");
+        if (close(sock) < 0) perror("close");
         exit(1);
     }
 
+    return sock;
+}
+
+void comm_raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+void *listener(void (*server)(FILE *)) {
+    lsock = comm_listen(comm_port, 100);
+
     fprintf(stderr, "listening on port %d\n", comm_port);
 
     while (1) {
@@ -64,6 +86,7 @@ void *listener(void (*server)(FILE *)) {
         struct sockaddr_in client_addr;
         socklen_t client_len = sizeof(client_addr);
 
+        COMM_SYSCALL();
         if ((csock = accept(lsock, (struct sockaddr *)&client_addr,
                             &client_len)) < 0) {
             perror("accept");
@@ -90,19 +113,457 @@ void comm_shutdown(FILE *cxstr) {
     if (fclose(cxstr) < 0) perror("fclose");
 }
 
-int comm_serve(FILE *cxstr, char *response, char *command) {
-    if (strlen(response) > 0) {
-        if (fputs(response, cxstr) == EOF || fputc('\n', cxstr) == EOF ||
-            fflush(cxstr) == EOF) {
+void comm_buf_init(comm_buf_t *buf) {
+    buf->in_start = 0;
+    buf->in_end = 0;
+    buf->out_len = 0;
+    buf->niov = 0;
+    buf->npinned = 0;
+    buf->nqueued = 0;
+    buf->scanning = 0;
+}
+
+/* Writes all of iov to fd, blocking as long as it takes. Returns -1 if the
+   connection failed. */
+static int write_all(int fd, struct iovec *iov, int niov) {
+    while (niov > 0) {
+        COMM_SYSCALL();
+        ssize_t n = writev(fd, iov, niov);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        while (niov > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            niov--;
+        }
+        if (niov > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/* Like write_all(), freeing copy once done, even if the thread is cancelled
+   while blocked. */
+static int write_owned(int fd, struct iovec *iov, int niov, char *copy) {
+    int ret;
+    pthread_cleanup_push(free, copy);
+    ret = write_all(fd, iov, niov);
+    pthread_cleanup_pop(1);
+    return ret;
+}
+
+int comm_flush(int fd, comm_buf_t *buf, char **rest, size_t *rest_len) {
+    struct iovec *iov = buf->iov;
+    int niov = buf->niov;
+    int ret = 0;
+    char *copy = NULL;
+
+    if (rest != NULL) *rest = NULL;
+    // nothing is acknowledged before it is durable
+    if (niov > 0) db_sync();
+    if (niov > 0) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = niov;
+        COMM_SYSCALL();
+        ssize_t sent = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+            errno != EINTR)
+            ret = -1;
+        for (; ret == 0 && sent > 0 && niov > 0; iov++, niov--) {
+            if ((size_t)sent < iov->iov_len) {
+                iov->iov_base = (char *)iov->iov_base + sent;
+                iov->iov_len -= sent;
+                break;
+            }
+            sent -= iov->iov_len;
+        }
+    }
+
+    // copy the rest out if it points into the database, or if the caller
+    // takes it over
+    if (ret == 0 && niov > 0 && (buf->npinned > 0 || rest != NULL)) {
+        size_t len = 0;
+        for (int i = 0; i < niov; i++) len += iov[i].iov_len;
+        if ((copy = malloc(len)) == NULL) {
+            ret = -1;
+        } else {
+            size_t off = 0;
+            for (int i = 0; i < niov; i++) {
+                memcpy(copy + off, iov[i].iov_base, iov[i].iov_len);
+                off += iov[i].iov_len;
+            }
+            iov[0].iov_base = copy;
+            iov[0].iov_len = len;
+            niov = 1;
+        }
+    }
+    for (int i = 0; i < buf->npinned; i++) db_value_release(&buf->pinned[i]);
+    buf->npinned = 0;
+    buf->out_len = 0;
+    buf->niov = 0;
+    buf->nqueued = 0;
+
+    if (ret == 0 && niov > 0 && rest != NULL) {
+        *rest = copy;
+        *rest_len = iov[0].iov_len;
+        return 1;
+    }
+    if (ret == 0 && niov > 0) return write_owned(fd, iov, niov, copy);
+    free(copy);
+    return ret;
+}
+
+int comm_collect(comm_buf_t *buf, char **out, size_t *len, size_t *cap) {
+    size_t need = *len;
+    for (int i = 0; i < buf->niov; i++) need += buf->iov[i].iov_len;
+    int ret = 0;
+
+    if (need > *cap) {
+        size_t grown = *cap > 0 ? *cap : COMM_OUTLEN;
+        while (grown < need) grown *= 2;
+        char *block = realloc(*out, grown);
+        if (block == NULL) {
+            ret = -1;
+        } else {
+            *out = block;
+            *cap = grown;
+        }
+    }
+    for (int i = 0; ret == 0 && i < buf->niov; i++) {
+        memcpy(*out + *len, buf->iov[i].iov_base, buf->iov[i].iov_len);
+        *len += buf->iov[i].iov_len;
+    }
+
+    for (int i = 0; i < buf->npinned; i++) db_value_release(&buf->pinned[i]);
+    buf->npinned = 0;
+    buf->out_len = 0;
+    buf->niov = 0;
+    buf->nqueued = 0;
+    return ret;
+}
+
+/* Appends len bytes of text to the queued responses. */
+static void queue_text(comm_buf_t *buf, const char *text, size_t len) {
+    char *dst = buf->out + buf->out_len;
+    memcpy(dst, text, len);
+    buf->out_len += len;
+
+    struct iovec *last = buf->niov > 0 ? &buf->iov[buf->niov - 1] : NULL;
+    if (last != NULL && (char *)last->iov_base + last->iov_len == dst) {
+        last->iov_len += len;
+    } else {
+        buf->iov[buf->niov].iov_base = dst;
+        buf->iov[buf->niov].iov_len = len;
+        buf->niov++;
+    }
+}
+
+int comm_buf_full(comm_buf_t *buf) {
+    // the lines of a scan take two iovecs more than other responses
+    return buf->nqueued >= COMM_BATCH || buf->niov > 2 * COMM_BATCH ||
+           buf->out_len + BUFLEN + 1 > COMM_OUTLEN;
+}
+
+void comm_queue_response(comm_buf_t *buf, const char *response,
+                         db_value_t *value) {
+    if (value->data == NULL && response[0] == '\0') return;
+
+    if (value->data != NULL) {
+        // the value goes out from where it is, pinned until the flush
+        buf->iov[buf->niov].iov_base = (void *)value->data;
+        buf->iov[buf->niov].iov_len = value->len;
+        buf->niov++;
+        buf->pinned[buf->npinned++] = *value;
+        value->data = NULL;
+    } else {
+        queue_text(buf, response, strlen(response));
+    }
+    queue_text(buf, "\n", 1);
+    buf->nqueued++;
+}
+
+/* Read and write 16-bit and 32-bit fields in network byte order. */
+static size_t get16(const char *p) {
+    const unsigned char *u = (const unsigned char *)p;
+    return (size_t)u[0] << 8 | u[1];
+}
+
+static uint32_t get32(const char *p) {
+    const unsigned char *u = (const unsigned char *)p;
+    return (uint32_t)u[0] << 24 | (uint32_t)u[1] << 16 | (uint32_t)u[2] << 8 |
+           u[3];
+}
+
+/* Returns the length of the binary request at the head of buf's input, 0 if
+   its header is not all there, or -1 if a field is too long. */
+static long binary_length(comm_buf_t *buf) {
+    const char *start = buf->in + buf->in_start;
+    if (buf->in_end - buf->in_start < COMM_BIN_HEADER) return 0;
+    size_t key_len = get16(start + 4);
+    size_t value_len = get16(start + 6);
+    if (key_len > BUFLEN - 1 || value_len > BUFLEN - 1) return -1;
+    return COMM_BIN_HEADER + key_len + value_len;
+}
+
+static void put16(char *p, size_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void put32(char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static int is_binary(comm_buf_t *buf) {
+    return buf->in_end > buf->in_start &&
+           (unsigned char)buf->in[buf->in_start] == COMM_BIN_MAGIC;
+}
+
+/* Returns how long the text line at the head of buf's input may be. */
+static size_t line_limit(comm_buf_t *buf) {
+    if (buf->in_end > buf->in_start && db_is_batch(buf->in[buf->in_start]))
+        return COMM_BATCH_LINE;
+    return BUFLEN - 1;
+}
+
+int comm_has_command(comm_buf_t *buf, int at_eof) {
+    size_t avail = buf->in_end - buf->in_start;
+    if (buf->scanning) return 1;
+    if (is_binary(buf)) {
+        long len = binary_length(buf);
+        return at_eof || len < 0 || (len > 0 && avail >= (size_t)len);
+    }
+    if (avail >= line_limit(buf) || (at_eof && avail > 0)) return 1;
+    return memchr(buf->in + buf->in_start, '\n', avail) != NULL;
+}
+
+int comm_next_command(comm_buf_t *buf, comm_cmd_t *cmd, int at_eof) {
+    size_t avail = buf->in_end - buf->in_start;
+    char *start = buf->in + buf->in_start;
+
+    if (buf->scanning) {
+        // the scan goes on; comm_execute() knows where
+        cmd->binary = 0;
+        cmd->text = NULL;
+        cmd->text_len = 0;
+        return 1;
+    }
+    if (is_binary(buf)) {
+        long len = binary_length(buf);
+        if (len < 0) return -1;
+        if (len == 0 || avail < (size_t)len) return at_eof ? -1 : 0;
+        cmd->binary = 1;
+        cmd->opcode = (unsigned char)start[1];
+        cmd->key_len = get16(start + 4);
+        cmd->value_len = get16(start + 6);
+        cmd->id = get32(start + 8);
+        cmd->key = start + COMM_BIN_HEADER;
+        cmd->value = cmd->key + cmd->key_len;
+        buf->in_start += len;
+    } else {
+        size_t limit = line_limit(buf);
+        size_t len = avail < limit ? avail : limit;
+        char *nl = memchr(start, '\n', len);
+
+        if (nl != NULL)
+            len = nl - start + 1;
+        else if (len < limit && !(at_eof && len > 0))
+            return 0;
+
+        cmd->binary = 0;
+        cmd->text = start;
+        cmd->text_len = len;
+        buf->in_start += len;
+    }
+#ifdef COMM_STATS
+    __atomic_add_fetch(&comm_stat_commands, 1, __ATOMIC_RELAXED);
+#endif
+    return 1;
+}
+
+/* Runs a binary request and queues the response: a header, then the value
+   a query found. */
+static void execute_binary(comm_buf_t *buf, comm_cmd_t *cmd) {
+    db_value_t value = {NULL, 0};
+    char version = COMM_BIN_VERSION;
+    const char *data = NULL;
+    size_t len = 0;
+    int status = COMM_BIN_OK;
+
+    // the database stores keys and values NUL-terminated, so they cannot hold
+    // a NUL, and keys cannot be empty
+    int valid = cmd->key_len > 0 &&
+                memchr(cmd->key, '\0', cmd->key_len) == NULL &&
+                memchr(cmd->value, '\0', cmd->value_len) == NULL;
+
+    switch (cmd->opcode) {
+    case COMM_BIN_HELLO:
+        data = &version;
+        len = 1;
+        break;
+    case COMM_BIN_QUERY:
+        if (!valid) {
+            status = COMM_BIN_BAD_REQUEST;
+        } else if (!db_query_pin(cmd->key, cmd->key_len, &value) ||
+                   value.len == 0) {
+            db_value_release(&value);
+            status = COMM_BIN_NOT_FOUND;
+        }
+        break;
+    case COMM_BIN_ADD:
+        if (!valid || cmd->value_len == 0)
+            status = COMM_BIN_BAD_REQUEST;
+        else if (!db_add(cmd->key, cmd->key_len, cmd->value, cmd->value_len))
+            status = COMM_BIN_EXISTS;
+        break;
+    case COMM_BIN_DELETE:
+        if (!valid)
+            status = COMM_BIN_BAD_REQUEST;
+        else if (!db_remove(cmd->key, cmd->key_len))
+            status = COMM_BIN_NOT_FOUND;
+        break;
+    default:
+        status = COMM_BIN_BAD_REQUEST;
+        break;
+    }
+    if (value.data != NULL) len = value.len;
+
+    char header[COMM_BIN_HEADER] = {(char)COMM_BIN_MAGIC, cmd->opcode, status};
+    put16(header + 6, len);
+    put32(header + 8, cmd->id);
+    queue_text(buf, header, COMM_BIN_HEADER);
+
+    if (value.data != NULL) {
+        // the value goes out from where it is, pinned until the flush
+        buf->iov[buf->niov].iov_base = (void *)value.data;
+        buf->iov[buf->niov].iov_len = value.len;
+        buf->niov++;
+        buf->pinned[buf->npinned++] = value;
+    } else if (len > 0) {
+        queue_text(buf, data, len);
+    }
+    buf->nqueued++;
+}
+
+/* Runs a batch command, queueing a response per key. */
+static void execute_batch(comm_buf_t *buf, comm_cmd_t *cmd) {
+    db_batch_t batch;
+    interpret_batch(cmd->text, cmd->text_len, &batch);
+    for (int i = 0; i < batch.n; i++)
+        comm_queue_response(buf, batch.response[i], &batch.pinned[i]);
+}
+
+/* Queues the next pairs of the scan in buf as "<key> <value>" lines, straight
+   from the database, and DB_SCAN_END once the scan is over. cmd starts a new
+   scan, unless it is NULL. */
+static void execute_scan(comm_buf_t *buf, comm_cmd_t *cmd) {
+    db_value_t none = {NULL, 0};
+    db_pair_t pairs[COMM_SCAN_CHUNK];
+
+    if (cmd != NULL && !interpret_scan(cmd->text, cmd->text_len, &buf->scan)) {
+        comm_queue_response(buf, "ill-formed command", &none);
+        comm_queue_response(buf, DB_SCAN_END, &none);
+        return;
+    }
+    int n = db_scan_next(&buf->scan, pairs, COMM_SCAN_CHUNK);
+    for (int i = 0; i < n; i++) {
+        buf->iov[buf->niov].iov_base = (void *)pairs[i].key;
+        buf->iov[buf->niov].iov_len = pairs[i].key_len;
+        buf->niov++;
+        queue_text(buf, " ", 1);
+        // the value's pin keeps the key too
+        buf->iov[buf->niov].iov_base = (void *)pairs[i].value.data;
+        buf->iov[buf->niov].iov_len = pairs[i].value.len;
+        buf->niov++;
+        buf->pinned[buf->npinned++] = pairs[i].value;
+        queue_text(buf, "\n", 1);
+        buf->nqueued++;
+    }
+    buf->scanning = !buf->scan.done;
+    if (!buf->scanning) comm_queue_response(buf, DB_SCAN_END, &none);
+}
+
+int comm_scanning(comm_buf_t *buf) {
+    return buf->scanning;
+}
+
+void comm_execute(comm_buf_t *buf, comm_cmd_t *cmd) {
+    if (buf->scanning) {
+        execute_scan(buf, NULL);
+    } else if (cmd->binary) {
+        execute_binary(buf, cmd);
+    } else if (cmd->text_len > 0 && db_is_batch(cmd->text[0])) {
+        execute_batch(buf, cmd);
+    } else if (cmd->text_len > 0 && db_is_scan(cmd->text[0])) {
+        execute_scan(buf, cmd);
+    } else {
+        char response[BUFLEN];
+        db_value_t value;
+        interpret_command_pinned(cmd->text, cmd->text_len, response, BUFLEN,
+                                 &value);
+        comm_queue_response(buf, response, &value);
+    }
+}
+
+int comm_serve(FILE *cxstr, comm_buf_t *buf, comm_cmd_t *command) {
+    int fd = fileno(cxstr);
+    int ret;
+
+    if (comm_buf_full(buf) && comm_flush(fd, buf, NULL, NULL) < 0) {
+        fprintf(stderr, "client connection terminated\n");
+        return -1;
+    }
+
+    // Commands the client has already sent run before anything is written
+    // back; only once the input runs dry do all their responses go out
+    // together.
+    while ((ret = comm_next_command(buf, command, 0)) == 0) {
+        if (comm_flush(fd, buf, NULL, NULL) < 0) {
             fprintf(stderr, "client connection terminated\n");
             return -1;
         }
-    }
 
-    if (fgets(command, BUFLEN, cxstr) == NULL) {
+        if (buf->in_start > 0) {
+            memmove(buf->in, buf->in + buf->in_start,
+                    buf->in_end - buf->in_start);
+            buf->in_end -= buf->in_start;
+            buf->in_start = 0;
+        }
+        ssize_t n;
+        do {
+            COMM_SYSCALL();
+            n = read(fd, buf->in + buf->in_end, COMM_INLEN - buf->in_end);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) {
+            // an unterminated last line still counts, as with fgets()
+            if (comm_next_command(buf, command, 1) > 0) return 0;
+            fprintf(stderr, "client connection terminated\n");
+            return -1;
+        }
+        buf->in_end += n;
+    }
+    if (ret < 0) {
+        comm_flush(fd, buf, NULL, NULL);
         fprintf(stderr, "client connection terminated\n");
         return -1;
     }
 
     return 0;
 }
+
+void comm_stats(unsigned long *syscalls, unsigned long *commands) {
+#ifdef COMM_STATS
+    *syscalls = __atomic_load_n(&comm_stat_syscalls, __ATOMIC_RELAXED);
+    *commands = __atomic_load_n(&comm_stat_commands, __ATOMIC_RELAXED);
+#else
+    *syscalls = 0;
+    *commands = 0;
+#endif
+}
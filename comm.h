@@ -3,7 +3,11 @@
 
 #include <errno.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/uio.h>
+
+#include "./db.h"
 
 #define BUFLEN 256
 #define handle_error_en(en, msg) \
@@ -13,8 +17,196 @@
         exit(EXIT_FAILURE);      \
     } while (0)
 
+// input buffered per connection
+#define COMM_INLEN 4096
+// room for the text of responses not sent yet
+#define COMM_OUTLEN 4096
+// responses that may wait for one flush
+#define COMM_BATCH 64
+// the longest text line: batch commands may take the whole input buffer,
+// other lines are split every BUFLEN - 1 bytes like fgets() splits them
+#define COMM_BATCH_LINE (COMM_INLEN - 1)
+// text of the responses to one batch command, at most: DB_BATCH_MAX lines
+// no longer than "already in database\n"
+#define COMM_BATCH_TEXT (DB_BATCH_MAX * 20)
+// pairs of a scan queued at a time; each takes four iovecs, as many as two
+// responses of a batch
+#define COMM_SCAN_CHUNK (DB_BATCH_MAX / 2)
+
+/*
+ * The state of one connection: the input read from it but not served yet,
+ * and the responses not sent yet. Text responses are copied into out, while
+ * query results stay pinned in the database until they are sent (see
+ * db_query_pin() in db.h). A buffer that is not full yet has room for the
+ * responses to one more command, even a batch of DB_BATCH_MAX keys, or for
+ * the next COMM_SCAN_CHUNK pairs of a scan. A scan command is served chunk by
+ * chunk, its state kept in scan, so its pairs go out as they are found
+ * instead of all being gathered first.
+ */
+typedef struct comm_buf {
+    char in[COMM_INLEN];
+    size_t in_start;  // the unread input is in[in_start, in_end)
+    size_t in_end;
+    char out[COMM_OUTLEN + COMM_BATCH_TEXT];
+    size_t out_len;
+    // what to send, in order
+    struct iovec iov[2 * (COMM_BATCH + DB_BATCH_MAX)];
+    int niov;
+    db_value_t pinned[COMM_BATCH + DB_BATCH_MAX];
+    int npinned;
+    int nqueued;  // responses in iov
+    db_scan_t scan;
+    int scanning;  // whether scan has pairs left to send
+} comm_buf_t;
+
+/*
+ * The binary protocol. Instead of a text line, a client may send a binary
+ * request: a COMM_BIN_HEADER-byte header, then the key and the value, each as
+ * many bytes as the header says. Every header field is in network byte order:
+ *
+ *   byte 0     COMM_BIN_MAGIC, which no text command starts with
+ *   byte 1     the opcode (COMM_BIN_HELLO ... COMM_BIN_DELETE)
+ *   byte 2     the status (COMM_BIN_OK ... COMM_BIN_BAD_REQUEST); 0 in requests
+ *   byte 3     0
+ *   bytes 4-5  the key length; 0 in responses
+ *   bytes 6-7  the value length
+ *   bytes 8-11 a request id the client picks, echoed in the response
+ *
+ * The response to a binary request is a header with the same opcode and id,
+ * followed by the value for a query that found its key. Keys and values may
+ * hold any bytes but NUL and be up to BUFLEN - 1 bytes long; a longer field
+ * is a protocol error, which closes the connection. Both protocols share the
+ * port and may even be mixed on one connection, since every request says
+ * which one it is in its first byte. A client negotiates the binary protocol
+ * with COMM_BIN_HELLO, which this server answers with COMM_BIN_OK and its
+ * protocol version as a one-byte value; a server that only speaks text
+ * answers it with a line instead.
+ */
+#define COMM_BIN_MAGIC 0xDB
+#define COMM_BIN_HEADER 12
+#define COMM_BIN_VERSION 1
+enum { COMM_BIN_HELLO, COMM_BIN_QUERY, COMM_BIN_ADD, COMM_BIN_DELETE };
+enum { COMM_BIN_OK, COMM_BIN_NOT_FOUND, COMM_BIN_EXISTS, COMM_BIN_BAD_REQUEST };
+
+/*
+ * A command from a connection: a text line or a binary request. The line, key
+ * and value are not copied; they point into the input of the buffer the
+ * command came from, and stay valid until more input is read into it.
+ */
+typedef struct comm_cmd {
+    int binary;
+    const char *text;  // the line, if it is text, with its newline if any
+    size_t text_len;
+    // the request, if it is binary
+    int opcode;
+    uint32_t id;
+    const char *key;
+    size_t key_len;
+    const char *value;
+    size_t value_len;
+} comm_cmd_t;
+
+/*
+ * Compiling with -DCOMM_STATS counts the commands served and the system calls
+ * the server makes to move them and their responses over the network; see
+ * comm_stats(). futex(2) calls made by locks and condition variables are not
+ * counted.
+ */
+#ifdef COMM_STATS
+extern unsigned long comm_stat_syscalls;
+#define COMM_SYSCALL() \
+    __atomic_add_fetch(&comm_stat_syscalls, 1, __ATOMIC_RELAXED)
+#else
+#define COMM_SYSCALL() ((void)0)
+#endif
+
 pthread_t start_listener(int port, void (*serve_func)(FILE *));
 void comm_shutdown(FILE *cxstr);
-int comm_serve(FILE *cxstr, char *resp, char *cmd);
+/*
+ * Creates a TCP socket listening on port with the given backlog. Exits the
+ * program on failure.
+ */
+int comm_listen(int port, int backlog);
+
+/*
+ * Raises the limit on open descriptors as far as the system lets the process,
+ * for servers that keep a socket open per connection.
+ */
+void comm_raise_fd_limit(void);
+
+void comm_buf_init(comm_buf_t *buf);
+
+/*
+ * Moves the next command out of buf's input into cmd: a binary request, or a
+ * text line split the way fgets() would split it (at COMM_BATCH_LINE bytes
+ * rather than BUFLEN - 1 for a batch command). Returns 0 if no whole
+ * command is buffered; if at_eof is nonzero an unterminated last line counts
+ * as one. Returns -1 on a protocol error: a binary request with a field too
+ * long, or cut short by the end of the input. While a scan is being served,
+ * its next chunk counts as the next command, and no input is taken.
+ */
+int comm_next_command(comm_buf_t *buf, comm_cmd_t *cmd, int at_eof);
+
+/*
+ * Returns nonzero if comm_next_command() would take a command out of buf, or
+ * fail.
+ */
+int comm_has_command(comm_buf_t *buf, int at_eof);
+
+/*
+ * Runs cmd against the database and queues its response in buf, which must
+ * not be full; a batch command gets a response per key, and a scan command
+ * its first COMM_SCAN_CHUNK pairs, or its next ones if it is in progress.
+ */
+void comm_execute(comm_buf_t *buf, comm_cmd_t *cmd);
+
+/* Returns nonzero if a scan is being served from buf. */
+int comm_scanning(comm_buf_t *buf);
+
+/* Returns nonzero if buf has no room for the responses to another command. */
+int comm_buf_full(comm_buf_t *buf);
+
+/*
+ * Queues a response in buf, which must not be full: the pinned value if value
+ * holds one (taking the pin over), otherwise resp unless it is empty.
+ */
+void comm_queue_response(comm_buf_t *buf, const char *resp,
+                         db_value_t *value);
+
+/*
+ * Sends every response queued in buf to fd and releases the values pinned
+ * for them. If rest is NULL it blocks until all is sent, copying out pinned
+ * values first if the socket is full. Otherwise it never blocks: whatever the
+ * socket cannot take is copied into a malloc()ed block stored in *rest, its
+ * length in *rest_len, and 1 is returned. Returns 0 once all is sent and -1
+ * if the connection failed. Before sending anything it waits for the changes
+ * the thread has made to be durable (see db_sync()).
+ */
+int comm_flush(int fd, comm_buf_t *buf, char **rest, size_t *rest_len);
+
+/*
+ * Appends every response queued in buf to the malloc()ed block *out, which
+ * holds *len bytes in room for *cap, growing it as needed, and releases the
+ * values pinned for them. The responses are dropped if the block cannot grow,
+ * in which case -1 is returned. Unlike comm_flush(), it does not wait for
+ * the thread's changes to be durable; whoever sends the block has to call
+ * db_sync() first.
+ */
+int comm_collect(comm_buf_t *buf, char **out, size_t *len, size_t *cap);
+
+/*
+ * Stores the number of commands served and of network system calls made
+ * since the program started. Both are 0 unless it was compiled with
+ * -DCOMM_STATS.
+ */
+void comm_stats(unsigned long *syscalls, unsigned long *commands);
+
+/*
+ * Stores the next command in cmd, once buf has room for its response (see
+ * comm_execute()). Responses are only sent once every command the client has
+ * sent so far has been served, so a client that pipelines its commands gets
+ * their responses in one write. Returns -1 if the connection is gone.
+ */
+int comm_serve(FILE *cxstr, comm_buf_t *buf, comm_cmd_t *cmd);
 
 #endif  // COMM_H_
@@ -1,292 +1,476 @@
-#include <assert.h>
 #include <ctype.h>
-#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "./db.h"
+#include "./engine.h"
+#include "./epoch.h"
+#include "./wal.h"
 
-#define MAXLEN 256
+#define MAXLEN DB_MAXLEN
 
-// The root node of the binary tree, unlike all
-// other nodes in the tree, this one is never
-// freed (it's allocated in the data region).
-node_t head = {"", "", 0, 0, PTHREAD_RWLOCK_INITIALIZER};
-// write or read type to be passed into search()
-int write_e = 0;
-int read_e = 1;
-
-//------------------------------------------------------------------------------------------------
-// Constructor, destructor, and cleanup methods
+/*
+ * One independent partition of the database. Keys are assigned to shards by
+ * hash, and every shard has its own instance of the storage engine, so
+ * operations on different shards never touch the same lock or cache line.
+ */
+typedef struct shard {
+    void *state;  // the engine instance holding the shard's pairs
+} __attribute__((aligned(64))) shard_t;
 
-node_t *node_constructor(char *arg_key, char *arg_value, node_t *arg_left,
-                         node_t *arg_right)
-{
-    size_t key_len = strlen(arg_key);
-    size_t val_len = strlen(arg_value);
+// the engines db_set_engine() can select, the default first
+static const engine_ops_t *const engines[] = {
+    &bst_engine, &bptree_engine, &art_engine, &skiplist_engine};
 
-    if (key_len > MAXLEN || val_len > MAXLEN)
-        return 0;
+// storage engine of every shard, and the flags its instances are made with
+static const engine_ops_t *engine = &bst_engine;
+static unsigned int engine_flags = 0;
+// The shards, created on first use unless one of the db_set_*() functions
+// has created them already.
+static shard_t *shards = NULL;
+static int nshards = 1;
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
 
-    node_t *new_node = (node_t *)malloc(sizeof(node_t));
+// stops the loads running in the background; see "Bulk loading" below
+static void loads_stop(void);
+// stops checkpointing and closes the write-ahead log; see "Recovery and
+// checkpoints" below
+static void wal_stop(void);
 
-    if (new_node == NULL)
-        return 0;
+//------------------------------------------------------------------------------------------------
+// Shards
 
-    if ((new_node->key = (char *)malloc(key_len + 1)) == NULL)
-    {
-        free(new_node);
-        return 0;
-    }
-    if ((new_node->value = (char *)malloc(val_len + 1)) == NULL)
+/* Frees n shards made by shards_constructor(), with everything in them. */
+static void shards_destructor(shard_t *array, int n)
+{
+    for (int i = 0; i < n; i++)
     {
-        free(new_node->key);
-        free(new_node);
-        return 0;
+        if (array[i].state != NULL)
+            engine->destructor(array[i].state);
     }
+    free(array);
+}
+
+/* Returns n empty shards of the given engine, or NULL on failure. */
+static shard_t *shards_constructor(const engine_ops_t *ops, unsigned int flags,
+                                   int n)
+{
+    shard_t *array;
+    if (posix_memalign((void **)&array, 64, n * sizeof(shard_t)) != 0)
+        return NULL;
 
-    if ((snprintf(new_node->key, MAXLEN, "%s", arg_key)) < 0)
+    for (int i = 0; i < n; i++)
     {
-        free(new_node->value);
-        free(new_node->key);
-        free(new_node);
-        return 0;
+        if ((array[i].state = ops->constructor(flags)) == NULL)
+        {
+            while (i-- > 0)
+                ops->destructor(array[i].state);
+            free(array);
+            return NULL;
+        }
     }
-    if ((snprintf(new_node->value, MAXLEN, "%s", arg_value)) < 0)
+    return array;
+}
+
+/*
+ * Replaces the (still empty) shards with n new ones of the given engine and
+ * flags. Returns 0 on success and -1 on failure, leaving everything as it was.
+ */
+static int shards_rebuild(const engine_ops_t *ops, unsigned int flags, int n)
+{
+    shard_t *array = shards_constructor(ops, flags, n);
+    if (array == NULL)
+        return -1;
+
+    if (shards != NULL)
+        shards_destructor(shards, nshards);
+    shards = array;
+    nshards = n;
+    engine = ops;
+    engine_flags = flags;
+    return 0;
+}
+
+/* Creates the default shards if no db_set_*() call has done so. */
+static void shards_init(void)
+{
+    if (shards == NULL && shards_rebuild(engine, engine_flags, nshards) < 0)
     {
-        free(new_node->value);
-        free(new_node->key);
-        free(new_node);
-        return 0;
+        fprintf(stderr, "could not create the database\n");
+        exit(1);
     }
+}
 
-    // init rwlock and error check
-    int err;
-    if ((err = pthread_rwlock_init(&new_node->rwlock, 0)) != 0)
+/* Returns key's hash: 32-bit FNV-1a, finalized with murmur3's avalanche step
+ * so that similar keys end up in unrelated shards. */
+static unsigned int shard_hash(const char *key, size_t len)
+{
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
     {
-        fprintf(stderr, "pthread rwlock init");
-        free(new_node->value);
-        free(new_node->key);
-        free(new_node);
-        return 0;
+        h ^= (unsigned char)key[i];
+        h *= 16777619u;
     }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
 
-    new_node->lchild = arg_left;
-    new_node->rchild = arg_right;
-    return new_node;
+/* Returns the shard that key, whose length is len, belongs to. */
+static inline shard_t *shard_of(const char *key, size_t len)
+{
+    pthread_once(&shards_once, shards_init);
+    if (nshards == 1)
+        return shards;
+    // This is the hash the binary tree derives its priorities from; within a
+    // shard the priorities still come in random order, which is all the
+    // treap needs.
+    return &shards[shard_hash(key, len) % nshards];
 }
 
-void node_destructor(node_t *node)
+//------------------------------------------------------------------------------------------------
+// Database configuration
+
+int db_set_shards(int n)
 {
-    if (&node->rwlock != NULL)
-    {
-        pthread_rwlock_destroy(&node->rwlock);
-    }
-    if (node->key != NULL)
-        free(node->key);
-    if (node->value != NULL)
-        free(node->value);
-    free(node);
+    if (n < 1)
+        return -1;
+    return shards_rebuild(engine, engine_flags, n);
 }
 
-/* Recursively destroys node and all its children. */
-void db_cleanup_recurs(node_t *node)
+int db_set_engine(const char *name)
 {
-    if (node == NULL)
+    for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++)
     {
-        return;
+        if (strcmp(name, engines[i]->name) == 0)
+            return shards_rebuild(engines[i], engine_flags, nshards);
     }
+    return -1;
+}
 
-    db_cleanup_recurs(node->lchild);
-    db_cleanup_recurs(node->rchild);
-
-    node_destructor(node);
+int db_index_enable(void)
+{
+    return shards_rebuild(engine, engine_flags | ENGINE_HASH_INDEX, nshards);
 }
 
-void db_cleanup()
+int db_huge_pages_enable(void)
 {
-    db_cleanup_recurs(head.lchild);
-    db_cleanup_recurs(head.rchild);
+    return shards_rebuild(engine, engine_flags | ENGINE_HUGE_PAGES, nshards);
 }
 
 //------------------------------------------------------------------------------------------------
-// Database modifiers and accessors
+// Write-ahead logging
+//
+// Once db_wal_enable() has opened a log, every add, remove and range removal
+// that changes the database is logged (see wal.h), as are the adds of a
+// bulk load's runs. The change and its record are made under a lock on the
+// stripe of its key (on all of them for a range or a run), so the log has
+// the changes to a key in the order they were made; appending only copies
+// the record into the log's buffer. A thread remembers where its last
+// record ends, and db_sync() waits for that to be on disk before the thread
+// answers.
+
+// stripes of keys whose changes are logged in order
+#define WAL_STRIPES 256
 
-node_t *search(char *key, node_t *parent, node_t **parentpp, int rw)
+// the log, if db_wal_enable() has opened one
+static wal_t *wal = NULL;
+static struct {
+    pthread_mutex_t mutex;
+} __attribute__((aligned(64))) wal_stripes[WAL_STRIPES];
+// where the last record the thread has logged ends
+static __thread unsigned long wal_pending = 0;
+
+/* Locks the stripe of key, whose length is len, and returns it. The thread
+ * cannot be cancelled until wal_unlock() restores state. */
+static pthread_mutex_t *wal_lock(const char *key, size_t len, int *state)
 {
-    node_t *next;
-    if (strcmp(key, parent->key) < 0)
-    {
-        next = parent->lchild;
-    }
-    else
-    {
-        next = parent->rchild;
-    }
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, state);
+    pthread_mutex_t *stripe =
+        &wal_stripes[shard_hash(key, len) % WAL_STRIPES].mutex;
+    pthread_mutex_lock(stripe);
+    return stripe;
+}
 
-    node_t *result;
-    if (next == NULL)
-    {
-        result = NULL;
-    }
-    else
-    {
-        if (rw == read_e)
-        {
-            pthread_rwlock_rdlock(&next->rwlock);
-        }
-        else if (rw == write_e)
-        {
-            pthread_rwlock_wrlock(&next->rwlock);
-        }
+static void wal_unlock(pthread_mutex_t *stripe, int state)
+{
+    pthread_mutex_unlock(stripe);
+    pthread_setcancelstate(state, NULL);
+}
 
-        if (strcmp(key, next->key) == 0)
-        {
-            result = next;
-        }
-        else
-        {
-            pthread_rwlock_unlock(&parent->rwlock);
-            return search(key, next, parentpp, rw);
-        }
-    }
+/* Locks every stripe, for a change to keys in all of them. */
+static void wal_lock_all(int *state)
+{
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, state);
+    for (int i = 0; i < WAL_STRIPES; i++)
+        pthread_mutex_lock(&wal_stripes[i].mutex);
+}
 
-    if (parentpp != NULL)
-    {
-        *parentpp = parent;
-    }
-    else
+static void wal_unlock_all(int state)
+{
+    for (int i = WAL_STRIPES - 1; i >= 0; i--)
+        pthread_mutex_unlock(&wal_stripes[i].mutex);
+    pthread_setcancelstate(state, NULL);
+}
+
+/* Logs a change the thread has made, holding its stripe. */
+static void wal_log(int op, const char *key, size_t key_len,
+                    const char *value, size_t value_len)
+{
+    wal_pending = wal_append(wal, op, key, key_len, value, value_len);
+}
+
+/* Adds a pair to the given instance of the engine, logging it if it is
+ * added. */
+static int logged_insert(void *state, const char *key, size_t key_len,
+                         const char *value, size_t value_len)
+{
+    if (wal == NULL)
+        return engine->insert(state, key, key_len, value, value_len);
+    int cancel;
+    pthread_mutex_t *stripe = wal_lock(key, key_len, &cancel);
+    int added = engine->insert(state, key, key_len, value, value_len);
+    if (added)
+        wal_log(WAL_ADD, key, key_len, value, value_len);
+    wal_unlock(stripe, cancel);
+    return added;
+}
+
+/* Removes a key from the given instance of the engine, logging it if it is
+ * removed. */
+static int logged_remove(void *state, const char *key, size_t key_len)
+{
+    if (wal == NULL)
+        return engine->remove(state, key, key_len);
+    int cancel;
+    pthread_mutex_t *stripe = wal_lock(key, key_len, &cancel);
+    int removed = engine->remove(state, key, key_len);
+    if (removed)
+        wal_log(WAL_REMOVE, key, key_len, "", 0);
+    wal_unlock(stripe, cancel);
+    return removed;
+}
+
+void db_sync(void)
+{
+    if (wal != NULL && wal_pending > 0)
     {
-        pthread_rwlock_unlock(&parent->rwlock);
+        wal_wait(wal, wal_pending);
+        wal_pending = 0;
     }
+}
 
-    return result;
+int db_wal_enabled(void)
+{
+    return wal != NULL;
 }
 
-void db_query(char *key, char *result, int len)
+//------------------------------------------------------------------------------------------------
+// Database modifiers and accessors
+
+void db_query(const char *key, size_t key_len, char *result, int len)
 {
-    pthread_rwlock_rdlock(&head.rwlock);
-    // pass in read type as the last paramemter of search for query
-    node_t *target = search(key, &head, NULL, read_e);
-    if (target == NULL)
+    db_value_t value;
+    if (db_query_pin(key, key_len, &value))
     {
-        snprintf(result, len, "not found");
+        snprintf(result, len, "%s", value.data);
+        db_value_release(&value);
     }
     else
     {
-        snprintf(result, len, "%s", target->value);
-        pthread_rwlock_unlock(&target->rwlock);
+        snprintf(result, len, "not found");
     }
 }
 
-int db_add(char *key, char *value)
+int db_query_pin(const char *key, size_t key_len, db_value_t *value)
 {
-    node_t *parent;
-    node_t *target;
-    pthread_rwlock_wrlock(&head.rwlock);
-    // pass in write type as the last paramemter of search for add
-    if ((target = search(key, &head, &parent, write_e)) != NULL)
+    shard_t *shard = shard_of(key, key_len);
+    // A handle is a reference on the calling thread's epoch, which keeps the
+    // value alive even if its pair is removed concurrently. The epoch counts
+    // nested references itself, so there is no counter on the value that
+    // threads sending the same hot value would have to share.
+    epoch_enter();
+    value->data = engine->lookup(shard->state, key, key_len);
+    if (value->data == NULL)
     {
-        pthread_rwlock_unlock(&parent->rwlock);
-        pthread_rwlock_unlock(&target->rwlock);
+        value->len = 0;
+        epoch_exit();
         return 0;
     }
+    value->len = strlen(value->data);
+    return 1;
+}
 
-    node_t *newnode = node_constructor(key, value, NULL, NULL);
+void db_value_release(db_value_t *value)
+{
+    if (value->data != NULL)
+    {
+        value->data = NULL;
+        epoch_exit();
+    }
+}
 
-    if (strcmp(key, parent->key) < 0)
-        parent->lchild = newnode;
-    else
-        parent->rchild = newnode;
-    pthread_rwlock_unlock(&parent->rwlock);
-    return 1;
+int db_add(const char *key, size_t key_len, const char *value,
+           size_t value_len)
+{
+    if (key_len > MAXLEN || value_len > MAXLEN)
+        return 0;
+    // shard_of() first: it may have to create the shards
+    shard_t *shard = shard_of(key, key_len);
+    return logged_insert(shard->state, key, key_len, value, value_len);
 }
 
-int db_remove(char *key)
+int db_remove(const char *key, size_t key_len)
 {
-    node_t *parent; // parent of the node to delete
-    node_t *dnode;  // node to delete
-    pthread_rwlock_wrlock(&head.rwlock);
+    shard_t *shard = shard_of(key, key_len);
+    return logged_remove(shard->state, key, key_len);
+}
 
-    // first, find the node to be removed
-    // pass in write type as the last paramemter of search for remove
-    if ((dnode = search(key, &head, &parent, write_e)) == NULL)
+/*
+ * Stores in order[] the positions of the n keys of a batch grouped by shard,
+ * and in shard[i] the shard of keys[i]. Within a shard the keys keep their
+ * order, so operations on the same key apply as they were given.
+ */
+static void batch_group(const char *const *keys, const size_t *key_lens,
+                        int n, int *order, int *shard)
+{
+    pthread_once(&shards_once, shards_init);
+    if (nshards == 1)
     {
-        // it's not there
-        pthread_rwlock_unlock(&parent->rwlock);
-        return 0;
+        for (int i = 0; i < n; i++)
+        {
+            shard[i] = 0;
+            order[i] = i;
+        }
+        return;
     }
 
-    // Found it. If the target has no right child, then we can simply replace
-    // its parent's pointer to the target with the target's own left child.
-
-    if (dnode->rchild == NULL)
+    int count[DB_BATCH_MAX + 1] = {0};
+    int *first = count;
+    int ngroups = 0;
+    int group[DB_BATCH_MAX];
+    int group_of[DB_BATCH_MAX];
+    // shards in the order they first appear, each with how many keys it has
+    for (int i = 0; i < n; i++)
     {
-        if (strcmp(dnode->key, parent->key) < 0)
-            parent->lchild = dnode->lchild;
-        else
-            parent->rchild = dnode->lchild;
+        shard[i] = shard_hash(keys[i], key_lens[i]) % nshards;
+        int g = 0;
+        while (g < ngroups && group[g] != shard[i])
+            g++;
+        if (g == ngroups)
+            group[ngroups++] = shard[i];
+        group_of[i] = g;
+        count[g + 1]++;
+    }
+    for (int g = 0; g < ngroups; g++)
+        first[g + 1] += first[g];
+    for (int i = 0; i < n; i++)
+        order[first[group_of[i]]++] = i;
+}
 
-        // done with dnode
-        pthread_rwlock_unlock(&dnode->rwlock);
-        node_destructor(dnode);
-        pthread_rwlock_unlock(&parent->rwlock);
+int db_query_batch(const char *const *keys, const size_t *key_lens, int n,
+                   db_value_t *values)
+{
+    int order[DB_BATCH_MAX];
+    int shard[DB_BATCH_MAX];
+    const char *sorted_keys[DB_BATCH_MAX];
+    size_t sorted_lens[DB_BATCH_MAX];
+    const char *found[DB_BATCH_MAX];
+    batch_group(keys, key_lens, n, order, shard);
+    for (int i = 0; i < n; i++)
+    {
+        sorted_keys[i] = keys[order[i]];
+        sorted_lens[i] = key_lens[order[i]];
     }
-    else if (dnode->lchild == NULL)
+
+    int nfound = 0;
+    epoch_enter();
+    for (int start = 0, end; start < n; start = end)
     {
-        // ditto if the target has no left child
-        if (strcmp(dnode->key, parent->key) < 0)
-            parent->lchild = dnode->rchild;
+        // the keys of one shard go to its engine together
+        void *state = shards[shard[order[start]]].state;
+        for (end = start + 1;
+             end < n && shard[order[end]] == shard[order[start]]; end++)
+            ;
+        if (engine->lookup_batch != NULL)
+        {
+            engine->lookup_batch(state, sorted_keys + start,
+                                 sorted_lens + start, end - start,
+                                 found + start);
+        }
         else
-            parent->rchild = dnode->rchild;
-
-        // done with dnode
-        pthread_rwlock_unlock(&dnode->rwlock);
-        node_destructor(dnode);
-        pthread_rwlock_unlock(&parent->rwlock);
+        {
+            for (int i = start; i < end; i++)
+                found[i] =
+                    engine->lookup(state, sorted_keys[i], sorted_lens[i]);
+        }
     }
-    else
+    for (int i = 0; i < n; i++)
     {
-        // Find the lexicographically smallest node in the right subtree and
-        // replace the node to be deleted with that node. This new node thus is
-        // lexicographically smaller than all nodes in its right subtree, and
-        // greater than all nodes in its left subtree
-
-        pthread_rwlock_wrlock(&dnode->rchild->rwlock);
-
-        node_t *next = dnode->rchild;
-        node_t **pnext = &dnode->rchild;
-
-        while (next->lchild != NULL)
+        db_value_t *value = &values[order[i]];
+        value->data = found[i];
+        value->len = 0;
+        if (found[i] != NULL)
         {
-            // work our way down the lchild chain, finding the smallest node
-            // in the subtree.
-
-            pthread_rwlock_wrlock(&next->lchild->rwlock);
-            pthread_rwlock_unlock(&next->rwlock);
-            node_t *nextl = next->lchild;
-            pnext = &next->lchild;
-            next = nextl;
+            // every handle is a reference on the epoch of its own
+            epoch_enter();
+            value->len = strlen(found[i]);
+            nfound++;
         }
+    }
+    epoch_exit();
+    return nfound;
+}
 
-        // replace next's position on right subtree with its right child
-        *pnext = next->rchild;
-
-        // replace dnode with the contents of next
-        dnode->key = realloc(dnode->key, strlen(next->key) + 1);
-        dnode->value = realloc(dnode->value, strlen(next->value) + 1);
-
-        snprintf(dnode->key, MAXLEN, "%s", next->key);
-        snprintf(dnode->value, MAXLEN, "%s", next->value);
+void db_add_batch(const char *const *keys, const size_t *key_lens,
+                  const char *const *values, const size_t *value_lens, int n,
+                  int *results)
+{
+    int order[DB_BATCH_MAX];
+    int shard[DB_BATCH_MAX];
+    batch_group(keys, key_lens, n, order, shard);
+    for (int i = 0; i < n; i++)
+    {
+        int k = order[i];
+        results[k] = key_lens[k] <= MAXLEN && value_lens[k] <= MAXLEN &&
+                     logged_insert(shards[shard[k]].state, keys[k],
+                                   key_lens[k], values[k], value_lens[k]);
+    }
+}
 
-        pthread_rwlock_unlock(&next->rwlock);
-        node_destructor(next);
-        pthread_rwlock_unlock(&parent->rwlock);
-        pthread_rwlock_unlock(&dnode->rwlock);
+void db_remove_batch(const char *const *keys, const size_t *key_lens, int n,
+                     int *results)
+{
+    int order[DB_BATCH_MAX];
+    int shard[DB_BATCH_MAX];
+    batch_group(keys, key_lens, n, order, shard);
+    for (int i = 0; i < n; i++)
+    {
+        int k = order[i];
+        results[k] = logged_remove(shards[shard[k]].state, keys[k],
+                                   key_lens[k]);
     }
+}
 
-    return 1;
+void db_cleanup()
+{
+    loads_stop();
+    wal_stop();
+    pthread_once(&shards_once, shards_init);
+    // the retired pairs are only freed once nobody can use them anymore
+    epoch_cleanup();
+    shards_destructor(shards, nshards);
+    shards = NULL;
 }
 
 //------------------------------------------------------------------------------------------------
@@ -300,31 +484,98 @@ static inline void print_spaces(int lvl, FILE *out)
     }
 }
 
-/* helper function for db_print */
-void db_print_recurs(node_t *node, int lvl, FILE *out)
+/* A key/value pair to be printed. */
+typedef struct pair {
+    const char *key;
+    const char *value;
+} pair_t;
+
+/* A growable array of pairs, used to print the database as one balanced tree
+ * when it is not a single binary tree. */
+typedef struct pair_list {
+    pair_t *pairs;
+    size_t len;
+    size_t cap;
+} pair_list_t;
+
+/* Appends (key, value) to list. Returns 0 on success and -1 if out of memory. */
+static int pair_list_push(const char *key, const char *value, void *list_arg)
+{
+    pair_list_t *list = (pair_list_t *)list_arg;
+    if (list->len == list->cap)
+    {
+        size_t cap = list->cap * 2 + 64;
+        pair_t *grown = realloc(list->pairs, cap * sizeof(pair_t));
+        if (grown == NULL)
+            return -1;
+        list->pairs = grown;
+        list->cap = cap;
+    }
+    list->pairs[list->len].key = key;
+    list->pairs[list->len].value = value;
+    list->len++;
+    return 0;
+}
+
+static int pair_key_cmp(const void *a, const void *b)
 {
-    print_spaces(lvl, out); // print spaces to differentiate levels
+    return strcmp(((const pair_t *)a)->key, ((const pair_t *)b)->key);
+}
 
-    // print node's key/value, or (root) if it's the root
-    if (node == NULL)
+/* Prints pairs[lo, hi), which are sorted by key, as a balanced tree. */
+static void print_balanced(pair_t *pairs, size_t lo, size_t hi, int lvl,
+                           FILE *out)
+{
+    print_spaces(lvl, out);
+    if (lo >= hi)
     {
         fprintf(out, "(null)\n");
         return;
     }
 
-    pthread_rwlock_rdlock(&node->rwlock); // lock after checking NULL
+    size_t mid = lo + (hi - lo) / 2;
+    fprintf(out, "%s %s\n", pairs[mid].key, pairs[mid].value);
+    print_balanced(pairs, lo, mid, lvl + 1, out);
+    print_balanced(pairs, mid + 1, hi, lvl + 1, out);
+}
 
-    if (node == &head)
+/*
+ * Prints the whole database as one tree. A single shard whose engine has a
+ * binary tree of its own is printed as it is. Otherwise (several shards,
+ * whose key ranges interleave, or an engine that is not a binary tree) the
+ * pairs are gathered in key order and printed as a balanced binary tree
+ * holding the same pairs, in the same format.
+ */
+static void print_db(FILE *out)
+{
+    pthread_once(&shards_once, shards_init);
+    if (nshards == 1 && engine->print != NULL)
     {
-        fprintf(out, "(root)\n");
+        engine->print(shards[0].state, out);
+        return;
     }
-    else
+
+    pair_list_t list = {NULL, 0, 0};
+    // the pairs must not be reclaimed before they have been printed
+    epoch_enter();
+    for (int i = 0; i < nshards; i++)
     {
-        fprintf(out, "%s %s\n", node->key, node->value);
+        if (engine->scan(shards[i].state, "", 0, pair_list_push, &list) < 0)
+        {
+            fprintf(stderr, "db_print: out of memory\n");
+            break;
+        }
     }
-    db_print_recurs(node->lchild, lvl + 1, out);
-    db_print_recurs(node->rchild, lvl + 1, out);
-    pthread_rwlock_unlock(&node->rwlock);
+    // every shard is in key order already
+    if (nshards > 1)
+        qsort(list.pairs, list.len, sizeof(pair_t), pair_key_cmp);
+
+    fprintf(out, "(root)\n");
+    print_spaces(1, out);
+    fprintf(out, "(null)\n");
+    print_balanced(list.pairs, 0, list.len, 1, out);
+    epoch_exit();
+    free(list.pairs);
 }
 
 int db_print(char *filename)
@@ -332,7 +583,7 @@ int db_print(char *filename)
     FILE *out;
     if (filename == NULL)
     {
-        db_print_recurs(&head, 0, stdout);
+        print_db(stdout);
         return 0;
     }
 
@@ -344,7 +595,7 @@ int db_print(char *filename)
 
     if (*filename == '\0')
     {
-        db_print_recurs(&head, 0, stdout);
+        print_db(stdout);
         return 0;
     }
 
@@ -353,112 +604,1890 @@ int db_print(char *filename)
         return -1;
     }
 
-    db_print_recurs(&head, 0, out);
+    print_db(out);
     fclose(out);
 
     return 0;
 }
 
 //------------------------------------------------------------------------------------------------
-// Command interpreting
+// Scans
+
+void db_scan_range(db_scan_t *scan, const char *start, size_t start_len,
+                   const char *end, size_t end_len, long limit)
+{
+    // no key is longer than MAXLEN
+    scan->from_len = start_len < MAXLEN ? start_len : MAXLEN;
+    memcpy(scan->from, start, scan->from_len);
+    scan->past_from = 0;
+    scan->has_end = end != NULL;
+    scan->end_len = end_len < MAXLEN ? end_len : MAXLEN;
+    if (end != NULL)
+        memcpy(scan->end, end, scan->end_len);
+    scan->left = limit;
+    scan->done = limit == 0;
+}
 
 /*
- * Interprets the given command string and writes up to len bytes into response,
- * where len is the buffer size.
+ * Turns the len bytes at key, a prefix, into the smallest key that is larger
+ * than the prefix without starting with it, where the keys with the prefix
+ * end, and returns its length; returns 0 if there is no such key.
  */
-void interpret_command(char *command, char *response, int len)
+static size_t prefix_end(char *key, size_t len)
+{
+    while (len > 0 && (unsigned char)key[len - 1] == 0xff)
+        len--;
+    if (len > 0)
+        key[len - 1]++;
+    return len;
+}
+
+void db_scan_prefix(db_scan_t *scan, const char *prefix, size_t prefix_len,
+                    long limit)
+{
+    db_scan_range(scan, prefix, prefix_len, prefix, prefix_len, limit);
+    scan->end_len = prefix_end(scan->end, scan->end_len);
+    scan->has_end = scan->end_len > 0;
+}
+
+/* The pairs one shard contributes to a step of a scan. */
+typedef struct scan_step {
+    const db_scan_t *scan;
+    pair_t *pairs;  // room for n
+    int n;
+    int len;
+} scan_step_t;
+
+/* Adds a pair the engine came across to the step, until there are n, or a
+ * key past the end of the range turns up. */
+static int scan_step_push(const char *key, const char *value, void *step_arg)
+{
+    scan_step_t *step = (scan_step_t *)step_arg;
+    const db_scan_t *scan = step->scan;
+    if (scan->past_from &&
+        engine_key_cmp(scan->from, scan->from_len, key) == 0)
+        return 0;
+    if (scan->has_end && engine_key_cmp(scan->end, scan->end_len, key) <= 0)
+        return 1;
+    step->pairs[step->len].key = key;
+    step->pairs[step->len].value = value;
+    return ++step->len == step->n;
+}
+
+/* Compares the pairs at the heads of two shards' steps, like strcmp(). */
+static int step_head_cmp(const scan_step_t *a, int a_head,
+                         const scan_step_t *b, int b_head)
 {
-    char value[MAXLEN];
-    char ibuf[MAXLEN];
-    char name[MAXLEN];
-    int sscanf_ret;
+    return strcmp(a->pairs[a_head].key, b->pairs[b_head].key);
+}
 
-    if (strlen(command) <= 1)
+int db_scan_next(db_scan_t *scan, db_pair_t *pairs, int n)
+{
+    pthread_once(&shards_once, shards_init);
+    if (scan->left >= 0 && scan->left < n)
+        n = scan->left;
+    if (scan->done || n <= 0)
     {
-        snprintf(response, len, "ill-formed command");
-        return;
+        scan->done = 1;
+        return 0;
     }
 
-    switch (command[0])
+    pair_t *found = malloc(nshards * n * sizeof(pair_t));
+    scan_step_t *steps = malloc(nshards * sizeof(scan_step_t));
+    int *heads = calloc(nshards, sizeof(int));
+    if (found == NULL || steps == NULL || heads == NULL)
     {
-    case 'q':
-        // Query
-        sscanf_ret = sscanf(&command[1], "%255s", name);
-        if (sscanf_ret < 1)
-        {
-            snprintf(response, len, "ill-formed command");
-            return;
-        }
-        db_query(name, response, len);
-        if (strlen(response) == 0)
-        {
-            snprintf(response, len, "not found");
-        }
-        return;
+        // out of memory: end the scan where it is
+        free(found);
+        free(steps);
+        free(heads);
+        scan->done = 1;
+        return 0;
+    }
 
-    case 'a':
-        // Add to the database
-        sscanf_ret = sscanf(&command[1], "%255s %255s", name, value);
-        if (sscanf_ret < 2)
-        {
-            snprintf(response, len, "ill-formed command");
-            return;
-        }
-        if (db_add(name, value))
-        {
-            snprintf(response, len, "added");
-        }
-        else
-        {
-            snprintf(response, len, "already in database");
-        }
-        return;
+    // the pairs stay valid until the epoch is left, with a reference on it
+    // for every pair handed out
+    epoch_enter();
+    int total = 0;
+    for (int i = 0; i < nshards; i++)
+    {
+        steps[i] = (scan_step_t){scan, found + i * n, n, 0};
+        engine->scan(shards[i].state, scan->from, scan->from_len,
+                     scan_step_push, &steps[i]);
+        total += steps[i].len;
+    }
 
-    case 'd':
-        // delete from the database
-        sscanf_ret = sscanf(&command[1], "%255s", name);
-        if (sscanf_ret < 1)
-        {
-            snprintf(response, len, "ill-formed command");
-            return;
-        }
-        if (db_remove(name))
-        {
-            snprintf(response, len, "removed");
-        }
-        else
+    int count = 0;
+    for (; count < n && count < total; count++)
+    {
+        // every shard's pairs are in order: take the smallest of their heads
+        int best = -1;
+        for (int i = 0; i < nshards; i++)
         {
-            snprintf(response, len, "not in database");
+            if (heads[i] < steps[i].len &&
+                (best < 0 ||
+                 step_head_cmp(&steps[i], heads[i], &steps[best],
+                               heads[best]) < 0))
+                best = i;
         }
-        return;
+        pair_t *pair = &steps[best].pairs[heads[best]++];
+        epoch_enter();
+        pairs[count].key = pair->key;
+        pairs[count].key_len = strlen(pair->key);
+        pairs[count].value.data = pair->value;
+        pairs[count].value.len = strlen(pair->value);
+    }
+    epoch_exit();
 
-    case 'f':
-        // process the commands in a file (silently)
-        sscanf_ret = sscanf(&command[1], "%255s", name);
-        if (sscanf_ret < 1)
-        {
-            snprintf(response, len, "ill-formed command");
-            return;
-        }
+    if (count > 0)
+    {
+        memcpy(scan->from, pairs[count - 1].key, pairs[count - 1].key_len);
+        scan->from_len = pairs[count - 1].key_len;
+        scan->past_from = 1;
+    }
+    if (scan->left >= 0)
+        scan->left -= count;
+    // fewer pairs than asked for means that every shard ran out
+    scan->done = total < n || scan->left == 0;
+    free(found);
+    free(steps);
+    free(heads);
+    return count;
+}
+
+//------------------------------------------------------------------------------------------------
+// Range removal
+
+// keys a scan collects at a time for remove_range_slow()
+#define REMOVE_CHUNK 64
+
+/* The keys of a range that remove_range_slow() removes next. */
+typedef struct remove_chunk {
+    const char *end;  // first key past the range, or NULL
+    size_t end_len;
+    char keys[REMOVE_CHUNK][MAXLEN];
+    size_t lens[REMOVE_CHUNK];
+    int n;
+} remove_chunk_t;
+
+/* Copies a key the engine came across into the chunk, until it is full or a
+ * key past the end of the range turns up. */
+static int remove_chunk_push(const char *key, const char *value,
+                             void *chunk_arg)
+{
+    remove_chunk_t *chunk = (remove_chunk_t *)chunk_arg;
+    (void)value;
+    if (chunk->end != NULL &&
+        engine_key_cmp(chunk->end, chunk->end_len, key) <= 0)
+        return 1;
+    size_t len = strlen(key);
+    memcpy(chunk->keys[chunk->n], key, len);
+    chunk->lens[chunk->n] = len;
+    return ++chunk->n == REMOVE_CHUNK;
+}
+
+/*
+ * Removes the keys of a range from an instance of an engine without
+ * remove_range(): scans for a chunk of them at a time, then removes those
+ * one by one, once the scan has let go of its locks.
+ */
+static long remove_range_slow(void *state, const char *start,
+                              size_t start_len, const char *end,
+                              size_t end_len)
+{
+    remove_chunk_t *chunk = malloc(sizeof(remove_chunk_t));
+    if (chunk == NULL)
+        return 0;
+    chunk->end = end;
+    chunk->end_len = end_len;
+
+    long removed = 0;
+    char from[MAXLEN];
+    do
+    {
+        chunk->n = 0;
+        epoch_enter();
+        engine->scan(state, start, start_len, remove_chunk_push, chunk);
+        epoch_exit();
+        for (int i = 0; i < chunk->n; i++)
+            removed += engine->remove(state, chunk->keys[i], chunk->lens[i]);
 
-        FILE *finput = fopen(name, "r");
-        if (!finput)
+        // the next chunk starts at the last key, which is gone by now
+        if (chunk->n > 0)
         {
-            snprintf(response, len, "bad file name");
-            return;
+            start_len = chunk->lens[chunk->n - 1];
+            memcpy(from, chunk->keys[chunk->n - 1], start_len);
+            start = from;
         }
-        while (fgets(ibuf, sizeof(ibuf), finput) != 0)
-        {
-            // fgets is not a cancellation point
-            pthread_testcancel();
-            interpret_command(ibuf, response, len);
+    } while (chunk->n == REMOVE_CHUNK);
+    free(chunk);
+    return removed;
+}
+
+long db_remove_range(const char *start, size_t start_len, const char *end,
+                     size_t end_len)
+{
+    pthread_once(&shards_once, shards_init);
+    long removed = 0;
+    int cancel;
+    if (wal != NULL)
+        wal_lock_all(&cancel);
+    for (int i = 0; i < nshards; i++)
+    {
+        if (engine->remove_range != NULL)
+            removed += engine->remove_range(shards[i].state, start, start_len,
+                                            end, end_len);
+        else
+            removed += remove_range_slow(shards[i].state, start, start_len,
+                                         end, end_len);
+    }
+    if (wal != NULL)
+    {
+        if (removed > 0)
+            wal_log(end != NULL ? WAL_RANGE : WAL_RANGE_TAIL, start,
+                    start_len, end != NULL ? end : "", end_len);
+        wal_unlock_all(cancel);
+    }
+    return removed;
+}
+
+long db_remove_prefix(const char *prefix, size_t prefix_len)
+{
+    // no key is longer than MAXLEN, so neither is a prefix of one
+    if (prefix_len > MAXLEN)
+        return 0;
+    char end[MAXLEN];
+    memcpy(end, prefix, prefix_len);
+    size_t end_len = prefix_end(end, prefix_len);
+    return db_remove_range(prefix, prefix_len, end_len > 0 ? end : NULL,
+                           end_len);
+}
+
+//------------------------------------------------------------------------------------------------
+// Order statistics
+
+/* Sums the engine's rank() of key (NULL for the number of keys) over every
+ * shard. */
+static long shards_rank(const char *key, size_t key_len)
+{
+    long rank = 0;
+    for (int i = 0; i < nshards; i++)
+        rank += engine->rank(shards[i].state, key, key_len);
+    return rank;
+}
+
+long db_rank(const char *key, size_t key_len)
+{
+    pthread_once(&shards_once, shards_init);
+    if (engine->rank == NULL)
+        return -1;
+    return shards_rank(key, key_len);
+}
+
+long db_count(const char *start, size_t start_len, const char *end,
+              size_t end_len)
+{
+    pthread_once(&shards_once, shards_init);
+    if (engine->rank == NULL)
+        return -1;
+    long first = shards_rank(start, start_len);
+    long past = shards_rank(end, end_len);
+    return past > first ? past - first : 0;
+}
+
+/* Returns the number of ranks from lo up to hi, or 0 if hi is not past lo. */
+static inline unsigned long rank_span(unsigned long lo, unsigned long hi)
+{
+    return hi > lo ? hi - lo : 0;
+}
+
+/*
+ * Finds the key of the given rank among all the shards, for db_select(), and
+ * stores its value in *value; returns NULL if there is none. Shard i holds
+ * the key, if at all, at one of its own ranks from lo[i] up to hi[i]. Each
+ * step takes the middle key of the widest of these ranges and ranks it in
+ * every other shard; the sum tells whether the key sought comes before or
+ * after it, which cuts every range at the key's place in its shard. Must be
+ * called inside an epoch.
+ */
+static const char *select_sharded(unsigned long rank, const char **value)
+{
+    unsigned long *lo = malloc(3 * nshards * sizeof(unsigned long));
+    if (lo == NULL)
+        return NULL;
+    unsigned long *hi = lo + nshards;
+    unsigned long *ranks = hi + nshards;
+    for (int i = 0; i < nshards; i++)
+    {
+        lo[i] = 0;
+        hi[i] = engine->rank(shards[i].state, NULL, 0);
+    }
+
+    const char *found = NULL;
+    while (found == NULL)
+    {
+        int widest = 0;
+        for (int i = 1; i < nshards; i++)
+        {
+            if (rank_span(lo[i], hi[i]) > rank_span(lo[widest], hi[widest]))
+                widest = i;
+        }
+        if (rank_span(lo[widest], hi[widest]) == 0)
+            break;
+
+        unsigned long mid = lo[widest] + (hi[widest] - lo[widest]) / 2;
+        const char *key = engine->select(shards[widest].state, mid, value);
+        if (key == NULL)
+        {
+            // the shard shrank meanwhile
+            hi[widest] = mid;
+            continue;
+        }
+        size_t key_len = strlen(key);
+        unsigned long total = 0;
+        for (int i = 0; i < nshards; i++)
+        {
+            ranks[i] = i == widest
+                           ? mid
+                           : engine->rank(shards[i].state, key, key_len);
+            total += ranks[i];
+        }
+
+        if (total == rank)
+        {
+            found = key;
+        }
+        else if (total < rank)
+        {
+            // the key sought is larger than key, and than all before it
+            for (int i = 0; i < nshards; i++)
+            {
+                unsigned long first = ranks[i] + (i == widest);
+                if (lo[i] < first)
+                    lo[i] = first;
+            }
+        }
+        else
+        {
+            for (int i = 0; i < nshards; i++)
+            {
+                if (hi[i] > ranks[i])
+                    hi[i] = ranks[i];
+            }
+        }
+    }
+    free(lo);
+    return found;
+}
+
+int db_select(long rank, db_pair_t *pair)
+{
+    pthread_once(&shards_once, shards_init);
+    if (engine->select == NULL)
+        return -1;
+    if (rank < 0)
+        return 0;
+
+    // the pair stays valid until the handle is released, like a scan's
+    const char *value;
+    const char *key;
+    epoch_enter();
+    if (nshards == 1)
+        key = engine->select(shards[0].state, rank, &value);
+    else
+        key = select_sharded(rank, &value);
+    if (key == NULL)
+    {
+        epoch_exit();
+        return 0;
+    }
+    pair->key = key;
+    pair->key_len = strlen(key);
+    pair->value.data = value;
+    pair->value.len = strlen(value);
+    return 1;
+}
+
+//------------------------------------------------------------------------------------------------
+// Command interpreting
+
+/* Returns nonzero for the characters sscanf()'s %s stops at in the C locale,
+ * which are those isspace() reports there. */
+static inline int is_blank(char c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/*
+ * Finds the next whitespace-separated token in [*pos, end) the way
+ * sscanf("%255s") would: a NUL ends the input, and a word longer than
+ * MAXLEN - 1 bytes is cut there, its rest being the next token. Stores the
+ * token, in place, in *tok and *tok_len, moves *pos past it and returns 1, or
+ * returns 0 if there is no token left.
+ */
+static int next_token(const char **pos, const char *end, const char **tok,
+                      size_t *tok_len)
+{
+    const char *p = *pos;
+    while (p < end && is_blank(*p))
+        p++;
+
+    const char *start = p;
+    const char *limit = end - p < MAXLEN - 1 ? end : p + MAXLEN - 1;
+    while (p < limit && *p != '\0' && !is_blank(*p))
+        p++;
+    if (p == start)
+        return 0;
+
+    *tok = start;
+    *tok_len = p - start;
+    *pos = p;
+    return 1;
+}
+
+/* Parses the tok_len bytes at tok as a decimal number. Returns it, or -1 if
+ * it is not one. Numbers beyond ten billion, which no scan limit or rank
+ * reaches, are cut there. */
+static long parse_number(const char *tok, size_t tok_len)
+{
+    long number = 0;
+    for (size_t i = 0; i < tok_len; i++)
+    {
+        if (tok[i] < '0' || tok[i] > '9')
+            return -1;
+        if (number < 1000000000L)
+            number = number * 10 + (tok[i] - '0');
+    }
+    return number;
+}
+
+/*
+ * Runs the scan command of command_len bytes at command and writes its
+ * response into response, of len bytes: a line per pair, and DB_SCAN_END.
+ * The scan stops once the response is full.
+ */
+static void scan_to_text(const char *command, size_t command_len,
+                         char *response, int len)
+{
+    db_scan_t scan;
+    db_pair_t pairs[DB_BATCH_MAX];
+    int off = 0;
+
+    if (!interpret_scan(command, command_len, &scan))
+    {
+        off = snprintf(response, len, "ill-formed command\n");
+        scan.done = 1;
+    }
+    while (off < len && !scan.done)
+    {
+        int n = db_scan_next(&scan, pairs, DB_BATCH_MAX);
+        for (int i = 0; i < n; i++)
+        {
+            if (off < len)
+                off += snprintf(response + off, len - off, "%s %s\n",
+                                pairs[i].key, pairs[i].value.data);
+            db_value_release(&pairs[i].value);
+        }
+    }
+    if (off < len)
+        snprintf(response + off, len - off, DB_SCAN_END);
+}
+
+/*
+ * Interprets the given command string and writes up to len bytes into response,
+ * where len is the buffer size.
+ */
+void interpret_command(const char *command, char *response, int len)
+{
+    size_t command_len = strlen(command);
+    if (command_len > 0 && db_is_scan(command[0]))
+    {
+        scan_to_text(command, command_len, response, len);
+        return;
+    }
+    if (command_len == 0 || !db_is_batch(command[0]))
+    {
+        interpret_command_pinned(command, command_len, response, len, NULL);
+        return;
+    }
+
+    db_batch_t batch;
+    interpret_batch(command, command_len, &batch);
+    int off = 0;
+    response[0] = '\0';
+    for (int i = 0; i < batch.n; i++)
+    {
+        const char *text = batch.pinned[i].data != NULL ? batch.pinned[i].data
+                                                        : batch.response[i];
+        if (off < len)
+            off += snprintf(response + off, len - off, i > 0 ? "\n%s" : "%s",
+                            text);
+        db_value_release(&batch.pinned[i]);
+    }
+}
+
+/*
+ * Interprets the command_len bytes of command and writes up to len bytes into
+ * response, where len is the buffer size. If pinned is not NULL, a query that
+ * finds its key leaves response empty and pins the value in *pinned instead.
+ * The command is parsed in place in one pass: its tokens are handed to the
+ * database as slices of it, with their lengths.
+ */
+void interpret_command_pinned(const char *command, size_t command_len,
+                              char *response, int len, db_value_t *pinned)
+{
+    const char *pos = command + 1;
+    const char *end = command + command_len;
+    const char *name;
+    const char *value;
+    size_t name_len;
+    size_t value_len;
+    char fname[MAXLEN];
+    long count;
+    unsigned long done;
+    unsigned long total;
+    db_pair_t pair;
+
+    if (pinned != NULL)
+        pinned->data = NULL;
+    // anything after a NUL is not part of the command
+    if (command_len <= 1 || command[0] == '\0' || command[1] == '\0')
+    {
+        snprintf(response, len, "ill-formed command");
+        return;
+    }
+
+    switch (command[0])
+    {
+    case 'q':
+        // Query
+        if (!next_token(&pos, end, &name, &name_len))
+        {
+            snprintf(response, len, "ill-formed command");
+            return;
+        }
+        if (pinned != NULL)
+        {
+            if (db_query_pin(name, name_len, pinned) && pinned->len > 0)
+            {
+                response[0] = '\0';
+                return;
+            }
+            db_value_release(pinned);
+            snprintf(response, len, "not found");
+            return;
+        }
+        db_query(name, name_len, response, len);
+        if (response[0] == '\0')
+        {
+            snprintf(response, len, "not found");
+        }
+        return;
+
+    case 'a':
+        // Add to the database
+        if (!next_token(&pos, end, &name, &name_len) ||
+            !next_token(&pos, end, &value, &value_len))
+        {
+            snprintf(response, len, "ill-formed command");
+            return;
+        }
+        if (db_add(name, name_len, value, value_len))
+        {
+            snprintf(response, len, "added");
+        }
+        else
+        {
+            snprintf(response, len, "already in database");
+        }
+        return;
+
+    case 'd':
+        // delete from the database
+        if (!next_token(&pos, end, &name, &name_len))
+        {
+            snprintf(response, len, "ill-formed command");
+            return;
+        }
+        if (db_remove(name, name_len))
+        {
+            snprintf(response, len, "removed");
+        }
+        else
+        {
+            snprintf(response, len, "not in database");
+        }
+        return;
+
+    case 'x':
+        // delete the keys in a range
+        if (!next_token(&pos, end, &name, &name_len) ||
+            !next_token(&pos, end, &value, &value_len))
+        {
+            snprintf(response, len, "ill-formed command");
+            return;
+        }
+        count = db_remove_range(name, name_len, value, value_len);
+        snprintf(response, len, "removed %ld", count);
+        return;
+
+    case 'X':
+        // delete the keys starting with a prefix
+        if (!next_token(&pos, end, &name, &name_len))
+        {
+            snprintf(response, len, "ill-formed command");
+            return;
+        }
+        count = db_remove_prefix(name, name_len);
+        snprintf(response, len, "removed %ld", count);
+        return;
+
+    case 'c':
+        // count the keys in a range
+        if (!next_token(&pos, end, &name, &name_len) ||
+            !next_token(&pos, end, &value, &value_len))
+        {
+            snprintf(response, len, "ill-formed command");
+            return;
+        }
+        if ((count = db_count(name, name_len, value, value_len)) < 0)
+            snprintf(response, len, "not supported");
+        else
+            snprintf(response, len, "%ld", count);
+        return;
+
+    case 'k':
+        // rank of a key: how many keys are smaller
+        if (!next_token(&pos, end, &name, &name_len))
+        {
+            snprintf(response, len, "ill-formed command");
+            return;
+        }
+        if ((count = db_rank(name, name_len)) < 0)
+            snprintf(response, len, "not supported");
+        else
+            snprintf(response, len, "%ld", count);
+        return;
+
+    case 's':
+        // select the key of a rank
+        if (!next_token(&pos, end, &name, &name_len) ||
+            (count = parse_number(name, name_len)) < 0)
+        {
+            snprintf(response, len, "ill-formed command");
+            return;
+        }
+        switch (db_select(count, &pair))
+        {
+        case 1:
+            break;
+        case 0:
+            snprintf(response, len, "not found");
+            return;
+        default:
+            snprintf(response, len, "not supported");
+            return;
+        }
+        if (pinned != NULL)
+        {
+            // the key goes out from the database, on the pair's handle
+            pinned->data = pair.key;
+            pinned->len = pair.key_len;
+            response[0] = '\0';
+            return;
+        }
+        snprintf(response, len, "%s", pair.key);
+        db_value_release(&pair.value);
+        return;
+
+    case 'f':
+        // process the commands in a file (silently)
+        if (!next_token(&pos, end, &name, &name_len))
+        {
+            snprintf(response, len, "ill-formed command");
+            return;
+        }
+        memcpy(fname, name, name_len);
+        fname[name_len] = '\0';
+        if (db_load(fname) < 0)
+            snprintf(response, len, "bad file name");
+        else
+            snprintf(response, len, "file processed");
+        return;
+
+    case 'F':
+        // process the commands in a file in the background
+        if (!next_token(&pos, end, &name, &name_len))
+        {
+            snprintf(response, len, "ill-formed command");
+            return;
         }
-        fclose(finput);
-        snprintf(response, len, "file processed");
+        memcpy(fname, name, name_len);
+        fname[name_len] = '\0';
+        if ((count = db_load_start(fname)) < 0)
+            snprintf(response, len, "bad file name");
+        else
+            snprintf(response, len, "load %ld started", count);
         return;
 
+    case 'l':
+        // how far a background load has got
+        if (!next_token(&pos, end, &name, &name_len) ||
+            (count = parse_number(name, name_len)) < 0)
+        {
+            snprintf(response, len, "ill-formed command");
+            return;
+        }
+        switch (db_load_progress(count, &done, &total))
+        {
+        case 1:
+            if (total > 0)
+                snprintf(response, len, "load %ld: %lu of %lu lines", count,
+                         done, total);
+            else
+                snprintf(response, len, "load %ld: %lu lines so far", count,
+                         done);
+            return;
+        case 0:
+            snprintf(response, len, "load %ld: file processed", count);
+            return;
+        default:
+            snprintf(response, len, "no such load");
+            return;
+        }
+
     default:
         snprintf(response, len, "ill-formed command");
         return;
     }
 }
+
+int db_is_scan(char c)
+{
+    return c == 'r' || c == 'p';
+}
+
+int interpret_scan(const char *command, size_t command_len, db_scan_t *scan)
+{
+    const char *pos = command + 1;
+    const char *end = command + command_len;
+    const char *first;
+    const char *last = NULL;
+    const char *tok;
+    size_t first_len;
+    size_t last_len = 0;
+    size_t tok_len;
+    long limit = -1;
+
+    if (command_len <= 1 || command[1] == '\0' ||
+        !next_token(&pos, end, &first, &first_len))
+        return 0;
+    if (command[0] == 'r' && !next_token(&pos, end, &last, &last_len))
+        return 0;
+    if (next_token(&pos, end, &tok, &tok_len) &&
+        (limit = parse_number(tok, tok_len)) < 0)
+        return 0;
+
+    if (command[0] == 'r')
+        db_scan_range(scan, first, first_len, last, last_len, limit);
+    else
+        db_scan_prefix(scan, first, first_len, limit);
+    return 1;
+}
+
+int db_is_batch(char c)
+{
+    return c == 'Q' || c == 'A' || c == 'D';
+}
+
+void interpret_batch(const char *command, size_t command_len,
+                     db_batch_t *batch)
+{
+    const char *pos = command + 1;
+    const char *end = command + command_len;
+    const char *keys[DB_BATCH_MAX];
+    size_t key_lens[DB_BATCH_MAX];
+    const char *values[DB_BATCH_MAX];
+    size_t value_lens[DB_BATCH_MAX];
+    int results[DB_BATCH_MAX];
+    int n = 0;
+    int pairs = command[0] == 'A';
+
+    for (int i = 0; i < DB_BATCH_MAX; i++)
+        batch->pinned[i].data = NULL;
+    batch->n = 1;
+    batch->response[0] = "ill-formed command";
+    if (command_len <= 1 || command[1] == '\0')
+        return;
+
+    const char *key;
+    size_t key_len;
+    while (next_token(&pos, end, &key, &key_len))
+    {
+        if (n == DB_BATCH_MAX)
+            return;
+        keys[n] = key;
+        key_lens[n] = key_len;
+        if (pairs && !next_token(&pos, end, &values[n], &value_lens[n]))
+            return;
+        n++;
+    }
+    if (n == 0)
+        return;
+
+    batch->n = n;
+    switch (command[0])
+    {
+    case 'Q':
+        db_query_batch(keys, key_lens, n, batch->pinned);
+        for (int i = 0; i < n; i++)
+        {
+            batch->response[i] = "";
+            if (batch->pinned[i].data == NULL || batch->pinned[i].len == 0)
+            {
+                db_value_release(&batch->pinned[i]);
+                batch->response[i] = "not found";
+            }
+        }
+        return;
+
+    case 'A':
+        db_add_batch(keys, key_lens, values, value_lens, n, results);
+        for (int i = 0; i < n; i++)
+            batch->response[i] = results[i] ? "added" : "already in database";
+        return;
+
+    default:
+        db_remove_batch(keys, key_lens, n, results);
+        for (int i = 0; i < n; i++)
+            batch->response[i] = results[i] ? "removed" : "not in database";
+        return;
+    }
+}
+
+//------------------------------------------------------------------------------------------------
+// Bulk loading
+//
+// db_load() maps its file rather than reading it a line at a time, and cuts
+// it at line ends into pieces that threads parse at the same time. The lines
+// then run in order, except that a run of adds, up to LOAD_RUN of them, is
+// gathered first: it is sorted by shard and key, in pieces by several threads
+// and merged, repeated keys are dropped but for their first add, and every
+// shard takes its part at once from a thread of its own. The binary tree
+// links a sorted part into a treap and merges that into the tree in one pass
+// (see bst_insert_sorted()); the other engines add it key by key, in order.
+
+// threads a load parses, sorts and adds with, the calling one included
+#define LOAD_THREADS 8
+// the most consecutive adds that are sorted and added together
+#define LOAD_RUN (1 << 16)
+// the least bytes or lines worth a thread of their own
+#define LOAD_GRAIN 4096
+// the fewest pairs of a shard worth the engine's insert_sorted()
+#define LOAD_SORTED_MIN 8
+
+/* A line of a file being loaded, cut where fgets() would have cut it. */
+typedef struct load_line {
+    const char *text;
+    size_t len;            // up to the first NUL, which ends a command
+    const char *key;       // NULL unless the line is a well-formed add
+    size_t key_len;
+    const char *value;
+    size_t value_len;
+    unsigned long prefix;  // the first eight bytes of the key, big-endian
+    unsigned int shard;    // the shard of the key
+    unsigned int seq;      // the position of the add in its run
+} load_line_t;
+
+/* The lines of one piece of a file being loaded. */
+typedef struct load_piece {
+    const char *start;
+    const char *end;
+    load_line_t *lines;
+    size_t n;
+    size_t cap;
+    int failed;  // memory ran out
+} load_piece_t;
+
+/* A load, running or over; those from db_load_start() are kept in loads. */
+typedef struct load {
+    long id;
+    int threads;   // the most threads it runs on, one per core
+    int fd;        // the file, unless input has taken it over
+    FILE *input;   // the file, if it has to be read line by line
+    char *map;     // the file, mapped, or NULL
+    size_t size;
+    load_piece_t pieces[LOAD_THREADS];
+    int npieces;
+    // a run of adds, with room for another and for the arguments of
+    // insert_sorted()
+    load_line_t *run;
+    load_line_t *spare;
+    const char **keys;
+    size_t *key_lens;
+    const char **values;
+    size_t *value_lens;
+    size_t cap;
+    // lines in the file (0 until it has been parsed) and lines run so far,
+    // both accessed atomically
+    unsigned long lines;
+    unsigned long done;
+    int over;  // under loads.mutex
+    pthread_t thread;  // the thread running a load from db_load_start()
+    struct load *next;
+} load_t;
+
+/* Splits a task of n parts among threads, for run_tasks(). */
+typedef struct load_tasks {
+    void (*fn)(void *arg, int i);
+    void *arg;
+    int n;
+    int next;  // the next part to take, accessed atomically
+} load_tasks_t;
+
+/* A run being sorted by load_sort_piece() and load_merge(). */
+typedef struct load_sort {
+    load_line_t *src;
+    load_line_t *dst;
+    size_t bounds[LOAD_THREADS + 1];  // where each sorted piece starts
+    int npieces;
+    int width;  // pieces already merged together
+} load_sort_t;
+
+/* A sorted run being added to the shards by load_add_shard(). */
+typedef struct load_add {
+    load_t *load;
+    load_line_t *run;
+    size_t *parts;  // where each shard's part of the run starts, and the end
+    // with a log, how many pairs of each part were added, which are moved to
+    // the front of the part, to be logged
+    size_t *added;
+} load_add_t;
+
+static void *load_tasks_main(void *arg)
+{
+    load_tasks_t *tasks = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&tasks->next, 1, __ATOMIC_RELAXED)) <
+           tasks->n)
+        tasks->fn(tasks->arg, i);
+    return NULL;
+}
+
+/*
+ * Calls fn(arg, i) for every i from 0 to n - 1, from up to threads threads
+ * (at most LOAD_THREADS), the calling one among them, and returns once all
+ * calls are done. The calling thread cannot be cancelled meanwhile, as the
+ * other threads use its stack.
+ */
+static void run_tasks(void (*fn)(void *arg, int i), void *arg, int n,
+                      int threads)
+{
+    load_tasks_t tasks = {fn, arg, n, 0};
+    pthread_t helpers[LOAD_THREADS];
+    int nthreads = 0;
+    int state;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+    while (nthreads < n - 1 && nthreads < threads - 1 &&
+           pthread_create(&helpers[nthreads], NULL, load_tasks_main,
+                          &tasks) == 0)
+        nthreads++;
+    load_tasks_main(&tasks);
+    while (nthreads > 0)
+        pthread_join(helpers[--nthreads], NULL);
+    pthread_setcancelstate(state, NULL);
+}
+
+/* Returns the length of the line at p, ending before end, as fgets() would
+ * read it into a buffer of MAXLEN bytes. */
+static size_t line_length(const char *p, const char *end)
+{
+    size_t len = end - p < MAXLEN - 1 ? (size_t)(end - p) : MAXLEN - 1;
+    const char *newline = memchr(p, '\n', len);
+    return newline != NULL ? (size_t)(newline - p) + 1 : len;
+}
+
+/* Parses the lines of piece i of the load at arg. */
+static void load_parse(void *arg, int i)
+{
+    load_piece_t *piece = &((load_t *)arg)->pieces[i];
+    const char *p = piece->start;
+    while (p < piece->end)
+    {
+        if (piece->n == piece->cap)
+        {
+            size_t cap = piece->cap > 0 ? 2 * piece->cap : 1024;
+            load_line_t *lines = realloc(piece->lines, cap * sizeof(*lines));
+            if (lines == NULL)
+            {
+                piece->failed = 1;
+                return;
+            }
+            piece->lines = lines;
+            piece->cap = cap;
+        }
+
+        size_t len = line_length(p, piece->end);
+        load_line_t *line = &piece->lines[piece->n++];
+        const char *nul = memchr(p, '\0', len);
+        line->text = p;
+        line->len = nul != NULL ? (size_t)(nul - p) : len;
+        line->key = NULL;
+        p += len;
+
+        // an add is well-formed where interpret_command_pinned() takes it
+        const char *pos = line->text + 1;
+        const char *end = line->text + line->len;
+        if (line->len > 1 && line->text[0] == 'a' &&
+            next_token(&pos, end, &line->key, &line->key_len) &&
+            !next_token(&pos, end, &line->value, &line->value_len))
+            line->key = NULL;
+        if (line->key == NULL)
+            continue;
+        line->prefix = 0;
+        for (size_t k = 0; k < 8; k++)
+        {
+            unsigned char c = k < line->key_len ? line->key[k] : 0;
+            line->prefix = (line->prefix << 8) | c;
+        }
+        line->shard =
+            nshards > 1 ? shard_hash(line->key, line->key_len) % nshards : 0;
+    }
+}
+
+/*
+ * Maps the load's file and parses it, in pieces cut at line ends. Returns 0
+ * on success and -1 if the file cannot be mapped (a pipe, say) or memory ran
+ * out, in which case it has to be read line by line.
+ */
+static int load_map(load_t *load)
+{
+    struct stat st;
+    if (fstat(load->fd, &st) < 0 || !S_ISREG(st.st_mode))
+        return -1;
+    load->size = st.st_size;
+    if (load->size == 0)
+        return 0;
+    load->map = mmap(NULL, load->size, PROT_READ, MAP_PRIVATE, load->fd, 0);
+    if (load->map == MAP_FAILED)
+    {
+        load->map = NULL;
+        return -1;
+    }
+    madvise(load->map, load->size, MADV_SEQUENTIAL);
+
+    const char *end = load->map + load->size;
+    int n = load->size / LOAD_GRAIN + 1;
+    if (n > load->threads)
+        n = load->threads;
+    const char *start = load->map;
+    for (int i = 0; i < n; i++)
+    {
+        // a piece ends at the first line end past its share of the file,
+        // where fgets() starts a new line too
+        const char *cut = load->map + load->size * (i + 1) / n;
+        if (cut < start)
+            cut = start;
+        if (cut > load->map && cut < end)
+        {
+            const char *newline = memchr(cut - 1, '\n', end - (cut - 1));
+            cut = newline != NULL ? newline + 1 : end;
+        }
+        load->pieces[i].start = start;
+        load->pieces[i].end = cut;
+        start = cut;
+    }
+    load->npieces = n;
+    run_tasks(load_parse, load, n, n);
+
+    unsigned long lines = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (load->pieces[i].failed)
+            return -1;
+        lines += load->pieces[i].n;
+    }
+    load->cap = lines < LOAD_RUN ? lines : LOAD_RUN;
+    if (load->cap == 0)
+        return 0;
+    load->run = malloc(load->cap * sizeof(*load->run));
+    load->spare = malloc(load->cap * sizeof(*load->spare));
+    load->keys = malloc(load->cap * sizeof(*load->keys));
+    load->key_lens = malloc(load->cap * sizeof(*load->key_lens));
+    load->values = malloc(load->cap * sizeof(*load->values));
+    load->value_lens = malloc(load->cap * sizeof(*load->value_lens));
+    if (load->run == NULL || load->spare == NULL || load->keys == NULL ||
+        load->key_lens == NULL || load->values == NULL ||
+        load->value_lens == NULL)
+        return -1;
+    __atomic_store_n(&load->lines, lines, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Orders the adds of a run by shard, then key, then position. */
+static int load_line_cmp(const void *a, const void *b)
+{
+    const load_line_t *x = a;
+    const load_line_t *y = b;
+    if (x->shard != y->shard)
+        return x->shard < y->shard ? -1 : 1;
+    if (x->prefix != y->prefix)
+        return x->prefix < y->prefix ? -1 : 1;
+    int cmp = memcmp(x->key, y->key,
+                     x->key_len < y->key_len ? x->key_len : y->key_len);
+    if (cmp != 0)
+        return cmp;
+    if (x->key_len != y->key_len)
+        return x->key_len < y->key_len ? -1 : 1;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/* Sorts piece i of the run at arg. */
+static void load_sort_piece(void *arg, int i)
+{
+    load_sort_t *sort = arg;
+    qsort(sort->src + sort->bounds[i], sort->bounds[i + 1] - sort->bounds[i],
+          sizeof(load_line_t), load_line_cmp);
+}
+
+/* Merges the i-th pair of sorted stretches of sort->width pieces each from
+ * sort->src into sort->dst. */
+static void load_merge(void *arg, int i)
+{
+    load_sort_t *sort = arg;
+    int first = 2 * i * sort->width;
+    int middle = first + sort->width;
+    int last = middle + sort->width;
+    if (middle > sort->npieces)
+        middle = sort->npieces;
+    if (last > sort->npieces)
+        last = sort->npieces;
+
+    size_t a = sort->bounds[first];
+    size_t a_end = sort->bounds[middle];
+    size_t b = a_end;
+    size_t b_end = sort->bounds[last];
+    size_t out = a;
+    while (a < a_end && b < b_end)
+    {
+        if (load_line_cmp(&sort->src[b], &sort->src[a]) < 0)
+            sort->dst[out++] = sort->src[b++];
+        else
+            sort->dst[out++] = sort->src[a++];
+    }
+    memcpy(sort->dst + out, sort->src + a, (a_end - a) * sizeof(load_line_t));
+    out += a_end - a;
+    memcpy(sort->dst + out, sort->src + b, (b_end - b) * sizeof(load_line_t));
+}
+
+/* Moves the pairs of run from first to last whose key is in the shard at
+ * state, if present is set, or is not, if it is not, to the front of them in
+ * order, and returns how many there are. */
+static size_t load_keep_present(void *state, load_line_t *run, size_t first,
+                                size_t last, int present)
+{
+    size_t kept = first;
+    epoch_enter();
+    for (size_t j = first; j < last; j++)
+    {
+        if ((engine->lookup(state, run[j].key, run[j].key_len) != NULL) ==
+            present)
+            run[kept++] = run[j];
+    }
+    epoch_exit();
+    return kept - first;
+}
+
+/*
+ * Adds the pairs of the i-th shard of the sorted run at arg. With a log, it
+ * also sets add->added[i]; every stripe is held meanwhile, so no other
+ * writer adds or removes a key of the part, and whichever of its keys is
+ * missing before and present after was added here.
+ */
+static void load_add_shard(void *arg, int i)
+{
+    load_add_t *add = arg;
+    load_t *load = add->load;
+    load_line_t *run = add->run;
+    size_t first = add->parts[i];
+    size_t last = add->parts[i + 1];
+    void *state = shards[run[first].shard].state;
+
+    if (engine->insert_sorted == NULL || last - first < LOAD_SORTED_MIN)
+    {
+        size_t kept = first;
+        for (size_t j = first; j < last; j++)
+        {
+            if (engine->insert(state, run[j].key, run[j].key_len,
+                               run[j].value, run[j].value_len) &&
+                add->added != NULL)
+                run[kept++] = run[j];
+        }
+        if (add->added != NULL)
+            add->added[i] = kept - first;
+        return;
+    }
+    if (add->added != NULL)
+        last = first + load_keep_present(state, run, first, last, 0);
+    for (size_t j = first; j < last; j++)
+    {
+        load->keys[j] = run[j].key;
+        load->key_lens[j] = run[j].key_len;
+        load->values[j] = run[j].value;
+        load->value_lens[j] = run[j].value_len;
+    }
+    size_t added = engine->insert_sorted(
+        state, load->keys + first, load->key_lens + first, load->values + first,
+        load->value_lens + first, last - first);
+    if (add->added == NULL)
+        return;
+    // only if memory ran out are some of the missing keys still missing
+    if (added < last - first)
+        last = first + load_keep_present(state, run, first, last, 1);
+    add->added[i] = last - first;
+}
+
+/* Adds the n adds gathered in load->run, as if one after another. */
+static void load_run(load_t *load, size_t n)
+{
+    load_sort_t sort = {load->run, load->spare, {0}, 1, 1};
+    if (n >= 2 * LOAD_GRAIN)
+    {
+        sort.npieces = n / LOAD_GRAIN;
+        if (sort.npieces > load->threads)
+            sort.npieces = load->threads;
+    }
+    for (int i = 0; i <= sort.npieces; i++)
+        sort.bounds[i] = n * i / sort.npieces;
+    run_tasks(load_sort_piece, &sort, sort.npieces, sort.npieces);
+    for (; sort.width < sort.npieces; sort.width *= 2)
+    {
+        int pairs = (sort.npieces + 2 * sort.width - 1) / (2 * sort.width);
+        run_tasks(load_merge, &sort, pairs, pairs);
+        load_line_t *merged = sort.dst;
+        sort.dst = sort.src;
+        sort.src = merged;
+    }
+
+    // only the first add of a key counts; the parts of the shards follow
+    // each other
+    load_line_t *run = sort.src;
+    size_t kept = 0;
+    int nparts = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (kept > 0 && run[kept - 1].shard == run[i].shard &&
+            run[kept - 1].key_len == run[i].key_len &&
+            memcmp(run[kept - 1].key, run[i].key, run[i].key_len) == 0)
+            continue;
+        if (kept == 0 || run[kept - 1].shard != run[i].shard)
+            nparts++;
+        run[kept++] = run[i];
+    }
+
+    // every shard takes its part from one thread; with a log, a short run is
+    // not worth locking every stripe for, and it is added pair by pair
+    load_add_t add = {load, run, NULL, NULL};
+    if (wal == NULL || kept >= WAL_STRIPES)
+    {
+        add.parts = malloc((nparts + 1) * sizeof(size_t));
+        if (wal != NULL && add.parts != NULL &&
+            (add.added = malloc(nparts * sizeof(size_t))) == NULL)
+        {
+            free(add.parts);
+            add.parts = NULL;
+        }
+    }
+    if (add.parts == NULL)
+    {
+        for (size_t i = 0; i < kept; i++)
+            db_add(run[i].key, run[i].key_len, run[i].value,
+                   run[i].value_len);
+        return;
+    }
+    nparts = 0;
+    for (size_t i = 0; i < kept; i++)
+    {
+        if (i == 0 || run[i - 1].shard != run[i].shard)
+            add.parts[nparts++] = i;
+    }
+    add.parts[nparts] = kept;
+    int threads = kept / LOAD_GRAIN + 1;
+    // with a log, the pairs added are logged together, after they are added
+    // and before any other change to their keys
+    int cancel;
+    if (wal != NULL)
+        wal_lock_all(&cancel);
+    run_tasks(load_add_shard, &add, nparts,
+              threads < load->threads ? threads : load->threads);
+    if (wal != NULL)
+    {
+        for (int p = 0; p < nparts; p++)
+        {
+            for (size_t i = add.parts[p]; i < add.parts[p] + add.added[p]; i++)
+                wal_log(WAL_ADD, run[i].key, run[i].key_len, run[i].value,
+                        run[i].value_len);
+        }
+        wal_unlock_all(cancel);
+    }
+    free(add.parts);
+    free(add.added);
+}
+
+// the loads db_load_start() has started, for db_load_progress() to find and
+// db_cleanup() to stop
+static struct {
+    pthread_mutex_t mutex;
+    load_t *list;  // newest first
+    long last_id;
+    int stopping;  // set while db_cleanup() stops them; accessed atomically
+} loads = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0};
+
+/* Runs the command of len bytes at text, less than MAXLEN, and drops its
+ * response, as the commands of a file are run silently. */
+static void load_command(const char *text, size_t len)
+{
+    char command[MAXLEN];
+    char response[MAXLEN];
+    memcpy(command, text, len);
+    command[len] = '\0';
+    interpret_command(command, response, sizeof(response));
+}
+
+/* Runs the parsed lines of the load in order, gathering runs of adds. */
+static void load_execute(load_t *load)
+{
+    unsigned long done = 0;
+    size_t n = 0;
+    for (int i = 0; i < load->npieces; i++)
+    {
+        load_piece_t *piece = &load->pieces[i];
+        for (size_t j = 0; j < piece->n; j++)
+        {
+            load_line_t *line = &piece->lines[j];
+            if (line->key != NULL)
+            {
+                line->seq = n;
+                load->run[n++] = *line;
+                if (n == load->cap)
+                {
+                    load_run(load, n);
+                    n = 0;
+                }
+            }
+            else
+            {
+                if (n > 0)
+                {
+                    load_run(load, n);
+                    n = 0;
+                }
+                load_command(line->text, line->len);
+            }
+            done++;
+            __atomic_store_n(&load->done, done - n, __ATOMIC_RELAXED);
+
+            if (__atomic_load_n(&loads.stopping, __ATOMIC_RELAXED))
+                return;
+            // nothing above is a cancellation point
+            pthread_testcancel();
+        }
+    }
+    if (n > 0)
+        load_run(load, n);
+    __atomic_store_n(&load->done, done, __ATOMIC_RELAXED);
+}
+
+/* Runs the commands of the load's file read one line at a time, for files
+ * that cannot be mapped. */
+static void load_lines(load_t *load)
+{
+    char line[MAXLEN];
+    char response[MAXLEN];
+    if ((load->input = fdopen(load->fd, "r")) == NULL)
+        return;
+    load->fd = -1;
+    while (fgets(line, sizeof(line), load->input) != NULL &&
+           !__atomic_load_n(&loads.stopping, __ATOMIC_RELAXED))
+    {
+        // fgets is not a cancellation point
+        pthread_testcancel();
+        interpret_command(line, response, sizeof(response));
+        __atomic_add_fetch(&load->done, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* Frees what load_map() made. */
+static void load_unmap(load_t *load)
+{
+    for (int i = 0; i < load->npieces; i++)
+        free(load->pieces[i].lines);
+    load->npieces = 0;
+    free(load->run);
+    free(load->spare);
+    free(load->keys);
+    free(load->key_lens);
+    free(load->values);
+    free(load->value_lens);
+    load->run = load->spare = NULL;
+    load->keys = load->values = NULL;
+    load->key_lens = load->value_lens = NULL;
+    if (load->map != NULL)
+        munmap(load->map, load->size);
+    load->map = NULL;
+}
+
+/* Frees everything of the load but the load itself. */
+static void load_release(void *arg)
+{
+    load_t *load = arg;
+    load_unmap(load);
+    if (load->input != NULL)
+        fclose(load->input);
+    else if (load->fd >= 0)
+        close(load->fd);
+    load->input = NULL;
+    load->fd = -1;
+}
+
+/* Runs the commands of the file the load has opened. */
+static void load_file(load_t *load)
+{
+    pthread_cleanup_push(load_release, load);
+    pthread_once(&shards_once, shards_init);
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    load->threads = cores < 1 ? 1 : cores < LOAD_THREADS ? cores : LOAD_THREADS;
+    if (load_map(load) == 0)
+    {
+        load_execute(load);
+    }
+    else
+    {
+        load_unmap(load);
+        load_lines(load);
+    }
+    pthread_cleanup_pop(1);
+}
+
+int db_load(const char *filename)
+{
+    load_t *load = calloc(1, sizeof(load_t));
+    if (load == NULL)
+        return -1;
+    if ((load->fd = open(filename, O_RDONLY)) < 0)
+    {
+        free(load);
+        return -1;
+    }
+    pthread_cleanup_push(free, load);
+    load_file(load);
+    pthread_cleanup_pop(1);
+    return 0;
+}
+
+static void *load_main(void *arg)
+{
+    load_t *load = arg;
+    load_file(load);
+    pthread_mutex_lock(&loads.mutex);
+    load->over = 1;
+    pthread_mutex_unlock(&loads.mutex);
+    return NULL;
+}
+
+long db_load_start(const char *filename)
+{
+    load_t *load = calloc(1, sizeof(load_t));
+    if (load == NULL)
+        return -1;
+    if ((load->fd = open(filename, O_RDONLY)) < 0)
+    {
+        free(load);
+        return -1;
+    }
+
+    pthread_mutex_lock(&loads.mutex);
+    load->id = loads.last_id + 1;
+    if (pthread_create(&load->thread, NULL, load_main, load) != 0)
+    {
+        pthread_mutex_unlock(&loads.mutex);
+        close(load->fd);
+        free(load);
+        return -1;
+    }
+    loads.last_id++;
+    load->next = loads.list;
+    loads.list = load;
+    pthread_mutex_unlock(&loads.mutex);
+    return load->id;
+}
+
+int db_load_progress(long id, unsigned long *done, unsigned long *total)
+{
+    int ret = -1;
+    pthread_mutex_lock(&loads.mutex);
+    for (load_t *load = loads.list; load != NULL; load = load->next)
+    {
+        if (load->id == id)
+        {
+            *done = __atomic_load_n(&load->done, __ATOMIC_RELAXED);
+            *total = __atomic_load_n(&load->lines, __ATOMIC_RELAXED);
+            ret = !load->over;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&loads.mutex);
+    return ret;
+}
+
+/*
+ * Stops the loads still running and forgets every load. Their threads are
+ * joined rather than waited for, since a thread still uses the database
+ * (its epoch record, say) after its load is over. A load may start another
+ * meanwhile, which is then stopped as well.
+ */
+static void loads_stop(void)
+{
+    __atomic_store_n(&loads.stopping, 1, __ATOMIC_RELAXED);
+    while (1)
+    {
+        pthread_mutex_lock(&loads.mutex);
+        load_t *list = loads.list;
+        loads.list = NULL;
+        pthread_mutex_unlock(&loads.mutex);
+        if (list == NULL)
+            break;
+        while (list != NULL)
+        {
+            load_t *next = list->next;
+            pthread_join(list->thread, NULL);
+            free(list);
+            list = next;
+        }
+    }
+    __atomic_store_n(&loads.stopping, 0, __ATOMIC_RELAXED);
+}
+
+//------------------------------------------------------------------------------------------------
+// Recovery and checkpoints
+//
+// db_wal_enable() replays the checkpoint and the log files a chunk of records
+// at a time. The records of a chunk are grouped by the hash of their key into
+// one part per thread, each part keeping the order of its records, and the
+// threads replay the parts at the same time; the changes to a key all fall in
+// one part, in the order they were logged. A range removal, which may touch any
+// part, ends a chunk and runs on its own. The pairs of a checkpoint are written
+// shard by shard in key order, so there the parts are the shards, each sorted,
+// which go through the engine's insert_sorted() like a bulk load's run. The
+// checkpoint records how many shards it was written from; if the server now has
+// another number, a shard's pairs are no longer in one run, and they are
+// replayed as records. A checkpointer thread writes a checkpoint every
+// interval, if anything has been logged since the last.
+
+// records replayed together
+#define REPLAY_CHUNK LOAD_RUN
+// pairs a checkpoint copies out of a shard at a time
+#define CHECKPOINT_CHUNK 64
+
+/* A chunk of records being replayed. */
+typedef struct replay {
+    int threads;
+    wal_record_t *records;  // in the order they were logged
+    wal_record_t *grouped;  // grouped by part, in the same order within one
+    unsigned int *part;     // the part of every record
+    size_t *bounds;  // where each part starts in grouped, and the end
+    int nparts;
+    int sorted;  // whether the parts are shards, for insert_sorted()
+    // the arguments of insert_sorted()
+    const char **keys;
+    size_t *key_lens;
+    const char **values;
+    size_t *value_lens;
+} replay_t;
+
+/* The pairs of a shard that checkpoint() writes next. */
+typedef struct checkpoint_chunk {
+    char from[MAXLEN];  // the last key written, if any
+    size_t from_len;
+    int past_from;
+    char keys[CHECKPOINT_CHUNK][MAXLEN];
+    size_t key_lens[CHECKPOINT_CHUNK];
+    char values[CHECKPOINT_CHUNK][MAXLEN];
+    size_t value_lens[CHECKPOINT_CHUNK];
+    int n;
+} checkpoint_chunk_t;
+
+// the thread that writes checkpoints
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t stop;
+    int interval;  // seconds between checkpoints
+    int stopping;  // accessed atomically
+    int running;
+    pthread_t thread;
+} checkpointer = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0,
+                  0, 0};
+
+/* Replays the i-th part of the chunk at arg. */
+static void replay_part(void *arg, int i)
+{
+    replay_t *replay = arg;
+    size_t first = replay->bounds[i];
+    size_t last = replay->bounds[i + 1];
+    wal_record_t *records = replay->grouped;
+
+    if (replay->sorted && engine->insert_sorted != NULL &&
+        last - first >= LOAD_SORTED_MIN)
+    {
+        for (size_t j = first; j < last; j++)
+        {
+            replay->keys[j] = records[j].key;
+            replay->key_lens[j] = records[j].key_len;
+            replay->values[j] = records[j].value;
+            replay->value_lens[j] = records[j].value_len;
+        }
+        engine->insert_sorted(shards[i].state, replay->keys + first,
+                              replay->key_lens + first, replay->values + first,
+                              replay->value_lens + first, last - first);
+        return;
+    }
+    // no log is open yet, so nothing is logged again
+    for (size_t j = first; j < last; j++)
+    {
+        if (records[j].op == WAL_ADD)
+            db_add(records[j].key, records[j].key_len, records[j].value,
+                   records[j].value_len);
+        else
+            db_remove(records[j].key, records[j].key_len);
+    }
+}
+
+/* Replays the n records of the chunk, grouped into parts. */
+static void replay_chunk(replay_t *replay, size_t n)
+{
+    if (n == 0)
+        return;
+    size_t *bounds = replay->bounds;
+    memset(bounds, 0, (replay->nparts + 1) * sizeof(size_t));
+    for (size_t i = 0; i < n; i++)
+    {
+        unsigned int h =
+            shard_hash(replay->records[i].key, replay->records[i].key_len);
+        replay->part[i] = h % replay->nparts;
+        bounds[replay->part[i] + 1]++;
+    }
+    for (int p = 0; p < replay->nparts; p++)
+        bounds[p + 1] += bounds[p];
+    for (size_t i = 0; i < n; i++)
+        replay->grouped[bounds[replay->part[i]]++] = replay->records[i];
+    // each part's bound has moved to where the next one starts
+    memmove(bounds + 1, bounds, replay->nparts * sizeof(size_t));
+    bounds[0] = 0;
+
+    int threads = n / LOAD_GRAIN + 1;
+    run_tasks(replay_part, replay, replay->nparts,
+              threads < replay->threads ? threads : replay->threads);
+}
+
+/* Replays the records of a checkpoint or log file, for wal_open(). */
+static void replay_file(void *arg, const char *data, size_t len,
+                        unsigned int checkpoint)
+{
+    replay_t *replay = arg;
+    replay->sorted = checkpoint == (unsigned int)nshards &&
+                     engine->insert_sorted != NULL;
+    replay->nparts = replay->sorted ? nshards : replay->threads;
+
+    const char *pos = data;
+    size_t n = 0;
+    wal_record_t record;
+    while (wal_next(&pos, data + len, &record))
+    {
+        if (record.op == WAL_RANGE || record.op == WAL_RANGE_TAIL)
+        {
+            replay_chunk(replay, n);
+            n = 0;
+            db_remove_range(record.key, record.key_len,
+                            record.op == WAL_RANGE ? record.value : NULL,
+                            record.value_len);
+            continue;
+        }
+        replay->records[n++] = record;
+        if (n == REPLAY_CHUNK)
+        {
+            replay_chunk(replay, n);
+            n = 0;
+        }
+    }
+    replay_chunk(replay, n);
+}
+
+/* Copies a pair the engine came across into the chunk, until it is full. */
+static int checkpoint_chunk_push(const char *key, const char *value,
+                                 void *chunk_arg)
+{
+    checkpoint_chunk_t *chunk = chunk_arg;
+    size_t len = strlen(key);
+    if (chunk->past_from && len == chunk->from_len &&
+        memcmp(key, chunk->from, len) == 0)
+        return 0;
+    memcpy(chunk->keys[chunk->n], key, len);
+    chunk->key_lens[chunk->n] = len;
+    chunk->value_lens[chunk->n] = strlen(value);
+    memcpy(chunk->values[chunk->n], value, chunk->value_lens[chunk->n]);
+    return ++chunk->n == CHECKPOINT_CHUNK;
+}
+
+/*
+ * Writes every pair in the database to a new checkpoint, shard by shard, a
+ * chunk at a time copied out of the shard and written once the scan has let
+ * go of its locks. Returns 0 on success, and -1 on failure or if the
+ * checkpointer is stopped meanwhile.
+ */
+static int checkpoint(void)
+{
+    checkpoint_chunk_t *chunk = malloc(sizeof(checkpoint_chunk_t));
+    if (chunk == NULL)
+        return -1;
+    wal_checkpoint_t *checkpoint = wal_checkpoint_begin(wal, nshards);
+    if (checkpoint == NULL)
+    {
+        free(chunk);
+        return -1;
+    }
+
+    int complete = 1;
+    for (int i = 0; complete && i < nshards; i++)
+    {
+        chunk->from_len = 0;
+        chunk->past_from = 0;
+        do
+        {
+            chunk->n = 0;
+            epoch_enter();
+            engine->scan(shards[i].state, chunk->from, chunk->from_len,
+                         checkpoint_chunk_push, chunk);
+            epoch_exit();
+            for (int j = 0; j < chunk->n; j++)
+            {
+                if (wal_checkpoint_add(checkpoint, chunk->keys[j],
+                                       chunk->key_lens[j], chunk->values[j],
+                                       chunk->value_lens[j]) < 0)
+                    complete = 0;
+            }
+            if (chunk->n > 0)
+            {
+                chunk->from_len = chunk->key_lens[chunk->n - 1];
+                memcpy(chunk->from, chunk->keys[chunk->n - 1],
+                       chunk->from_len);
+                chunk->past_from = 1;
+            }
+            if (__atomic_load_n(&checkpointer.stopping, __ATOMIC_RELAXED))
+                complete = 0;
+        } while (complete && chunk->n == CHECKPOINT_CHUNK);
+    }
+    free(chunk);
+    return wal_checkpoint_end(checkpoint, complete);
+}
+
+static void *checkpointer_main(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&checkpointer.mutex);
+    while (!checkpointer.stopping)
+    {
+        struct timespec at;
+        clock_gettime(CLOCK_REALTIME, &at);
+        at.tv_sec += checkpointer.interval;
+        while (!checkpointer.stopping &&
+               pthread_cond_timedwait(&checkpointer.stop, &checkpointer.mutex,
+                                      &at) == 0)
+            ;
+        if (checkpointer.stopping)
+            break;
+        pthread_mutex_unlock(&checkpointer.mutex);
+        if (wal_size(wal) > 0 && checkpoint() < 0 &&
+            !__atomic_load_n(&checkpointer.stopping, __ATOMIC_RELAXED))
+            fprintf(stderr, "could not write a checkpoint\n");
+        pthread_mutex_lock(&checkpointer.mutex);
+    }
+    pthread_mutex_unlock(&checkpointer.mutex);
+    return NULL;
+}
+
+int db_wal_enable(const char *path, const char *policy, int interval)
+{
+    static const char *const policies[] = {"always", "batch", "interval"};
+    static const int policy_values[] = {WAL_FSYNC_ALWAYS, WAL_FSYNC_BATCH,
+                                        WAL_FSYNC_INTERVAL};
+    int p = 0;
+    while (p < 3 && strcmp(policy, policies[p]) != 0)
+        p++;
+    if (p == 3 || interval < 0 || wal != NULL)
+        return -1;
+
+    pthread_once(&shards_once, shards_init);
+    for (int i = 0; i < WAL_STRIPES; i++)
+        pthread_mutex_init(&wal_stripes[i].mutex, NULL);
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    replay_t replay;
+    replay.threads =
+        cores < 1 ? 1 : cores < LOAD_THREADS ? cores : LOAD_THREADS;
+    int nbounds = (nshards > replay.threads ? nshards : replay.threads) + 1;
+    replay.records = malloc(REPLAY_CHUNK * sizeof(wal_record_t));
+    replay.grouped = malloc(REPLAY_CHUNK * sizeof(wal_record_t));
+    replay.part = malloc(REPLAY_CHUNK * sizeof(unsigned int));
+    replay.bounds = malloc(nbounds * sizeof(size_t));
+    replay.keys = malloc(REPLAY_CHUNK * sizeof(char *));
+    replay.key_lens = malloc(REPLAY_CHUNK * sizeof(size_t));
+    replay.values = malloc(REPLAY_CHUNK * sizeof(char *));
+    replay.value_lens = malloc(REPLAY_CHUNK * sizeof(size_t));
+    wal_t *log = NULL;
+    if (replay.records != NULL && replay.grouped != NULL &&
+        replay.part != NULL && replay.bounds != NULL && replay.keys != NULL &&
+        replay.key_lens != NULL && replay.values != NULL &&
+        replay.value_lens != NULL)
+        log = wal_open(path, policy_values[p], replay_file, &replay);
+    free(replay.records);
+    free(replay.grouped);
+    free(replay.part);
+    free(replay.bounds);
+    free(replay.keys);
+    free(replay.key_lens);
+    free(replay.values);
+    free(replay.value_lens);
+    if (log == NULL)
+        return -1;
+
+    wal = log;
+    checkpointer.interval = interval;
+    if (interval > 0 &&
+        pthread_create(&checkpointer.thread, NULL, checkpointer_main, NULL) !=
+            0)
+    {
+        wal_close(log);
+        wal = NULL;
+        return -1;
+    }
+    checkpointer.running = interval > 0;
+    return 0;
+}
+
+static void wal_stop(void)
+{
+    if (wal == NULL)
+        return;
+    if (checkpointer.running)
+    {
+        pthread_mutex_lock(&checkpointer.mutex);
+        __atomic_store_n(&checkpointer.stopping, 1, __ATOMIC_RELAXED);
+        pthread_cond_signal(&checkpointer.stop);
+        pthread_mutex_unlock(&checkpointer.mutex);
+        pthread_join(checkpointer.thread, NULL);
+        checkpointer.running = 0;
+        checkpointer.stopping = 0;
+    }
+    wal_close(wal);
+    wal = NULL;
+}
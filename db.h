@@ -1,77 +1,373 @@
 #ifndef DB_H_
 #define DB_H_
 
-#include <pthread.h>
+#include <stddef.h>
 
-typedef struct node {
-    char *key;
-    char *value;
-    struct node *lchild;
-    struct node *rchild;
-    pthread_rwlock_t rwlock;
-} node_t;
+/*
+ * The database keeps its pairs in one of several storage engines (see
+ * engine.h), selected at startup with db_set_engine(). The functions below
+ * are all the rest of the server uses; which data structure they end up in
+ * is never visible outside db.c.
+ */
+
+/**
+ * db_set_shards() splits the database into n independent shards. Keys are
+ * assigned to shards by hash, and every shard has its own engine instance,
+ * with its own locks, so db_query(), db_add() and db_remove() on different
+ * shards never contend. It must be called before the database is used.
+ * Returns 0 on success and -1 on failure.
+ */
+int db_set_shards(int n);
+
+/**
+ * db_set_engine() selects the data structure every shard keeps its pairs in:
+ * "bst" (the default) for a binary tree (see bst.h), "bptree" for a
+ * cache-conscious B+-tree (see bptree.h), "art" for an adaptive radix tree
+ * (see art.h), or "skiplist" for a lock-free skiplist (see skiplist.h). It
+ * must be called before the database is used. Returns 0 on success and -1 on
+ * an unknown name or failure.
+ */
+int db_set_engine(const char *name);
+
+/**
+ * db_index_enable() creates the optional hash index over the database. From
+ * then on db_add() and db_remove() keep it in sync with the tree and
+ * db_query() answers from it instead of walking the tree. Only the binary
+ * tree keeps an index; the other engines ignore it. It must be called before
+ * the database is used. Returns 0 on success and -1 on failure.
+ */
+int db_index_enable(void);
+
+/**
+ * db_huge_pages_enable() backs the memory the binary tree allocates its nodes
+ * from with huge pages: reserved ones if the system has any, transparent ones
+ * otherwise. The other engines ignore it. It must be called before the
+ * database is used. Returns 0 on success and -1 on failure.
+ */
+int db_huge_pages_enable(void);
+
+/**
+ * db_wal_enable() rebuilds the database from the write-ahead log at path (see
+ * wal.h), if there is one, and from then on logs every change to it: adds,
+ * removes and range removals, whichever call or command they come from. The
+ * log is synced to disk as policy says: "always" as soon as anything has
+ * been logged, "batch" a millisecond later, so that more changes share the
+ * sync, or "interval" every 100 ms only. Every interval seconds (never if it
+ * is 0) the database is written to a checkpoint, which replaces the log
+ * written so far. It must be called after the other db_*_enable() and
+ * db_set_*() calls and before the database is used. Returns 0 on success
+ * and -1 on an unknown policy or failure.
+ */
+int db_wal_enable(const char *path, const char *policy, int interval);
+
+/**
+ * db_sync() returns once the changes the calling thread has made are on disk
+ * as far as the log's policy promises (at once under "interval", or without
+ * a log). The server calls it before sending responses, so that no change is
+ * acknowledged before it is durable; changes from many threads are synced
+ * together, one sync covering all that were logged while the last one ran.
+ */
+void db_sync(void);
+
+/**
+ * db_wal_enabled() returns nonzero if db_wal_enable() has opened a log, so
+ * that the server can gather the responses of several clients before one
+ * db_sync().
+ */
+int db_wal_enabled(void);
+
+/**
+ * DB_MAXLEN is the length of the longest key or value the database takes.
+ */
+#define DB_MAXLEN 256
 
-extern node_t head;
+/**
+ * The db_query() function looks up the value associated with the given key,
+ * the key_len bytes at key, which need not be NUL-terminated. No engine takes
+ * any locks for this. If the key is found, the function returns its value in
+ * the given result buffer of the given size. Otherwise, result is filled with
+ * "not found". The other functions below take keys and values the same way.
+ */
+void db_query(const char *key, size_t key_len, char *result, int len);
 
 /**
- * The search() function searches the tree, starting at parent, for a node
- * containing the given key (the "target node"). If it is found, it will return
- * that node, otherwise it will return NULL.
- * If parentpp is not NULL, then the location that it points to is set to the
- * address of the parent of the target node. If the target node is not found,
- * then the location pointed to by parentpp is set to the address of what would
- * be the parent of the target node, if it were there. Returns the found node on
- * success and NULL on failure.
+ * A value stored in the database, pinned by db_query_pin(): data points at the
+ * stored string itself (len bytes plus a terminator), not at a copy.
  */
-node_t *search(char *key, node_t *parent, node_t **parentp, int rw);
+typedef struct db_value {
+    const char *data;
+    size_t len;
+} db_value_t;
 
 /**
- * The db_query() function calls search() to retrieve the node associated with
- * the given key. If such a node is found, the function retrieves the value
- * stored in that node, and returns it in the given result buffer of the given
- * size. Otherwise, result is filled with "not found".
+ * db_query_pin() looks up the value associated with the given key like
+ * db_query(), but instead of copying it, stores a handle to it in value and
+ * returns 1. The string stays valid, even if its key is removed, until the
+ * same thread passes the handle to db_value_release(); a thread may hold any
+ * number of handles at a time. Returns 0, leaving value->data NULL, if the
+ * key is not in the database. Pinned values keep removed pairs from being
+ * freed, so release them as soon as they have been sent.
  */
-void db_query(char *key, char *result, int len);
+int db_query_pin(const char *key, size_t key_len, db_value_t *value);
 
 /**
- * db_add() uses search() to determine if the given key is already in the
- * database. If the key is not in the database, the function creates a new node
- * with the given key and value and inserts this node into the database as a
- * child of the parent node returned by search(). Returns 1 on success and 0 on
- * failure.
+ * db_value_release() releases a handle from db_query_pin(), if value->data
+ * is not NULL, and sets value->data to NULL.
  */
-int db_add(char *key, char *value);
+void db_value_release(db_value_t *value);
 
 /**
- * The db_remove() function calls search() to retrieve the node associated with
- * the given key. If such a node is found, the function must delete it while
- * preserving the tree ordering constraints. There are three cases that may
- * occur, depending on the children of the node to be removed:
- *  - Both children are NULL: In this case, the function simply deletes the node
- * and sets the corresponding pointer of the parent node to NULL.
- *  - One child is NULL: In this case, the function replaces the node with its
- * non-NULL child.
- *  - Neither child is NULL: In this case, the function finds the leftmost child
- * of the node's right subtree and replaces the removed node with this one.
- * Since the replacement node has no left child, it is easy to remove it from
- * its current position, and since it is the leftmost child of its subtree it
- * can occupy the position of the deleted node and satisfy the tree's ordering
- * constraints. Returns 1 on success and 0 on failure.
+ * db_add() adds the given key and value to the database, unless the key is in
+ * it already or either string is longer than 256 characters. Returns 1 on
+ * success and 0 on failure.
  */
-int db_remove(char *key);
+int db_add(const char *key, size_t key_len, const char *value,
+           size_t value_len);
+
+/**
+ * The db_remove() function removes the given key and its value from the
+ * database. Returns 1 on success and 0 on failure.
+ */
+int db_remove(const char *key, size_t key_len);
+
+/**
+ * db_remove_range() removes every key from start on, up to but not including
+ * end (or up to the last key, if end is NULL), and returns how many it
+ * removed. The binary tree detaches them all at once, in O(log n) per shard
+ * whatever their number, and frees them in the background; the other engines
+ * remove them one by one as a scan finds them. db_remove_prefix() removes
+ * the keys starting with the prefix_len bytes at prefix the same way.
+ */
+long db_remove_range(const char *start, size_t start_len, const char *end,
+                     size_t end_len);
+long db_remove_prefix(const char *prefix, size_t prefix_len);
+
+/**
+ * DB_BATCH_MAX is the largest number of keys db_query_batch(), db_add_batch()
+ * and db_remove_batch() take, and that a batch command may carry.
+ */
+#define DB_BATCH_MAX 64
+
+/**
+ * db_query_batch() looks up n keys at once, keys[i] being key_lens[i] bytes
+ * long, and pins their values in values[i] like db_query_pin() (leaving
+ * values[i].data NULL if keys[i] is not in the database). The keys of each
+ * shard go to its engine together, which may interleave their lookups so
+ * that the cache misses overlap. Returns the number of keys found.
+ */
+int db_query_batch(const char *const *keys, const size_t *key_lens, int n,
+                   db_value_t *values);
+
+/**
+ * db_add_batch() adds n pairs like db_add(), storing what db_add() would have
+ * returned for pair i in results[i]. The pairs are added shard by shard;
+ * pairs with the same key keep their order, so only the first of them is
+ * added.
+ */
+void db_add_batch(const char *const *keys, const size_t *key_lens,
+                  const char *const *values, const size_t *value_lens, int n,
+                  int *results);
+
+/**
+ * db_remove_batch() removes n keys like db_remove(), storing what
+ * db_remove() would have returned for key i in results[i]. The keys are
+ * removed shard by shard; only the first of several equal keys is removed.
+ */
+void db_remove_batch(const char *const *keys, const size_t *key_lens, int n,
+                     int *results);
+
+/**
+ * A pair handed out by db_scan_next(). Its value is pinned like one from
+ * db_query_pin(), and the handle keeps the key valid as well.
+ */
+typedef struct db_pair {
+    const char *key;
+    size_t key_len;
+    db_value_t value;
+} db_pair_t;
+
+/**
+ * A scan over a range of keys, in ascending order: set up by db_scan_range()
+ * or db_scan_prefix(), then carried on a few pairs at a time by
+ * db_scan_next(). Between calls the scan holds no locks and pins nothing; it
+ * only remembers the key it goes on from, so it can be carried on as slowly
+ * as its results are consumed.
+ */
+typedef struct db_scan {
+    char from[DB_MAXLEN];  // the scan goes on from this key
+    size_t from_len;
+    int past_from;         // whether from itself has been visited already
+    char end[DB_MAXLEN];   // the first key past the range, if has_end
+    size_t end_len;
+    int has_end;
+    long left;  // pairs the scan may still visit, or -1 if there is no limit
+    int done;   // set once the scan has visited all it will
+} db_scan_t;
+
+/**
+ * db_scan_range() sets up scan to visit the keys from start on, up to but
+ * not including end (or up to the last key, if end is NULL), and at most
+ * limit of them unless limit is negative.
+ */
+void db_scan_range(db_scan_t *scan, const char *start, size_t start_len,
+                   const char *end, size_t end_len, long limit);
+
+/**
+ * db_scan_prefix() sets up scan to visit the keys starting with the
+ * prefix_len bytes at prefix, at most limit of them unless limit is negative.
+ */
+void db_scan_prefix(db_scan_t *scan, const char *prefix, size_t prefix_len,
+                    long limit);
+
+/**
+ * db_scan_next() stores the next pairs of scan, up to n of them, in pairs and
+ * returns how many it stored; the caller releases every pair's value with
+ * db_value_release(). Each shard's engine is asked for the n pairs that
+ * follow the last one visited, straight from where they are, and the shards'
+ * pairs are merged in key order; no lock is held once the call returns. Sets
+ * scan->done once the scan is over.
+ */
+int db_scan_next(db_scan_t *scan, db_pair_t *pairs, int n);
+
+/**
+ * db_rank() returns the number of keys in the database smaller than the given
+ * key, in O(log n) per shard, or -1 if the storage engine keeps no counts to
+ * tell this (only the binary tree does). Like db_count() and db_select(), it
+ * is exact while nothing is being added or removed; an add or remove running
+ * at the same time may or may not be counted.
+ */
+long db_rank(const char *key, size_t key_len);
+
+/**
+ * db_count() returns the number of keys from start on, up to but not
+ * including end (or up to the last key, if end is NULL), in O(log n) per
+ * shard, or -1 if the storage engine keeps no counts.
+ */
+long db_count(const char *start, size_t start_len, const char *end,
+              size_t end_len);
+
+/**
+ * db_select() finds the key of the given rank, the smallest key having rank
+ * 0, and stores it with its value in pair, pinned like the pairs of
+ * db_scan_next(). Returns 1 on success, 0 if there are no more than rank
+ * keys, and -1 if the storage engine keeps no counts. With several shards it
+ * narrows down a range of ranks in every shard at once, ranking a key of one
+ * shard in all the others at each step.
+ */
+int db_select(long rank, db_pair_t *pair);
+
+/**
+ * The line that ends every response to a scan command, whether it comes after
+ * one "<key> <value>" line per pair found or after "ill-formed command". Pair
+ * lines have two words, so this one, with three, is never mistaken for one.
+ */
+#define DB_SCAN_END "end of scan"
+
+/**
+ * db_is_scan() returns nonzero if a command starting with c is a scan
+ * command: 'r' followed by the first key of a range, the first key past it
+ * and optionally the most pairs to return, or 'p' followed by a key prefix
+ * and optionally the most pairs to return.
+ */
+int db_is_scan(char c);
+
+/**
+ * interpret_scan() interprets the scan command of command_len bytes at
+ * command, which is tokenized like any other command, and sets up scan for
+ * it. Returns 1 on success and 0 if the command is ill-formed: it lacks a key,
+ * or has a limit that is not a number. Words after the limit are ignored.
+ */
+int interpret_scan(const char *command, size_t command_len, db_scan_t *scan);
 
 /**
  * The interpret_command() function gets called by the server to interpret a
  * command from a client, call database functions, and store the response.
+ * The responses to a batch command (see interpret_batch()) are stored one
+ * per line, as are the pairs a scan command finds, as far as they fit, and
+ * the DB_SCAN_END line after them.
+ */
+void interpret_command(const char *command, char *response, int resp_capacity);
+
+/**
+ * interpret_command_pinned() works like interpret_command() on the command_len
+ * bytes at command, which need not be NUL-terminated (a NUL still ends the
+ * command), except that a query that finds its key leaves response empty and
+ * returns the value pinned in *pinned instead (see db_query_pin()), for the
+ * caller to send straight from the database and then release. For every
+ * other command pinned->data is set to NULL. The command is parsed in place,
+ * without copying it or its tokens.
+ */
+void interpret_command_pinned(const char *command, size_t command_len,
+                              char *response, int resp_capacity,
+                              db_value_t *pinned);
+
+/**
+ * The responses to a batch command, in the order of its keys: the value
+ * pinned in pinned[i] for a query that found its key, response[i] otherwise.
+ */
+typedef struct db_batch {
+    int n;
+    const char *response[DB_BATCH_MAX];
+    db_value_t pinned[DB_BATCH_MAX];
+} db_batch_t;
+
+/**
+ * db_is_batch() returns nonzero if a command starting with c is a batch
+ * command: 'Q' followed by keys to query, 'A' by key/value pairs to add, or
+ * 'D' by keys to remove, up to DB_BATCH_MAX of them on one line.
+ */
+int db_is_batch(char c);
+
+/**
+ * interpret_batch() interprets the batch command of command_len bytes at
+ * command, which is tokenized like any other command, and stores its
+ * responses in batch: one per key, exactly what the single-key command ('q',
+ * 'a' or 'd') would have answered, with the values of queries pinned like
+ * interpret_command_pinned() does. The keys go to the database together (see
+ * db_query_batch()). A batch without keys, with a key but no value, or with
+ * more than DB_BATCH_MAX keys gets the single response "ill-formed command".
+ */
+void interpret_batch(const char *command, size_t command_len,
+                     db_batch_t *batch);
+
+/**
+ * db_load() runs the commands in the file named filename, silently, like "f
+ * <file>" does, and returns 0, or -1 if the file cannot be opened. The file
+ * is mapped and cut at line ends into pieces that threads parse at the same
+ * time. Every other line runs in its place through interpret_command(), but
+ * consecutive adds are gathered, up to 65536 of them: they are sorted by key
+ * in parallel, rid of repeated keys (the first add of a key counts), and
+ * every shard takes its part at once, from a thread of its own, through the
+ * engine's insert_sorted() where it has one. So the adds of such a run may
+ * show to other clients in any order. A file that cannot be mapped, such as
+ * a pipe, is read line by line instead.
+ */
+int db_load(const char *filename);
+
+/**
+ * db_load_start() starts running the file named filename like db_load() in
+ * a thread of its own and returns the load's number, counting from 1, or -1
+ * if the file cannot be opened or the thread not be started. db_cleanup()
+ * stops the loads still running.
+ */
+long db_load_start(const char *filename);
+
+/**
+ * db_load_progress() stores in *done how many lines the load numbered id has
+ * run, and in *total how many lines its file has (0 until it has been parsed,
+ * or if it is read line by line). Returns 1 while the load runs, 0 once it is
+ * over and -1 if there is no such load.
  */
-void interpret_command(char *command, char *response, int resp_capacity);
+int db_load_progress(long id, unsigned long *done, unsigned long *total);
 
 /**
- * The db_print() function performs a pre-order traversal of the tree, printing
- * each node's representation and then recursively printing its left and right
- * subtrees. It will attempt to print to a file with the given filename, or
- * stdout if none is provided. Returns 0 on success or -1 on failure (invalid
- * file)
+ * The db_print() function prints the database as a tree: each node's
+ * representation, then recursively its left and right subtrees. The binary
+ * tree is printed as it is; if the database is split into several shards, or
+ * kept in a structure other than the binary tree, its pairs are printed in
+ * the same format as one balanced tree. It will attempt to print to a file
+ * with the given filename, or stdout if none is provided. Returns 0 on
+ * success or -1 on failure (invalid file)
  */
 int db_print(char *filename);
 
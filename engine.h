@@ -0,0 +1,107 @@
+#ifndef ENGINE_H_
+#define ENGINE_H_
+
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * The interface between db.c and the data structures that can hold the pairs
+ * of the database (the "storage engines"). Every engine provides one table of
+ * operations below; db.c picks a table at startup and keeps one instance of
+ * the engine per shard, passing the instance's state to every operation, so
+ * the rest of the server never knows which data structure is in use.
+ *
+ * All operations except the constructor and the destructor may be called
+ * concurrently from any number of threads. lookup(), scan() and select()
+ * must be called inside an epoch (see epoch.h): the strings they hand out
+ * stay valid until the matching epoch_exit(), even if their pair is removed
+ * meanwhile.
+ *
+ * Keys and values come in as a pointer and a length, straight from wherever
+ * the caller found them (a connection's input, say), and need not be
+ * NUL-terminated; they never contain a NUL byte. The copies the engines keep,
+ * and hand out, are NUL-terminated.
+ */
+
+// constructor flags; engines ignore those that do not apply to them
+#define ENGINE_HASH_INDEX 1  // keep a hash index for point queries
+#define ENGINE_HUGE_PAGES 2  // back node memory with huge pages
+
+/* Called by scan() for every pair; a nonzero return stops the scan. */
+typedef int (*engine_visit_t)(const char *key, const char *value, void *arg);
+
+typedef struct engine_ops {
+    // the name the engine is selected by
+    const char *name;
+    // Creates an empty instance with the given ENGINE_* flags. Returns NULL
+    // on failure.
+    void *(*constructor)(unsigned int flags);
+    // Frees an instance and every pair in it. Only called when no other
+    // thread is using the instance.
+    void (*destructor)(void *state);
+    // Returns the value stored under key, or NULL if there is none.
+    const char *(*lookup)(void *state, const char *key, size_t key_len);
+    // Looks up the n keys at keys[i], key_lens[i] bytes each, storing their
+    // values, or NULL, in values[i]. NULL if the engine has no faster way
+    // than calling lookup() for every key.
+    void (*lookup_batch)(void *state, const char *const *keys,
+                         const size_t *key_lens, int n, const char **values);
+    // Adds the pair (key, value). Returns 1 on success and 0 if key is
+    // already there or memory ran out.
+    int (*insert)(void *state, const char *key, size_t key_len,
+                  const char *value, size_t value_len);
+    // Adds the n pairs (keys[i], values[i]), given in ascending key order
+    // with no key twice, skipping those whose key is already there, and
+    // returns how many it added. NULL if the engine has no faster way than
+    // calling insert() for every pair.
+    unsigned long (*insert_sorted)(void *state, const char *const *keys,
+                                   const size_t *key_lens,
+                                   const char *const *values,
+                                   const size_t *value_lens, size_t n);
+    // Removes key. Returns 1 on success and 0 if it is not there.
+    int (*remove)(void *state, const char *key, size_t key_len);
+    // Removes every key from start on, up to but not including end (or up
+    // to the last key if end is NULL), and returns how many there were. NULL
+    // if the engine has no faster way than removing the keys one by one.
+    unsigned long (*remove_range)(void *state, const char *start,
+                                  size_t start_len, const char *end,
+                                  size_t end_len);
+    // Calls fn on every pair whose key is not smaller than the start_len
+    // bytes at start, in ascending key order, stopping early if fn returns
+    // nonzero, and returns what fn last returned (or 0). The engine goes
+    // straight to start instead of walking the pairs before it.
+    int (*scan)(void *state, const char *start, size_t start_len,
+                engine_visit_t fn, void *arg);
+    // Returns the number of keys smaller than the key_len bytes at key, or
+    // the number of keys if key is NULL. NULL if the engine keeps no counts
+    // to answer this in O(log n) with, in which case select() is NULL too.
+    unsigned long (*rank)(void *state, const char *key, size_t key_len);
+    // Returns the key whose rank() is rank and stores its value in *value,
+    // or returns NULL if there are no more than rank keys.
+    const char *(*select)(void *state, unsigned long rank, const char **value);
+    // Prints the instance in its own tree format, as described for db_print()
+    // in db.h. NULL if the engine has no tree of that shape to print, in which
+    // case db.c prints its pairs as a balanced tree instead.
+    void (*print)(void *state, FILE *out);
+} engine_ops_t;
+
+/*
+ * Compares the key of key_len bytes at key with the NUL-terminated string s,
+ * like strcmp().
+ */
+static inline int engine_key_cmp(const char *key, size_t key_len,
+                                 const char *s)
+{
+    int cmp = strncmp(key, s, key_len);
+    if (cmp != 0)
+        return cmp;
+    return s[key_len] == '\0' ? 0 : -1;
+}
+
+// the engines there are; see bst.h, bptree.h, art.h and skiplist.h
+extern const engine_ops_t bst_engine;
+extern const engine_ops_t bptree_engine;
+extern const engine_ops_t art_engine;
+extern const engine_ops_t skiplist_engine;
+
+#endif  // ENGINE_H_
@@ -0,0 +1,227 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "./epoch.h"
+
+// how many retires a thread does between attempts to advance the epoch
+#define EPOCH_ADVANCE_PERIOD 64
+
+typedef struct retired {
+    void *ptr;
+    void (*destructor)(void *);
+    unsigned long epoch;  // global epoch at the time of retirement
+} retired_t;
+
+/*
+ * Per-thread reclamation state. Records are never freed; a record released by
+ * an exiting thread is reused by the next thread that needs one. Each record
+ * sits on its own cache line so that announcing an epoch never bounces a line
+ * that another thread is writing.
+ */
+typedef struct epoch_rec {
+    // (epoch << 1) | 1 while inside a read-side section, 0 otherwise
+    unsigned long local;
+    int nesting;
+    int in_use;
+    struct epoch_rec *next;
+
+    retired_t *limbo;
+    size_t nlimbo;
+    size_t cap;
+} __attribute__((aligned(64))) epoch_rec_t;
+
+static unsigned long global_epoch = 1;
+static epoch_rec_t *rec_list;
+
+// retired memory left behind by threads that exited before it could be freed
+static retired_t *orphans;
+static size_t norphans;
+static size_t orphans_cap;
+static pthread_mutex_t orphan_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t rec_key;
+static pthread_once_t rec_key_once = PTHREAD_ONCE_INIT;
+static __thread epoch_rec_t *my_rec;
+
+//------------------------------------------------------------------------------------------------
+// Helpers
+
+/* Appends an entry to a growable array of retired pointers. */
+static void limbo_push(retired_t **arr, size_t *n, size_t *cap, retired_t item)
+{
+    if (*n == *cap)
+    {
+        size_t new_cap = (*cap == 0) ? EPOCH_ADVANCE_PERIOD : *cap * 2;
+        retired_t *grown = realloc(*arr, new_cap * sizeof(retired_t));
+        if (grown == NULL)
+        {
+            perror("realloc");
+            exit(1);
+        }
+        *arr = grown;
+        *cap = new_cap;
+    }
+    (*arr)[(*n)++] = item;
+}
+
+/* Destroys the entries of arr that were retired at least two epochs before
+ * global and compacts the rest to the front. */
+static void limbo_collect(retired_t *arr, size_t *n, unsigned long global)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < *n; i++)
+    {
+        if (arr[i].epoch + 2 <= global)
+            arr[i].destructor(arr[i].ptr);
+        else
+            arr[kept++] = arr[i];
+    }
+    *n = kept;
+}
+
+/* Thread-exit hook: hands the exiting thread's pending retires to the orphan
+ * list and releases its record for reuse. */
+static void rec_release(void *arg)
+{
+    epoch_rec_t *rec = (epoch_rec_t *)arg;
+
+    pthread_mutex_lock(&orphan_mutex);
+    for (size_t i = 0; i < rec->nlimbo; i++)
+        limbo_push(&orphans, &norphans, &orphans_cap, rec->limbo[i]);
+    pthread_mutex_unlock(&orphan_mutex);
+    rec->nlimbo = 0;
+
+    rec->nesting = 0;
+    __atomic_store_n(&rec->local, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&rec->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void rec_key_init(void)
+{
+    int err;
+    if ((err = pthread_key_create(&rec_key, rec_release)) != 0)
+    {
+        fprintf(stderr, "pthread_key_create: %s\n", strerror(err));
+        exit(1);
+    }
+}
+
+/* Returns the calling thread's record, claiming one on first use. */
+static epoch_rec_t *get_rec(void)
+{
+    if (my_rec != NULL)
+        return my_rec;
+
+    pthread_once(&rec_key_once, rec_key_init);
+
+    epoch_rec_t *rec;
+    for (rec = __atomic_load_n(&rec_list, __ATOMIC_ACQUIRE); rec != NULL;
+         rec = rec->next)
+    {
+        int free_rec = 0;
+        if (__atomic_compare_exchange_n(&rec->in_use, &free_rec, 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (rec == NULL)
+    {
+        if (posix_memalign((void **)&rec, 64, sizeof(epoch_rec_t)) != 0)
+        {
+            perror("posix_memalign");
+            exit(1);
+        }
+        memset(rec, 0, sizeof(epoch_rec_t));
+        rec->in_use = 1;
+        rec->next = __atomic_load_n(&rec_list, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rec_list, &rec->next, rec, 1,
+                                            __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED))
+            ;
+    }
+
+    pthread_setspecific(rec_key, rec);
+    my_rec = rec;
+    return rec;
+}
+
+/* Moves the global epoch forward if every active thread has observed the
+ * current one. Returns the (possibly new) global epoch. */
+static unsigned long try_advance(void)
+{
+    unsigned long global = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    for (epoch_rec_t *rec = __atomic_load_n(&rec_list, __ATOMIC_ACQUIRE);
+         rec != NULL; rec = rec->next)
+    {
+        unsigned long local = __atomic_load_n(&rec->local, __ATOMIC_ACQUIRE);
+        if ((local & 1) && (local >> 1) != global)
+            return global;
+    }
+
+    if (__atomic_compare_exchange_n(&global_epoch, &global, global + 1, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return global + 1;
+    return global;
+}
+
+//------------------------------------------------------------------------------------------------
+// Public interface
+
+void epoch_enter(void)
+{
+    epoch_rec_t *rec = get_rec();
+    if (rec->nesting++ > 0)
+        return;
+
+    unsigned long global = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->local, (global << 1) | 1, __ATOMIC_RELAXED);
+    // the announcement must be visible before any shared pointer is read
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void epoch_exit(void)
+{
+    epoch_rec_t *rec = my_rec;
+    if (--rec->nesting > 0)
+        return;
+
+    __atomic_store_n(&rec->local, 0, __ATOMIC_RELEASE);
+}
+
+void epoch_retire(void *ptr, void (*destructor)(void *))
+{
+    epoch_rec_t *rec = get_rec();
+    retired_t item = {ptr, destructor,
+                      __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE)};
+    limbo_push(&rec->limbo, &rec->nlimbo, &rec->cap, item);
+
+    if (rec->nlimbo % EPOCH_ADVANCE_PERIOD != 0)
+        return;
+
+    unsigned long global = try_advance();
+    limbo_collect(rec->limbo, &rec->nlimbo, global);
+
+    if (pthread_mutex_trylock(&orphan_mutex) == 0)
+    {
+        limbo_collect(orphans, &norphans, global);
+        pthread_mutex_unlock(&orphan_mutex);
+    }
+}
+
+void epoch_cleanup(void)
+{
+    for (epoch_rec_t *rec = rec_list; rec != NULL; rec = rec->next)
+    {
+        for (size_t i = 0; i < rec->nlimbo; i++)
+            rec->limbo[i].destructor(rec->limbo[i].ptr);
+        rec->nlimbo = 0;
+    }
+
+    pthread_mutex_lock(&orphan_mutex);
+    for (size_t i = 0; i < norphans; i++)
+        orphans[i].destructor(orphans[i].ptr);
+    norphans = 0;
+    pthread_mutex_unlock(&orphan_mutex);
+}
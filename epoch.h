@@ -0,0 +1,37 @@
+#ifndef EPOCH_H_
+#define EPOCH_H_
+
+/*
+ * Epoch-based memory reclamation.
+ *
+ * Threads that read shared structures without holding locks bracket those
+ * reads with epoch_enter() and epoch_exit(). Memory that has been unlinked from
+ * a shared structure is handed to epoch_retire() instead of being freed; it is
+ * only destroyed once every thread that was inside a read-side section when it
+ * was retired has left that section, so a lock-free reader can never touch
+ * freed memory.
+ */
+
+/*
+ * Starts a read-side critical section for the calling thread. Sections may
+ * nest; only the outermost one is announced to other threads.
+ */
+void epoch_enter(void);
+
+/* Ends the read-side critical section started by the matching epoch_enter(). */
+void epoch_exit(void);
+
+/*
+ * Schedules ptr to be passed to destructor once no reader can still hold a
+ * reference to it. The caller must already have unlinked ptr from every
+ * shared structure.
+ */
+void epoch_retire(void *ptr, void (*destructor)(void *));
+
+/*
+ * Destroys everything that is still waiting to be reclaimed. Only call this
+ * when no other thread is using the structures protected by epochs.
+ */
+void epoch_cleanup(void);
+
+#endif  // EPOCH_H_
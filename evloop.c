@@ -0,0 +1,574 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "./comm.h"
+#include "./db.h"
+#include "./evloop.h"
+#include "./server.h"
+
+// events an I/O thread takes from epoll at a time
+#define EVLOOP_EVENTS 64
+// connections a worker serves before answering any, when changes are logged
+#define EVLOOP_GROUP 64
+
+/* A client connection. */
+typedef struct conn {
+    int fd;
+    int epfd;     // the epoll instance of the I/O thread that accepted it
+    int eof;      // the client has closed its end
+    int closing;  // set by evloop_close_all(); accessed atomically
+    // input and queued responses; NULL while the connection is idle
+    comm_buf_t *buf;
+    // responses the socket could not take yet, from pending_off on
+    char *pending;
+    size_t pending_len;
+    size_t pending_off;
+    // for the list of all connections
+    struct conn *prev;
+    struct conn *next;
+    // for the workers' queue
+    struct conn *next_ready;
+} conn_t;
+
+/* A connection buffer on the free list. */
+typedef struct pool_buf {
+    comm_buf_t buf;
+    struct pool_buf *next;
+} pool_buf_t;
+
+typedef struct io_thread {
+    pthread_t thread;
+    int epfd;
+} io_thread_t;
+
+static int listen_fd = -1;
+// written once to make every I/O thread return
+static int stop_fd = -1;
+static io_thread_t *io_threads;
+static int num_io_threads;
+static pthread_t *workers;
+static int num_workers;
+
+// every open connection
+static conn_t *conns;
+static pthread_mutex_t conns_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// connections with commands to serve, oldest first
+static conn_t *ready_head;
+static conn_t *ready_tail;
+static int stopping;
+static pthread_mutex_t ready_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready_cond = PTHREAD_COND_INITIALIZER;
+
+// buffers of connections that went idle, for reuse
+static pool_buf_t *pool;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//------------------------------------------------------------------------------------------------
+// Buffers
+
+static comm_buf_t *buf_get(void)
+{
+    pthread_mutex_lock(&pool_mutex);
+    pool_buf_t *pb = pool;
+    if (pb != NULL)
+        pool = pb->next;
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (pb == NULL && (pb = malloc(sizeof(pool_buf_t))) == NULL)
+    {
+        perror("malloc");
+        return NULL;
+    }
+    comm_buf_init(&pb->buf);
+    return &pb->buf;
+}
+
+static void buf_put(comm_buf_t *buf)
+{
+    pool_buf_t *pb = (pool_buf_t *)buf;
+    pthread_mutex_lock(&pool_mutex);
+    pb->next = pool;
+    pool = pb;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+//------------------------------------------------------------------------------------------------
+// Connections
+
+static void conn_close(conn_t *conn)
+{
+    pthread_mutex_lock(&conns_mutex);
+    if (conn->prev != NULL)
+        conn->prev->next = conn->next;
+    else
+        conns = conn->next;
+    if (conn->next != NULL)
+        conn->next->prev = conn->prev;
+    pthread_mutex_unlock(&conns_mutex);
+
+    COMM_SYSCALL();
+    if (close(conn->fd) < 0)
+        perror("close");
+    if (conn->buf != NULL)
+        buf_put(conn->buf);
+    free(conn->pending);
+    free(conn);
+    fprintf(stderr, "client connection terminated\n");
+
+    client_count_remove();
+}
+
+/* Hands the connection back to its epoll instance until events happens. */
+static void conn_arm(conn_t *conn, unsigned int events)
+{
+    struct epoll_event ev;
+    ev.events = events | EPOLLONESHOT;
+    ev.data.ptr = conn;
+    COMM_SYSCALL();
+    if (epoll_ctl(conn->epfd, EPOLL_CTL_MOD, conn->fd, &ev) < 0)
+    {
+        perror("epoll_ctl");
+        conn_close(conn);
+    }
+}
+
+/* Queues the connection for a worker. */
+static void conn_dispatch(conn_t *conn)
+{
+    conn->next_ready = NULL;
+    pthread_mutex_lock(&ready_mutex);
+    if (ready_tail != NULL)
+        ready_tail->next_ready = conn;
+    else
+        ready_head = conn;
+    ready_tail = conn;
+    pthread_cond_signal(&ready_cond);
+    pthread_mutex_unlock(&ready_mutex);
+}
+
+/*
+ * Decides what happens to a connection that nobody is serving and that has
+ * nothing left to send: serve it, close it, or wait for more input.
+ */
+static void conn_continue(conn_t *conn)
+{
+    if (__atomic_load_n(&conn->closing, __ATOMIC_RELAXED))
+    {
+        conn_close(conn);
+        return;
+    }
+    if (comm_has_command(conn->buf, conn->eof))
+    {
+        conn_dispatch(conn);
+        return;
+    }
+    if (conn->eof)
+    {
+        conn_close(conn);
+        return;
+    }
+    if (conn->buf->in_start == conn->buf->in_end)
+    {
+        buf_put(conn->buf);
+        conn->buf = NULL;
+    }
+    conn_arm(conn, EPOLLIN);
+}
+
+/* Reads whatever input the socket holds, as far as the buffer takes it.
+ * Returns -1 if the connection failed. */
+static int conn_read(conn_t *conn)
+{
+    comm_buf_t *buf = conn->buf;
+    if (buf->in_start > 0)
+    {
+        memmove(buf->in, buf->in + buf->in_start, buf->in_end - buf->in_start);
+        buf->in_end -= buf->in_start;
+        buf->in_start = 0;
+    }
+
+    while (buf->in_end < COMM_INLEN)
+    {
+        COMM_SYSCALL();
+        ssize_t n = read(conn->fd, buf->in + buf->in_end,
+                         COMM_INLEN - buf->in_end);
+        if (n > 0)
+        {
+            buf->in_end += n;
+        }
+        else if (n == 0)
+        {
+            conn->eof = 1;
+            return 0;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            return 0;
+        }
+        else if (errno != EINTR)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Sends as much of the pending responses as the socket takes. Returns 0 once
+ * they are all sent, 1 if some are left and -1 if the connection failed. */
+static int conn_send_pending(conn_t *conn)
+{
+    while (conn->pending_off < conn->pending_len)
+    {
+        COMM_SYSCALL();
+        ssize_t n = send(conn->fd, conn->pending + conn->pending_off,
+                         conn->pending_len - conn->pending_off,
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 1;
+        if (n < 0)
+            return -1;
+        conn->pending_off += n;
+    }
+    free(conn->pending);
+    conn->pending = NULL;
+    conn->pending_len = 0;
+    conn->pending_off = 0;
+    return 0;
+}
+
+/* Handles an epoll event on a connection, in its I/O thread. */
+static void conn_event(conn_t *conn)
+{
+    if (conn->pending != NULL)
+    {
+        int ret = conn_send_pending(conn);
+        if (ret < 0)
+        {
+            conn_close(conn);
+            return;
+        }
+        if (ret > 0)
+        {
+            conn_arm(conn, EPOLLOUT);
+            return;
+        }
+    }
+
+    if (conn->buf == NULL && (conn->buf = buf_get()) == NULL)
+    {
+        conn_close(conn);
+        return;
+    }
+    if (!conn->eof && conn_read(conn) < 0)
+    {
+        conn_close(conn);
+        return;
+    }
+    conn_continue(conn);
+}
+
+/*
+ * Serves every command buffered on the connection, in a worker, leaving their
+ * responses for conn_respond() to send. Stops early if the socket cannot take
+ * the responses, leaving the rest of the commands until it can. Returns what
+ * conn_respond() takes.
+ */
+static int conn_serve(conn_t *conn)
+{
+    comm_buf_t *buf = conn->buf;
+    comm_cmd_t command;
+    int ret = 0;
+
+    while (ret == 0)
+    {
+        if (comm_buf_full(buf))
+        {
+            ret = comm_flush(conn->fd, buf, &conn->pending, &conn->pending_len);
+            if (ret != 0)
+                break;
+        }
+        int found = comm_next_command(buf, &command, conn->eof);
+        if (found <= 0)
+        {
+            ret = found;
+            break;
+        }
+        if (client_control_wait_unless(&conn->closing))
+        {
+            ret = -1;
+            break;
+        }
+        comm_execute(buf, &command);
+    }
+    return ret;
+}
+
+/* Sends the responses conn_serve() left, which returned ret, and decides
+ * what happens to the connection next. */
+static void conn_respond(conn_t *conn, int ret)
+{
+    comm_buf_t *buf = conn->buf;
+
+    // this also releases the values pinned in this thread if the connection
+    // is going away
+    if (ret == 0)
+        ret = comm_flush(conn->fd, buf, &conn->pending, &conn->pending_len);
+    else
+        comm_flush(conn->fd, buf, NULL, NULL);
+
+    if (ret < 0)
+        conn_close(conn);
+    else if (ret > 0)
+        conn_arm(conn, EPOLLOUT);
+    else
+        conn_continue(conn);
+}
+
+//------------------------------------------------------------------------------------------------
+// Threads
+
+/* Accepts every pending connection into the I/O thread's epoll instance. */
+static void accept_all(io_thread_t *io)
+{
+    while (1)
+    {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        COMM_SYSCALL();
+        int fd = accept(listen_fd, (struct sockaddr *)&client_addr,
+                        &client_len);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept");
+            return;
+        }
+        COMM_SYSCALL();
+        if (stop_accepting || fcntl(fd, F_SETFL, O_NONBLOCK) < 0)
+        {
+            close(fd);
+            continue;
+        }
+
+        fprintf(stderr, "received connection from %s#%hu\n",
+                inet_ntoa(client_addr.sin_addr), client_addr.sin_port);
+
+        conn_t *conn = calloc(1, sizeof(conn_t));
+        if (conn == NULL)
+        {
+            perror("calloc");
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->epfd = io->epfd;
+
+        client_count_add();
+
+        pthread_mutex_lock(&conns_mutex);
+        conn->next = conns;
+        if (conns != NULL)
+            conns->prev = conn;
+        conns = conn;
+        pthread_mutex_unlock(&conns_mutex);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.ptr = conn;
+        COMM_SYSCALL();
+        if (epoll_ctl(io->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        {
+            perror("epoll_ctl");
+            conn_close(conn);
+        }
+    }
+}
+
+static void *io_main(void *arg)
+{
+    io_thread_t *io = (io_thread_t *)arg;
+    struct epoll_event events[EVLOOP_EVENTS];
+
+    while (1)
+    {
+        COMM_SYSCALL();
+        int n = epoll_wait(io->epfd, events, EVLOOP_EVENTS, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            exit(1);
+        }
+        for (int i = 0; i < n; i++)
+        {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &stop_fd)
+                return NULL;
+            else if (ptr == &listen_fd)
+                accept_all(io);
+            else
+                conn_event((conn_t *)ptr);
+        }
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    (void)arg;
+    // With a write-ahead log, a worker takes every queued connection, up to
+    // EVLOOP_GROUP, and serves them all before answering any, so that the
+    // changes they make are synced to disk together (see db_sync()).
+    int most = db_wal_enabled() ? EVLOOP_GROUP : 1;
+    conn_t *group[EVLOOP_GROUP];
+    int rets[EVLOOP_GROUP];
+    while (1)
+    {
+        pthread_mutex_lock(&ready_mutex);
+        while (ready_head == NULL && !stopping)
+            pthread_cond_wait(&ready_cond, &ready_mutex);
+        if (ready_head == NULL)
+        {
+            pthread_mutex_unlock(&ready_mutex);
+            return NULL;
+        }
+        int n = 0;
+        while (n < most && ready_head != NULL)
+        {
+            group[n++] = ready_head;
+            ready_head = ready_head->next_ready;
+        }
+        if (ready_head == NULL)
+            ready_tail = NULL;
+        pthread_mutex_unlock(&ready_mutex);
+
+        for (int i = 0; i < n; i++)
+            rets[i] = conn_serve(group[i]);
+        for (int i = 0; i < n; i++)
+            conn_respond(group[i], rets[i]);
+    }
+}
+
+//------------------------------------------------------------------------------------------------
+// Public interface
+
+int evloop_start(int port, int io_count, int worker_count)
+{
+    comm_raise_fd_limit();
+    listen_fd = comm_listen(port, SOMAXCONN);
+    if (fcntl(listen_fd, F_SETFL, O_NONBLOCK) < 0 ||
+        (stop_fd = eventfd(0, EFD_CLOEXEC)) < 0)
+    {
+        perror("evloop_start");
+        return -1;
+    }
+
+    io_threads = calloc(io_count, sizeof(io_thread_t));
+    workers = calloc(worker_count, sizeof(pthread_t));
+    if (io_threads == NULL || workers == NULL)
+    {
+        perror("calloc");
+        return -1;
+    }
+
+    int err;
+    for (; num_workers < worker_count; num_workers++)
+    {
+        if ((err = pthread_create(&workers[num_workers], 0, worker_main,
+                                  NULL)) != 0)
+            handle_error_en(err, "pthread_create");
+    }
+    for (; num_io_threads < io_count; num_io_threads++)
+    {
+        io_thread_t *io = &io_threads[num_io_threads];
+        if ((io->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        {
+            perror("epoll_create1");
+            return -1;
+        }
+
+        // each connection wakes only one of the I/O threads
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = &listen_fd;
+        if (epoll_ctl(io->epfd, EPOLL_CTL_ADD, listen_fd, &ev) < 0)
+        {
+            perror("epoll_ctl");
+            return -1;
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = &stop_fd;
+        if (epoll_ctl(io->epfd, EPOLL_CTL_ADD, stop_fd, &ev) < 0)
+        {
+            perror("epoll_ctl");
+            return -1;
+        }
+
+        if ((err = pthread_create(&io->thread, 0, io_main, io)) != 0)
+            handle_error_en(err, "pthread_create");
+    }
+
+    fprintf(stderr, "listening on port %d (%d I/O threads, %d workers)\n",
+            port, io_count, worker_count);
+    return 0;
+}
+
+void evloop_close_all(void)
+{
+    pthread_mutex_lock(&conns_mutex);
+    for (conn_t *conn = conns; conn != NULL; conn = conn->next)
+    {
+        // whoever holds the connection sees the flag or the dead socket and
+        // closes it
+        __atomic_store_n(&conn->closing, 1, __ATOMIC_RELAXED);
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&conns_mutex);
+}
+
+void evloop_stop(void)
+{
+    unsigned long long one = 1;
+    if (write(stop_fd, &one, sizeof(one)) < 0)
+        perror("write");
+    for (int i = 0; i < num_io_threads; i++)
+    {
+        pthread_join(io_threads[i].thread, NULL);
+        close(io_threads[i].epfd);
+    }
+
+    pthread_mutex_lock(&ready_mutex);
+    stopping = 1;
+    pthread_cond_broadcast(&ready_cond);
+    pthread_mutex_unlock(&ready_mutex);
+    for (int i = 0; i < num_workers; i++)
+        pthread_join(workers[i], NULL);
+
+    close(stop_fd);
+    close(listen_fd);
+    free(io_threads);
+    free(workers);
+
+    while (pool != NULL)
+    {
+        pool_buf_t *next = pool->next;
+        free(pool);
+        pool = next;
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef EVLOOP_H_
+#define EVLOOP_H_
+
+/*
+ * The server's event-driven connection handling, an alternative to one
+ * thread per client (see run_client() in server.c).
+ *
+ * A few I/O threads each wait on an epoll instance of their own for the
+ * sockets of the connections they accepted. Whenever a connection has input,
+ * the I/O thread reads what is there and, once a whole command is buffered,
+ * hands the connection to a fixed pool of worker threads, which serve every
+ * buffered command in order and send the responses back together (see
+ * comm_serve() in comm.h). A connection is armed in epoll, queued for a
+ * worker or being served, never two at once, so its commands run one after
+ * another as they would in a client thread. Idle connections hold no buffers,
+ * so thousands of them cost little more than their sockets.
+ *
+ * Connections are counted in sv_ctrl.num_client_threads like client threads
+ * (see client_count_add()), workers honour client_control_stop(), and
+ * delete_all() closes every connection through evloop_close_all().
+ */
+
+/*
+ * Starts listening on port, with io_threads I/O threads and workers worker
+ * threads. Returns -1 if the threads could not be set up.
+ */
+int evloop_start(int port, int io_threads, int workers);
+
+/*
+ * Closes every connection. Commands already received but not served yet are
+ * dropped; workers stopped by client_control_stop() let go of theirs once
+ * client_control_wake() is called.
+ */
+void evloop_close_all(void);
+
+/* Stops and joins every thread of the event loop and the listening socket. */
+void evloop_stop(void);
+
+#endif  // EVLOOP_H_
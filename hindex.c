@@ -0,0 +1,310 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "./engine.h"
+#include "./epoch.h"
+#include "./hindex.h"
+
+// number of lock stripes; a power of two
+#define HINDEX_STRIPES 64
+// initial number of buckets; a power of two, at least HINDEX_STRIPES
+#define HINDEX_INITIAL_BUCKETS 1024
+// average chain length at which the table is grown
+#define HINDEX_LOAD_FACTOR 2
+// old buckets moved to the new table by each update during a resize
+#define HINDEX_MIGRATE_BATCH 8
+// failed lookups before a reader starts yielding the CPU
+#define HINDEX_SPINS 8
+
+/*
+ * Chains are intrusive: they are linked through the nodes' hnext fields, so
+ * indexing a node never allocates.
+ */
+typedef struct htable {
+    size_t nbuckets;  // a power of two
+
+    // progress of draining this table into its successor during a resize
+    size_t migrate_next;  // next bucket to be claimed for moving
+    size_t migrated;      // buckets that have been moved
+
+    node_t *buckets[];
+} htable_t;
+
+/*
+ * Every bucket belongs to the stripe given by the low bits of its index. Since
+ * tables never have fewer buckets than there are stripes, an entry belongs to
+ * the same stripe in the old and in the new table during a resize.
+ */
+typedef struct stripe {
+    pthread_mutex_t mutex;
+    unsigned int seq;  // odd while the stripe is being modified
+    long count;        // entries in this stripe, guarded by mutex
+} __attribute__((aligned(64))) stripe_t;
+
+struct hindex {
+    htable_t *cur;  // table that new entries go to
+    htable_t *old;  // table being drained into cur, or NULL
+    pthread_mutex_t resize_mutex;
+
+    stripe_t stripes[HINDEX_STRIPES];
+};
+
+//------------------------------------------------------------------------------------------------
+// Helpers
+
+/* 64-bit FNV-1a hash of the len bytes of key. */
+static unsigned long hash_key(const char *key, size_t len)
+{
+    unsigned long h = 14695981039346656037ul;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)key[i];
+        h *= 1099511628211ul;
+    }
+    return h;
+}
+
+static htable_t *htable_constructor(size_t nbuckets)
+{
+    htable_t *table =
+        calloc(1, sizeof(htable_t) + nbuckets * sizeof(node_t *));
+    if (table == NULL)
+        return NULL;
+    table->nbuckets = nbuckets;
+    return table;
+}
+
+static void htable_reclaim(void *table)
+{
+    free(table);
+}
+
+static inline node_t **bucket_of(htable_t *table, unsigned long hash)
+{
+    return &table->buckets[hash & (table->nbuckets - 1)];
+}
+
+static inline stripe_t *stripe_of(hindex_t *idx, unsigned long hash)
+{
+    return &idx->stripes[hash & (HINDEX_STRIPES - 1)];
+}
+
+/* Locks a stripe and marks it as being modified, so lookups on it retry. */
+static void stripe_lock(stripe_t *stripe)
+{
+    pthread_mutex_lock(&stripe->mutex);
+    __atomic_store_n(&stripe->seq, stripe->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void stripe_unlock(stripe_t *stripe)
+{
+    __atomic_store_n(&stripe->seq, stripe->seq + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&stripe->mutex);
+}
+
+/* Unlinks node from the chain at *bucket. Returns 1 on success or 0 if it is
+ * not in this chain. The stripe must be locked. */
+static int chain_unlink(node_t **bucket, node_t *node)
+{
+    for (node_t **link = bucket; *link != NULL; link = &(*link)->hnext)
+    {
+        if (*link == node)
+        {
+            __atomic_store_n(link, node->hnext, __ATOMIC_RELEASE);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Lock-free search of the chain at *bucket; see hindex_lookup(). */
+static node_t *chain_find(node_t **bucket, unsigned long hash, const char *key,
+                          size_t len)
+{
+    for (node_t *node = __atomic_load_n(bucket, __ATOMIC_ACQUIRE); node != NULL;
+         node = __atomic_load_n(&node->hnext, __ATOMIC_ACQUIRE))
+    {
+        if (node->hash == hash && engine_key_cmp(key, len, node->key) == 0)
+            return node;
+    }
+    return NULL;
+}
+
+/* Moves every node of bucket i of the old table into the current one. */
+static void migrate_bucket(hindex_t *idx, htable_t *old, size_t i)
+{
+    stripe_t *stripe = &idx->stripes[i & (HINDEX_STRIPES - 1)];
+    htable_t *cur = __atomic_load_n(&idx->cur, __ATOMIC_ACQUIRE);
+
+    stripe_lock(stripe);
+    node_t *node = old->buckets[i];
+    while (node != NULL)
+    {
+        node_t *next = node->hnext;
+        node_t **dest = bucket_of(cur, node->hash);
+        // Relinking in place is safe for concurrent lookups: a node is on
+        // exactly one chain at any time, and the stripe's sequence counter
+        // makes a lookup that followed a moved node retry.
+        __atomic_store_n(&old->buckets[i], next, __ATOMIC_RELEASE);
+        __atomic_store_n(&node->hnext, *dest, __ATOMIC_RELAXED);
+        __atomic_store_n(dest, node, __ATOMIC_RELEASE);
+        node = next;
+    }
+    stripe_unlock(stripe);
+}
+
+/*
+ * Does a share of an ongoing resize: claims a few buckets of the old table and
+ * moves them over. Whoever moves the last bucket retires the old table. Must
+ * be called inside an epoch, and not with a stripe locked.
+ */
+static void migrate_some(hindex_t *idx)
+{
+    htable_t *old = __atomic_load_n(&idx->old, __ATOMIC_ACQUIRE);
+    if (old == NULL)
+        return;
+
+    for (int n = 0; n < HINDEX_MIGRATE_BATCH; n++)
+    {
+        size_t i = __atomic_fetch_add(&old->migrate_next, 1, __ATOMIC_ACQ_REL);
+        if (i >= old->nbuckets)
+            return;
+
+        migrate_bucket(idx, old, i);
+        if (__atomic_add_fetch(&old->migrated, 1, __ATOMIC_ACQ_REL) ==
+            old->nbuckets)
+        {
+            pthread_mutex_lock(&idx->resize_mutex);
+            __atomic_store_n(&idx->old, NULL, __ATOMIC_RELEASE);
+            pthread_mutex_unlock(&idx->resize_mutex);
+            epoch_retire(old, htable_reclaim);
+            return;
+        }
+    }
+}
+
+/* Installs a table twice the size of the current one, unless a resize is
+ * already under way. The entries are moved over later by migrate_some(). */
+static void start_resize(hindex_t *idx)
+{
+    if (pthread_mutex_trylock(&idx->resize_mutex) != 0)
+        return;
+
+    htable_t *cur = idx->cur;
+    htable_t *grown;
+    if (__atomic_load_n(&idx->old, __ATOMIC_ACQUIRE) == NULL &&
+        (grown = htable_constructor(cur->nbuckets * 2)) != NULL)
+    {
+        // Lookups read cur before old, so publishing old first guarantees
+        // that a lookup which sees the new table also sees the old one.
+        __atomic_store_n(&idx->old, cur, __ATOMIC_RELEASE);
+        __atomic_store_n(&idx->cur, grown, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&idx->resize_mutex);
+}
+
+//------------------------------------------------------------------------------------------------
+// Public interface
+
+hindex_t *hindex_constructor(void)
+{
+    hindex_t *idx;
+    if (posix_memalign((void **)&idx, 64, sizeof(hindex_t)) != 0)
+        return NULL;
+    memset(idx, 0, sizeof(hindex_t));
+
+    if ((idx->cur = htable_constructor(HINDEX_INITIAL_BUCKETS)) == NULL)
+    {
+        free(idx);
+        return NULL;
+    }
+    pthread_mutex_init(&idx->resize_mutex, NULL);
+    for (int i = 0; i < HINDEX_STRIPES; i++)
+    {
+        pthread_mutex_init(&idx->stripes[i].mutex, NULL);
+    }
+    return idx;
+}
+
+void hindex_destructor(hindex_t *idx)
+{
+    free(idx->cur);
+    free(idx->old);
+    pthread_mutex_destroy(&idx->resize_mutex);
+    for (int i = 0; i < HINDEX_STRIPES; i++)
+    {
+        pthread_mutex_destroy(&idx->stripes[i].mutex);
+    }
+    free(idx);
+}
+
+void hindex_insert(hindex_t *idx, node_t *node)
+{
+    node->hash = hash_key(node->key, strlen(node->key));
+
+    // the tables can be retired under us by a concurrent resize
+    epoch_enter();
+    stripe_t *stripe = stripe_of(idx, node->hash);
+    stripe_lock(stripe);
+    htable_t *cur = __atomic_load_n(&idx->cur, __ATOMIC_ACQUIRE);
+    node_t **bucket = bucket_of(cur, node->hash);
+    node->hnext = *bucket;
+    __atomic_store_n(bucket, node, __ATOMIC_RELEASE);
+    long count = ++stripe->count;
+    stripe_unlock(stripe);
+
+    if (count > (long)(cur->nbuckets / HINDEX_STRIPES * HINDEX_LOAD_FACTOR))
+        start_resize(idx);
+    migrate_some(idx);
+    epoch_exit();
+}
+
+void hindex_remove(hindex_t *idx, node_t *node)
+{
+    stripe_t *stripe = stripe_of(idx, node->hash);
+
+    epoch_enter();
+    stripe_lock(stripe);
+    htable_t *old = __atomic_load_n(&idx->old, __ATOMIC_ACQUIRE);
+    htable_t *cur = __atomic_load_n(&idx->cur, __ATOMIC_ACQUIRE);
+    if ((old != NULL && chain_unlink(bucket_of(old, node->hash), node)) ||
+        chain_unlink(bucket_of(cur, node->hash), node))
+        stripe->count--;
+    stripe_unlock(stripe);
+
+    migrate_some(idx);
+    epoch_exit();
+}
+
+node_t *hindex_lookup(hindex_t *idx, const char *key, size_t len)
+{
+    unsigned long hash = hash_key(key, len);
+    stripe_t *stripe = stripe_of(idx, hash);
+
+    for (int attempt = 0;; attempt++)
+    {
+        unsigned int seq = __atomic_load_n(&stripe->seq, __ATOMIC_ACQUIRE);
+        if (!(seq & 1))
+        {
+            htable_t *cur = __atomic_load_n(&idx->cur, __ATOMIC_ACQUIRE);
+            htable_t *old = __atomic_load_n(&idx->old, __ATOMIC_ACQUIRE);
+
+            node_t *found = NULL;
+            if (old != NULL)
+                found = chain_find(bucket_of(old, hash), hash, key, len);
+            if (found == NULL)
+                found = chain_find(bucket_of(cur, hash), hash, key, len);
+
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&stripe->seq, __ATOMIC_RELAXED) == seq)
+                return found;
+        }
+
+        if (attempt > HINDEX_SPINS)
+            sched_yield();
+    }
+}
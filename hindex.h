@@ -0,0 +1,48 @@
+#ifndef HINDEX_H_
+#define HINDEX_H_
+
+#include "./bst.h"
+
+/*
+ * A concurrent hash index over the tree nodes, kept next to the tree so that
+ * point queries do not have to walk it. The hash chains are linked through
+ * the nodes themselves, and a node must stay in memory until it is both
+ * unlinked from the index and no lookup can still be looking at it, which
+ * epoch_retire() already guarantees for removed nodes.
+ *
+ * Updates are serialized per lock stripe; lookups take no locks at all but
+ * validate a per-stripe sequence counter and retry if an update raced with
+ * them, and must run inside an epoch (see epoch.h). The table grows
+ * incrementally: once it gets too full a table twice the size is installed
+ * and every later update moves a few buckets of the old table over, so no
+ * single operation ever rehashes the whole index.
+ */
+typedef struct hindex hindex_t;
+
+/* Creates an empty index. Returns NULL on failure. */
+hindex_t *hindex_constructor(void);
+
+/*
+ * Frees the index (not the nodes in it). Only call this when no other thread
+ * is using the index.
+ */
+void hindex_destructor(hindex_t *idx);
+
+/*
+ * Adds node to the index under its key, linking it through node->hnext. The
+ * caller guarantees that no other node with the same key is indexed, and that
+ * no other thread adds or removes the same key concurrently.
+ */
+void hindex_insert(hindex_t *idx, node_t *node);
+
+/* Removes node from the index. The same rules as for hindex_insert() apply. */
+void hindex_remove(hindex_t *idx, node_t *node);
+
+/*
+ * Returns the node indexed under the len bytes of key, or NULL if there is
+ * none. Must be called inside an epoch; the node stays valid until the
+ * matching epoch_exit().
+ */
+node_t *hindex_lookup(hindex_t *idx, const char *key, size_t len);
+
+#endif  // HINDEX_H_
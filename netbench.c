@@ -0,0 +1,524 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "./comm.h"
+
+#define LINELEN 512
+#define RECVLEN 65536
+
+/*
+ * A script loaded into memory: every line ending in a newline, or encoded as
+ * a binary request.
+ */
+typedef struct script {
+    char **lines;
+    size_t *lens;
+    size_t nlines;
+} script_t;
+
+/* A connection to the server and the commands it has in flight. */
+typedef struct conn {
+    int fd;
+    size_t sent;     // commands queued for sending so far
+    size_t done;     // commands answered so far
+    double *starts;  // when each command was queued
+    // bytes waiting to be sent, from out_off on
+    char *out;
+    size_t out_len;
+    size_t out_off;
+    size_t out_cap;
+    // the start of a binary response not received whole yet
+    char in[COMM_BIN_HEADER + BUFLEN];
+    size_t in_len;
+} conn_t;
+
+// nonzero if the commands go out as binary requests
+static int binary;
+// keys per batch command, if consecutive commands go out as batches
+static size_t batch = 1;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Encodes a text command as a binary request with the given id into frame,
+ * which takes COMM_BIN_HEADER + 2 * BUFLEN bytes. Returns its length.
+ */
+static size_t encode(const char *line, uint32_t id, char *frame)
+{
+    char key[BUFLEN] = "";
+    char value[BUFLEN] = "";
+    int opcode = COMM_BIN_HELLO;
+    switch (line[0])
+    {
+    case 'q':
+        opcode = COMM_BIN_QUERY;
+        sscanf(line + 1, "%255s", key);
+        break;
+    case 'a':
+        opcode = COMM_BIN_ADD;
+        sscanf(line + 1, "%255s %255s", key, value);
+        break;
+    case 'd':
+        opcode = COMM_BIN_DELETE;
+        sscanf(line + 1, "%255s", key);
+        break;
+    }
+
+    size_t key_len = strlen(key);
+    size_t value_len = strlen(value);
+    unsigned char *h = (unsigned char *)frame;
+    memset(h, 0, COMM_BIN_HEADER);
+    h[0] = COMM_BIN_MAGIC;
+    h[1] = opcode;
+    h[4] = key_len >> 8;
+    h[5] = key_len;
+    h[6] = value_len >> 8;
+    h[7] = value_len;
+    h[8] = id >> 24;
+    h[9] = id >> 16;
+    h[10] = id >> 8;
+    h[11] = id;
+    memcpy(frame + COMM_BIN_HEADER, key, key_len);
+    memcpy(frame + COMM_BIN_HEADER + key_len, value, value_len);
+    return COMM_BIN_HEADER + key_len + value_len;
+}
+
+/*
+ * Reads every line of the file at path into script, encoded as binary
+ * requests if binary is set. Returns 0 on success and -1 on failure.
+ */
+static int script_load(const char *path, script_t *script)
+{
+    FILE *in;
+    if ((in = fopen(path, "r")) == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    size_t cap = 1024;
+    script->nlines = 0;
+    script->lines = malloc(cap * sizeof(char *));
+    script->lens = malloc(cap * sizeof(size_t));
+    if (script->lines == NULL || script->lens == NULL)
+    {
+        perror("malloc");
+        fclose(in);
+        return -1;
+    }
+
+    char buf[LINELEN];
+    while (fgets(buf, sizeof(buf) - 1, in) != NULL)
+    {
+        size_t len = strlen(buf);
+        if (buf[len - 1] != '\n')
+        {
+            buf[len++] = '\n';
+            buf[len] = '\0';
+        }
+        if (script->nlines == cap)
+        {
+            cap *= 2;
+            char **grown = realloc(script->lines, cap * sizeof(char *));
+            size_t *grown_lens = NULL;
+            if (grown != NULL)
+                script->lines = grown;
+            if (grown == NULL ||
+                (grown_lens = realloc(script->lens, cap * sizeof(size_t))) ==
+                    NULL)
+            {
+                perror("realloc");
+                fclose(in);
+                return -1;
+            }
+            script->lens = grown_lens;
+        }
+
+        char frame[COMM_BIN_HEADER + 2 * BUFLEN];
+        char *line = buf;
+        if (binary)
+        {
+            len = encode(buf, script->nlines, frame);
+            line = frame;
+        }
+        if ((script->lines[script->nlines] = malloc(len)) == NULL)
+        {
+            perror("malloc");
+            fclose(in);
+            return -1;
+        }
+        memcpy(script->lines[script->nlines], line, len);
+        script->lens[script->nlines++] = len;
+    }
+
+    fclose(in);
+    if (script->nlines == 0)
+    {
+        fprintf(stderr, "%s: no commands\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/* Opens a nonblocking TCP connection to host:port. Returns -1 on failure. */
+static int connect_to(const char *host, const char *port)
+{
+    struct addrinfo hints;
+    struct addrinfo *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int err;
+    if ((err = getaddrinfo(host, port, &hints, &result)) != 0)
+    {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
+        return -1;
+    }
+
+    int sock = -1;
+    for (struct addrinfo *res = result; res != NULL; res = res->ai_next)
+    {
+        if ((sock = socket(res->ai_family, res->ai_socktype,
+                           res->ai_protocol)) < 0)
+            continue;
+        if (connect(sock, res->ai_addr, res->ai_addrlen) == 0)
+            break;
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(result);
+
+    if (sock < 0 || fcntl(sock, F_SETFL, O_NONBLOCK) < 0)
+    {
+        fprintf(stderr, "could not connect to %s:%s\n", host, port);
+        return -1;
+    }
+    return sock;
+}
+
+/* Appends len bytes at data to the bytes waiting to be sent. Returns -1 if
+ * out of memory. */
+static int conn_queue(conn_t *conn, const char *data, size_t len)
+{
+    if (conn->out_len + len > conn->out_cap)
+    {
+        size_t cap = 2 * (conn->out_len + len);
+        char *grown = realloc(conn->out, cap);
+        if (grown == NULL)
+        {
+            perror("realloc");
+            return -1;
+        }
+        conn->out = grown;
+        conn->out_cap = cap;
+    }
+    memcpy(conn->out + conn->out_len, data, len);
+    conn->out_len += len;
+    return 0;
+}
+
+/*
+ * Queues commands until the connection has depth of them in flight and sends
+ * what the socket takes. With batches, up to batch consecutive 'q', 'a' or
+ * 'd' commands go out as one batch command ('Q', 'A' or 'D'), each of its
+ * keys still counting as a command. Returns -1 if the connection failed.
+ */
+static int conn_send(conn_t *conn, script_t *script, size_t ncommands,
+                     size_t depth, size_t offset)
+{
+    while (conn->sent < ncommands && conn->sent - conn->done < depth)
+    {
+        size_t i = (offset + conn->sent) % script->nlines;
+        const char *line = script->lines[i];
+        size_t len = script->lens[i];
+        char op = line[0];
+        if (batch == 1 || (op != 'q' && op != 'a' && op != 'd'))
+        {
+            if (conn_queue(conn, line, len) < 0)
+                return -1;
+            conn->starts[conn->sent++] = now();
+            continue;
+        }
+
+        // the keys (and values) of the commands, without their newlines
+        char head = op - 'a' + 'A';
+        size_t line_len = 1;
+        size_t keys = 0;
+        if (conn_queue(conn, &head, 1) < 0)
+            return -1;
+        do
+        {
+            if (conn_queue(conn, line + 1, len - 2) < 0)
+                return -1;
+            line_len += len - 2;
+            conn->starts[conn->sent++] = now();
+            keys++;
+            i = (offset + conn->sent) % script->nlines;
+            line = script->lines[i];
+            len = script->lens[i];
+        } while (keys < batch && conn->sent < ncommands &&
+                 conn->sent - conn->done < depth && line[0] == op &&
+                 line_len + len - 2 < COMM_BATCH_LINE);
+        if (conn_queue(conn, "\n", 1) < 0)
+            return -1;
+    }
+
+    while (conn->out_off < conn->out_len)
+    {
+        ssize_t n = send(conn->fd, conn->out + conn->out_off,
+                         conn->out_len - conn->out_off, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            perror("send");
+            return -1;
+        }
+        conn->out_off += n;
+    }
+    conn->out_off = conn->out_len = 0;
+    return 0;
+}
+
+/* Returns the value length in the header of a binary response. */
+static size_t value_length(const char *header)
+{
+    const unsigned char *h = (const unsigned char *)header;
+    return (size_t)h[6] << 8 | h[7];
+}
+
+/*
+ * Reads responses, one line or binary response per command, and records how
+ * long each took. Returns -1 if the connection failed.
+ */
+static int conn_receive(conn_t *conn, double *latencies)
+{
+    char buf[RECVLEN];
+    ssize_t n = recv(conn->fd, buf, sizeof(buf), 0);
+    if (n < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+        perror("recv");
+        return -1;
+    }
+    if (n == 0)
+    {
+        fprintf(stderr, "the server closed a connection\n");
+        return -1;
+    }
+
+    double t = now();
+    if (!binary)
+    {
+        for (ssize_t i = 0; i < n; i++)
+        {
+            if (buf[i] == '\n' && conn->done < conn->sent)
+            {
+                latencies[conn->done] = t - conn->starts[conn->done];
+                conn->done++;
+            }
+        }
+        return 0;
+    }
+
+    // binary responses are a header, then as much value as it says
+    for (ssize_t i = 0; i < n;)
+    {
+        size_t need = COMM_BIN_HEADER;
+        if (conn->in_len >= COMM_BIN_HEADER)
+            need += value_length(conn->in);
+        size_t take = need - conn->in_len;
+        if (take > (size_t)(n - i))
+            take = n - i;
+        memcpy(conn->in + conn->in_len, buf + i, take);
+        conn->in_len += take;
+        i += take;
+
+        if (conn->in_len >= COMM_BIN_HEADER &&
+            conn->in_len == COMM_BIN_HEADER + value_length(conn->in))
+        {
+            if (conn->done < conn->sent)
+            {
+                latencies[conn->done] = t - conn->starts[conn->done];
+                conn->done++;
+            }
+            conn->in_len = 0;
+        }
+    }
+    return 0;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+void usage_error(const char *cmd)
+{
+    fprintf(stderr,
+            "Usage: %s [-b] [-c <connections>] [-d <depth>] "
+            "[-m <keys per batch>] [-n <commands per connection>] <host> "
+            "<port> <script>\n",
+            cmd);
+}
+
+/*
+ * Network benchmark for the server. Opens the given number of connections,
+ * each of which sends n commands taken from the script in turn (connection i
+ * starting at line i * n) while keeping up to depth of them in flight, all
+ * from one thread. Reports the aggregate throughput and the median and 99th
+ * percentile latency of a command, from queueing it to reading its response.
+ * -b sends the commands as binary requests (see comm.h) instead of text, and
+ * -m sends up to the given number of consecutive queries, adds or deletes as
+ * one batch command (see interpret_batch() in db.h).
+ */
+int main(int argc, char *argv[])
+{
+    int nconns = 1;
+    size_t depth = 1;
+    size_t ncommands = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "bc:d:m:n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            binary = 1;
+            break;
+        case 'c':
+            nconns = atoi(optarg);
+            break;
+        case 'd':
+            depth = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            batch = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            ncommands = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage_error(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 3 || nconns < 1 || depth < 1 || batch < 1 ||
+        batch > DB_BATCH_MAX || (binary && batch > 1))
+    {
+        usage_error(argv[0]);
+        return 1;
+    }
+
+    script_t script;
+    if (script_load(argv[optind + 2], &script) < 0)
+        return 1;
+    if (ncommands == 0)
+        ncommands = script.nlines;
+
+    conn_t *conns = calloc(nconns, sizeof(conn_t));
+    struct pollfd *fds = calloc(nconns, sizeof(struct pollfd));
+    double *latencies = malloc(nconns * ncommands * sizeof(double));
+    if (conns == NULL || fds == NULL || latencies == NULL)
+    {
+        perror("malloc");
+        return 1;
+    }
+    for (int i = 0; i < nconns; i++)
+    {
+        if ((conns[i].fd = connect_to(argv[optind], argv[optind + 1])) < 0)
+            return 1;
+        if ((conns[i].starts = malloc(ncommands * sizeof(double))) == NULL)
+        {
+            perror("malloc");
+            return 1;
+        }
+        fds[i].fd = conns[i].fd;
+    }
+
+    double start = now();
+    int active = nconns;
+    for (int i = 0; i < nconns; i++)
+    {
+        if (conn_send(&conns[i], &script, ncommands, depth, i * ncommands) < 0)
+            return 1;
+    }
+    while (active > 0)
+    {
+        for (int i = 0; i < nconns; i++)
+        {
+            conn_t *conn = &conns[i];
+            fds[i].events = 0;
+            if (conn->done < ncommands)
+                fds[i].events = POLLIN;
+            if (conn->out_off < conn->out_len)
+                fds[i].events |= POLLOUT;
+        }
+        if (poll(fds, nconns, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            return 1;
+        }
+        for (int i = 0; i < nconns; i++)
+        {
+            conn_t *conn = &conns[i];
+            if (fds[i].revents == 0)
+                continue;
+            if (fds[i].revents & (POLLIN | POLLERR | POLLHUP))
+            {
+                if (conn_receive(conn, latencies + i * ncommands) < 0)
+                    return 1;
+                if (conn->done == ncommands)
+                    active--;
+            }
+            if (conn_send(conn, &script, ncommands, depth, i * ncommands) < 0)
+                return 1;
+        }
+    }
+    double elapsed = now() - start;
+
+    size_t total = nconns * ncommands;
+    qsort(latencies, total, sizeof(double), compare_doubles);
+    printf("%zu commands, %d connections, depth %zu: %.3f s, %.0f commands/s, "
+           "p50 %.1f us, p99 %.1f us\n",
+           total, nconns, depth, elapsed, total / elapsed,
+           latencies[total / 2] * 1e6, latencies[total * 99 / 100] * 1e6);
+
+    for (int i = 0; i < nconns; i++)
+    {
+        close(conns[i].fd);
+        free(conns[i].starts);
+        free(conns[i].out);
+    }
+    for (size_t i = 0; i < script.nlines; i++)
+    {
+        free(script.lines[i]);
+    }
+    free(script.lines);
+    free(script.lens);
+    free(conns);
+    free(fds);
+    free(latencies);
+    return 0;
+}
@@ -0,0 +1,137 @@
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "./rwlock.h"
+
+// times a thread looks at a taken lock before going to sleep on it
+#define RWLOCK_SPINS 100
+
+#ifdef RWLOCK_STATS
+static unsigned long stat_spins;
+static unsigned long stat_sleeps;
+#define STAT_INC(counter) __atomic_add_fetch(&(counter), 1, __ATOMIC_RELAXED)
+#else
+#define STAT_INC(counter) ((void)0)
+#endif
+
+//------------------------------------------------------------------------------------------------
+// Helpers
+
+/* Tells the CPU that the thread is busy-waiting. */
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+#endif
+}
+
+/* Sleeps until the lock is woken, unless its word is no longer expected. */
+static void futex_wait(rwlock_t *lock, unsigned int expected)
+{
+    STAT_INC(stat_sleeps);
+    syscall(SYS_futex, &lock->state, FUTEX_WAIT_PRIVATE, expected, NULL, NULL,
+            0);
+}
+
+/*
+ * Spins while the lock word has any of the given bits set, for a while.
+ * Returns the last word seen.
+ */
+static unsigned int spin_while(rwlock_t *lock, unsigned int bits)
+{
+    unsigned int state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+    if (state & bits)
+    {
+        STAT_INC(stat_spins);
+        for (int i = 0; i < RWLOCK_SPINS && (state & bits); i++)
+        {
+            cpu_relax();
+            state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+        }
+    }
+    return state;
+}
+
+//------------------------------------------------------------------------------------------------
+// Slow paths
+
+void rwlock_rdlock_slow(rwlock_t *lock)
+{
+    unsigned int state =
+        spin_while(lock, RWLOCK_WRITER | RWLOCK_WRITERS_WAITING);
+    while (1)
+    {
+        if (!(state & (RWLOCK_WRITER | RWLOCK_WRITERS_WAITING)))
+        {
+            if (__atomic_compare_exchange_n(&lock->state, &state, state + 1, 0,
+                                            __ATOMIC_ACQUIRE,
+                                            __ATOMIC_RELAXED))
+                return;
+            continue;
+        }
+
+        // announce the sleeper, so that whoever releases the lock wakes it
+        unsigned int waiting = state | RWLOCK_READERS_WAITING;
+        if (state == waiting ||
+            __atomic_compare_exchange_n(&lock->state, &state, waiting, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            futex_wait(lock, waiting);
+            state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void rwlock_wrlock_slow(rwlock_t *lock)
+{
+    unsigned int state =
+        spin_while(lock, RWLOCK_WRITER | RWLOCK_READERS |
+                             RWLOCK_WRITERS_WAITING);
+    while (1)
+    {
+        if (!(state & (RWLOCK_WRITER | RWLOCK_READERS)))
+        {
+            // Other writers may be asleep as well, so the waiting bit stays
+            // set: it makes the release wake them. It also keeps new readers
+            // out, but it is only set here once a writer has had to wait.
+            unsigned int taken = state | RWLOCK_WRITER;
+            if (__atomic_compare_exchange_n(&lock->state, &state, taken, 0,
+                                            __ATOMIC_ACQUIRE,
+                                            __ATOMIC_RELAXED))
+                return;
+            continue;
+        }
+
+        unsigned int waiting = state | RWLOCK_WRITERS_WAITING;
+        if (state == waiting ||
+            __atomic_compare_exchange_n(&lock->state, &state, waiting, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            futex_wait(lock, waiting);
+            state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void rwlock_wake(rwlock_t *lock)
+{
+    // Wake everybody: the writers race for the lock again, and the readers
+    // go back to sleep if one of them wins.
+    syscall(SYS_futex, &lock->state, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL,
+            0);
+}
+
+void rwlock_stats(unsigned long *spins, unsigned long *sleeps)
+{
+#ifdef RWLOCK_STATS
+    *spins = __atomic_load_n(&stat_spins, __ATOMIC_RELAXED);
+    *sleeps = __atomic_load_n(&stat_sleeps, __ATOMIC_RELAXED);
+#else
+    *spins = 0;
+    *sleeps = 0;
+#endif
+}
@@ -0,0 +1,119 @@
+#ifndef RWLOCK_H_
+#define RWLOCK_H_
+
+/*
+ * A reader-writer lock in one 32-bit word, used for the nodes of the binary
+ * tree in place of pthread_rwlock_t (which takes 56 bytes on glibc).
+ *
+ * The word holds the number of readers, a bit for the writer, and two bits
+ * recording that readers or writers may be asleep. Acquiring and releasing an
+ * uncontended lock is a single atomic instruction. A thread that finds the
+ * lock taken spins for a while, then sleeps on the word with futex(2) until
+ * whoever releases the lock wakes it. Writers are preferred: once a writer is
+ * waiting, new readers wait as well, so a steady stream of readers cannot
+ * starve it. Locks must therefore only ever be nested in one order (the tree
+ * always locks parents before children), and a thread must never read-lock a
+ * lock it already holds.
+ *
+ * Compiling with -DRWLOCK_STATS makes the slow paths count how often they
+ * were taken; see rwlock_stats().
+ */
+typedef struct rwlock {
+    unsigned int state;
+} rwlock_t;
+
+#define RWLOCK_INITIALIZER {0}
+
+#define RWLOCK_WRITER 0x80000000u          // held by a writer
+#define RWLOCK_WRITERS_WAITING 0x40000000u // writers may be asleep
+#define RWLOCK_READERS_WAITING 0x20000000u // readers may be asleep
+#define RWLOCK_READERS 0x1fffffffu         // number of readers holding it
+
+// slow paths, in rwlock.c
+void rwlock_rdlock_slow(rwlock_t *lock);
+void rwlock_wrlock_slow(rwlock_t *lock);
+void rwlock_wake(rwlock_t *lock);
+
+static inline void rwlock_init(rwlock_t *lock)
+{
+    lock->state = 0;
+}
+
+/* Acquires lock for reading. */
+static inline void rwlock_rdlock(rwlock_t *lock)
+{
+    unsigned int state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+    if ((state & (RWLOCK_WRITER | RWLOCK_WRITERS_WAITING)) != 0 ||
+        !__atomic_compare_exchange_n(&lock->state, &state, state + 1, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        rwlock_rdlock_slow(lock);
+}
+
+/* Acquires lock for writing. */
+static inline void rwlock_wrlock(rwlock_t *lock)
+{
+    unsigned int state = 0;
+    if (!__atomic_compare_exchange_n(&lock->state, &state, RWLOCK_WRITER, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        rwlock_wrlock_slow(lock);
+}
+
+/* Releases lock, whether it is held for reading or for writing. */
+static inline void rwlock_unlock(rwlock_t *lock)
+{
+    unsigned int state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+    if (state & RWLOCK_WRITER)
+    {
+        // nobody else can change the word but to add a waiting bit
+        state = __atomic_exchange_n(&lock->state, 0, __ATOMIC_RELEASE);
+        if (state & (RWLOCK_WRITERS_WAITING | RWLOCK_READERS_WAITING))
+            rwlock_wake(lock);
+        return;
+    }
+
+    state = __atomic_sub_fetch(&lock->state, 1, __ATOMIC_RELEASE);
+    if ((state & RWLOCK_READERS) == 0 &&
+        (state & (RWLOCK_WRITERS_WAITING | RWLOCK_READERS_WAITING)) != 0)
+        rwlock_wake(lock);
+}
+
+/*
+ * Acquires lock for reading like rwlock_rdlock(), and adds delta to the
+ * 32-bit counter that directly follows the lock in memory in the same atomic
+ * instruction: lock and counter are taken as one 64-bit word, the lock being
+ * its low half, so the lock must be 8-byte aligned. The binary tree's writers
+ * count themselves into the nodes they pass this way (see bst.c), for the
+ * price of the locking alone.
+ */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && __SIZEOF_LONG__ == 8
+typedef unsigned long __attribute__((may_alias)) rwlock_word_t;
+
+static inline void rwlock_rdlock_add(rwlock_t *lock, unsigned int delta)
+{
+    rwlock_word_t *word = (rwlock_word_t *)lock;
+    unsigned long old = __atomic_load_n(word, __ATOMIC_RELAXED);
+    if (((unsigned int)old & (RWLOCK_WRITER | RWLOCK_WRITERS_WAITING)) != 0 ||
+        !__atomic_compare_exchange_n(word, &old,
+                                     old + 1 + ((unsigned long)delta << 32), 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        rwlock_rdlock_slow(lock);
+        __atomic_add_fetch((unsigned int *)(lock + 1), delta, __ATOMIC_RELAXED);
+    }
+}
+#else
+static inline void rwlock_rdlock_add(rwlock_t *lock, unsigned int delta)
+{
+    rwlock_rdlock(lock);
+    __atomic_add_fetch((unsigned int *)(lock + 1), delta, __ATOMIC_RELAXED);
+}
+#endif
+
+/*
+ * Stores how many times a thread had to spin for a lock, and how many times
+ * it went to sleep, since the program started. Both are 0 unless the program
+ * was compiled with -DRWLOCK_STATS.
+ */
+void rwlock_stats(unsigned long *spins, unsigned long *sleeps);
+
+#endif  // RWLOCK_H_
@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
@@ -14,7 +15,9 @@
 
 #include "./comm.h"
 #include "./db.h"
+#include "./evloop.h"
 #include "./server.h"
+#include "./uring.h"
 
 client_t *thread_list_head;
 pthread_mutex_t thread_list_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -24,6 +27,10 @@ server_control_t sv_ctrl = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
                             0};
 // flag to mark if server has stopped accepting clients
 int stop_accepting = 0;
+// how clients are served: by a thread each, by the event loop (evloop.c) or
+// by io_uring rings (uring.c)
+enum { IO_THREADS, IO_EPOLL, IO_URING };
+static int io_mode = IO_THREADS;
 
 //------------------------------------------------------------------------------------------------
 // Client threads' constructor and main method
@@ -66,38 +73,29 @@ void *run_client(void *arg)
         return NULL;
     }
 
+    // new clients go to the front, so that joining takes constant time
     pthread_mutex_lock(&thread_list_mutex);
-    if (thread_list_head == NULL)
+    client->next = thread_list_head;
+    if (thread_list_head != NULL)
     {
-        thread_list_head = client;
-    }
-    else
-    {
-        client_t *cur = thread_list_head;
-        while (cur->next != NULL)
-        {
-            cur = cur->next;
-        }
-        cur->next = client;
-        client->prev = cur;
-        client->next = NULL;
+        thread_list_head->prev = client;
     }
+    thread_list_head = client;
     pthread_mutex_lock(&sv_ctrl.server_mutex);
     sv_ctrl.num_client_threads++;
     pthread_mutex_unlock(&sv_ctrl.server_mutex);
     pthread_mutex_unlock(&thread_list_mutex);
 
-    char response[BUFLEN];
-    memset(response, '\0', BUFLEN);
-    char command[BUFLEN];
-    memset(command, '\0', BUFLEN);
+    comm_cmd_t command;
+    comm_buf_t buf;
+    comm_buf_init(&buf);
 
     pthread_cleanup_push(thread_cleanup, (void *)client);
 
-    while (comm_serve(client->cxstr, response, command) == 0)
+    while (comm_serve(client->cxstr, &buf, &command) == 0)
     {
         client_control_wait();
-        interpret_command(command, response, BUFLEN);
+        comm_execute(&buf, &command);
     }
     pthread_cleanup_pop(1);
 
@@ -155,6 +153,21 @@ void thread_cleanup(void *arg)
 
 void delete_all()
 {
+    if (io_mode != IO_THREADS)
+    {
+        if (io_mode == IO_URING)
+        {
+            uring_close_all();
+        }
+        else
+        {
+            evloop_close_all();
+        }
+        // let go of connections stopped in the middle of their commands
+        client_control_wake();
+        return;
+    }
+
     pthread_mutex_lock(&thread_list_mutex);
     client_t *cur = thread_list_head;
     while (cur != NULL)
@@ -169,6 +182,33 @@ void delete_all()
     pthread_mutex_unlock(&thread_list_mutex);
 }
 
+// Called by the event loops when a client connects, in place of starting a
+// thread for it
+void client_count_add()
+{
+    pthread_mutex_lock(&sv_ctrl.server_mutex);
+    sv_ctrl.num_client_threads++;
+    pthread_mutex_unlock(&sv_ctrl.server_mutex);
+}
+
+// Called by the event loops when a client's connection is closed
+void client_count_remove()
+{
+    pthread_mutex_lock(&sv_ctrl.server_mutex);
+    sv_ctrl.num_client_threads--;
+
+    // check if it's the last client
+    if (sv_ctrl.num_client_threads == 0)
+    {
+        int err;
+        if ((err = pthread_cond_signal(&sv_ctrl.server_cond)) != 0)
+        {
+            handle_error_en(err, "pthread_cond_signal err");
+        }
+    }
+    pthread_mutex_unlock(&sv_ctrl.server_mutex);
+}
+
 //------------------------------------------------------------------------------------------------
 // Methods for stop/go server commands
 
@@ -198,6 +238,44 @@ void client_control_wait()
     pthread_cleanup_pop(1);
 }
 
+// Called by the event loops in place of client_control_wait() before every
+// command. Returns right away, without locking, unless the clients are
+// stopped; otherwise waits until they go again or *cancelled becomes
+// nonzero. Returns *cancelled.
+int client_control_wait_unless(int *cancelled)
+{
+    if (!__atomic_load_n(&cl_ctrl.stopped, __ATOMIC_RELAXED))
+    {
+        return __atomic_load_n(cancelled, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_lock(&cl_ctrl.go_mutex);
+    while (cl_ctrl.stopped && !__atomic_load_n(cancelled, __ATOMIC_RELAXED))
+    {
+        int err_cond_wait;
+        if ((err_cond_wait =
+                 pthread_cond_wait(&cl_ctrl.go, &cl_ctrl.go_mutex)) != 0)
+        {
+            handle_error_en(err_cond_wait, "pthread_cond_wait err");
+        }
+    }
+    pthread_mutex_unlock(&cl_ctrl.go_mutex);
+    return __atomic_load_n(cancelled, __ATOMIC_RELAXED);
+}
+
+// Wakes everybody in client_control_wait_unless(), so that they look at their
+// cancel flags again.
+void client_control_wake()
+{
+    pthread_mutex_lock(&cl_ctrl.go_mutex);
+    int err_cond_broadcast;
+    if ((err_cond_broadcast = pthread_cond_broadcast(&cl_ctrl.go)) != 0)
+    {
+        handle_error_en(err_cond_broadcast, "pthread_cond_broadcast err");
+    }
+    pthread_mutex_unlock(&cl_ctrl.go_mutex);
+}
+
 // Called by main thread to stop client threads
 void client_control_stop()
 {
@@ -294,12 +372,137 @@ void sig_handler_destructor(sig_handler_t *sighandler)
 //------------------------------------------------------------------------------------------------
 // Main function
 
-// The arguments to the server should be the port number.
+// Prints a usage tip and exits.
+static void usage_error(void)
+{
+    fprintf(stderr, "Usage: ./server <port> [--index] [--huge-pages] "
+                    "[--shards=<n>] [--engine=bst|bptree|art|skiplist] "
+                    "[--io=threads|epoll|uring] [--workers=<n>] "
+                    "[--wal=<file>] [--fsync=always|batch|interval] "
+                    "[--checkpoint=<seconds>]\n");
+    exit(1);
+}
+
+// Returns the number written in decimal digits at text, or -1 if text is not
+// such a number, in full, or the number does not fit in an int.
+static int parse_count(const char *text)
+{
+    char *end;
+    errno = 0;
+    long value = strtol(text, &end, 10);
+    if (*text < '0' || *text > '9' || *end != '\0' || errno != 0 ||
+        value > INT_MAX)
+        return -1;
+    return (int)value;
+}
+
+// The arguments to the server should be the port number, followed by options:
+// --index answers point queries from a hash index kept next to the tree,
+// --huge-pages backs the tree's nodes with huge pages,
+// --shards=<n> splits the database into n independently locked shards, and
+// --engine= picks the data structure the shards keep their pairs in,
+// --io=epoll serves clients from an event loop and a pool of workers instead
+// of a thread per client, and --workers=<n> sets the size of that pool (by
+// default one worker per core); --io=uring serves them from that many
+// io_uring rings instead, falling back to epoll if the kernel cannot.
+// --wal=<file> keeps a write-ahead log of every change in file, replaying it
+// on startup, --fsync= says when the log is synced to disk (always by
+// default), and --checkpoint=<seconds> how often the database is written to
+// a checkpoint that replaces the log (every 60 seconds by default, never if
+// 0).
 int main(int argc, char *argv[])
 {
-    if (argc != 2)
+    if (argc < 2)
+    {
+        usage_error();
+    }
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = cores > 0 ? (int)cores : 1;
+    const char *wal_path = NULL;
+    const char *fsync_policy = "always";
+    int checkpoint_interval = 60;
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--index") == 0)
+        {
+            if (db_index_enable() < 0)
+            {
+                fprintf(stderr, "could not create the hash index\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--huge-pages") == 0)
+        {
+            if (db_huge_pages_enable() < 0)
+            {
+                fprintf(stderr, "could not set up huge pages\n");
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "--shards=", 9) == 0)
+        {
+            if (db_set_shards(parse_count(argv[i] + 9)) < 0)
+            {
+                fprintf(stderr, "invalid shard count: %s\n", argv[i] + 9);
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "--engine=", 9) == 0)
+        {
+            if (db_set_engine(argv[i] + 9) < 0)
+            {
+                fprintf(stderr, "invalid engine: %s\n", argv[i] + 9);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--io=threads") == 0)
+        {
+            io_mode = IO_THREADS;
+        }
+        else if (strcmp(argv[i], "--io=epoll") == 0)
+        {
+            io_mode = IO_EPOLL;
+        }
+        else if (strcmp(argv[i], "--io=uring") == 0)
+        {
+            io_mode = IO_URING;
+        }
+        else if (strncmp(argv[i], "--workers=", 10) == 0)
+        {
+            if ((workers = parse_count(argv[i] + 10)) < 1)
+            {
+                fprintf(stderr, "invalid worker count: %s\n", argv[i] + 10);
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "--wal=", 6) == 0)
+        {
+            wal_path = argv[i] + 6;
+        }
+        else if (strncmp(argv[i], "--fsync=", 8) == 0)
+        {
+            fsync_policy = argv[i] + 8;
+        }
+        else if (strncmp(argv[i], "--checkpoint=", 13) == 0)
+        {
+            if ((checkpoint_interval = parse_count(argv[i] + 13)) < 0)
+            {
+                fprintf(stderr, "invalid checkpoint interval: %s\n",
+                        argv[i] + 13);
+                exit(1);
+            }
+        }
+        else
+        {
+            usage_error();
+        }
+    }
+    // the log is replayed into the database as configured above
+    if (wal_path != NULL &&
+        db_wal_enable(wal_path, fsync_policy, checkpoint_interval) < 0)
     {
-        fprintf(stderr, "Usage: ./server <port>\n");
+        fprintf(stderr, "could not open the write-ahead log %s (fsync=%s)\n",
+                wal_path, fsync_policy);
         exit(1);
     }
 
@@ -314,7 +517,29 @@ int main(int argc, char *argv[])
     sig_handler_t *handler = sig_handler_constructor();
 
     pthread_t listener;
-    listener = start_listener(atoi(argv[1]), client_constructor);
+    if (io_mode == IO_URING && uring_start(atoi(argv[1]), workers) < 0)
+    {
+        fprintf(stderr, "io_uring is not available, using epoll\n");
+        io_mode = IO_EPOLL;
+    }
+    if (io_mode == IO_EPOLL)
+    {
+        // a few I/O threads are plenty, as the workers do the real work
+        int io_threads = 1 + workers / 8;
+        if (io_threads > 4)
+        {
+            io_threads = 4;
+        }
+        if (evloop_start(atoi(argv[1]), io_threads, workers) < 0)
+        {
+            fprintf(stderr, "could not start the event loop\n");
+            exit(1);
+        }
+    }
+    else if (io_mode == IO_THREADS)
+    {
+        listener = start_listener(atoi(argv[1]), client_constructor);
+    }
 
     while (1)
     {
@@ -380,8 +605,29 @@ int main(int argc, char *argv[])
     }
     pthread_cleanup_pop(1);
     db_cleanup();
-    pthread_cancel(listener);
-    pthread_join(listener, NULL);
+
+    unsigned long syscalls, commands;
+    comm_stats(&syscalls, &commands);
+    if (commands > 0)
+    {
+        fprintf(stderr,
+                "%lu commands, %lu network system calls (%.3f per command)\n",
+                commands, syscalls, (double)syscalls / commands);
+    }
+
+    if (io_mode == IO_URING)
+    {
+        uring_stop();
+    }
+    else if (io_mode == IO_EPOLL)
+    {
+        evloop_stop();
+    }
+    else
+    {
+        pthread_cancel(listener);
+        pthread_join(listener, NULL);
+    }
     pthread_exit(NULL);
 
     return 0;
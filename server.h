@@ -43,6 +43,8 @@ typedef struct sig_handler {
     pthread_t thread;
 } sig_handler_t;
 
+// shared with the event loops in evloop.c and uring.c
+extern int stop_accepting;
 
 // Client threads' constructor and main method
 void client_constructor(FILE *cxstr);
@@ -58,6 +60,12 @@ void client_control_wait();
 void client_control_stop();
 void client_control_release();
 
+// For the event loops, which serve clients without a thread each
+void client_count_add();
+void client_count_remove();
+int client_control_wait_unless(int *cancelled);
+void client_control_wake();
+
 // SIGINT signal handling
 sig_handler_t *sig_handler_constructor();
 void *monitor_signal(void *arg);
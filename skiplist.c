@@ -0,0 +1,431 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "./engine.h"
+#include "./epoch.h"
+#include "./skiplist.h"
+
+// number of levels; with one node in four reaching the next level up, this is
+// plenty for 4^16 keys
+#define SKIPLIST_MAX_LEVEL 16
+
+// state bits of a node; whoever sets the second one of them retires the node
+#define NODE_LINKED 1   // the inserting thread is done linking the node
+#define NODE_REMOVED 2  // the node has been marked at the bottom level
+
+/*
+ * A node and its pair, in one allocation. The low bit of next[i] is set once
+ * the node is being removed from level i, which freezes that pointer: any
+ * compare-and-swap on it (to link a new successor) fails from then on.
+ */
+typedef struct sl_node {
+    char *key;    // points into the node, right after next[]
+    char *value;  // points into the node, right after key's terminator
+    unsigned int state;
+    int level;  // number of levels the node is on; never changes
+    struct sl_node *next[];
+} sl_node_t;
+
+struct skiplist {
+    // sentinel in front of the first node, on every level; its key is unused
+    sl_node_t *head;
+};
+
+//------------------------------------------------------------------------------------------------
+// Marked pointers
+
+static inline int is_marked(sl_node_t *ptr)
+{
+    return ((uintptr_t)ptr & 1) != 0;
+}
+
+static inline sl_node_t *marked(sl_node_t *ptr)
+{
+    return (sl_node_t *)((uintptr_t)ptr | 1);
+}
+
+static inline sl_node_t *unmarked(sl_node_t *ptr)
+{
+    return (sl_node_t *)((uintptr_t)ptr & ~(uintptr_t)1);
+}
+
+static inline sl_node_t *load_next(sl_node_t *node, int level)
+{
+    return __atomic_load_n(&node->next[level], __ATOMIC_ACQUIRE);
+}
+
+/* Replaces node's next pointer at level if it is still *expected; otherwise
+ * stores its current value in *expected. Returns nonzero on success. */
+static inline int cas_next(sl_node_t *node, int level, sl_node_t **expected,
+                           sl_node_t *desired)
+{
+    return __atomic_compare_exchange_n(&node->next[level], expected, desired, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+//------------------------------------------------------------------------------------------------
+// Helpers
+
+// state of the thread's level generator, never 0 once seeded
+static __thread unsigned long level_seed;
+
+/* Returns a random level for a new node: 1, and one more with probability
+ * 1/4 each time, up to SKIPLIST_MAX_LEVEL. */
+static int random_level(void)
+{
+    if (level_seed == 0)
+        level_seed = (uintptr_t)&level_seed | 1;  // differs between threads
+
+    // xorshift64
+    level_seed ^= level_seed << 13;
+    level_seed ^= level_seed >> 7;
+    level_seed ^= level_seed << 17;
+
+    unsigned long r = level_seed;
+    int level = 1;
+    while (level < SKIPLIST_MAX_LEVEL && (r & 3) == 0)
+    {
+        level++;
+        r >>= 2;
+    }
+    return level;
+}
+
+static sl_node_t *node_constructor(const char *key, size_t key_len,
+                                   const char *value, size_t val_len, int level)
+{
+    size_t size = sizeof(sl_node_t) + level * sizeof(sl_node_t *);
+    sl_node_t *node = malloc(size + key_len + val_len + 2);
+    if (node == NULL)
+        return NULL;
+
+    node->key = (char *)node + size;
+    memcpy(node->key, key, key_len);
+    node->key[key_len] = '\0';
+    node->value = node->key + key_len + 1;
+    memcpy(node->value, value, val_len);
+    node->value[val_len] = '\0';
+    node->state = 0;
+    node->level = level;
+    memset(node->next, 0, level * sizeof(sl_node_t *));
+    return node;
+}
+
+/* free() in the shape epoch_retire() expects */
+static void node_reclaim(void *node)
+{
+    free(node);
+}
+
+/*
+ * Stores in preds[i] the last node before key, whose length is len, on level
+ * i, and in succs[i] the node after it (the first one whose key is not
+ * smaller than key, or NULL), unlinking every marked node it comes across on
+ * the way. Returns nonzero if succs[0] holds key.
+ */
+static int find(skiplist_t *list, const char *key, size_t len,
+                sl_node_t **preds, sl_node_t **succs)
+{
+    int restart;
+    do
+    {
+        restart = 0;
+        sl_node_t *pred = list->head;
+        for (int level = SKIPLIST_MAX_LEVEL - 1; level >= 0 && !restart;
+             level--)
+        {
+            sl_node_t *curr = unmarked(load_next(pred, level));
+            while (curr != NULL)
+            {
+                sl_node_t *succ = load_next(curr, level);
+                if (is_marked(succ))
+                {
+                    // curr is being removed: unlink it from this level. If
+                    // pred has changed or is being removed itself, start over.
+                    sl_node_t *expected = curr;
+                    if (!cas_next(pred, level, &expected, unmarked(succ)))
+                    {
+                        restart = 1;
+                        break;
+                    }
+                    curr = unmarked(succ);
+                    continue;
+                }
+                if (engine_key_cmp(key, len, curr->key) <= 0)
+                    break;
+                pred = curr;
+                curr = succ;
+            }
+            preds[level] = pred;
+            succs[level] = curr;
+        }
+    } while (restart);
+
+    return succs[0] != NULL && engine_key_cmp(key, len, succs[0]->key) == 0;
+}
+
+/*
+ * Records that the inserting or the removing thread (given by bit) is done
+ * with node. The second of the two unlinks the node from every level it may
+ * still be on, and retires it.
+ */
+static void node_release(skiplist_t *list, sl_node_t *node, unsigned int bit)
+{
+    unsigned int state = __atomic_fetch_or(&node->state, bit, __ATOMIC_ACQ_REL);
+    if ((state & ~bit) == 0)
+        return;
+
+    // Nothing links the node anywhere anymore, and it is marked on every
+    // level, so the search unlinks it wherever it still is: the node comes
+    // before any newer node with the same key, where the search stops.
+    sl_node_t *preds[SKIPLIST_MAX_LEVEL];
+    sl_node_t *succs[SKIPLIST_MAX_LEVEL];
+    find(list, node->key, strlen(node->key), preds, succs);
+    epoch_retire(node, node_reclaim);
+}
+
+/*
+ * Links node, which is on the bottom level already, into the levels above,
+ * given the neighbours find() reported for it. Gives up as soon as the node
+ * is being removed: once its own pointer on a level is marked, it must not be
+ * linked there anymore.
+ */
+static void link_upper_levels(skiplist_t *list, sl_node_t *node,
+                              sl_node_t **preds, sl_node_t **succs)
+{
+    for (int level = 1; level < node->level; level++)
+    {
+        while (1)
+        {
+            sl_node_t *next = load_next(node, level);
+            if (is_marked(next) ||
+                (next != succs[level] &&
+                 !cas_next(node, level, &next, succs[level])))
+                return;
+
+            sl_node_t *expected = succs[level];
+            if (cas_next(preds[level], level, &expected, node))
+                break;
+
+            // the neighbourhood changed; look again, and give up if the node
+            // has been removed already
+            find(list, node->key, strlen(node->key), preds, succs);
+            if (succs[0] != node)
+                return;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------------------------
+// Public interface
+
+skiplist_t *skiplist_constructor(void)
+{
+    skiplist_t *list = malloc(sizeof(skiplist_t));
+    if (list == NULL)
+        return NULL;
+    list->head = node_constructor("", 0, "", 0, SKIPLIST_MAX_LEVEL);
+    if (list->head == NULL)
+    {
+        free(list);
+        return NULL;
+    }
+    return list;
+}
+
+void skiplist_destructor(skiplist_t *list)
+{
+    // every node that is still on the bottom level is still in the list
+    sl_node_t *node = list->head;
+    while (node != NULL)
+    {
+        sl_node_t *next = unmarked(node->next[0]);
+        free(node);
+        node = next;
+    }
+    free(list);
+}
+
+const char *skiplist_lookup(skiplist_t *list, const char *key, size_t len)
+{
+    sl_node_t *pred = list->head;
+    sl_node_t *curr = NULL;
+    for (int level = SKIPLIST_MAX_LEVEL - 1; level >= 0; level--)
+    {
+        curr = unmarked(load_next(pred, level));
+        while (curr != NULL && engine_key_cmp(key, len, curr->key) > 0)
+        {
+            pred = curr;
+            curr = unmarked(load_next(curr, level));
+        }
+    }
+
+    // a node with key that is being removed may still be in front of one
+    // that has been added again since
+    while (curr != NULL && engine_key_cmp(key, len, curr->key) == 0)
+    {
+        sl_node_t *next = load_next(curr, 0);
+        if (!is_marked(next))
+            return curr->value;
+        curr = unmarked(next);
+    }
+    return NULL;
+}
+
+int skiplist_insert(skiplist_t *list, const char *key, size_t key_len,
+                    const char *value, size_t value_len)
+{
+    sl_node_t *preds[SKIPLIST_MAX_LEVEL];
+    sl_node_t *succs[SKIPLIST_MAX_LEVEL];
+    sl_node_t *node =
+        node_constructor(key, key_len, value, value_len, random_level());
+    if (node == NULL)
+        return 0;
+
+    epoch_enter();
+    // linking the node into the bottom level adds the key
+    do
+    {
+        if (find(list, key, key_len, preds, succs))
+        {
+            epoch_exit();
+            free(node);
+            return 0;
+        }
+        for (int level = 0; level < node->level; level++)
+            node->next[level] = succs[level];
+    } while (!cas_next(preds[0], 0, &succs[0], node));
+
+    link_upper_levels(list, node, preds, succs);
+    node_release(list, node, NODE_LINKED);
+    epoch_exit();
+    return 1;
+}
+
+int skiplist_remove(skiplist_t *list, const char *key, size_t len)
+{
+    sl_node_t *preds[SKIPLIST_MAX_LEVEL];
+    sl_node_t *succs[SKIPLIST_MAX_LEVEL];
+
+    epoch_enter();
+    if (!find(list, key, len, preds, succs))
+    {
+        epoch_exit();
+        return 0;
+    }
+    sl_node_t *node = succs[0];
+
+    // mark the upper levels, top first, so that nothing can be linked behind
+    // the node on them anymore
+    for (int level = node->level - 1; level >= 1; level--)
+    {
+        sl_node_t *next = load_next(node, level);
+        while (!is_marked(next) && !cas_next(node, level, &next, marked(next)))
+            ;
+    }
+
+    // marking the bottom level removes the key; if another thread got there
+    // first, it removed the key instead
+    sl_node_t *next = load_next(node, 0);
+    while (1)
+    {
+        if (is_marked(next))
+        {
+            epoch_exit();
+            return 0;
+        }
+        if (cas_next(node, 0, &next, marked(next)))
+            break;
+    }
+
+    node_release(list, node, NODE_REMOVED);
+    epoch_exit();
+    return 1;
+}
+
+int skiplist_scan(skiplist_t *list, const char *start, size_t len,
+                  int (*fn)(const char *key, const char *value, void *arg),
+                  void *arg)
+{
+    sl_node_t *pred = list->head;
+    sl_node_t *node = NULL;
+    for (int level = SKIPLIST_MAX_LEVEL - 1; level >= 0; level--)
+    {
+        node = unmarked(load_next(pred, level));
+        while (node != NULL && engine_key_cmp(start, len, node->key) > 0)
+        {
+            pred = node;
+            node = unmarked(load_next(node, level));
+        }
+    }
+
+    while (node != NULL)
+    {
+        sl_node_t *next = load_next(node, 0);
+        if (!is_marked(next))
+        {
+            int ret = fn(node->key, node->value, arg);
+            if (ret != 0)
+                return ret;
+        }
+        node = unmarked(next);
+    }
+    return 0;
+}
+
+//------------------------------------------------------------------------------------------------
+// Engine interface
+
+static void *skiplist_engine_constructor(unsigned int flags)
+{
+    (void)flags;  // there is no hash index to keep
+    return skiplist_constructor();
+}
+
+static void skiplist_engine_destructor(void *state)
+{
+    skiplist_destructor(state);
+}
+
+static const char *skiplist_engine_lookup(void *state, const char *key,
+                                          size_t key_len)
+{
+    return skiplist_lookup(state, key, key_len);
+}
+
+static int skiplist_engine_insert(void *state, const char *key,
+                                  size_t key_len, const char *value,
+                                  size_t value_len)
+{
+    return skiplist_insert(state, key, key_len, value, value_len);
+}
+
+static int skiplist_engine_remove(void *state, const char *key,
+                                  size_t key_len)
+{
+    return skiplist_remove(state, key, key_len);
+}
+
+static int skiplist_engine_scan(void *state, const char *start,
+                                size_t start_len, engine_visit_t fn, void *arg)
+{
+    return skiplist_scan(state, start, start_len, fn, arg);
+}
+
+// there is no binary tree to print
+const engine_ops_t skiplist_engine = {
+    "skiplist",
+    skiplist_engine_constructor,
+    skiplist_engine_destructor,
+    skiplist_engine_lookup,
+    NULL,
+    skiplist_engine_insert,
+    NULL,
+    skiplist_engine_remove,
+    NULL,
+    skiplist_engine_scan,
+    NULL,
+    NULL,
+    NULL,
+};
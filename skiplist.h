@@ -0,0 +1,62 @@
+#ifndef SKIPLIST_H_
+#define SKIPLIST_H_
+
+#include <stddef.h>
+
+/*
+ * A lock-free skiplist mapping string keys to string values, used as an
+ * alternative storage engine to the binary tree in bst.c.
+ *
+ * No operation ever waits for another thread: lookups only follow pointers,
+ * and updates change the list with compare-and-swap, retrying (or helping to
+ * finish a concurrent removal) when they lose a race. A key is inserted by
+ * linking its node into the bottom level, which makes it visible, and then
+ * into the levels above. It is removed by first marking the node's own next
+ * pointers, top level first; marking the bottom one is what removes the key,
+ * and whichever thread marks it wins the removal. Marked nodes are unlinked by
+ * every later search that passes them, and once a node is both fully inserted
+ * and removed it is unlinked from every level and handed to epoch_retire().
+ * Every operation must therefore run inside an epoch (see epoch.h), which the
+ * functions below take care of themselves except for the lookup and scan.
+ */
+typedef struct skiplist skiplist_t;
+
+/* Creates an empty list. Returns NULL on failure. */
+skiplist_t *skiplist_constructor(void);
+
+/*
+ * Frees the list and every pair in it. Only call this when no other thread is
+ * using the list.
+ */
+void skiplist_destructor(skiplist_t *list);
+
+/*
+ * Returns the value stored under key, or NULL if there is none. Must be
+ * called inside an epoch; the value stays valid until the matching
+ * epoch_exit().
+ */
+const char *skiplist_lookup(skiplist_t *list, const char *key, size_t len);
+
+/*
+ * Adds the pair (key, value) to the list. Returns 1 on success and 0 if key
+ * is already in the list or memory ran out.
+ */
+int skiplist_insert(skiplist_t *list, const char *key, size_t key_len,
+                    const char *value, size_t value_len);
+
+/* Removes key from the list. Returns 1 on success and 0 if it is not there. */
+int skiplist_remove(skiplist_t *list, const char *key, size_t len);
+
+/*
+ * Calls fn on every pair in the list whose key is not smaller than the len
+ * bytes at start, in ascending key order, stopping early if fn returns
+ * nonzero, and returns what fn last returned (or 0). The first of them is
+ * found the way skiplist_lookup() finds a key. Pairs that are added or
+ * removed concurrently may or may not be visited. Must be called inside an
+ * epoch.
+ */
+int skiplist_scan(skiplist_t *list, const char *start, size_t len,
+                  int (*fn)(const char *key, const char *value, void *arg),
+                  void *arg);
+
+#endif  // SKIPLIST_H_
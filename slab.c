@@ -0,0 +1,326 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "./slab.h"
+
+// size (and alignment) of a slab
+#define SLAB_SIZE (64 * 1024)
+// size (and alignment) of the chunks slabs are carved from; a huge page
+#define SLAB_CHUNK_SIZE (2 * 1024 * 1024)
+// blocks a thread keeps per size class before handing them to the depot
+#define SLAB_BATCH 64
+// threads that get free lists of their own; any others share one set
+#define SLAB_THREADS 256
+
+// the block sizes handed out: 16 bytes apart where nodes of short keys fall,
+// further apart above
+static const size_t class_size[] = {32,  48,  64,  80,  96,  112, 128, 144,
+                                    160, 176, 192, 224, 256, 320, 384, 448,
+                                    512, 640, 768};
+#define SLAB_CLASSES (sizeof(class_size) / sizeof(class_size[0]))
+
+/*
+ * The first cache line of every slab. Blocks find their arena and size class
+ * through it by rounding their address down to the slab size.
+ */
+typedef struct slab {
+    slab_arena_t *arena;
+    unsigned int cls;
+    // next chunk of the arena; only kept in the first slab of a chunk
+    struct slab *next_chunk;
+} __attribute__((aligned(64))) slab_t;
+
+/* A block on a free list. */
+typedef struct free_block {
+    struct free_block *next;
+    // in the first block of a batch in the depot: the next batch, and the
+    // number of blocks in this one
+    struct free_block *next_batch;
+    size_t count;
+} free_block_t;
+
+/* One thread's free lists, and the slabs it is carving new blocks from. */
+typedef struct slab_cache {
+    free_block_t *free[SLAB_CLASSES];
+    size_t count[SLAB_CLASSES];
+    char *bump[SLAB_CLASSES];  // next uncarved block in the current slab
+    char *end[SLAB_CLASSES];   // end of the current slab
+} __attribute__((aligned(64))) slab_cache_t;
+
+struct slab_arena {
+    pthread_mutex_t mutex;  // protects everything below but caches
+    int huge_pages;
+    slab_t *chunks;         // every chunk mapped so far, newest first
+    char *next_slab;        // the part of the newest chunk not carved yet
+    char *chunk_end;
+    free_block_t *depot[SLAB_CLASSES];  // batches handed back by threads
+    // per-thread caches, indexed by the thread's slot; the last one belongs
+    // to the depot and is only used under mutex
+    slab_cache_t caches[SLAB_THREADS + 1];
+};
+
+// which threads own a slot (and with it a cache in every arena)
+static int slot_in_use[SLAB_THREADS];
+static pthread_key_t slot_key;
+static pthread_once_t slot_key_once = PTHREAD_ONCE_INIT;
+// the calling thread's slot plus one, or 0 before it has claimed one
+static __thread int my_slot;
+
+//------------------------------------------------------------------------------------------------
+// Thread slots
+
+/* Thread-exit hook: releases the thread's slot for reuse. Its free lists
+ * stay where they are, for the next thread that claims the slot. */
+static void slot_release(void *arg)
+{
+    int slot = (int)(intptr_t)arg - 1;
+    __atomic_store_n(&slot_in_use[slot], 0, __ATOMIC_RELEASE);
+}
+
+static void slot_key_init(void)
+{
+    int err;
+    if ((err = pthread_key_create(&slot_key, slot_release)) != 0)
+    {
+        fprintf(stderr, "pthread_key_create: %s\n", strerror(err));
+        exit(1);
+    }
+}
+
+/* Returns the calling thread's slot, claiming one on first use, or
+ * SLAB_THREADS if they are all taken. */
+static int get_slot(void)
+{
+    if (my_slot != 0)
+        return my_slot - 1;
+
+    pthread_once(&slot_key_once, slot_key_init);
+    int slot;
+    for (slot = 0; slot < SLAB_THREADS; slot++)
+    {
+        int free_slot = 0;
+        if (__atomic_compare_exchange_n(&slot_in_use[slot], &free_slot, 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (slot < SLAB_THREADS)
+        pthread_setspecific(slot_key, (void *)(intptr_t)(slot + 1));
+    my_slot = slot + 1;
+    return slot;
+}
+
+//------------------------------------------------------------------------------------------------
+// Helpers
+
+/* Returns the size class for size, or SLAB_CLASSES if it is too big. */
+static unsigned int class_of(size_t size)
+{
+    unsigned int cls = 0;
+    while (cls < SLAB_CLASSES && class_size[cls] < size)
+        cls++;
+    return cls;
+}
+
+/* Maps a new chunk, aligned to its size. Returns NULL on failure. */
+static char *chunk_map(int huge_pages)
+{
+    char *chunk;
+    if (huge_pages)
+    {
+        // huge pages are aligned to their size already
+        chunk = mmap(NULL, SLAB_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (chunk != MAP_FAILED)
+            return chunk;
+    }
+
+    // map twice the size and trim it down to an aligned chunk
+    char *area = mmap(NULL, 2 * SLAB_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (area == MAP_FAILED)
+        return NULL;
+    chunk = (char *)(((uintptr_t)area + SLAB_CHUNK_SIZE - 1) &
+                     ~(uintptr_t)(SLAB_CHUNK_SIZE - 1));
+    if (chunk > area)
+        munmap(area, chunk - area);
+    munmap(chunk + SLAB_CHUNK_SIZE, area + SLAB_CHUNK_SIZE - chunk);
+
+    // without reserved huge pages, ask for transparent ones
+    if (huge_pages)
+        madvise(chunk, SLAB_CHUNK_SIZE, MADV_HUGEPAGE);
+    return chunk;
+}
+
+/* Returns a new slab for blocks of class cls. Called with the arena's mutex
+ * held. Returns NULL on failure. */
+static slab_t *slab_new(slab_arena_t *arena, unsigned int cls)
+{
+    slab_t *slab;
+    if (arena->next_slab == arena->chunk_end)
+    {
+        char *chunk = chunk_map(arena->huge_pages);
+        if (chunk == NULL)
+            return NULL;
+        slab = (slab_t *)chunk;
+        slab->next_chunk = arena->chunks;
+        arena->chunks = slab;
+        arena->next_slab = chunk + SLAB_SIZE;
+        arena->chunk_end = chunk + SLAB_CHUNK_SIZE;
+    }
+    else
+    {
+        slab = (slab_t *)arena->next_slab;
+        slab->next_chunk = NULL;
+        arena->next_slab += SLAB_SIZE;
+    }
+    slab->arena = arena;
+    slab->cls = cls;
+    return slab;
+}
+
+/* Refills cache's free list or current slab for class cls, from the depot or
+ * with a new slab. Called with the arena's mutex held. Returns -1 if out of
+ * memory. */
+static int cache_refill(slab_arena_t *arena, slab_cache_t *cache,
+                        unsigned int cls)
+{
+    free_block_t *batch = arena->depot[cls];
+    if (batch != NULL)
+    {
+        arena->depot[cls] = batch->next_batch;
+        cache->free[cls] = batch;
+        cache->count[cls] = batch->count;
+        return 0;
+    }
+
+    slab_t *slab = slab_new(arena, cls);
+    if (slab == NULL)
+        return -1;
+    cache->bump[cls] = (char *)slab + sizeof(slab_t);
+    cache->end[cls] = (char *)slab + SLAB_SIZE;
+    return 0;
+}
+
+/* Takes a block of class cls from cache, refilling it if it is empty. The
+ * arena's mutex is held on entry if and only if locked is nonzero. */
+static void *cache_alloc(slab_arena_t *arena, slab_cache_t *cache,
+                         unsigned int cls, int locked)
+{
+    free_block_t *block = cache->free[cls];
+    if (block == NULL &&
+        (size_t)(cache->end[cls] - cache->bump[cls]) < class_size[cls])
+    {
+        if (!locked)
+            pthread_mutex_lock(&arena->mutex);
+        int ret = cache_refill(arena, cache, cls);
+        if (!locked)
+            pthread_mutex_unlock(&arena->mutex);
+        if (ret < 0)
+            return NULL;
+        block = cache->free[cls];
+    }
+
+    if (block != NULL)
+    {
+        cache->free[cls] = block->next;
+        cache->count[cls]--;
+        return block;
+    }
+    char *carved = cache->bump[cls];
+    cache->bump[cls] += class_size[cls];
+    return carved;
+}
+
+/* Puts block of class cls on cache's free list, moving the whole list to the
+ * depot first if it is full. The arena's mutex is held on entry if and only
+ * if locked is nonzero. */
+static void cache_free(slab_arena_t *arena, slab_cache_t *cache,
+                       unsigned int cls, free_block_t *block, int locked)
+{
+    if (cache->count[cls] >= SLAB_BATCH)
+    {
+        free_block_t *batch = cache->free[cls];
+        batch->count = cache->count[cls];
+        if (!locked)
+            pthread_mutex_lock(&arena->mutex);
+        batch->next_batch = arena->depot[cls];
+        arena->depot[cls] = batch;
+        if (!locked)
+            pthread_mutex_unlock(&arena->mutex);
+        cache->free[cls] = NULL;
+        cache->count[cls] = 0;
+    }
+    block->next = cache->free[cls];
+    cache->free[cls] = block;
+    cache->count[cls]++;
+}
+
+//------------------------------------------------------------------------------------------------
+// Public interface
+
+slab_arena_t *slab_arena_constructor(int huge_pages)
+{
+    slab_arena_t *arena;
+    if (posix_memalign((void **)&arena, 64, sizeof(slab_arena_t)) != 0)
+        return NULL;
+    memset(arena, 0, sizeof(slab_arena_t));
+    if (pthread_mutex_init(&arena->mutex, NULL) != 0)
+    {
+        free(arena);
+        return NULL;
+    }
+    arena->huge_pages = huge_pages;
+    return arena;
+}
+
+void slab_arena_destructor(slab_arena_t *arena)
+{
+    slab_t *chunk = arena->chunks;
+    while (chunk != NULL)
+    {
+        slab_t *next = chunk->next_chunk;
+        munmap(chunk, SLAB_CHUNK_SIZE);
+        chunk = next;
+    }
+    pthread_mutex_destroy(&arena->mutex);
+    free(arena);
+}
+
+void *slab_alloc(slab_arena_t *arena, size_t size)
+{
+    unsigned int cls = class_of(size);
+    if (cls == SLAB_CLASSES)
+        return NULL;
+
+    int slot = get_slot();
+    if (slot < SLAB_THREADS)
+        return cache_alloc(arena, &arena->caches[slot], cls, 0);
+
+    // threads without a slot of their own share the last cache
+    pthread_mutex_lock(&arena->mutex);
+    void *block = cache_alloc(arena, &arena->caches[slot], cls, 1);
+    pthread_mutex_unlock(&arena->mutex);
+    return block;
+}
+
+void slab_free(void *ptr)
+{
+    slab_t *slab = (slab_t *)((uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1));
+    slab_arena_t *arena = slab->arena;
+
+    int slot = get_slot();
+    if (slot < SLAB_THREADS)
+    {
+        cache_free(arena, &arena->caches[slot], slab->cls, ptr, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&arena->mutex);
+    cache_free(arena, &arena->caches[slot], slab->cls, ptr, 1);
+    pthread_mutex_unlock(&arena->mutex);
+}
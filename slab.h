@@ -0,0 +1,49 @@
+#ifndef SLAB_H_
+#define SLAB_H_
+
+#include <stddef.h>
+
+/*
+ * A slab allocator for small blocks that all die together, used for the
+ * nodes of the binary tree (see bst.c).
+ *
+ * An arena hands out blocks in a few size classes, each block carved from a
+ * 64 KiB slab that holds blocks of one class only; slabs in turn are carved
+ * from 2 MiB chunks mapped straight from the kernel, optionally backed by
+ * huge pages. Every thread allocates from and frees into free lists of its
+ * own, so the common case takes no lock at all; a thread whose lists grow
+ * too long hands a batch of blocks to a depot shared by the arena, where
+ * threads whose lists run dry pick them up again. Freeing the arena returns
+ * every chunk at once, without looking at the blocks in it.
+ */
+typedef struct slab_arena slab_arena_t;
+
+// the largest block an arena hands out
+#define SLAB_MAX_SIZE 768
+
+/*
+ * Creates an empty arena. If huge_pages is nonzero its chunks are backed by
+ * huge pages where the system allows it. Returns NULL on failure.
+ */
+slab_arena_t *slab_arena_constructor(int huge_pages);
+
+/*
+ * Frees the arena and every block allocated from it, in time proportional to
+ * the number of chunks. Only call this when no other thread is using the
+ * arena.
+ */
+void slab_arena_destructor(slab_arena_t *arena);
+
+/*
+ * Returns a block of at least size bytes, aligned to 16 bytes, or NULL if
+ * size is larger than SLAB_MAX_SIZE or memory ran out.
+ */
+void *slab_alloc(slab_arena_t *arena, size_t size);
+
+/*
+ * Returns a block from slab_alloc() to its arena. Any thread may free any
+ * block.
+ */
+void slab_free(void *ptr);
+
+#endif  // SLAB_H_
@@ -0,0 +1,866 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "./comm.h"
+#include "./db.h"
+#include "./server.h"
+#include "./uring.h"
+
+// submission queue entries per ring; the completion queue gets four times as
+// many, since multishot requests complete many times
+#define URING_ENTRIES 1024
+// receive buffers per ring, and their size
+#define URING_BUFS 256
+#define URING_BUF_SIZE 4096
+// the buffer group receives pick their buffers from
+#define URING_BGID 0
+// responses a connection may have waiting before its receives are paused
+#define URING_MAX_PENDING (256 * 1024)
+
+// what a completion is for: a connection's address with the low bits
+// telling the request apart, or one of the ring's own requests
+#define UD_RECV 0
+#define UD_SEND 1
+#define UD_IGNORE 2
+#define UD_MASK 3
+#define UD_ACCEPT 4
+#define UD_WAKE 8
+
+/* A client connection, owned by the ring that accepted it. */
+typedef struct uconn {
+    int fd;
+    int eof;         // no more input will come, or be served
+    int dead;        // the connection failed or is being closed
+    int closing;     // set by uring_close_all(); accessed atomically
+    int recv_armed;  // the multishot receive is in flight
+    int sending;     // a send is in flight
+    int paused;      // receives stopped until the client reads its responses
+    int shut;        // shutdown(2) was called to end the requests in flight
+    int dirty;       // on the ring's list of connections with new responses
+    // input and queued responses; NULL while the connection is idle
+    comm_buf_t *buf;
+    // responses being sent, from out_off on
+    char *out;
+    size_t out_len;
+    size_t out_off;
+    size_t out_cap;
+    // responses collected since that send was queued
+    char *more;
+    size_t more_len;
+    size_t more_cap;
+    // for the list of all connections
+    struct uconn *prev;
+    struct uconn *next;
+    // for the ring's list of connections with new responses
+    struct uconn *next_dirty;
+} uconn_t;
+
+/* A connection buffer on a ring's free list. */
+typedef struct ring_buf {
+    comm_buf_t buf;
+    struct ring_buf *next;
+} ring_buf_t;
+
+/* An io_uring instance and the thread that drives it. */
+typedef struct ring {
+    pthread_t thread;
+    int fd;
+    // the submission queue, shared with the kernel
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned sq_next;    // tail including the entries not published yet
+    unsigned to_submit;  // entries the kernel has not taken yet
+    // the completion queue, shared with the kernel
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    size_t sq_map_len;
+    void *cq_map;
+    size_t cq_map_len;
+    size_t sqes_len;
+    // the receive buffers and the ring handing them to the kernel
+    struct io_uring_buf_ring *br;
+    size_t br_len;
+    char *bufs;
+    unsigned short br_tail;
+    // read by the ring to learn that it should stop
+    int wake_fd;
+    uint64_t wake_val;
+    int stopping;
+    uconn_t *dirty;
+    ring_buf_t *free_bufs;
+} ring_t;
+
+static int listen_fd = -1;
+static ring_t *rings;
+static int num_rings;
+
+// every open connection
+static uconn_t *conns;
+static pthread_mutex_t conns_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void conn_arm_recv(ring_t *ring, uconn_t *conn);
+static void conn_settle(ring_t *ring, uconn_t *conn);
+
+//------------------------------------------------------------------------------------------------
+// Rings
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_register(int fd, unsigned op, void *arg, unsigned nr)
+{
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+/* Submits the queued entries and, if wait is nonzero, waits for at least
+ * one completion. Returns -1 on failure. */
+static int ring_enter(ring_t *ring, unsigned wait)
+{
+    __atomic_store_n(ring->sq_tail, ring->sq_next, __ATOMIC_RELEASE);
+    COMM_SYSCALL();
+    int n = (int)syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait,
+                         wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (n < 0)
+        return (errno == EINTR || errno == EAGAIN || errno == EBUSY) ? 0 : -1;
+    ring->to_submit -= n;
+    return 0;
+}
+
+/* Returns a cleared submission queue entry, or NULL if the queue is full and
+ * the kernel takes none of it. */
+static struct io_uring_sqe *ring_sqe(ring_t *ring)
+{
+    if (ring->sq_next - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+        ring->sq_entries)
+    {
+        ring_enter(ring, 0);
+        if (ring->sq_next - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+            ring->sq_entries)
+            return NULL;
+    }
+
+    unsigned idx = ring->sq_next & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+    ring->sq_next++;
+    ring->to_submit++;
+    return sqe;
+}
+
+/* Hands receive buffer bid back to the kernel. */
+static void ring_recycle(ring_t *ring, unsigned short bid)
+{
+    struct io_uring_buf *buf =
+        &ring->br->bufs[ring->br_tail & (URING_BUFS - 1)];
+    buf->addr = (uintptr_t)(ring->bufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    ring->br_tail++;
+    __atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+}
+
+/* Returns nonzero if the kernel supports opcode op, as far as probe says. */
+static int ring_has_op(struct io_uring_probe *probe, int op)
+{
+    return op < probe->ops_len &&
+           (probe->ops[op].flags & IO_URING_OP_SUPPORTED) != 0;
+}
+
+static void ring_teardown(ring_t *ring)
+{
+    if (ring->sqes != NULL)
+        munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_map != NULL && ring->cq_map != ring->sq_map)
+        munmap(ring->cq_map, ring->cq_map_len);
+    if (ring->sq_map != NULL)
+        munmap(ring->sq_map, ring->sq_map_len);
+    if (ring->br != NULL)
+        munmap(ring->br, ring->br_len);
+    free(ring->bufs);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    if (ring->wake_fd >= 0)
+        close(ring->wake_fd);
+    while (ring->free_bufs != NULL)
+    {
+        ring_buf_t *next = ring->free_bufs->next;
+        free(ring->free_bufs);
+        ring->free_bufs = next;
+    }
+}
+
+/*
+ * Sets up the io_uring instance of ring, with its receive buffers. Returns -1
+ * if the kernel cannot do what the rings need; ring_teardown() cleans up
+ * either way.
+ */
+static int ring_setup(ring_t *ring)
+{
+    ring->fd = -1;
+    ring->wake_fd = -1;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = 4 * URING_ENTRIES;
+    if ((ring->fd = sys_io_uring_setup(URING_ENTRIES, &p)) < 0 &&
+        errno == EINVAL)
+    {
+        // kernels before 5.19 do not know COOP_TASKRUN
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = 4 * URING_ENTRIES;
+        ring->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    }
+    if (ring->fd < 0)
+        return -1;
+
+    // multishot receives came with Linux 6.0, as did zero-copy sends, which
+    // the probe does list
+    size_t probe_len =
+        sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_len);
+    if (probe == NULL)
+        return -1;
+    int ok = sys_io_uring_register(ring->fd, IORING_REGISTER_PROBE, probe,
+                                   256) == 0 &&
+             ring_has_op(probe, IORING_OP_ACCEPT) &&
+             ring_has_op(probe, IORING_OP_RECV) &&
+             ring_has_op(probe, IORING_OP_SEND) &&
+             ring_has_op(probe, IORING_OP_READ) &&
+             ring_has_op(probe, IORING_OP_ASYNC_CANCEL) &&
+             ring_has_op(probe, IORING_OP_SEND_ZC);
+    free(probe);
+    if (!ok)
+        return -1;
+
+    ring->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_map_len =
+        p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_map_len > ring->sq_map_len)
+            ring->sq_map_len = ring->cq_map_len;
+        ring->cq_map_len = ring->sq_map_len;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED)
+    {
+        ring->sq_map = NULL;
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cq_map = ring->sq_map;
+    }
+    else
+    {
+        ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED)
+        {
+            ring->cq_map = NULL;
+            return -1;
+        }
+    }
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        return -1;
+    }
+
+    char *sq = ring->sq_map;
+    char *cq = ring->cq_map;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+    ring->sq_next = *ring->sq_tail;
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // the receive buffers, registered as a provided buffer ring (Linux 5.19)
+    ring->br_len = URING_BUFS * sizeof(struct io_uring_buf);
+    ring->br = mmap(NULL, ring->br_len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->br == MAP_FAILED)
+    {
+        ring->br = NULL;
+        return -1;
+    }
+    if ((ring->bufs = malloc((size_t)URING_BUFS * URING_BUF_SIZE)) == NULL)
+        return -1;
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ring->br;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = URING_BGID;
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return -1;
+    for (int i = 0; i < URING_BUFS; i++)
+        ring_recycle(ring, i);
+
+    if ((ring->wake_fd = eventfd(0, EFD_CLOEXEC)) < 0)
+        return -1;
+    return 0;
+}
+
+static void ring_arm_accept(ring_t *ring)
+{
+    struct io_uring_sqe *sqe = ring_sqe(ring);
+    if (sqe == NULL)
+    {
+        fprintf(stderr, "io_uring: submission queue full\n");
+        exit(1);
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = UD_ACCEPT;
+}
+
+static void ring_arm_wake(ring_t *ring)
+{
+    struct io_uring_sqe *sqe = ring_sqe(ring);
+    if (sqe == NULL)
+    {
+        fprintf(stderr, "io_uring: submission queue full\n");
+        exit(1);
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = ring->wake_fd;
+    sqe->addr = (uintptr_t)&ring->wake_val;
+    sqe->len = sizeof(ring->wake_val);
+    sqe->off = (uint64_t)-1;
+    sqe->user_data = UD_WAKE;
+}
+
+static comm_buf_t *ring_buf_get(ring_t *ring)
+{
+    ring_buf_t *rb = ring->free_bufs;
+    if (rb != NULL)
+        ring->free_bufs = rb->next;
+    else if ((rb = malloc(sizeof(ring_buf_t))) == NULL)
+        return NULL;
+    comm_buf_init(&rb->buf);
+    return &rb->buf;
+}
+
+static void ring_buf_put(ring_t *ring, comm_buf_t *buf)
+{
+    ring_buf_t *rb = (ring_buf_t *)buf;
+    rb->next = ring->free_bufs;
+    ring->free_bufs = rb;
+}
+
+//------------------------------------------------------------------------------------------------
+// Connections
+
+static void conn_open(ring_t *ring, int fd)
+{
+    if (stop_accepting)
+    {
+        COMM_SYSCALL();
+        close(fd);
+        return;
+    }
+
+    struct sockaddr_in client_addr;
+    socklen_t client_len = sizeof(client_addr);
+    COMM_SYSCALL();
+    if (getpeername(fd, (struct sockaddr *)&client_addr, &client_len) == 0)
+        fprintf(stderr, "received connection from %s#%hu\n",
+                inet_ntoa(client_addr.sin_addr), client_addr.sin_port);
+
+    uconn_t *conn = calloc(1, sizeof(uconn_t));
+    if (conn == NULL)
+    {
+        perror("calloc");
+        COMM_SYSCALL();
+        close(fd);
+        return;
+    }
+    conn->fd = fd;
+    client_count_add();
+
+    pthread_mutex_lock(&conns_mutex);
+    conn->next = conns;
+    if (conns != NULL)
+        conns->prev = conn;
+    conns = conn;
+    pthread_mutex_unlock(&conns_mutex);
+
+    conn_arm_recv(ring, conn);
+    conn_settle(ring, conn);
+}
+
+static void conn_free(ring_t *ring, uconn_t *conn)
+{
+    pthread_mutex_lock(&conns_mutex);
+    if (conn->prev != NULL)
+        conn->prev->next = conn->next;
+    else
+        conns = conn->next;
+    if (conn->next != NULL)
+        conn->next->prev = conn->prev;
+    pthread_mutex_unlock(&conns_mutex);
+
+    COMM_SYSCALL();
+    if (close(conn->fd) < 0)
+        perror("close");
+    if (conn->buf != NULL)
+        ring_buf_put(ring, conn->buf);
+    free(conn->out);
+    free(conn->more);
+    free(conn);
+    fprintf(stderr, "client connection terminated\n");
+    client_count_remove();
+}
+
+static void conn_arm_recv(ring_t *ring, uconn_t *conn)
+{
+    struct io_uring_sqe *sqe = ring_sqe(ring);
+    if (sqe == NULL)
+    {
+        conn->dead = 1;
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = (uintptr_t)conn | UD_RECV;
+    conn->recv_armed = 1;
+}
+
+/* Queues a send of the responses collected so far. */
+static void conn_send(ring_t *ring, uconn_t *conn)
+{
+    struct io_uring_sqe *sqe = ring_sqe(ring);
+    if (sqe == NULL)
+    {
+        conn->dead = 1;
+        return;
+    }
+
+    // the buffer sent last time takes the next responses
+    char *spare = conn->out;
+    size_t spare_cap = conn->out_cap;
+    conn->out = conn->more;
+    conn->out_cap = conn->more_cap;
+    conn->out_len = conn->more_len;
+    conn->out_off = 0;
+    conn->more = spare;
+    conn->more_cap = spare_cap;
+    conn->more_len = 0;
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t)conn->out;
+    sqe->len = conn->out_len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t)conn | UD_SEND;
+    conn->sending = 1;
+}
+
+/*
+ * Serves every command in the connection's input, collecting the responses
+ * for the next send; nothing stays pinned in the database afterwards. A scan
+ * stops for the client to catch up once more than URING_MAX_PENDING bytes
+ * wait to be sent, and goes on when they are (see conn_sent()), unless drain
+ * is nonzero: then the input has to make room for more.
+ */
+static void conn_serve(ring_t *ring, uconn_t *conn, int drain)
+{
+    comm_buf_t *buf = conn->buf;
+    comm_cmd_t command;
+    int ret;
+
+    while (!conn->dead &&
+           !(comm_scanning(buf) && !drain &&
+             conn->more_len + conn->out_len - conn->out_off >
+                 URING_MAX_PENDING) &&
+           (ret = comm_next_command(buf, &command, conn->eof)) != 0)
+    {
+        if (ret < 0)
+        {
+            conn->dead = 1;
+            break;
+        }
+        if (client_control_wait_unless(&conn->closing))
+        {
+            conn->dead = 1;
+            break;
+        }
+        if (comm_buf_full(buf) &&
+            comm_collect(buf, &conn->more, &conn->more_len,
+                         &conn->more_cap) < 0)
+            conn->dead = 1;
+        comm_execute(buf, &command);
+    }
+    if (comm_collect(buf, &conn->more, &conn->more_len, &conn->more_cap) < 0)
+        conn->dead = 1;
+
+    if (conn->more_len > 0 && !conn->dirty)
+    {
+        conn->dirty = 1;
+        conn->next_dirty = ring->dirty;
+        ring->dirty = conn;
+    }
+
+    // stop reading from a client that does not read its responses
+    if (conn->more_len + conn->out_len - conn->out_off > URING_MAX_PENDING &&
+        conn->recv_armed && !conn->paused)
+    {
+        struct io_uring_sqe *sqe = ring_sqe(ring);
+        if (sqe != NULL)
+        {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = (uintptr_t)conn | UD_RECV;
+            sqe->user_data = (uintptr_t)conn | UD_IGNORE;
+            conn->paused = 1;
+        }
+    }
+}
+
+/* Takes in len bytes the connection received. */
+static void conn_input(ring_t *ring, uconn_t *conn, const char *data,
+                       size_t len)
+{
+    if (conn->buf == NULL && (conn->buf = ring_buf_get(ring)) == NULL)
+    {
+        conn->dead = 1;
+        return;
+    }
+    comm_buf_t *buf = conn->buf;
+
+    while (len > 0 && !conn->dead)
+    {
+        if (buf->in_start > 0)
+        {
+            memmove(buf->in, buf->in + buf->in_start,
+                    buf->in_end - buf->in_start);
+            buf->in_end -= buf->in_start;
+            buf->in_start = 0;
+        }
+        size_t n = COMM_INLEN - buf->in_end;
+        if (n > len)
+            n = len;
+        memcpy(buf->in + buf->in_end, data, n);
+        buf->in_end += n;
+        data += n;
+        len -= n;
+        conn_serve(ring, conn, len > 0);
+    }
+}
+
+static void conn_received(ring_t *ring, uconn_t *conn, int res,
+                          unsigned flags)
+{
+    if (!(flags & IORING_CQE_F_MORE))
+        conn->recv_armed = 0;
+
+    if (res > 0)
+    {
+        unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (!conn->eof && !conn->dead)
+            conn_input(ring, conn, ring->bufs + (size_t)bid * URING_BUF_SIZE,
+                       res);
+        ring_recycle(ring, bid);
+    }
+    else if (res == 0)
+    {
+        // an unterminated last line still counts, as with fgets()
+        conn->eof = 1;
+        if (conn->buf != NULL && !conn->dead)
+            conn_serve(ring, conn, 0);
+    }
+    else if (res != -ENOBUFS && res != -ECANCELED)
+    {
+        conn->dead = 1;
+    }
+
+    // the receive also ends when the buffers run out for a moment
+    if (!conn->recv_armed && !conn->eof && !conn->dead && !conn->paused)
+        conn_arm_recv(ring, conn);
+    conn_settle(ring, conn);
+}
+
+static void conn_sent(ring_t *ring, uconn_t *conn, int res)
+{
+    conn->sending = 0;
+    if (res < 0)
+    {
+        conn->dead = 1;
+    }
+    else if ((conn->out_off += res) < conn->out_len)
+    {
+        struct io_uring_sqe *sqe = ring_sqe(ring);
+        if (sqe == NULL)
+        {
+            conn->dead = 1;
+        }
+        else
+        {
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = conn->fd;
+            sqe->addr = (uintptr_t)(conn->out + conn->out_off);
+            sqe->len = conn->out_len - conn->out_off;
+            sqe->msg_flags = MSG_NOSIGNAL;
+            sqe->user_data = (uintptr_t)conn | UD_SEND;
+            conn->sending = 1;
+        }
+    }
+
+    if (!conn->sending && !conn->dead)
+    {
+        if (conn->more_len > 0)
+        {
+            conn_send(ring, conn);
+        }
+        else if (conn->buf != NULL && comm_scanning(conn->buf))
+        {
+            // the client has caught up with the scan it stopped
+            conn_serve(ring, conn, 0);
+        }
+        else
+        {
+            // the client has caught up, so it needs no output buffers
+            free(conn->out);
+            free(conn->more);
+            conn->out = conn->more = NULL;
+            conn->out_len = conn->out_off = conn->out_cap = 0;
+            conn->more_cap = 0;
+            if (conn->paused)
+            {
+                conn->paused = 0;
+                if (!conn->recv_armed && !conn->eof)
+                    conn_arm_recv(ring, conn);
+            }
+        }
+    }
+    conn_settle(ring, conn);
+}
+
+/*
+ * Closes the connection once it is done with: its input has ended and its
+ * responses are sent, or it failed, and no request on it is in flight.
+ */
+static void conn_settle(ring_t *ring, uconn_t *conn)
+{
+    if (__atomic_load_n(&conn->closing, __ATOMIC_RELAXED))
+        conn->dead = 1;
+    int scanning = conn->buf != NULL && comm_scanning(conn->buf);
+    if (!conn->eof && !conn->dead)
+    {
+        if (conn->buf != NULL && conn->buf->in_start == conn->buf->in_end &&
+            !scanning)
+        {
+            ring_buf_put(ring, conn->buf);
+            conn->buf = NULL;
+        }
+        return;
+    }
+    // responses still to go out
+    if (conn->dirty ||
+        (!conn->dead && (conn->sending || conn->more_len > 0 || scanning)))
+        return;
+
+    if (conn->recv_armed || conn->sending)
+    {
+        // make the requests in flight complete
+        if (!conn->shut)
+        {
+            COMM_SYSCALL();
+            shutdown(conn->fd, SHUT_RDWR);
+            conn->shut = 1;
+        }
+        return;
+    }
+    conn_free(ring, conn);
+}
+
+//------------------------------------------------------------------------------------------------
+// Ring threads
+
+static void ring_complete(ring_t *ring, uint64_t user_data, int res,
+                          unsigned flags)
+{
+    if (user_data == UD_ACCEPT)
+    {
+        if (res >= 0)
+            conn_open(ring, res);
+        if (!(flags & IORING_CQE_F_MORE))
+            ring_arm_accept(ring);
+        return;
+    }
+    if (user_data == UD_WAKE)
+    {
+        if (!__atomic_load_n(&ring->stopping, __ATOMIC_ACQUIRE))
+            ring_arm_wake(ring);
+        return;
+    }
+
+    uconn_t *conn = (uconn_t *)(uintptr_t)(user_data & ~(uint64_t)UD_MASK);
+    switch (user_data & UD_MASK)
+    {
+    case UD_RECV:
+        conn_received(ring, conn, res, flags);
+        break;
+    case UD_SEND:
+        conn_sent(ring, conn, res);
+        break;
+    default:
+        break;
+    }
+}
+
+/* Queues a send for every connection that has new responses, once the
+ * changes they answer are durable. */
+static void ring_flush(ring_t *ring)
+{
+    if (ring->dirty != NULL)
+        db_sync();
+    while (ring->dirty != NULL)
+    {
+        uconn_t *conn = ring->dirty;
+        ring->dirty = conn->next_dirty;
+        conn->dirty = 0;
+        if (!conn->sending && !conn->dead)
+            conn_send(ring, conn);
+        conn_settle(ring, conn);
+    }
+}
+
+static void *ring_main(void *arg)
+{
+    ring_t *ring = (ring_t *)arg;
+    ring_arm_accept(ring);
+    ring_arm_wake(ring);
+
+    while (!__atomic_load_n(&ring->stopping, __ATOMIC_ACQUIRE))
+    {
+        // submit everything queued since the last round, and wait
+        if (ring_enter(ring, 1) < 0)
+        {
+            perror("io_uring_enter");
+            exit(1);
+        }
+
+        unsigned head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            uint64_t user_data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+            ring_complete(ring, user_data, res, flags);
+        }
+        ring_flush(ring);
+    }
+    return NULL;
+}
+
+//------------------------------------------------------------------------------------------------
+// Public interface
+
+int uring_start(int port, int count)
+{
+    if ((rings = calloc(count, sizeof(ring_t))) == NULL)
+    {
+        perror("calloc");
+        return -1;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (ring_setup(&rings[i]) < 0)
+        {
+            for (int j = 0; j <= i; j++)
+                ring_teardown(&rings[j]);
+            free(rings);
+            rings = NULL;
+            return -1;
+        }
+    }
+
+    comm_raise_fd_limit();
+    listen_fd = comm_listen(port, SOMAXCONN);
+
+    int err;
+    for (; num_rings < count; num_rings++)
+    {
+        if ((err = pthread_create(&rings[num_rings].thread, 0, ring_main,
+                                  &rings[num_rings])) != 0)
+            handle_error_en(err, "pthread_create");
+    }
+
+    fprintf(stderr, "listening on port %d (%d io_uring threads)\n", port,
+            count);
+    return 0;
+}
+
+void uring_close_all(void)
+{
+    pthread_mutex_lock(&conns_mutex);
+    for (uconn_t *conn = conns; conn != NULL; conn = conn->next)
+    {
+        // the ring sees the flag when the dead socket completes its requests
+        __atomic_store_n(&conn->closing, 1, __ATOMIC_RELAXED);
+        COMM_SYSCALL();
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&conns_mutex);
+}
+
+void uring_stop(void)
+{
+    for (int i = 0; i < num_rings; i++)
+    {
+        uint64_t one = 1;
+        __atomic_store_n(&rings[i].stopping, 1, __ATOMIC_RELEASE);
+        COMM_SYSCALL();
+        if (write(rings[i].wake_fd, &one, sizeof(one)) < 0)
+            perror("write");
+    }
+    for (int i = 0; i < num_rings; i++)
+    {
+        pthread_join(rings[i].thread, NULL);
+        ring_teardown(&rings[i]);
+    }
+    free(rings);
+    close(listen_fd);
+}
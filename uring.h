@@ -0,0 +1,42 @@
+#ifndef URING_H_
+#define URING_H_
+
+/*
+ * The server's io_uring connection handling, a third way to serve clients
+ * next to one thread per client (server.c) and the epoll event loop
+ * (evloop.c).
+ *
+ * Each of a few ring threads owns an io_uring instance and the connections it
+ * accepted. A multishot accept on the listening socket feeds it connections,
+ * and a multishot receive per connection fills buffers the thread registered
+ * with the ring up front, so neither needs a new request per event. The
+ * thread serves the commands of every receive as it reaps it and collects the
+ * responses; once it has gone through all completions at hand, it queues one
+ * send per connection with responses and submits them all, together with
+ * anything else it has queued, in the same io_uring_enter(2) that waits for
+ * the next completions. A busy ring thus makes far less than one system call
+ * per command.
+ *
+ * Connections are counted with client_count_add() like those of the event
+ * loop, the ring threads honour client_control_stop(), and delete_all()
+ * closes every connection through uring_close_all().
+ */
+
+/*
+ * Starts listening on port with the given number of ring threads. Returns -1,
+ * before listening, if the kernel lacks io_uring or the features used here
+ * (multishot accept and receive, and provided buffer rings).
+ */
+int uring_start(int port, int rings);
+
+/*
+ * Closes every connection. Commands already received but not served yet are
+ * dropped, once client_control_wake() lets go of ring threads that are
+ * stopped.
+ */
+void uring_close_all(void);
+
+/* Stops and joins every ring thread and closes the listening socket. */
+void uring_stop(void);
+
+#endif  // URING_H_
@@ -0,0 +1,635 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "./wal.h"
+
+// bytes of records appended but not written yet; appending waits beyond this
+#define WAL_BUFFER (4 << 20)
+// bytes of a record before its key: checksum, kind, key and value lengths
+#define WAL_HEADER 9
+// bytes a checkpoint is written out in
+#define WAL_CHECKPOINT_BUFFER (1 << 16)
+// bytes a checkpoint file starts with: CHECKPOINT_MAGIC, then the number of
+// the first log file it does not cover and the parts it is written in
+#define CHECKPOINT_HEADER 24
+static const char CHECKPOINT_MAGIC[8] = "DBCKPT2";
+
+struct wal {
+    char *path;
+    int policy;
+    // held while writing to or syncing fd, or while replacing it; whoever
+    // holds it takes the buffer, so records reach the file in order
+    pthread_mutex_t io;
+    int fd;             // the log file appended to
+    unsigned long gen;  // its number
+    pthread_mutex_t mutex;  // guards everything below
+    pthread_cond_t work;    // signalled when the buffer stops being empty
+    pthread_cond_t space;   // broadcast when the buffer has been taken
+    // broadcast when a flush has synced, the one of flush n being
+    // synced_cond[n % 2], so that threads waiting for the next flush sleep on
+    pthread_cond_t synced_cond[2];
+    char *buf;    // records appended but not written yet
+    size_t len;
+    char *spare;  // the other buffer, being written or free
+    // positions in all that was ever appended: the end of the last record,
+    // of what the last flush took, of what has been written, of what has
+    // been synced, and where the current log file starts
+    unsigned long appended;
+    unsigned long taken;
+    unsigned long written;
+    unsigned long synced;
+    unsigned long rotated;
+    unsigned long flushes;  // the number of the last flush
+    // threads waiting for the next flush, and how many waited for the last
+    int waiting;
+    int group;
+    struct timespec sync_at;  // when WAL_FSYNC_INTERVAL syncs next
+    int stopping;
+    pthread_t flusher;
+};
+
+struct wal_checkpoint {
+    wal_t *wal;
+    int fd;
+    unsigned long gen;  // the first log file it does not cover
+    int failed;
+    size_t len;
+    char buf[WAL_CHECKPOINT_BUFFER];
+};
+
+//------------------------------------------------------------------------------------------------
+// Helpers
+
+/* Stops the server: once the log cannot be written, changes can no longer be
+ * made durable. */
+static void wal_fail(const char *what)
+{
+    perror(what);
+    exit(1);
+}
+
+/* Continues the 32-bit FNV-1a hash sum over the len bytes at data. */
+static uint32_t checksum(uint32_t sum, const char *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        sum ^= (unsigned char)data[i];
+        sum *= 16777619u;
+    }
+    return sum;
+}
+
+/* Fills in the header at dst of a record of the given kind and contents: its
+ * checksum, which covers all of the record but itself, and the rest. */
+static void record_header(char *dst, int op, const char *key,
+                          size_t key_len, const char *value, size_t value_len)
+{
+    uint16_t lens[2] = {key_len, value_len};
+    dst[4] = op;
+    memcpy(dst + 5, lens, sizeof(lens));
+    uint32_t sum = checksum(2166136261u, dst + 4, WAL_HEADER - 4);
+    sum = checksum(sum, key, key_len);
+    sum = checksum(sum, value, value_len);
+    memcpy(dst, &sum, sizeof(sum));
+}
+
+/* Writes the len bytes at data to fd. Returns 0 on success and -1 on
+ * failure. */
+static int write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Syncs the directory the files at path are in, so that files created,
+ * renamed or removed there stay so. */
+static void sync_dir(const char *path)
+{
+    char dir[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL)
+        strcpy(dir, ".");
+    else if (slash == path)
+        strcpy(dir, "/");
+    else
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd >= 0)
+    {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/* Stores the name of the n-th log file in name. */
+static void log_name(const wal_t *wal, unsigned long n, char *name)
+{
+    snprintf(name, PATH_MAX, "%s.%lu", wal->path, n);
+}
+
+/*
+ * Maps the file called name and hands its records to replay: for a
+ * checkpoint those past its header, whose log file number goes to *gen and
+ * whose number of parts goes to replay.
+ * Stores in *valid how many bytes of the file end with its last complete
+ * record. Returns 1 on success, 0 if there is no such file and -1 on failure
+ * or if a checkpoint is damaged.
+ */
+static int replay_file(const char *name, unsigned int checkpoint,
+                       wal_replay_t replay, void *arg, unsigned long *gen,
+                       size_t *valid)
+{
+    int fd = open(name, O_RDONLY);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -1;
+    struct stat st;
+    char *map = NULL;
+    if (fstat(fd, &st) < 0 ||
+        (st.st_size > 0 && (map = mmap(NULL, st.st_size, PROT_READ,
+                                       MAP_PRIVATE, fd, 0)) == MAP_FAILED))
+    {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    size_t size = st.st_size;
+    const char *start = map;
+    const char *end = map + size;
+    if (checkpoint)
+    {
+        uint64_t number, parts;
+        if (size < CHECKPOINT_HEADER ||
+            memcmp(map, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0)
+        {
+            if (map != NULL)
+                munmap(map, size);
+            return -1;
+        }
+        memcpy(&number, map + sizeof(CHECKPOINT_MAGIC), sizeof(number));
+        memcpy(&parts, map + sizeof(CHECKPOINT_MAGIC) + sizeof(number),
+               sizeof(parts));
+        if (parts == 0 || parts > UINT_MAX)
+        {
+            munmap(map, size);
+            return -1;
+        }
+        *gen = number;
+        checkpoint = parts;
+        start += CHECKPOINT_HEADER;
+    }
+
+    const char *pos = start;
+    wal_record_t record;
+    while (wal_next(&pos, end, &record))
+        ;
+    // a checkpoint is only put in place once it is complete
+    if (checkpoint && pos != end)
+    {
+        munmap(map, size);
+        return -1;
+    }
+    if (pos > start)
+        replay(arg, start, pos - start, checkpoint);
+    *valid = pos - map;
+    if (map != NULL)
+        munmap(map, size);
+    return 1;
+}
+
+//------------------------------------------------------------------------------------------------
+// Flushing
+
+/* Sets ts to us microseconds from now. */
+static void time_after(struct timespec *ts, long us)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += us / 1000000;
+    ts->tv_nsec += us % 1000000 * 1000;
+    if (ts->tv_nsec >= 1000000000)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+/* Returns whether the time in ts has come. */
+static int time_passed(const struct timespec *ts)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec > ts->tv_sec ||
+           (now.tv_sec == ts->tv_sec && now.tv_nsec >= ts->tv_nsec);
+}
+
+/*
+ * Takes the buffer and writes it out, then syncs the log file unless the
+ * policy says it is not time to yet. Called and returns with
+ * wal->mutex held, but lets go of it meanwhile, so appending goes on into
+ * the other buffer.
+ */
+static void flush(wal_t *wal)
+{
+    int sync = 1;
+    pthread_mutex_unlock(&wal->mutex);
+    pthread_mutex_lock(&wal->io);
+    pthread_mutex_lock(&wal->mutex);
+    char *out = wal->buf;
+    size_t len = wal->len;
+    unsigned long end = wal->appended;
+    wal->buf = wal->spare;
+    wal->spare = out;
+    wal->len = 0;
+    wal->taken = end;
+    unsigned long flush = ++wal->flushes;
+    wal->group = wal->waiting > 0 ? wal->waiting : 1;
+    wal->waiting = 0;
+    pthread_cond_broadcast(&wal->space);
+    if (wal->policy == WAL_FSYNC_INTERVAL && !wal->stopping &&
+        !time_passed(&wal->sync_at))
+        sync = 0;
+    pthread_mutex_unlock(&wal->mutex);
+
+    if (write_all(wal->fd, out, len) < 0)
+        wal_fail("could not write the log");
+    if (sync && fdatasync(wal->fd) < 0)
+        wal_fail("could not sync the log");
+
+    pthread_mutex_lock(&wal->mutex);
+    wal->written = end;
+    if (sync)
+    {
+        wal->synced = end;
+        time_after(&wal->sync_at, WAL_INTERVAL_MS * 1000L);
+        pthread_cond_broadcast(&wal->synced_cond[flush % 2]);
+    }
+    pthread_mutex_unlock(&wal->io);
+}
+
+static void *flusher_main(void *arg)
+{
+    wal_t *wal = arg;
+    pthread_mutex_lock(&wal->mutex);
+    while (wal->len > 0 || !wal->stopping)
+    {
+        if (wal->len == 0 && wal->synced == wal->written)
+        {
+            pthread_cond_wait(&wal->work, &wal->mutex);
+            continue;
+        }
+        // under WAL_FSYNC_INTERVAL, what has been appended is written out
+        // when the time to sync comes, or once it fills half the buffer
+        if (wal->policy == WAL_FSYNC_INTERVAL && !wal->stopping &&
+            wal->len < WAL_BUFFER / 2 && !time_passed(&wal->sync_at))
+        {
+            pthread_cond_timedwait(&wal->work, &wal->mutex, &wal->sync_at);
+            continue;
+        }
+        if (wal->policy == WAL_FSYNC_BATCH)
+        {
+            // wait until as many threads wait for this sync as took part in
+            // the last one, or WAL_BATCH_US at most
+            struct timespec until;
+            time_after(&until, WAL_BATCH_US);
+            while (!wal->stopping && wal->waiting < wal->group &&
+                   pthread_cond_timedwait(&wal->work, &wal->mutex, &until) !=
+                       ETIMEDOUT)
+                ;
+        }
+        flush(wal);
+    }
+    pthread_mutex_unlock(&wal->mutex);
+    return NULL;
+}
+
+//------------------------------------------------------------------------------------------------
+// The log
+
+/* Frees a log that wal_open() could not open, or that wal_close() closed. */
+static void wal_free(wal_t *wal)
+{
+    if (wal->fd >= 0)
+        close(wal->fd);
+    pthread_mutex_destroy(&wal->io);
+    pthread_mutex_destroy(&wal->mutex);
+    pthread_cond_destroy(&wal->work);
+    pthread_cond_destroy(&wal->space);
+    pthread_cond_destroy(&wal->synced_cond[0]);
+    pthread_cond_destroy(&wal->synced_cond[1]);
+    free(wal->buf);
+    free(wal->spare);
+    free(wal->path);
+    free(wal);
+}
+
+wal_t *wal_open(const char *path, int policy, wal_replay_t replay, void *arg)
+{
+    wal_t *wal = calloc(1, sizeof(wal_t));
+    if (wal == NULL)
+        return NULL;
+    wal->policy = policy;
+    wal->fd = -1;
+    wal->gen = 1;
+    wal->group = 1;
+    pthread_mutex_init(&wal->io, NULL);
+    pthread_mutex_init(&wal->mutex, NULL);
+    pthread_cond_init(&wal->work, NULL);
+    pthread_cond_init(&wal->space, NULL);
+    pthread_cond_init(&wal->synced_cond[0], NULL);
+    pthread_cond_init(&wal->synced_cond[1], NULL);
+    wal->path = strdup(path);
+    wal->buf = malloc(WAL_BUFFER);
+    wal->spare = malloc(WAL_BUFFER);
+    if (wal->path == NULL || wal->buf == NULL || wal->spare == NULL)
+    {
+        wal_free(wal);
+        return NULL;
+    }
+
+    // the checkpoint first, then the log files from the one it names on
+    char name[PATH_MAX];
+    size_t valid = 0;
+    snprintf(name, sizeof(name), "%s.ckpt", path);
+    if (replay_file(name, 1, replay, arg, &wal->gen, &valid) < 0)
+    {
+        wal_free(wal);
+        return NULL;
+    }
+    valid = 0;
+    unsigned long n;
+    for (n = wal->gen;; n++)
+    {
+        log_name(wal, n, name);
+        int found = replay_file(name, 0, replay, arg, NULL, &valid);
+        if (found < 0)
+        {
+            wal_free(wal);
+            return NULL;
+        }
+        if (found == 0)
+            break;
+    }
+
+    // appending goes on in the last log file, after its last whole record
+    if (n > wal->gen)
+        wal->gen = n - 1;
+    log_name(wal, wal->gen, name);
+    if ((wal->fd = open(name, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0 ||
+        ftruncate(wal->fd, valid) < 0 || fsync(wal->fd) < 0)
+    {
+        wal_free(wal);
+        return NULL;
+    }
+    sync_dir(path);
+    time_after(&wal->sync_at, WAL_INTERVAL_MS * 1000L);
+    if (pthread_create(&wal->flusher, NULL, flusher_main, wal) != 0)
+    {
+        wal_free(wal);
+        return NULL;
+    }
+    return wal;
+}
+
+int wal_next(const char **pos, const char *end, wal_record_t *record)
+{
+    const char *p = *pos;
+    uint32_t sum;
+    uint16_t lens[2];
+    if (end - p < WAL_HEADER)
+        return 0;
+    memcpy(&sum, p, sizeof(sum));
+    memcpy(lens, p + 5, sizeof(lens));
+    if ((size_t)(end - p) < WAL_HEADER + (size_t)lens[0] + lens[1] ||
+        checksum(2166136261u, p + 4, WAL_HEADER - 4 + lens[0] + lens[1]) !=
+            sum)
+        return 0;
+
+    record->op = p[4];
+    record->key = p + WAL_HEADER;
+    record->key_len = lens[0];
+    record->value = record->key + lens[0];
+    record->value_len = lens[1];
+    *pos = record->value + lens[1];
+    return 1;
+}
+
+unsigned long wal_append(wal_t *wal, int op, const char *key, size_t key_len,
+                         const char *value, size_t value_len)
+{
+    char header[WAL_HEADER];
+    size_t size = WAL_HEADER + key_len + value_len;
+    record_header(header, op, key, key_len, value, value_len);
+
+    // a thread is not cancelled while it holds the mutex
+    int state;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+    pthread_mutex_lock(&wal->mutex);
+    while (wal->len + size > WAL_BUFFER)
+        pthread_cond_wait(&wal->space, &wal->mutex);
+    if (wal->len == 0 ||
+        (wal->len < WAL_BUFFER / 2 && wal->len + size >= WAL_BUFFER / 2))
+        pthread_cond_signal(&wal->work);
+    char *dst = wal->buf + wal->len;
+    memcpy(dst, header, WAL_HEADER);
+    memcpy(dst + WAL_HEADER, key, key_len);
+    if (value_len > 0)
+        memcpy(dst + WAL_HEADER + key_len, value, value_len);
+    wal->len += size;
+    unsigned long pos = wal->appended += size;
+    pthread_mutex_unlock(&wal->mutex);
+    pthread_setcancelstate(state, NULL);
+    return pos;
+}
+
+void wal_wait(wal_t *wal, unsigned long pos)
+{
+    if (wal->policy == WAL_FSYNC_INTERVAL)
+        return;
+    int state;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+    pthread_mutex_lock(&wal->mutex);
+    while (wal->synced < pos)
+    {
+        // the flush that has taken pos, or the next one
+        unsigned long flush = wal->flushes;
+        if (pos > wal->taken)
+        {
+            flush++;
+            if (++wal->waiting == wal->group)
+                pthread_cond_signal(&wal->work);
+        }
+        pthread_cond_wait(&wal->synced_cond[flush % 2], &wal->mutex);
+    }
+    pthread_mutex_unlock(&wal->mutex);
+    pthread_setcancelstate(state, NULL);
+}
+
+unsigned long wal_size(wal_t *wal)
+{
+    pthread_mutex_lock(&wal->mutex);
+    unsigned long size = wal->appended - wal->rotated;
+    pthread_mutex_unlock(&wal->mutex);
+    return size;
+}
+
+void wal_close(wal_t *wal)
+{
+    pthread_mutex_lock(&wal->mutex);
+    wal->stopping = 1;
+    pthread_cond_signal(&wal->work);
+    pthread_mutex_unlock(&wal->mutex);
+    pthread_join(wal->flusher, NULL);
+    // under WAL_FSYNC_INTERVAL the last write may not have been synced
+    if (fdatasync(wal->fd) < 0)
+        perror("could not sync the log");
+    wal_free(wal);
+}
+
+//------------------------------------------------------------------------------------------------
+// Checkpoints
+
+/* Writes out the checkpoint's buffer, unless it has failed already. */
+static void checkpoint_flush(wal_checkpoint_t *checkpoint)
+{
+    if (!checkpoint->failed &&
+        write_all(checkpoint->fd, checkpoint->buf, checkpoint->len) < 0)
+        checkpoint->failed = 1;
+    checkpoint->len = 0;
+}
+
+/*
+ * Starts a new log file: writes out and syncs what the current one is
+ * still owed, then opens the next one for everything appended from now on.
+ * Returns 0 on success and -1 on failure, leaving the current one in use.
+ */
+static int rotate(wal_t *wal)
+{
+    char name[PATH_MAX];
+    pthread_mutex_lock(&wal->mutex);
+    flush(wal);
+    pthread_mutex_unlock(&wal->mutex);
+
+    // nothing is written while the file is replaced; whatever has been
+    // appended meanwhile goes to the new one
+    pthread_mutex_lock(&wal->io);
+    log_name(wal, wal->gen + 1, name);
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0)
+    {
+        pthread_mutex_unlock(&wal->io);
+        return -1;
+    }
+    sync_dir(wal->path);
+    int old = wal->fd;
+    pthread_mutex_lock(&wal->mutex);
+    if (fdatasync(old) < 0)
+        wal_fail("could not sync the log");
+    wal->fd = fd;
+    wal->gen++;
+    wal->synced = wal->written;
+    wal->rotated = wal->written;
+    pthread_cond_broadcast(&wal->synced_cond[0]);
+    pthread_cond_broadcast(&wal->synced_cond[1]);
+    pthread_mutex_unlock(&wal->mutex);
+    pthread_mutex_unlock(&wal->io);
+    close(old);
+    return 0;
+}
+
+wal_checkpoint_t *wal_checkpoint_begin(wal_t *wal, unsigned int parts)
+{
+    wal_checkpoint_t *checkpoint = malloc(sizeof(wal_checkpoint_t));
+    if (checkpoint == NULL)
+        return NULL;
+    if (rotate(wal) < 0)
+    {
+        free(checkpoint);
+        return NULL;
+    }
+
+    char name[PATH_MAX];
+    snprintf(name, sizeof(name), "%s.ckpt.tmp", wal->path);
+    if ((checkpoint->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    {
+        free(checkpoint);
+        return NULL;
+    }
+    checkpoint->wal = wal;
+    checkpoint->gen = wal->gen;
+    checkpoint->failed = 0;
+    uint64_t number = checkpoint->gen, count = parts;
+    memcpy(checkpoint->buf, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    memcpy(checkpoint->buf + sizeof(CHECKPOINT_MAGIC), &number,
+           sizeof(number));
+    memcpy(checkpoint->buf + sizeof(CHECKPOINT_MAGIC) + sizeof(number), &count,
+           sizeof(count));
+    checkpoint->len = CHECKPOINT_HEADER;
+    return checkpoint;
+}
+
+int wal_checkpoint_add(wal_checkpoint_t *checkpoint, const char *key,
+                       size_t key_len, const char *value, size_t value_len)
+{
+    size_t size = WAL_HEADER + key_len + value_len;
+    if (checkpoint->len + size > WAL_CHECKPOINT_BUFFER)
+        checkpoint_flush(checkpoint);
+    char *dst = checkpoint->buf + checkpoint->len;
+    record_header(dst, WAL_ADD, key, key_len, value, value_len);
+    memcpy(dst + WAL_HEADER, key, key_len);
+    if (value_len > 0)
+        memcpy(dst + WAL_HEADER + key_len, value, value_len);
+    checkpoint->len += size;
+    return checkpoint->failed ? -1 : 0;
+}
+
+int wal_checkpoint_end(wal_checkpoint_t *checkpoint, int complete)
+{
+    wal_t *wal = checkpoint->wal;
+    char tmp[PATH_MAX];
+    char name[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.ckpt.tmp", wal->path);
+    snprintf(name, sizeof(name), "%s.ckpt", wal->path);
+
+    if (complete)
+        checkpoint_flush(checkpoint);
+    if (complete && fsync(checkpoint->fd) < 0)
+        checkpoint->failed = 1;
+    close(checkpoint->fd);
+    int failed = checkpoint->failed || !complete || rename(tmp, name) < 0;
+    if (failed)
+    {
+        unlink(tmp);
+        free(checkpoint);
+        return -1;
+    }
+    sync_dir(wal->path);
+
+    // the log files before the checkpoint's are covered by it
+    for (unsigned long n = checkpoint->gen - 1; n > 0; n--)
+    {
+        log_name(wal, n, name);
+        if (unlink(name) < 0 && errno == ENOENT)
+            break;
+    }
+    free(checkpoint);
+    return 0;
+}
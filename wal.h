@@ -0,0 +1,131 @@
+#ifndef WAL_H_
+#define WAL_H_
+
+#include <stddef.h>
+
+/*
+ * A write-ahead log: an append-only file of the changes made to the
+ * database, from which its contents are rebuilt on startup.
+ *
+ * Threads append records to a buffer in memory and get back the position
+ * their record ends at; a flusher thread of the log's own writes out
+ * whatever has been appended and syncs it to disk, so one fdatasync() covers
+ * the records of every thread that appended while the previous one ran
+ * (group commit). A thread that has to know its records are on disk waits
+ * for their position with wal_wait().
+ *
+ * A checkpoint writes the whole database to a file of its own. It starts a
+ * new log file first, so everything appended meanwhile lands in that one, and
+ * removes the older log files once the checkpoint file is on disk. The files
+ * are <path>.ckpt for the checkpoint and <path>.<n> for the log files, n
+ * counting up from 1; on startup the checkpoint is replayed first, then the
+ * log files it names, in order.
+ */
+
+typedef struct wal wal_t;
+
+/*
+ * When the log syncs what has been appended: WAL_FSYNC_ALWAYS as soon as
+ * the flusher finds anything, WAL_FSYNC_BATCH after waiting WAL_BATCH_US
+ * for more to be appended, and WAL_FSYNC_INTERVAL only every
+ * WAL_INTERVAL_MS. Under the last, wal_wait() does not wait at all, and a
+ * crash may lose what was appended during the last interval.
+ */
+#define WAL_FSYNC_ALWAYS 0
+#define WAL_FSYNC_BATCH 1
+#define WAL_FSYNC_INTERVAL 2
+#define WAL_BATCH_US 1000
+#define WAL_INTERVAL_MS 100
+
+/*
+ * The kinds of records: an add of key and value, a remove of key, and the
+ * removal of every key from key on, up to but not including value
+ * (WAL_RANGE) or up to the last key (WAL_RANGE_TAIL, without a value).
+ */
+#define WAL_ADD 'a'
+#define WAL_REMOVE 'd'
+#define WAL_RANGE 'x'
+#define WAL_RANGE_TAIL 'X'
+
+/* A record read back by wal_next(); key and value point into the file. */
+typedef struct wal_record {
+    int op;
+    const char *key;
+    size_t key_len;
+    const char *value;
+    size_t value_len;
+} wal_record_t;
+
+/*
+ * A function wal_open() hands the contents of the checkpoint and of every
+ * log file to, in order, as the len bytes at data. The records there are read
+ * with wal_next(). For the checkpoint, whose records are all WAL_ADD,
+ * checkpoint is the number of parts given to wal_checkpoint_begin(); for a
+ * log file it is 0.
+ */
+typedef void (*wal_replay_t)(void *arg, const char *data, size_t len,
+                             unsigned int checkpoint);
+
+/*
+ * wal_open() replays the checkpoint and log files at path through replay,
+ * cuts the last log file off after its last complete record (a crash may
+ * have left one half-written) and opens it to append to, syncing as policy
+ * says. Returns the log, or NULL if a file cannot be read or written or the
+ * flusher not be started.
+ */
+wal_t *wal_open(const char *path, int policy, wal_replay_t replay, void *arg);
+
+/*
+ * wal_next() reads the record at *pos, before end, into record and moves
+ * *pos past it. Returns 1 on success, and 0 at end or at a record that is
+ * cut short or does not match its checksum.
+ */
+int wal_next(const char **pos, const char *end, wal_record_t *record);
+
+/*
+ * wal_append() appends a record of the given kind and returns the position
+ * it ends at, for wal_wait(). Keys and values are at most 65535 bytes long,
+ * and value may be NULL if value_len is 0. Waits while the buffer is full.
+ */
+unsigned long wal_append(wal_t *wal, int op, const char *key, size_t key_len,
+                         const char *value, size_t value_len);
+
+/*
+ * wal_wait() returns once everything appended up to position pos is on disk
+ * (at once under WAL_FSYNC_INTERVAL).
+ */
+void wal_wait(wal_t *wal, unsigned long pos);
+
+/*
+ * wal_size() returns how many bytes have been appended since the last
+ * checkpoint started.
+ */
+unsigned long wal_size(wal_t *wal);
+
+/*
+ * A checkpoint being written: wal_checkpoint_begin() starts a new log file
+ * and returns the checkpoint (or NULL on failure), recording in it the
+ * number of parts (at least 1) its writer splits the pairs into, so that
+ * replay can tell whether they are split as it expects. wal_checkpoint_add()
+ * adds a pair to it, and wal_checkpoint_end() syncs it and puts it in place
+ * of the last one, then removes the log files it covers. The pairs are those in
+ * the database at some point after wal_checkpoint_begin(); a pair changed
+ * meanwhile may be in either state, since its change is in the new log file
+ * and replaying that brings it up to date either way. wal_checkpoint_add()
+ * returns 0 on success and -1 on failure. If it has failed, or complete is 0,
+ * wal_checkpoint_end() only throws the checkpoint away, keeping the log
+ * files, and returns -1.
+ */
+typedef struct wal_checkpoint wal_checkpoint_t;
+wal_checkpoint_t *wal_checkpoint_begin(wal_t *wal, unsigned int parts);
+int wal_checkpoint_add(wal_checkpoint_t *checkpoint, const char *key,
+                       size_t key_len, const char *value, size_t value_len);
+int wal_checkpoint_end(wal_checkpoint_t *checkpoint, int complete);
+
+/*
+ * wal_close() writes out and syncs everything appended, whatever the policy,
+ * stops the flusher and frees the log.
+ */
+void wal_close(wal_t *wal);
+
+#endif  // WAL_H_